@@ -0,0 +1,249 @@
+#include "audio_encoder.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+#include <libavutil/mem.h>
+#include <libavutil/opt.h>
+#include <libavutil/samplefmt.h>
+}
+
+#include <algorithm>
+
+#include "defs.h"
+#include "mux.h"
+#include "timebase.h"
+
+using namespace std;
+
+AudioEncoder::AudioEncoder(const string &codec_name, int bit_rate)
+	: codec_name(codec_name), bit_rate(bit_rate)
+{
+	AVCodec *codec = avcodec_find_encoder_by_name(codec_name.c_str());
+	if (codec == nullptr) {
+		fprintf(stderr, "ERROR: Could not find codec '%s'\n", codec_name.c_str());
+		exit(1);
+	}
+
+	ctx = avcodec_alloc_context3(codec);
+	ctx->bit_rate = bit_rate;
+	ctx->sample_rate = OUTPUT_FREQUENCY;
+	ctx->sample_fmt = codec->sample_fmts[0];
+	ctx->channels = 2;
+	ctx->channel_layout = AV_CH_LAYOUT_STEREO;
+	ctx->time_base = AVRational{1, TIMEBASE};
+	ctx->flags |= CODEC_FLAG_GLOBAL_HEADER;
+	if (avcodec_open2(ctx, codec, NULL) < 0) {
+		fprintf(stderr, "Could not open codec '%s'\n", codec_name.c_str());
+		exit(1);
+	}
+
+	resampler = avresample_alloc_context();
+	if (resampler == nullptr) {
+		fprintf(stderr, "Allocating resampler failed.\n");
+		exit(1);
+	}
+
+	av_opt_set_int(resampler, "in_channel_layout",  AV_CH_LAYOUT_STEREO, 0);
+	av_opt_set_int(resampler, "out_channel_layout", AV_CH_LAYOUT_STEREO, 0);
+	av_opt_set_int(resampler, "in_sample_rate",     OUTPUT_FREQUENCY,    0);
+	av_opt_set_int(resampler, "out_sample_rate",    OUTPUT_FREQUENCY,    0);
+	av_opt_set_int(resampler, "in_sample_fmt",      AV_SAMPLE_FMT_FLT,   0);
+	av_opt_set_int(resampler, "out_sample_fmt",     ctx->sample_fmt,     0);
+
+	if (avresample_open(resampler) < 0) {
+		fprintf(stderr, "Could not open resample context.\n");
+		exit(1);
+	}
+
+	audio_frame = av_frame_alloc();
+
+	// Most codecs have a fixed frame size, so we can allocate the buffer
+	// right away; for the others, it will grow as needed.
+	if (ctx->frame_size > 0) {
+		ensure_sample_buffer(ctx->frame_size);
+	}
+
+	encoder_thread = thread(&AudioEncoder::encoder_thread_func, this);
+}
+
+AudioEncoder::~AudioEncoder()
+{
+	encode_last_audio();
+	av_freep(&sample_buffer[0]);
+	av_frame_free(&audio_frame);
+	avresample_free(&resampler);
+	avcodec_free_context(&ctx);
+}
+
+void AudioEncoder::add_mux(Mux *mux)
+{
+	lock_guard<mutex> lock(mux_mu);
+	muxes.push_back(mux);
+}
+
+void AudioEncoder::remove_mux(Mux *mux)
+{
+	lock_guard<mutex> lock(mux_mu);
+	muxes.erase(remove(muxes.begin(), muxes.end(), mux), muxes.end());
+}
+
+void AudioEncoder::encode_audio(shared_ptr<const vector<float>> audio, int64_t audio_pts)
+{
+	assert(audio->size() % 2 == 0);
+	{
+		lock_guard<mutex> lock(queue_mu);
+		assert(!should_quit);
+		queued_blocks.push(QueuedBlock{ move(audio), audio_pts });
+	}
+	queue_changed.notify_all();
+}
+
+void AudioEncoder::encode_last_audio()
+{
+	if (!encoder_thread.joinable()) {
+		return;
+	}
+	{
+		lock_guard<mutex> lock(queue_mu);
+		should_quit = true;
+	}
+	queue_changed.notify_all();
+	encoder_thread.join();
+}
+
+void AudioEncoder::encoder_thread_func()
+{
+	for ( ;; ) {
+		QueuedBlock block;
+		{
+			unique_lock<mutex> lock(queue_mu);
+			queue_changed.wait(lock, [this]{ return should_quit || !queued_blocks.empty(); });
+			if (queued_blocks.empty()) {
+				// should_quit is set, and there is nothing more to encode.
+				break;
+			}
+			block = move(queued_blocks.front());
+			queued_blocks.pop();
+		}
+		encode_block(*block.audio, block.pts);
+	}
+
+	if (!audio_queue.empty()) {
+		// Last frame can be whatever size we want.
+		int64_t queue_pts = last_pts - int64_t(audio_queue.size()) * TIMEBASE / (OUTPUT_FREQUENCY * 2);
+		encode_audio_one_frame(&audio_queue[0], audio_queue.size() / 2, queue_pts);
+		audio_queue.clear();
+	}
+	flush_delayed_frames();
+}
+
+void AudioEncoder::encode_block(const vector<float> &audio, int64_t audio_pts)
+{
+	last_pts = audio_pts + audio.size() * TIMEBASE / (OUTPUT_FREQUENCY * 2);
+
+	if (ctx->frame_size == 0) {
+		// No queueing needed.
+		assert(audio_queue.empty());
+		if (!audio.empty()) {
+			encode_audio_one_frame(&audio[0], audio.size() / 2, audio_pts);
+		}
+		return;
+	}
+
+	int64_t sample_offset = audio_queue.size();
+
+	audio_queue.insert(audio_queue.end(), audio.begin(), audio.end());
+	size_t sample_num;
+	for (sample_num = 0;
+	     sample_num + ctx->frame_size * 2 <= audio_queue.size();
+	     sample_num += ctx->frame_size * 2) {
+		int64_t adjusted_audio_pts = audio_pts + (int64_t(sample_num) - sample_offset) * TIMEBASE / (OUTPUT_FREQUENCY * 2);
+		encode_audio_one_frame(&audio_queue[sample_num],
+		                       ctx->frame_size,
+		                       adjusted_audio_pts);
+	}
+	audio_queue.erase(audio_queue.begin(), audio_queue.begin() + sample_num);
+}
+
+void AudioEncoder::ensure_sample_buffer(size_t num_samples)
+{
+	if (num_samples <= sample_buffer_capacity) {
+		return;
+	}
+	av_freep(&sample_buffer[0]);
+	if (av_samples_alloc(sample_buffer, &sample_buffer_linesize, 2, num_samples, ctx->sample_fmt, 0) < 0) {
+		fprintf(stderr, "Could not allocate %ld samples.\n", num_samples);
+		exit(1);
+	}
+	sample_buffer_capacity = num_samples;
+}
+
+void AudioEncoder::encode_audio_one_frame(const float *audio, size_t num_samples, int64_t audio_pts)
+{
+	ensure_sample_buffer(num_samples);
+
+	audio_frame->pts = audio_pts;
+	audio_frame->nb_samples = num_samples;
+	audio_frame->channel_layout = AV_CH_LAYOUT_STEREO;
+	audio_frame->format = ctx->sample_fmt;
+	audio_frame->sample_rate = OUTPUT_FREQUENCY;
+	memcpy(audio_frame->data, sample_buffer, sizeof(sample_buffer));
+	audio_frame->linesize[0] = sample_buffer_linesize;
+
+	if (avresample_convert(resampler, audio_frame->data, 0, num_samples,
+	                       (uint8_t **)&audio, 0, num_samples) < 0) {
+		fprintf(stderr, "Audio conversion failed.\n");
+		exit(1);
+	}
+
+	AVPacket pkt;
+	av_init_packet(&pkt);
+	pkt.data = nullptr;
+	pkt.size = 0;
+	int got_output = 0;
+	avcodec_encode_audio2(ctx, &pkt, audio_frame, &got_output);
+	if (got_output) {
+		send_packet(pkt);
+	}
+
+	// The frame does not own the sample buffer, so this only resets the fields.
+	av_frame_unref(audio_frame);
+	av_free_packet(&pkt);
+}
+
+void AudioEncoder::flush_delayed_frames()
+{
+	if (!(ctx->codec->capabilities & AV_CODEC_CAP_DELAY)) {
+		return;
+	}
+
+	for ( ;; ) {
+		int got_output = 0;
+		AVPacket pkt;
+		av_init_packet(&pkt);
+		pkt.data = nullptr;
+		pkt.size = 0;
+		avcodec_encode_audio2(ctx, &pkt, nullptr, &got_output);
+		if (!got_output) break;
+
+		send_packet(pkt);
+		av_free_packet(&pkt);
+	}
+}
+
+void AudioEncoder::send_packet(const AVPacket &pkt)
+{
+	AVPacket pkt_copy = pkt;
+	pkt_copy.stream_index = 1;
+	pkt_copy.flags = 0;
+
+	lock_guard<mutex> lock(mux_mu);
+	for (Mux *mux : muxes) {
+		mux->add_packet(pkt_copy, pkt_copy.pts, pkt_copy.dts);
+	}
+}
@@ -0,0 +1,103 @@
+// A class to encode audio (using ffmpeg) and send it to one or more Muxes.
+// Each AudioEncoder represents one distinct codec configuration (codec and
+// bit rate); if several muxes want the same configuration, they should share
+// the same AudioEncoder, so that every block of audio is converted and encoded
+// exactly once.
+//
+// Encoding happens on a separate thread; encode_audio() just queues up the
+// block and returns. The sample buffer used for format conversion is allocated
+// once and reused for every frame, instead of being allocated and freed
+// for each one.
+
+#ifndef _AUDIO_ENCODER_H
+#define _AUDIO_ENCODER_H 1
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavresample/avresample.h>
+#include <libavutil/frame.h>
+}
+
+class Mux;
+
+class AudioEncoder {
+public:
+	AudioEncoder(const std::string &codec_name, int bit_rate);
+
+	// Calls encode_last_audio() if it has not been called already.
+	~AudioEncoder();
+
+	const std::string &get_codec_name() const { return codec_name; }
+	int get_bit_rate() const { return bit_rate; }
+	const AVCodec *get_codec() const { return ctx->codec; }
+
+	// Does not take ownership. Packets are sent to all muxes added,
+	// from the encoding thread.
+	void add_mux(Mux *mux);
+
+	// Blocks until any packet currently being sent to <mux> is done,
+	// so that the mux can safely be destroyed after this returns.
+	void remove_mux(Mux *mux);
+
+	// <audio> is interleaved stereo, in OUTPUT_FREQUENCY. Does not block.
+	// The same block can be given to several encoders without being copied.
+	void encode_audio(std::shared_ptr<const std::vector<float>> audio, int64_t audio_pts);
+
+	// Encodes any leftover samples and flushes delayed frames from the codec.
+	// Blocks until everything has been sent to the muxes. encode_audio()
+	// cannot be called after this.
+	void encode_last_audio();
+
+private:
+	struct QueuedBlock {
+		std::shared_ptr<const std::vector<float>> audio;
+		int64_t pts;
+	};
+
+	void encoder_thread_func();
+	void encode_block(const std::vector<float> &audio, int64_t audio_pts);
+	void encode_audio_one_frame(const float *audio, size_t num_samples, int64_t audio_pts);
+	void flush_delayed_frames();
+	void send_packet(const AVPacket &pkt);
+
+	// Makes sure <sample_buffer> can hold at least <num_samples> samples
+	// (in each channel) in the codec's sample format.
+	void ensure_sample_buffer(size_t num_samples);
+
+	const std::string codec_name;
+	const int bit_rate;
+
+	AVCodecContext *ctx;
+	AVAudioResampleContext *resampler;
+	AVFrame *audio_frame = nullptr;
+
+	// Only touched by the encoder thread.
+	std::vector<float> audio_queue;  // Samples waiting for a full codec frame.
+	int64_t last_pts = -1;  // The first pts after all audio we've been given.
+	uint8_t *sample_buffer[AV_NUM_DATA_POINTERS] = { nullptr };
+	int sample_buffer_linesize = 0;
+	size_t sample_buffer_capacity = 0;  // In samples per channel.
+
+	std::thread encoder_thread;
+
+	// Protects <queued_blocks> and <should_quit>.
+	std::mutex queue_mu;
+	std::condition_variable queue_changed;
+	std::queue<QueuedBlock> queued_blocks;
+	bool should_quit = false;
+
+	std::mutex mux_mu;
+	std::vector<Mux *> muxes;  // Under <mux_mu>. Not owned.
+};
+
+#endif  // !defined(_AUDIO_ENCODER_H)
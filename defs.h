@@ -31,10 +31,33 @@
 #define MUX_BUFFER_SIZE 10485760
 
 // In number of frames. Comes in addition to any internal queues in x264
-// (frame threading, lookahead, etc.).
-#define X264_QUEUE_LENGTH 50
+// (frame threading, lookahead, etc.). Each queued frame holds on to one of
+// the H.264 encoder's readback surfaces (see SURFACE_NUM in h264encode.cpp),
+// so this needs to stay well below that, or rendering will have to wait.
+#define X264_QUEUE_LENGTH 8
+
+// How far behind an HTTP client can get before --http-slow-client-policy
+// kicks in. At the default x264 bitrate, the byte limit is about a minute.
+// With --http-uncompressed-video, that would be less than a second, so the
+// default there is two seconds of video at MAX_FPS instead.
+#define DEFAULT_HTTP_MAX_CLIENT_BACKLOG_KB 32768
+#define DEFAULT_HTTP_MAX_CLIENT_BACKLOG_KB_UNCOMPRESSED (2 * MAX_FPS * WIDTH * HEIGHT * 2 / 1024)
+#define DEFAULT_HTTP_MAX_CLIENT_LAG_SECONDS 10.0
+
+#define DEFAULT_HLS_SEGMENT_DURATION 2  // In seconds.
+#define DEFAULT_HLS_PLAYLIST_SEGMENTS 5
+
+// For --udp-output. Must be comfortably above the peak video + audio bitrate,
+// or the mux will not be able to keep the rate constant.
+#define DEFAULT_UDP_MUX_RATE_KBIT 8000
+
+// Size of the packet data ring for --shm-output. A 720p NV12 frame
+// (with --shm-output-raw) is 1.3 MB, so this is about a second of those.
+#define DEFAULT_SHM_OUTPUT_SIZE_MB 64
 
 #define X264_DEFAULT_PRESET "ultrafast"
 #define X264_DEFAULT_TUNE "film"
+#define DEFAULT_X264_OUTPUT_BIT_RATE 4500  // 4.5 Mbit/sec, in kilobit/sec.
+#define DEFAULT_X264_MIN_BIT_RATE 1000  // Lowest bitrate --x264-auto-bitrate will go to.
 
 #endif  // !defined(_DEFS_H)
@@ -0,0 +1,33 @@
+#include "ffmpeg_raii.h"
+
+extern "C" {
+#include <libavformat/avformat.h>
+#include <libavutil/frame.h>
+}
+
+using namespace std;
+
+void avformat_close_input_unique(AVFormatContext *format_ctx)
+{
+	avformat_close_input(&format_ctx);
+}
+
+AVFormatContextWithCloser avformat_open_input_unique(
+	const char *filename, AVInputFormat *fmt, AVDictionary **options)
+{
+	AVFormatContext *format_ctx = nullptr;
+	if (avformat_open_input(&format_ctx, filename, fmt, options) != 0) {
+		format_ctx = nullptr;
+	}
+	return AVFormatContextWithCloser(format_ctx, avformat_close_input_unique);
+}
+
+void av_frame_free_unique(AVFrame *frame)
+{
+	av_frame_free(&frame);
+}
+
+AVFrameWithDeleter av_frame_alloc_unique()
+{
+	return AVFrameWithDeleter(av_frame_alloc(), av_frame_free_unique);
+}
@@ -0,0 +1,32 @@
+#ifndef _FFMPEG_RAII_H
+#define _FFMPEG_RAII_H 1
+
+// Some helpers to make RAII versions of FFmpeg objects.
+// The cleanup functions don't interact all that well with unique_ptr,
+// so things get a bit messy and verbose, but overall it's worth it to ensure
+// we never leak things by accident in error paths.
+
+#include <memory>
+
+struct AVDictionary;
+struct AVFormatContext;
+struct AVFrame;
+struct AVInputFormat;
+
+void avformat_close_input_unique(AVFormatContext *format_ctx);
+
+typedef std::unique_ptr<AVFormatContext, decltype(avformat_close_input_unique)*>
+	AVFormatContextWithCloser;
+
+// Returns nullptr (in the unique_ptr) on error.
+AVFormatContextWithCloser avformat_open_input_unique(
+	const char *filename, AVInputFormat *fmt, AVDictionary **options);
+
+void av_frame_free_unique(AVFrame *frame);
+
+typedef std::unique_ptr<AVFrame, decltype(av_frame_free_unique)*>
+	AVFrameWithDeleter;
+
+AVFrameWithDeleter av_frame_alloc_unique();
+
+#endif  // !defined(_FFMPEG_RAII_H)
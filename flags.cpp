@@ -3,6 +3,12 @@
 #include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <string>
+
+using namespace std;
 
 Flags global_flags;
 
@@ -19,7 +25,28 @@ void usage()
 	fprintf(stderr, "      --http-x264-video           send x264-compressed video to HTTP clients\n");
 	fprintf(stderr, "      --x264-preset               x264 quality preset (default " X264_DEFAULT_PRESET ")\n");
 	fprintf(stderr, "      --x264-tune                 x264 tuning (default " X264_DEFAULT_TUNE ", can be blank)\n");
+	fprintf(stderr, "      --x264-bitrate              x264 bitrate (in kilobit/sec, default %d)\n",
+		DEFAULT_X264_OUTPUT_BIT_RATE);
+	fprintf(stderr, "      --x264-vbv-max-bitrate      x264 local max bitrate (in kilobit/sec per --vbv-bufsize,\n");
+	fprintf(stderr, "                                  0 = no limit, default: same as --x264-bitrate, i.e., CBR)\n");
+	fprintf(stderr, "      --x264-vbv-bufsize          x264 VBV size (in kilobits, 0 = one-frame VBV,\n");
+	fprintf(stderr, "                                  default: same as --x264-bitrate, that is, one-second VBV)\n");
+	fprintf(stderr, "      --x264-extra-param=NAME[=VALUE]  send arbitrary parameters to x264\n");
+	fprintf(stderr, "                                  (can be given multiple times)\n");
+	fprintf(stderr, "      --x264-auto-bitrate         lower the x264 bitrate automatically if HTTP clients\n");
+	fprintf(stderr, "                                  cannot keep up (never above --x264-bitrate)\n");
+	fprintf(stderr, "      --x264-min-bitrate          lowest bitrate for --x264-auto-bitrate\n");
+	fprintf(stderr, "                                  (in kilobit/sec, default %d)\n",
+		DEFAULT_X264_MIN_BIT_RATE);
+	fprintf(stderr, "      --x264-speedcontrol         automatically use faster x264 settings than --x264-preset\n");
+	fprintf(stderr, "                                  when x264 cannot keep up, instead of dropping frames\n");
+	fprintf(stderr, "      --x264-speedcontrol-verbose  output speedcontrol debugging statistics\n");
+	fprintf(stderr, "      --x264-rendition=WIDTHxHEIGHT[:KBITS]  also stream a downscaled version of the\n");
+	fprintf(stderr, "                                  x264 video, served at /WIDTHxHEIGHT (default bitrate\n");
+	fprintf(stderr, "                                  scales --x264-bitrate by area; can be given multiple times)\n");
 	fprintf(stderr, "      --http-mux=NAME             mux to use for HTTP streams (default " DEFAULT_STREAM_MUX_NAME ")\n");
+	fprintf(stderr, "      --http-output=URL:MUX       also serve the stream at URL, using the given mux\n");
+	fprintf(stderr, "                                  (e.g. /stream.ts:mpegts; can be given multiple times)\n");
 	fprintf(stderr, "      --http-audio-codec=NAME     audio codec to use for HTTP streams\n");
 	fprintf(stderr, "                                  (default is to use the same as for the recording)\n");
 	fprintf(stderr, "      --http-audio-bitrate=KBITS  audio codec bit rate to use for HTTP streams\n");
@@ -27,6 +54,52 @@ void usage()
 		DEFAULT_AUDIO_OUTPUT_BIT_RATE / 1000);
 	fprintf(stderr, "      --http-coarse-timebase      use less timebase for HTTP (recommended for muxers\n");
 	fprintf(stderr, "                                  that handle large pts poorly, like e.g. MP4)\n");
+	fprintf(stderr, "      --http-max-client-backlog=KB  max amount of data queued for a single HTTP client\n");
+	fprintf(stderr, "                                  (in kilobytes, 0 = no limit, default %d,\n",
+		DEFAULT_HTTP_MAX_CLIENT_BACKLOG_KB);
+	fprintf(stderr, "                                  or %d with --http-uncompressed-video)\n",
+		DEFAULT_HTTP_MAX_CLIENT_BACKLOG_KB_UNCOMPRESSED);
+	fprintf(stderr, "      --http-max-client-lag=SECS  max time a single HTTP client can be behind\n");
+	fprintf(stderr, "                                  (0 = no limit, default %.0f)\n",
+		DEFAULT_HTTP_MAX_CLIENT_LAG_SECONDS);
+	fprintf(stderr, "      --http-slow-client-policy=skip|disconnect  what to do with HTTP clients that\n");
+	fprintf(stderr, "                                  exceed the limits above (default skip, which skips\n");
+	fprintf(stderr, "                                  forward to the newest keyframe)\n");
+	fprintf(stderr, "      --http-startup-burst-rate=KBITS  max rate for sending the cached data from the\n");
+	fprintf(stderr, "                                  last keyframe to new HTTP clients (in kilobit/sec,\n");
+	fprintf(stderr, "                                  default 0 = as fast as the client can take it)\n");
+	fprintf(stderr, "      --http-hls                  also serve the stream as HLS, at /hls/main.m3u8\n");
+	fprintf(stderr, "                                  (and /hls/master.m3u8 with --x264-rendition);\n");
+	fprintf(stderr, "                                  requires --http-mux=mp4\n");
+	fprintf(stderr, "      --hls-segment-duration=SECS  approximate length of HLS segments (default %d)\n",
+		DEFAULT_HLS_SEGMENT_DURATION);
+	fprintf(stderr, "      --hls-playlist-segments=NUM  number of segments in the HLS playlists (default %d)\n",
+		DEFAULT_HLS_PLAYLIST_SEGMENTS);
+	fprintf(stderr, "      --udp-output=HOST:PORT      also send the stream as constant-bitrate MPEG-TS over\n");
+	fprintf(stderr, "                                  UDP (e.g. to a multicast group; IPv6 in brackets)\n");
+	fprintf(stderr, "      --udp-mux-rate=KBITS        total bitrate of the UDP stream, including padding\n");
+	fprintf(stderr, "                                  (default %d; must be above the peak stream bitrate)\n",
+		DEFAULT_UDP_MUX_RATE_KBIT);
+	fprintf(stderr, "      --shm-output=NAME           also make the stream packets available to local\n");
+	fprintf(stderr, "                                  processes in POSIX shared memory (see nageru_shm.h)\n");
+	fprintf(stderr, "      --shm-output-size=MB        size of the shared memory packet ring (default %d)\n",
+		DEFAULT_SHM_OUTPUT_SIZE_MB);
+	fprintf(stderr, "      --shm-output-raw            also put raw NV12 frames in the shared memory ring\n");
+	fprintf(stderr, "      --shm-input=NAME            use video and audio from another process, through\n");
+	fprintf(stderr, "                                  POSIX shared memory (see nageru_shm_input.h), as one\n");
+	fprintf(stderr, "                                  of the cards; can be given multiple times, and these\n");
+	fprintf(stderr, "                                  cards come after the physical ones\n");
+	fprintf(stderr, "      --compress-images           let the GPU driver compress images from the theme\n");
+	fprintf(stderr, "                                  (uses less GPU memory, but loses some quality)\n");
+	fprintf(stderr, "      --program-cache-dir=DIR     keep linked shader programs in DIR, for faster startup\n");
+	fprintf(stderr, "                                    (default: $XDG_CACHE_HOME/nageru/programs)\n");
+	fprintf(stderr, "      --no-program-cache          compile all shader programs from scratch on startup\n");
+	fprintf(stderr, "      --gpu-budget=PERCENT        ask the theme for cheaper chains if rendering the output\n");
+	fprintf(stderr, "                                    takes more than this much of the frame time on the\n");
+	fprintf(stderr, "                                    GPU (default 80%%; 0 = never)\n");
+	fprintf(stderr, "      --gpu-timing                measure the GPU time of each chain and rendering step\n");
+	fprintf(stderr, "                                    (see /gpu_timing on the HTTP port)\n");
+	fprintf(stderr, "      --gpu-timing-overlay        same, and also show the timings under the live display\n");
 	fprintf(stderr, "      --flat-audio                start with most audio processing turned off\n");
 	fprintf(stderr, "      --no-flush-pbos             do not explicitly signal texture data uploads\n");
 	fprintf(stderr, "                                    (will give display corruption, but makes it\n");
@@ -44,14 +117,44 @@ void parse_flags(int argc, char * const argv[])
 		{ "http-x264-video", no_argument, 0, 1008 },
 		{ "x264-preset", required_argument, 0, 1009 },
 		{ "x264-tune", required_argument, 0, 1010 },
+		{ "x264-bitrate", required_argument, 0, 1011 },
+		{ "x264-vbv-max-bitrate", required_argument, 0, 1012 },
+		{ "x264-vbv-bufsize", required_argument, 0, 1013 },
+		{ "x264-extra-param", required_argument, 0, 1014 },
+		{ "x264-auto-bitrate", no_argument, 0, 1015 },
+		{ "x264-min-bitrate", required_argument, 0, 1016 },
+		{ "x264-speedcontrol", no_argument, 0, 1017 },
+		{ "x264-speedcontrol-verbose", no_argument, 0, 1018 },
+		{ "x264-rendition", required_argument, 0, 1019 },
 		{ "http-mux", required_argument, 0, 1004 },
 		{ "http-coarse-timebase", no_argument, 0, 1005 },
 		{ "http-audio-codec", required_argument, 0, 1006 },
 		{ "http-audio-bitrate", required_argument, 0, 1007 },
+		{ "http-max-client-backlog", required_argument, 0, 1020 },
+		{ "http-max-client-lag", required_argument, 0, 1021 },
+		{ "http-slow-client-policy", required_argument, 0, 1022 },
+		{ "http-startup-burst-rate", required_argument, 0, 1023 },
+		{ "http-hls", no_argument, 0, 1024 },
+		{ "hls-segment-duration", required_argument, 0, 1025 },
+		{ "hls-playlist-segments", required_argument, 0, 1026 },
+		{ "http-output", required_argument, 0, 1027 },
+		{ "udp-output", required_argument, 0, 1028 },
+		{ "udp-mux-rate", required_argument, 0, 1029 },
+		{ "shm-output", required_argument, 0, 1030 },
+		{ "shm-output-size", required_argument, 0, 1031 },
+		{ "shm-output-raw", no_argument, 0, 1032 },
+		{ "shm-input", required_argument, 0, 1033 },
+		{ "compress-images", no_argument, 0, 1034 },
+		{ "program-cache-dir", required_argument, 0, 1035 },
+		{ "no-program-cache", no_argument, 0, 1036 },
+		{ "gpu-budget", required_argument, 0, 1037 },
+		{ "gpu-timing", no_argument, 0, 1038 },
+		{ "gpu-timing-overlay", no_argument, 0, 1039 },
 		{ "flat-audio", no_argument, 0, 1002 },
 		{ "no-flush-pbos", no_argument, 0, 1003 },
 		{ 0, 0, 0, 0 }
 	};
+	bool no_program_cache = false;
 	for ( ;; ) {
 		int option_index = 0;
 		int c = getopt_long(argc, argv, "c:t:", long_options, &option_index);
@@ -93,6 +196,122 @@ void parse_flags(int argc, char * const argv[])
 		case 1010:
 			global_flags.x264_tune = optarg;
 			break;
+		case 1011:
+			global_flags.x264_bitrate = atoi(optarg);
+			break;
+		case 1012:
+			global_flags.x264_vbv_max_bitrate = atoi(optarg);
+			break;
+		case 1013:
+			global_flags.x264_vbv_buffer_size = atoi(optarg);
+			break;
+		case 1014:
+			global_flags.x264_extra_param.push_back(optarg);
+			break;
+		case 1015:
+			global_flags.x264_auto_bitrate = true;
+			break;
+		case 1016:
+			global_flags.x264_min_bitrate = atoi(optarg);
+			break;
+		case 1017:
+			global_flags.x264_speedcontrol = true;
+			break;
+		case 1018:
+			global_flags.x264_speedcontrol_verbose = true;
+			break;
+		case 1019: {
+			X264Rendition rendition;
+			rendition.bitrate = -1;
+			if (sscanf(optarg, "%dx%d:%d", &rendition.width, &rendition.height, &rendition.bitrate) < 2 ||
+			    rendition.width <= 0 || rendition.height <= 0 ||
+			    rendition.width % 2 != 0 || rendition.height % 2 != 0 ||
+			    rendition.width > WIDTH || rendition.height > HEIGHT) {
+				fprintf(stderr, "ERROR: --x264-rendition must be WIDTHxHEIGHT[:KBITS], with even dimensions no larger than %dx%d\n",
+					WIDTH, HEIGHT);
+				exit(1);
+			}
+			rendition.url = "/" + to_string(rendition.width) + "x" + to_string(rendition.height);
+			global_flags.x264_renditions.push_back(rendition);
+			break;
+		}
+		case 1020:
+			global_flags.http_max_client_backlog_kb = atoi(optarg);
+			break;
+		case 1021:
+			global_flags.http_max_client_lag_seconds = atof(optarg);
+			break;
+		case 1022:
+			if (strcmp(optarg, "skip") == 0) {
+				global_flags.http_slow_client_policy = SLOW_CLIENT_SKIP;
+			} else if (strcmp(optarg, "disconnect") == 0) {
+				global_flags.http_slow_client_policy = SLOW_CLIENT_DISCONNECT;
+			} else {
+				fprintf(stderr, "ERROR: --http-slow-client-policy must be 'skip' or 'disconnect'\n");
+				exit(1);
+			}
+			break;
+		case 1023:
+			global_flags.http_startup_burst_rate_kbit = atoi(optarg);
+			break;
+		case 1024:
+			global_flags.http_hls = true;
+			break;
+		case 1025:
+			global_flags.hls_segment_duration = atoi(optarg);
+			break;
+		case 1026:
+			global_flags.hls_playlist_segments = atoi(optarg);
+			break;
+		case 1027: {
+			HTTPOutput output;
+			const char *colon = strrchr(optarg, ':');
+			if (optarg[0] != '/' || colon == nullptr || colon == optarg + 1 || colon[1] == '\0') {
+				fprintf(stderr, "ERROR: --http-output must be URL:MUX, where URL starts with a slash\n");
+				exit(1);
+			}
+			output.url = string(optarg, colon - optarg);
+			output.mux_name = colon + 1;
+			global_flags.http_outputs.push_back(output);
+			break;
+		}
+		case 1028:
+			global_flags.udp_output = optarg;
+			break;
+		case 1029:
+			global_flags.udp_mux_rate_kbit = atoi(optarg);
+			break;
+		case 1030:
+			global_flags.shm_output = optarg;
+			break;
+		case 1031:
+			global_flags.shm_output_size_mb = atoi(optarg);
+			break;
+		case 1032:
+			global_flags.shm_output_raw = true;
+			break;
+		case 1033:
+			global_flags.shm_inputs.push_back(optarg);
+			break;
+		case 1034:
+			global_flags.compress_images = true;
+			break;
+		case 1035:
+			global_flags.program_cache_dir = optarg;
+			break;
+		case 1036:
+			no_program_cache = true;
+			break;
+		case 1037:
+			global_flags.gpu_budget_percent = atoi(optarg);
+			break;
+		case 1038:
+			global_flags.gpu_timing = true;
+			break;
+		case 1039:
+			global_flags.gpu_timing = true;
+			global_flags.gpu_timing_overlay = true;
+			break;
 		case 1002:
 			global_flags.flat_audio = true;
 			break;
@@ -115,4 +334,125 @@ void parse_flags(int argc, char * const argv[])
 		fprintf(stderr, "ERROR: --http-uncompressed-video and --http-x264-video are mutually incompatible\n");
 		exit(1);
 	}
+	if (global_flags.http_max_client_backlog_kb == -1) {
+		global_flags.http_max_client_backlog_kb = global_flags.uncompressed_video_to_http ?
+			DEFAULT_HTTP_MAX_CLIENT_BACKLOG_KB_UNCOMPRESSED : DEFAULT_HTTP_MAX_CLIENT_BACKLOG_KB;
+	}
+	if (global_flags.x264_vbv_max_bitrate == -1) {
+		global_flags.x264_vbv_max_bitrate = global_flags.x264_bitrate;
+	}
+	if (global_flags.x264_vbv_buffer_size == -1) {
+		global_flags.x264_vbv_buffer_size = global_flags.x264_bitrate;
+	}
+	if (global_flags.x264_auto_bitrate &&
+	    global_flags.x264_min_bitrate > global_flags.x264_bitrate) {
+		fprintf(stderr, "ERROR: --x264-min-bitrate cannot be higher than --x264-bitrate\n");
+		exit(1);
+	}
+	if (!global_flags.x264_renditions.empty() && !global_flags.x264_video_to_http) {
+		fprintf(stderr, "ERROR: --x264-rendition requires --http-x264-video\n");
+		exit(1);
+	}
+	if (global_flags.http_hls &&
+	    global_flags.stream_mux_name != "mp4" && global_flags.stream_mux_name != "mov") {
+		// We segment the stream mux' output directly, which only works
+		// for fragmented MP4 (see MUX_OPTS).
+		fprintf(stderr, "ERROR: --http-hls requires --http-mux=mp4 or --http-mux=mov\n");
+		exit(1);
+	}
+	if (global_flags.http_hls && global_flags.uncompressed_video_to_http) {
+		fprintf(stderr, "ERROR: --http-hls and --http-uncompressed-video are mutually incompatible\n");
+		exit(1);
+	}
+	if (!global_flags.udp_output.empty() && global_flags.uncompressed_video_to_http) {
+		fprintf(stderr, "ERROR: --udp-output and --http-uncompressed-video are mutually incompatible\n");
+		exit(1);
+	}
+	if (global_flags.udp_mux_rate_kbit <= 0) {
+		fprintf(stderr, "ERROR: --udp-mux-rate must be positive\n");
+		exit(1);
+	}
+	if (global_flags.shm_inputs.size() > size_t(global_flags.num_cards)) {
+		fprintf(stderr, "ERROR: Got %zu --shm-input, but only %d card(s); --num-cards must include them\n",
+			global_flags.shm_inputs.size(), global_flags.num_cards);
+		exit(1);
+	}
+	for (const string &name : global_flags.shm_inputs) {
+		if (name.empty() || name[0] != '/') {
+			fprintf(stderr, "ERROR: --shm-input must start with a slash (e.g. /graphics)\n");
+			exit(1);
+		}
+	}
+	if (global_flags.shm_output_raw && global_flags.shm_output.empty()) {
+		fprintf(stderr, "ERROR: --shm-output-raw requires --shm-output\n");
+		exit(1);
+	}
+	if (global_flags.shm_output_raw && global_flags.uncompressed_video_to_http) {
+		// The stream itself is NV12 then, so we would get every frame twice.
+		fprintf(stderr, "ERROR: --shm-output-raw and --http-uncompressed-video are mutually incompatible\n");
+		exit(1);
+	}
+	if (!global_flags.shm_output.empty() && global_flags.shm_output[0] != '/') {
+		fprintf(stderr, "ERROR: --shm-output must start with a slash (e.g. /nageru)\n");
+		exit(1);
+	}
+	if (global_flags.shm_output_size_mb <= 0) {
+		fprintf(stderr, "ERROR: --shm-output-size must be positive\n");
+		exit(1);
+	}
+	for (size_t i = 0; i < global_flags.http_outputs.size(); ++i) {
+		const string &url = global_flags.http_outputs[i].url;
+		bool duplicate = false;
+		for (size_t j = 0; j < i; ++j) {
+			duplicate |= (global_flags.http_outputs[j].url == url);
+		}
+		for (const X264Rendition &rendition : global_flags.x264_renditions) {
+			duplicate |= (rendition.url == url);
+		}
+		if (duplicate) {
+			fprintf(stderr, "ERROR: %s is used for more than one HTTP output\n", url.c_str());
+			exit(1);
+		}
+
+		// HTTPD looks at its endpoints and static files before the outputs,
+		// so an output with one of their URLs could never be reached.
+		if (url == "/" || url == "/metrics" || url == "/clients" || url == "/control/x264" ||
+		    url == "/gpu_timing" || url.compare(0, 5, "/hls/") == 0) {
+			fprintf(stderr, "ERROR: --http-output cannot use %s, which Nageru serves itself\n", url.c_str());
+			exit(1);
+		}
+	}
+	for (size_t i = 0; i < global_flags.x264_renditions.size(); ++i) {
+		// The rendition URLs and the x264 metrics are both keyed by resolution.
+		const X264Rendition &rendition = global_flags.x264_renditions[i];
+		bool duplicate = (rendition.width == WIDTH && rendition.height == HEIGHT);
+		for (size_t j = 0; j < i; ++j) {
+			duplicate |= (global_flags.x264_renditions[j].width == rendition.width &&
+			              global_flags.x264_renditions[j].height == rendition.height);
+		}
+		if (duplicate) {
+			fprintf(stderr, "ERROR: More than one x264 stream is %dx%d\n", rendition.width, rendition.height);
+			exit(1);
+		}
+	}
+	if (global_flags.hls_segment_duration < 1 || global_flags.hls_playlist_segments < 1) {
+		fprintf(stderr, "ERROR: --hls-segment-duration and --hls-playlist-segments must be at least 1\n");
+		exit(1);
+	}
+	for (X264Rendition &rendition : global_flags.x264_renditions) {
+		if (rendition.bitrate == -1) {
+			rendition.bitrate = max<int>(int64_t(global_flags.x264_bitrate) * rendition.width * rendition.height / (WIDTH * HEIGHT), 1);
+		}
+	}
+	if (no_program_cache) {
+		global_flags.program_cache_dir.clear();
+	} else if (global_flags.program_cache_dir.empty()) {
+		const char *xdg_cache_home = getenv("XDG_CACHE_HOME");
+		const char *home = getenv("HOME");
+		if (xdg_cache_home != nullptr && xdg_cache_home[0] != '\0') {
+			global_flags.program_cache_dir = string(xdg_cache_home) + "/nageru/programs";
+		} else if (home != nullptr && home[0] != '\0') {
+			global_flags.program_cache_dir = string(home) + "/.cache/nageru/programs";
+		}
+	}
 }
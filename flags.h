@@ -2,9 +2,30 @@
 #define _FLAGS_H
 
 #include <string>
+#include <vector>
 
 #include "defs.h"
 
+// An additional, downscaled version of the x264 stream (see --x264-rendition).
+struct X264Rendition {
+	int width, height;
+	int bitrate;  // In kilobit/sec.
+	std::string url;  // Where HTTPD serves it, e.g. “/640x360”.
+};
+
+// An additional HTTP output of the main stream, with a different mux
+// (see --http-output).
+struct HTTPOutput {
+	std::string url;  // E.g. “/stream.ts”.
+	std::string mux_name;
+};
+
+// What to do with HTTP clients that fall too far behind.
+enum SlowClientPolicy {
+	SLOW_CLIENT_SKIP,  // Skip forward to the newest keyframe.
+	SLOW_CLIENT_DISCONNECT,
+};
+
 struct Flags {
 	int num_cards = 2;
 	std::string va_display;
@@ -17,8 +38,36 @@ struct Flags {
 	bool stream_coarse_timebase = false;
 	std::string stream_audio_codec_name;  // Blank = use the same as for the recording.
 	int stream_audio_codec_bitrate = DEFAULT_AUDIO_OUTPUT_BIT_RATE;  // Ignored if stream_audio_codec_name is blank.
+	int http_max_client_backlog_kb = -1;  // 0 = no limit, -1 = default for the codec (see defs.h).
+	double http_max_client_lag_seconds = DEFAULT_HTTP_MAX_CLIENT_LAG_SECONDS;  // 0 = no limit.
+	SlowClientPolicy http_slow_client_policy = SLOW_CLIENT_SKIP;
+	int http_startup_burst_rate_kbit = 0;  // 0 = no limit.
+	bool http_hls = false;
+	int hls_segment_duration = DEFAULT_HLS_SEGMENT_DURATION;  // In seconds.
+	int hls_playlist_segments = DEFAULT_HLS_PLAYLIST_SEGMENTS;
 	std::string x264_preset = X264_DEFAULT_PRESET;
 	std::string x264_tune = X264_DEFAULT_TUNE;
+	int x264_bitrate = DEFAULT_X264_OUTPUT_BIT_RATE;  // In kilobit/sec.
+	int x264_vbv_max_bitrate = -1;  // In kilobit/sec. 0 = no VBV, -1 = same as <x264_bitrate>.
+	int x264_vbv_buffer_size = -1;  // In kilobits. -1 = same as <x264_bitrate> (one-second VBV).
+	std::vector<std::string> x264_extra_param;  // In “name[=value]” format, as for x264_param_parse().
+	bool x264_auto_bitrate = false;
+	int x264_min_bitrate = DEFAULT_X264_MIN_BIT_RATE;  // In kilobit/sec. Only used if <x264_auto_bitrate>.
+	bool x264_speedcontrol = false;
+	bool x264_speedcontrol_verbose = false;
+	std::vector<X264Rendition> x264_renditions;  // Empty = only the main stream.
+	std::vector<HTTPOutput> http_outputs;  // In addition to the one at / with <stream_mux_name>.
+	std::string udp_output;  // HOST:PORT. Blank = none.
+	int udp_mux_rate_kbit = DEFAULT_UDP_MUX_RATE_KBIT;
+	std::string shm_output;  // Name of the shared memory segment. Blank = none.
+	int shm_output_size_mb = DEFAULT_SHM_OUTPUT_SIZE_MB;
+	bool shm_output_raw = false;
+	std::vector<std::string> shm_inputs;  // Names of shared memory segments. These are the last cards.
+	bool compress_images = false;
+	std::string program_cache_dir;  // Blank = no program cache.
+	int gpu_budget_percent = 80;  // Of the frame duration. 0 = never reduce quality.
+	bool gpu_timing = false;
+	bool gpu_timing_overlay = false;  // Implies gpu_timing.
 };
 extern Flags global_flags;
 
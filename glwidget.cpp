@@ -46,6 +46,15 @@ void GLWidget::clean_context()
 		makeCurrent();
 		resource_pool->clean_context();
 	}
+	if (gpu_timers) {
+		makeCurrent();
+		gpu_timers.reset();
+	}
+	if (blit_fbo != 0) {
+		makeCurrent();
+		glDeleteFramebuffers(1, &blit_fbo);
+		blit_fbo = 0;
+	}
 }
 
 void GLWidget::initializeGL()
@@ -75,11 +84,16 @@ void GLWidget::initializeGL()
 	glDisable(GL_BLEND);
 	glDisable(GL_DEPTH_TEST);
 	glDepthMask(GL_FALSE);
+
+	gpu_timers.reset(new GPUTimers);
 }
 
 void GLWidget::resizeGL(int width, int height)
 {
 	glViewport(0, 0, width, height);
+	if (output != Mixer::OUTPUT_LIVE) {
+		global_mixer->set_display_size(output, width, height);
+	}
 }
 
 void GLWidget::paintGL()
@@ -96,9 +110,29 @@ void GLWidget::paintGL()
 	check_error();
 	glWaitSync(frame.ready_fence.get(), /*flags=*/0, GL_TIMEOUT_IGNORED);
 	check_error();
+	if (frame.chain == nullptr) {
+		// Already rendered by the mixer, at our size (unless we have been
+		// resized since), so just copy it to the screen.
+		if (blit_fbo == 0) {
+			glGenFramebuffers(1, &blit_fbo);
+		}
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, blit_fbo);
+		glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, frame.texture, 0);
+		check_error();
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		gpu_timers->begin("display: " + frame.chain_name);
+		glBlitFramebuffer(0, 0, frame.texture_width, frame.texture_height,
+		                  0, 0, width(), height(), GL_COLOR_BUFFER_BIT, GL_LINEAR);
+		gpu_timers->end();
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		check_error();
+		return;
+	}
 	frame.setup_chain();
 	check_error();
+	gpu_timers->begin("display: " + frame.chain_name);
 	frame.chain->render_to_screen();
+	gpu_timers->end();
 	check_error();
 
 	if (resource_pool == nullptr) {
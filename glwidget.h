@@ -3,9 +3,11 @@
 
 #include <epoxy/gl.h>
 #include <QGLWidget>
+#include <memory>
 #include <string>
 #include <vector>
 
+#include "gpu_timing.h"
 #include "mixer.h"
 #include "qgl.h"
 #include "qobjectdefs.h"
@@ -57,6 +59,8 @@ private:
 	GLuint vao, program_num;
 	GLuint position_vbo, texcoord_vbo;
 	movit::ResourcePool *resource_pool = nullptr;
+	GLuint blit_fbo = 0;  // For copying frames the mixer has already rendered to the screen.
+	std::unique_ptr<GPUTimers> gpu_timers;
 };
 
 #endif
@@ -0,0 +1,174 @@
+#include "gpu_timing.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+
+#include "flags.h"
+
+using namespace std;
+
+namespace {
+
+// How many samples to keep per name; at 60 fps, this is the last ~17 seconds.
+constexpr size_t num_samples_kept = 1000;
+
+// If the GPU is so far behind that this many intervals are still outstanding,
+// stop measuring until it catches up, instead of allocating ever more queries.
+constexpr size_t max_pending_timings = 256;
+
+// What the UI displays call their timings; see GLWidget::paintGL().
+const char display_prefix[] = "display: ";
+
+struct Samples {
+	vector<double> times_ms;  // A ring buffer once full.
+	size_t next = 0;  // Where to put the next sample, once full.
+	int64_t total = 0;
+};
+
+mutex samples_mu;
+map<string, Samples> all_samples;  // Under <samples_mu>.
+
+void add_sample(const string &name, double time_ms)
+{
+	lock_guard<mutex> lock(samples_mu);
+	Samples &samples = all_samples[name];
+	if (samples.times_ms.size() < num_samples_kept) {
+		samples.times_ms.push_back(time_ms);
+	} else {
+		samples.times_ms[samples.next] = time_ms;
+		samples.next = (samples.next + 1) % num_samples_kept;
+	}
+	++samples.total;
+}
+
+struct Percentiles {
+	double p50, p90, p99, max;
+};
+
+// <times_ms> must be non-empty; it is sorted as a side effect.
+Percentiles compute_percentiles(vector<double> *times_ms)
+{
+	sort(times_ms->begin(), times_ms->end());
+	auto at = [times_ms](double fraction) {
+		return (*times_ms)[min<size_t>(times_ms->size() * fraction, times_ms->size() - 1)];
+	};
+	return Percentiles{ at(0.5), at(0.9), at(0.99), times_ms->back() };
+}
+
+}  // namespace
+
+GPUTimers::~GPUTimers()
+{
+	for (const PendingTiming &pending : pending_timings) {
+		free_queries.push_back(pending.queries[0]);
+		free_queries.push_back(pending.queries[1]);
+	}
+	if (!free_queries.empty()) {
+		glDeleteQueries(free_queries.size(), free_queries.data());
+	}
+}
+
+void GPUTimers::begin(const string &name)
+{
+	if (!global_flags.gpu_timing) {
+		return;
+	}
+	assert(!in_interval);
+	in_interval = true;
+
+	collect_results();
+	skipping = (pending_timings.size() >= max_pending_timings);
+	if (skipping) {
+		return;
+	}
+	while (free_queries.size() < 2) {
+		GLuint query;
+		glGenQueries(1, &query);
+		free_queries.push_back(query);
+	}
+	current.name = name;
+	for (unsigned i = 0; i < 2; ++i) {
+		current.queries[i] = free_queries.back();
+		free_queries.pop_back();
+	}
+	glQueryCounter(current.queries[0], GL_TIMESTAMP);
+}
+
+void GPUTimers::end()
+{
+	if (!global_flags.gpu_timing) {
+		return;
+	}
+	assert(in_interval);
+	in_interval = false;
+	if (skipping) {
+		return;
+	}
+	glQueryCounter(current.queries[1], GL_TIMESTAMP);
+	pending_timings.push_back(current);
+}
+
+void GPUTimers::collect_results()
+{
+	while (!pending_timings.empty()) {
+		const PendingTiming &pending = pending_timings.front();
+		GLuint available = 0;
+		glGetQueryObjectuiv(pending.queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			// The later ones cannot be done either.
+			return;
+		}
+		GLuint64 start_ns, end_ns;
+		glGetQueryObjectui64v(pending.queries[0], GL_QUERY_RESULT, &start_ns);
+		glGetQueryObjectui64v(pending.queries[1], GL_QUERY_RESULT, &end_ns);
+		add_sample(pending.name, (end_ns - start_ns) * 1e-6);
+
+		free_queries.push_back(pending.queries[0]);
+		free_queries.push_back(pending.queries[1]);
+		pending_timings.pop_front();
+	}
+}
+
+string gpu_timing_report()
+{
+	string ret = "# name samples p50_ms p90_ms p99_ms max_ms\n";
+
+	lock_guard<mutex> lock(samples_mu);
+	for (const auto &name_and_samples : all_samples) {
+		vector<double> times_ms = name_and_samples.second.times_ms;
+		Percentiles p = compute_percentiles(&times_ms);
+
+		char buf[256];
+		snprintf(buf, sizeof(buf), " %lld %.3f %.3f %.3f %.3f\n",
+			(long long)name_and_samples.second.total, p.p50, p.p90, p.p99, p.max);
+
+		// Names may contain spaces (the theme sets them), so quote them.
+		ret += "\"" + name_and_samples.first + "\"" + buf;
+	}
+	return ret;
+}
+
+string gpu_timing_summary()
+{
+	string ret;
+
+	lock_guard<mutex> lock(samples_mu);
+	for (const auto &name_and_samples : all_samples) {
+		if (name_and_samples.first.compare(0, strlen(display_prefix), display_prefix) == 0) {
+			continue;
+		}
+		vector<double> times_ms = name_and_samples.second.times_ms;
+		Percentiles p = compute_percentiles(&times_ms);
+
+		char buf[256];
+		snprintf(buf, sizeof(buf), "%s%s %.1f/%.1f ms",
+			ret.empty() ? "" : ", ", name_and_samples.first.c_str(), p.p50, p.p99);
+		ret += buf;
+	}
+	return ret;
+}
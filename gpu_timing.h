@@ -0,0 +1,57 @@
+#ifndef _GPU_TIMING_H
+#define _GPU_TIMING_H 1
+
+// Optional instrumentation (--gpu-timing) of how long the GPU spends on
+// each chain and on the other parts of producing a frame, such as chroma
+// subsampling and readback for the encoder.
+//
+// We use pairs of timestamp queries (not GL_TIME_ELAPSED, since those cannot
+// overlap with each other, and QualityGovernor already uses one), and read
+// them back a few frames later, so that we never need to wait for the GPU.
+// The results for the last samples of each name are kept in one global table,
+// no matter which thread or context they came from, and can be summarized
+// as percentiles.
+
+#include <epoxy/gl.h>
+#include <deque>
+#include <string>
+#include <vector>
+
+class GPUTimers {
+public:
+	// All calls, including the constructor and destructor, must happen
+	// with the same OpenGL context current, since query objects are
+	// not shared between contexts.
+	GPUTimers() {}
+	~GPUTimers();
+
+	// Times the GPU work issued between begin() and end() under <name>.
+	// Intervals cannot be nested. Does nothing unless --gpu-timing is given.
+	void begin(const std::string &name);
+	void end();
+
+private:
+	struct PendingTiming {
+		std::string name;
+		GLuint queries[2];
+	};
+
+	// Reads back all the queries that are done, oldest first.
+	void collect_results();
+
+	std::deque<PendingTiming> pending_timings;
+	std::vector<GLuint> free_queries;
+	PendingTiming current;
+	bool in_interval = false;
+	bool skipping = false;  // If the GPU is too far behind to measure this interval.
+};
+
+// A table of percentiles (in milliseconds) for each name, for the HTTP
+// endpoint, one name per line.
+std::string gpu_timing_report();
+
+// A short, single-line version (median and 99th percentile only, and without
+// the UI displays, which are named “display: ...”), for showing on screen.
+std::string gpu_timing_summary();
+
+#endif  // !defined(_GPU_TIMING_H)
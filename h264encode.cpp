@@ -10,14 +10,11 @@
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-#include <libavresample/avresample.h>
-#include <libavutil/channel_layout.h>
 #include <libavutil/frame.h>
 #include <libavutil/rational.h>
-#include <libavutil/samplefmt.h>
-#include <libavutil/opt.h>
 }
 #include <libdrm/drm_fourcc.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -38,12 +35,16 @@ extern "C" {
 #include <thread>
 #include <utility>
 
+#include "audio_encoder.h"
 #include "context.h"
 #include "defs.h"
 #include "flags.h"
+#include "hls_segmenter.h"
 #include "httpd.h"
 #include "mux.h"
+#include "shm_output.h"
 #include "timebase.h"
+#include "udp_stream.h"
 #include "x264encode.h"
 
 using namespace std;
@@ -128,54 +129,40 @@ using namespace std;
 // though); we know that for N B-frames we need at most (N-1) frames
 // in the reorder buffer, and can just sort on that.
 //
-// The class also deals with keeping a freelist as needed.
+// The reorderer never touches the pixels; it just holds on to references
+// to the readback buffers until it's their turn to go out.
 class FrameReorderer {
 public:
-	FrameReorderer(unsigned queue_length, int width, int height);
+	FrameReorderer(unsigned queue_length);
 
 	// Returns the next frame to insert with its pts, if any. Otherwise -1 and nullptr.
-	// Does _not_ take ownership of data; a copy is taken if needed.
-	// The returned pointer is valid until the next call to reorder_frame, or destruction.
+	// Keeps the reference to <data> until the frame is returned.
 	// As a special case, if queue_length == 0, will just return pts and data (no reordering needed).
-	pair<int64_t, const uint8_t *> reorder_frame(int64_t pts, const uint8_t *data);
+	pair<int64_t, shared_ptr<const uint8_t>> reorder_frame(int64_t pts, shared_ptr<const uint8_t> data);
 
 	// The same as reorder_frame, but without inserting anything. Used to empty the queue.
-	pair<int64_t, const uint8_t *> get_first_frame();
+	pair<int64_t, shared_ptr<const uint8_t>> get_first_frame();
 
 	bool empty() const { return frames.empty(); }
 
 private:
 	unsigned queue_length;
-	int width, height;
 
-	priority_queue<pair<int64_t, uint8_t *>> frames;
-	stack<uint8_t *> freelist;  // Includes the last value returned from reorder_frame.
-
-	// Owns all the pointers. Normally, freelist and frames could do this themselves,
-	// except priority_queue doesn't work well with movable-only types.
-	vector<unique_ptr<uint8_t[]>> owner;
+	priority_queue<pair<int64_t, shared_ptr<const uint8_t>>> frames;
 };
 
-FrameReorderer::FrameReorderer(unsigned queue_length, int width, int height)
-    : queue_length(queue_length), width(width), height(height)
+FrameReorderer::FrameReorderer(unsigned queue_length)
+    : queue_length(queue_length)
 {
-	for (unsigned i = 0; i < queue_length; ++i) {
-		owner.emplace_back(new uint8_t[width * height * 2]);
-		freelist.push(owner.back().get());
-	}
 }
 
-pair<int64_t, const uint8_t *> FrameReorderer::reorder_frame(int64_t pts, const uint8_t *data)
+pair<int64_t, shared_ptr<const uint8_t>> FrameReorderer::reorder_frame(int64_t pts, shared_ptr<const uint8_t> data)
 {
 	if (queue_length == 0) {
-		return make_pair(pts, data);
+		return make_pair(pts, move(data));
 	}
 
-	assert(!freelist.empty());
-	uint8_t *storage = freelist.top();
-	freelist.pop();
-	memcpy(storage, data, width * height * 2);
-	frames.emplace(-pts, storage);  // Invert pts to get smallest first.
+	frames.emplace(-pts, move(data));  // Invert pts to get smallest first.
 
 	if (frames.size() >= queue_length) {
 		return get_first_frame();
@@ -184,31 +171,27 @@ pair<int64_t, const uint8_t *> FrameReorderer::reorder_frame(int64_t pts, const
 	}
 }
 
-pair<int64_t, const uint8_t *> FrameReorderer::get_first_frame()
+pair<int64_t, shared_ptr<const uint8_t>> FrameReorderer::get_first_frame()
 {
 	assert(!frames.empty());
-	pair<int64_t, uint8_t *> storage = frames.top();
+	pair<int64_t, shared_ptr<const uint8_t>> storage = frames.top();
 	frames.pop();
-	int64_t pts = storage.first;
-	freelist.push(storage.second);
-	return make_pair(-pts, storage.second);  // Re-invert pts (see reorder_frame()).
+	return make_pair(-storage.first, move(storage.second));  // Re-invert pts (see reorder_frame()).
 }
 
-class H264EncoderImpl : public KeyFrameSignalReceiver {
+class H264EncoderImpl {
 public:
-	H264EncoderImpl(QSurface *surface, const string &va_display, int width, int height, HTTPD *httpd);
+	H264EncoderImpl(QSurface *surface, const string &va_display, int width, int height, HTTPD *httpd, H264Encoder::PersistentOutputs *persistent_outputs);
 	~H264EncoderImpl();
 	void add_audio(int64_t pts, vector<float> audio);
 	bool begin_frame(GLuint *y_tex, GLuint *cbcr_tex);
+	vector<H264Encoder::RenditionTextures> get_rendition_textures();
 	RefCountedGLsync end_frame(int64_t pts, const vector<RefCountedFrame> &input_frames);
 	void shutdown();
+	void change_x264_rate_control(int bitrate_kbit, int vbv_max_bitrate_kbit, int vbv_buffer_size_kbit);
 	void open_output_file(const std::string &filename);
 	void close_output_file();
 
-	virtual void signal_keyframe() override {
-		stream_mux_writing_keyframes = true;
-	}
-
 private:
 	struct storage_task {
 		unsigned long long display_order;
@@ -230,26 +213,12 @@ private:
 	void encode_thread_func();
 	void encode_remaining_frames_as_p(int encoding_frame_num, int gop_start_display_frame_num, int64_t last_dts);
 	void add_packet_for_uncompressed_frame(int64_t pts, const uint8_t *data);
+	void add_uncompressed_frame(int64_t pts, shared_ptr<const uint8_t> data);
+	shared_ptr<const uint8_t> get_readback_frame(unsigned surface_num, const uint8_t *data);
 	void encode_frame(PendingFrame frame, int encoding_frame_num, int display_frame_num, int gop_start_display_frame_num,
 	                  int frame_type, int64_t pts, int64_t dts);
 	void storage_task_thread();
-	void encode_audio(const vector<float> &audio,
-	                  vector<float> *audio_queue,
-	                  int64_t audio_pts,
-	                  AVCodecContext *ctx,
-	                  AVAudioResampleContext *resampler,
-			  const vector<Mux *> &muxes);
-	void encode_audio_one_frame(const float *audio,
-	                            size_t num_samples,  // In each channel.
-				    int64_t audio_pts,
-				    AVCodecContext *ctx,
-				    AVAudioResampleContext *resampler,
-				    const vector<Mux *> &muxes);
-	void encode_last_audio(vector<float> *audio_queue,
-	                       int64_t audio_pts,
-			       AVCodecContext *ctx,
-			       AVAudioResampleContext *resampler,
-			       const vector<Mux *> &muxes);
+	void encode_audio(vector<float> audio, int64_t audio_pts);
 	void encode_remaining_audio();
 	void storage_task_enqueue(storage_task task);
 	void save_codeddata(storage_task task);
@@ -276,8 +245,10 @@ private:
 	int update_RefPicList(int frame_type);
 	void open_output_stream();
 	void close_output_stream();
-	static int write_packet_thunk(void *opaque, uint8_t *buf, int buf_size);
-	int write_packet(uint8_t *buf, int buf_size);
+	void set_hls_master_playlist();
+	struct StreamOutput;
+	void open_stream_output(StreamOutput *output, int width, int height, Mux::Codec video_codec);
+	vector<Mux *> get_main_stream_muxes() const;
 
 	bool is_shutdown = false;
 	bool use_zerocopy;
@@ -288,6 +259,7 @@ private:
 	mutex storage_task_queue_mutex;
 	condition_variable storage_task_queue_changed;
 	int srcsurface_status[SURFACE_NUM];  // protected by storage_task_queue_mutex
+	unsigned readback_refs[SURFACE_NUM]{ 0 };  // protected by storage_task_queue_mutex. See get_readback_frame().
 	queue<storage_task> storage_task_queue;  // protected by storage_task_queue_mutex
 	bool storage_thread_should_quit = false;  // protected by storage_task_queue_mutex
 
@@ -299,33 +271,61 @@ private:
 
 	map<int, PendingFrame> pending_video_frames;  // under frame_queue_mutex
 	map<int64_t, vector<float>> pending_audio_frames;  // under frame_queue_mutex
-	int64_t last_audio_pts = 0;  // The first pts after all audio we've encoded.
 	QSurface *surface;
 
-	AVCodecContext *context_audio_file;
-	AVCodecContext *context_audio_stream = nullptr;  // nullptr = don't code separate audio for stream.
-
-	AVAudioResampleContext *resampler_audio_file = nullptr;
-	AVAudioResampleContext *resampler_audio_stream = nullptr;
-
-	vector<float> audio_queue_file;
-	vector<float> audio_queue_stream;
+	unique_ptr<AudioEncoder> file_audio_encoder;
+	unique_ptr<AudioEncoder> stream_audio_encoder;  // nullptr = the stream uses the same configuration as the file.
 
-	unique_ptr<Mux> stream_mux;  // To HTTP.
 	unique_ptr<Mux> file_mux;  // To local disk.
 
-	// While Mux object is constructing, <stream_mux_writing_header> is true,
-	// and the header is being collected into stream_mux_header.
-	bool stream_mux_writing_header;
-	string stream_mux_header;
+	// A mux sending its output to an HTTPD output (and possibly HLS),
+	// or to UDP.
+	struct StreamOutput : public KeyFrameSignalReceiver {
+		HTTPD *httpd;
+		unsigned httpd_output;
+		string mux_name;
+		UDPStream *udp_stream = nullptr;  // If set, used instead of <httpd>. Owned by the PersistentOutputs.
+		unique_ptr<Mux> mux;
+		HLSSegmenter *hls_segmenter = nullptr;  // nullptr if not using --http-hls. Owned by the PersistentOutputs.
+
+		// While the Mux object is constructing, <writing_header> is true,
+		// and the header is being collected into <header>.
+		bool writing_header = false;
+		string header;
+
+		bool writing_keyframes = false;
+		int64_t keyframe_pts = 0;
+
+		virtual void signal_keyframe(int64_t pts) override {
+			writing_keyframes = true;
+			keyframe_pts = pts;
+		}
+		static int write_packet_thunk(void *opaque, uint8_t *buf, int buf_size);
+		int write_packet(uint8_t *buf, int buf_size);
+	};
+
+	ShmOutput *shm_output;  // nullptr if not using --shm-output. Owned by the PersistentOutputs.
 
-	bool stream_mux_writing_keyframes = false;
+	// The main stream: First the one at / (with --http-mux), then one for
+	// each --http-output, then --udp-output if set. They all get the same packets, so the video and
+	// audio are only encoded once no matter how many there are.
+	vector<unique_ptr<StreamOutput>> stream_outputs;
 
-	AVFrame *audio_frame = nullptr;
 	HTTPD *httpd;
 	unique_ptr<FrameReorderer> reorderer;
 	unique_ptr<X264Encoder> x264_encoder;  // nullptr if not using x264.
 
+	// For --x264-rendition. Each rendition is a separate stream on its own
+	// HTTPD output, with its own mux, reorderer and x264 encoder, but it
+	// shares the audio encoder with the main stream.
+	struct Rendition {
+		X264Rendition config;
+		StreamOutput output;  // Always with --http-mux.
+		unique_ptr<FrameReorderer> reorderer;
+		unique_ptr<X264Encoder> x264_encoder;
+	};
+	vector<unique_ptr<Rendition>> renditions;
+
 	Display *x11_display = nullptr;
 
 	// Encoder parameters
@@ -348,6 +348,15 @@ private:
 		GLuint pbo;
 		uint8_t *y_ptr, *cbcr_ptr;
 		size_t y_offset, cbcr_offset;
+
+		// One for each element in <renditions>. Read back into a PBO
+		// just like the main frame, but never uploaded to VA-API.
+		struct RenditionSurface {
+			GLuint y_tex, cbcr_tex;
+			GLuint pbo;
+			uint8_t *ptr;  // NV12.
+		};
+		vector<RenditionSurface> renditions;
 	};
 	GLSurface gl_surfaces[SURFACE_NUM];
 
@@ -992,6 +1001,9 @@ void H264EncoderImpl::enable_zerocopy_if_possible()
 	} else if (global_flags.x264_video_to_http) {
 		fprintf(stderr, "Disabling zerocopy H.264 encoding due to --http-x264-video.\n");
 		use_zerocopy = false;
+	} else if (global_flags.shm_output_raw) {
+		fprintf(stderr, "Disabling zerocopy H.264 encoding due to --shm-output-raw.\n");
+		use_zerocopy = false;
 	} else {
 		use_zerocopy = true;
 	}
@@ -1270,6 +1282,27 @@ int H264EncoderImpl::setup_encode()
             gl_surfaces[i].cbcr_ptr = ptr + gl_surfaces[i].cbcr_offset;
             glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
         }
+
+        for (const unique_ptr<Rendition> &rendition : renditions) {
+            const int width = rendition->config.width, height = rendition->config.height;
+            GLSurface::RenditionSurface rsurf;
+
+            glGenTextures(1, &rsurf.y_tex);
+            glBindTexture(GL_TEXTURE_2D, rsurf.y_tex);
+            glTexStorage2D(GL_TEXTURE_2D, 1, GL_R8, width, height);
+
+            glGenTextures(1, &rsurf.cbcr_tex);
+            glBindTexture(GL_TEXTURE_2D, rsurf.cbcr_tex);
+            glTexStorage2D(GL_TEXTURE_2D, 1, GL_RG8, width / 2, height / 2);
+
+            glGenBuffers(1, &rsurf.pbo);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, rsurf.pbo);
+            glBufferStorage(GL_PIXEL_PACK_BUFFER, width * height * 3 / 2, nullptr, GL_MAP_READ_BIT | GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT);
+            rsurf.ptr = (uint8_t *)glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, width * height * 3 / 2, GL_MAP_READ_BIT | GL_MAP_PERSISTENT_BIT);
+            glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+
+            gl_surfaces[i].renditions.push_back(rsurf);
+        }
     }
 
     for (i = 0; i < SURFACE_NUM; i++) {
@@ -1677,7 +1710,9 @@ void H264EncoderImpl::save_codeddata(storage_task task)
 		}
 		if (!global_flags.uncompressed_video_to_http &&
 		    !global_flags.x264_video_to_http) {
-			stream_mux->add_packet(pkt, task.pts + global_delay(), task.dts + global_delay());
+			for (const unique_ptr<StreamOutput> &output : stream_outputs) {
+				output->mux->add_packet(pkt, task.pts + global_delay(), task.dts + global_delay());
+			}
 		}
 	}
 	// Encode and add all audio frames up to and including the pts of this video frame.
@@ -1695,129 +1730,20 @@ void H264EncoderImpl::save_codeddata(storage_task task)
 			pending_audio_frames.erase(it); 
 		}
 
-		if (context_audio_stream) {
-			encode_audio(audio, &audio_queue_file, audio_pts, context_audio_file, resampler_audio_file, { file_mux.get() });
-			encode_audio(audio, &audio_queue_stream, audio_pts, context_audio_stream, resampler_audio_stream, { stream_mux.get() });
-		} else {
-			encode_audio(audio, &audio_queue_file, audio_pts, context_audio_file, resampler_audio_file, { stream_mux.get(), file_mux.get() });
-		}
-		last_audio_pts = audio_pts + audio.size() * TIMEBASE / (OUTPUT_FREQUENCY * 2);
+		encode_audio(move(audio), audio_pts);
 
 		if (audio_pts == task.pts) break;
 	}
 }
 
-void H264EncoderImpl::encode_audio(
-	const vector<float> &audio,
-	vector<float> *audio_queue,
-	int64_t audio_pts,
-	AVCodecContext *ctx,
-	AVAudioResampleContext *resampler,
-	const vector<Mux *> &muxes)
+void H264EncoderImpl::encode_audio(vector<float> audio, int64_t audio_pts)
 {
-	if (ctx->frame_size == 0) {
-		// No queueing needed.
-		assert(audio_queue->empty());
-		assert(audio.size() % 2 == 0);
-		encode_audio_one_frame(&audio[0], audio.size() / 2, audio_pts, ctx, resampler, muxes);
-		return;
-	}
-
-	int64_t sample_offset = audio_queue->size();
-
-	audio_queue->insert(audio_queue->end(), audio.begin(), audio.end());
-	size_t sample_num;
-	for (sample_num = 0;
-	     sample_num + ctx->frame_size * 2 <= audio_queue->size();
-	     sample_num += ctx->frame_size * 2) {
-		int64_t adjusted_audio_pts = audio_pts + (int64_t(sample_num) - sample_offset) * TIMEBASE / (OUTPUT_FREQUENCY * 2);
-		encode_audio_one_frame(&(*audio_queue)[sample_num],
-		                       ctx->frame_size,
-		                       adjusted_audio_pts,
-		                       ctx,
-		                       resampler,
-		                       muxes);
-	}
-	audio_queue->erase(audio_queue->begin(), audio_queue->begin() + sample_num);
-}
-
-void H264EncoderImpl::encode_audio_one_frame(
-	const float *audio,
-	size_t num_samples,
-	int64_t audio_pts,
-	AVCodecContext *ctx,
-	AVAudioResampleContext *resampler,
-	const vector<Mux *> &muxes)
-{
-	audio_frame->pts = audio_pts + global_delay();
-	audio_frame->nb_samples = num_samples;
-	audio_frame->channel_layout = AV_CH_LAYOUT_STEREO;
-	audio_frame->format = ctx->sample_fmt;
-	audio_frame->sample_rate = OUTPUT_FREQUENCY;
-
-	if (av_samples_alloc(audio_frame->data, nullptr, 2, num_samples, ctx->sample_fmt, 0) < 0) {
-		fprintf(stderr, "Could not allocate %ld samples.\n", num_samples);
-		exit(1);
-	}
-
-	if (avresample_convert(resampler, audio_frame->data, 0, num_samples,
-	                       (uint8_t **)&audio, 0, num_samples) < 0) {
-		fprintf(stderr, "Audio conversion failed.\n");
-		exit(1);
-	}
-
-	AVPacket pkt;
-	av_init_packet(&pkt);
-	pkt.data = nullptr;
-	pkt.size = 0;
-	int got_output = 0;
-	avcodec_encode_audio2(ctx, &pkt, audio_frame, &got_output);
-	if (got_output) {
-		pkt.stream_index = 1;
-		pkt.flags = 0;
-		for (Mux *mux : muxes) {
-			mux->add_packet(pkt, pkt.pts, pkt.dts);
-		}
-	}
-
-	av_freep(&audio_frame->data[0]);
-
-	av_frame_unref(audio_frame);
-	av_free_packet(&pkt);
-}
-
-void H264EncoderImpl::encode_last_audio(
-	vector<float> *audio_queue,
-	int64_t audio_pts,
-	AVCodecContext *ctx,
-	AVAudioResampleContext *resampler,
-	const vector<Mux *> &muxes)
-{
-	if (!audio_queue->empty()) {
-		// Last frame can be whatever size we want.
-		assert(audio_queue->size() % 2 == 0);
-		encode_audio_one_frame(&(*audio_queue)[0], audio_queue->size() / 2, audio_pts, ctx, resampler, muxes);
-		audio_queue->clear();
-	}
-
-	if (ctx->codec->capabilities & AV_CODEC_CAP_DELAY) {
-		// Collect any delayed frames.
-		for ( ;; ) {
-			int got_output = 0;
-			AVPacket pkt;
-			av_init_packet(&pkt);
-			pkt.data = nullptr;
-			pkt.size = 0;
-			avcodec_encode_audio2(ctx, &pkt, nullptr, &got_output);
-			if (!got_output) break;
-
-			pkt.stream_index = 1;
-			pkt.flags = 0;
-			for (Mux *mux : muxes) {
-				mux->add_packet(pkt, pkt.pts, pkt.dts);
-			}
-			av_free_packet(&pkt);
-		}
+	// Each distinct codec configuration gets the block exactly once;
+	// the AudioEncoders share it without copying.
+	shared_ptr<const vector<float>> block = make_shared<const vector<float>>(move(audio));
+	file_audio_encoder->encode_audio(block, audio_pts + global_delay());
+	if (stream_audio_encoder) {
+		stream_audio_encoder->encode_audio(block, audio_pts + global_delay());
 	}
 }
 
@@ -1872,6 +1798,16 @@ int H264EncoderImpl::release_encode()
 		}
 		glDeleteTextures(1, &gl_surfaces[i].y_tex);
 		glDeleteTextures(1, &gl_surfaces[i].cbcr_tex);
+
+		for (const GLSurface::RenditionSurface &rsurf : gl_surfaces[i].renditions) {
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, rsurf.pbo);
+			glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+			glDeleteBuffers(1, &rsurf.pbo);
+			glDeleteTextures(1, &rsurf.y_tex);
+			glDeleteTextures(1, &rsurf.cbcr_tex);
+		}
+		gl_surfaces[i].renditions.clear();
 	}
 
 	vaDestroyContext(va_dpy, context_id);
@@ -1889,77 +1825,111 @@ int H264EncoderImpl::deinit_va()
     return 0;
 }
 
-namespace {
-
-void init_audio_encoder(const string &codec_name, int bit_rate, AVCodecContext **ctx, AVAudioResampleContext **resampler)
+H264EncoderImpl::H264EncoderImpl(QSurface *surface, const string &va_display, int width, int height, HTTPD *httpd, H264Encoder::PersistentOutputs *persistent_outputs)
+	: current_storage_frame(0), surface(surface), httpd(httpd), frame_width(width), frame_height(height)
 {
-	AVCodec *codec_audio = avcodec_find_encoder_by_name(codec_name.c_str());
-	if (codec_audio == nullptr) {
-		fprintf(stderr, "ERROR: Could not find codec '%s'\n", codec_name.c_str());
-		exit(1);
-	}
+	file_audio_encoder.reset(new AudioEncoder(AUDIO_OUTPUT_CODEC_NAME, DEFAULT_AUDIO_OUTPUT_BIT_RATE));
 
-	AVCodecContext *context_audio = avcodec_alloc_context3(codec_audio);
-	context_audio->bit_rate = bit_rate;
-	context_audio->sample_rate = OUTPUT_FREQUENCY;
-	context_audio->sample_fmt = codec_audio->sample_fmts[0];
-	context_audio->channels = 2;
-	context_audio->channel_layout = AV_CH_LAYOUT_STEREO;
-	context_audio->time_base = AVRational{1, TIMEBASE};
-	context_audio->flags |= CODEC_FLAG_GLOBAL_HEADER;
-	if (avcodec_open2(context_audio, codec_audio, NULL) < 0) {
-		fprintf(stderr, "Could not open codec '%s'\n", codec_name.c_str());
-		exit(1);
+	// Only encode the stream audio separately if it actually differs
+	// from the file audio; otherwise, both muxes get the same packets.
+	if (!global_flags.stream_audio_codec_name.empty() &&
+	    (global_flags.stream_audio_codec_name != file_audio_encoder->get_codec_name() ||
+	     global_flags.stream_audio_codec_bitrate != file_audio_encoder->get_bit_rate())) {
+		stream_audio_encoder.reset(new AudioEncoder(global_flags.stream_audio_codec_name,
+			global_flags.stream_audio_codec_bitrate));
 	}
 
-	*ctx = context_audio;
-
-	*resampler = avresample_alloc_context();
-	if (*resampler == nullptr) {
-		fprintf(stderr, "Allocating resampler failed.\n");
-		exit(1);
+	if (!persistent_outputs->created) {
+		if (global_flags.http_hls) {
+			persistent_outputs->main_hls_segmenter.reset(new HLSSegmenter(httpd, "/hls/main"));
+			for (const X264Rendition &config : global_flags.x264_renditions) {
+				persistent_outputs->rendition_hls_segmenters.emplace_back(new HLSSegmenter(httpd, "/hls" + config.url));
+			}
+		}
+		if (!global_flags.udp_output.empty()) {
+			persistent_outputs->udp_stream.reset(new UDPStream(global_flags.udp_output, global_flags.udp_mux_rate_kbit));
+		}
+		if (!global_flags.shm_output.empty()) {
+			AudioEncoder *audio_encoder = stream_audio_encoder ? stream_audio_encoder.get() : file_audio_encoder.get();
+			persistent_outputs->shm_output.reset(new ShmOutput(global_flags.shm_output, size_t(global_flags.shm_output_size_mb) << 20,
+				frame_width, frame_height,
+				global_flags.uncompressed_video_to_http ? Mux::CODEC_NV12 : Mux::CODEC_H264,
+				audio_encoder->get_codec_name()));
+		}
+		persistent_outputs->created = true;
 	}
+	shm_output = persistent_outputs->shm_output.get();
 
-	av_opt_set_int(*resampler, "in_channel_layout",  AV_CH_LAYOUT_STEREO,       0);
-	av_opt_set_int(*resampler, "out_channel_layout", AV_CH_LAYOUT_STEREO,       0);
-	av_opt_set_int(*resampler, "in_sample_rate",     OUTPUT_FREQUENCY,          0);
-	av_opt_set_int(*resampler, "out_sample_rate",    OUTPUT_FREQUENCY,          0);
-	av_opt_set_int(*resampler, "in_sample_fmt",      AV_SAMPLE_FMT_FLT,         0);
-	av_opt_set_int(*resampler, "out_sample_fmt",     context_audio->sample_fmt, 0);
+	frame_width_mbaligned = (frame_width + 15) & (~15);
+	frame_height_mbaligned = (frame_height + 15) & (~15);
 
-	if (avresample_open(*resampler) < 0) {
-		fprintf(stderr, "Could not open resample context.\n");
-		exit(1);
+	for (size_t i = 0; i < global_flags.x264_renditions.size(); ++i) {
+		const X264Rendition &config = global_flags.x264_renditions[i];
+		unique_ptr<Rendition> rendition(new Rendition);
+		rendition->config = config;
+		rendition->output.httpd = httpd;
+		rendition->output.httpd_output = httpd->find_output(config.url);
+		rendition->output.mux_name = global_flags.stream_mux_name;
+		if (global_flags.http_hls) {
+			rendition->output.hls_segmenter = persistent_outputs->rendition_hls_segmenters[i].get();
+		}
+		renditions.push_back(move(rendition));
 	}
-}
-
-}  // namespace
-
-H264EncoderImpl::H264EncoderImpl(QSurface *surface, const string &va_display, int width, int height, HTTPD *httpd)
-	: current_storage_frame(0), surface(surface), httpd(httpd), frame_width(width), frame_height(height)
-{
-	init_audio_encoder(AUDIO_OUTPUT_CODEC_NAME, DEFAULT_AUDIO_OUTPUT_BIT_RATE, &context_audio_file, &resampler_audio_file);
 
-	if (!global_flags.stream_audio_codec_name.empty()) {
-		init_audio_encoder(global_flags.stream_audio_codec_name,
-			global_flags.stream_audio_codec_bitrate, &context_audio_stream, &resampler_audio_stream);
+	{
+		unique_ptr<StreamOutput> output(new StreamOutput);
+		output->httpd = httpd;
+		output->httpd_output = 0;
+		output->mux_name = global_flags.stream_mux_name;
+		output->hls_segmenter = persistent_outputs->main_hls_segmenter.get();
+		stream_outputs.push_back(move(output));
+	}
+	for (const HTTPOutput &config : global_flags.http_outputs) {
+		unique_ptr<StreamOutput> output(new StreamOutput);
+		output->httpd = httpd;
+		output->httpd_output = httpd->find_output(config.url);
+		output->mux_name = config.mux_name;
+		stream_outputs.push_back(move(output));
+	}
+	if (!global_flags.udp_output.empty()) {
+		unique_ptr<StreamOutput> output(new StreamOutput);
+		output->httpd = nullptr;
+		output->httpd_output = 0;
+		output->mux_name = "mpegts";
+		output->udp_stream = persistent_outputs->udp_stream.get();
+		stream_outputs.push_back(move(output));
+	}
+	if (global_flags.http_hls && !renditions.empty()) {
+		set_hls_master_playlist();
 	}
-
-	frame_width_mbaligned = (frame_width + 15) & (~15);
-	frame_height_mbaligned = (frame_height + 15) & (~15);
 
 	open_output_stream();
 
-	audio_frame = av_frame_alloc();
-
 	//print_input();
 
 	if (global_flags.uncompressed_video_to_http ||
-	    global_flags.x264_video_to_http) {
-		reorderer.reset(new FrameReorderer(ip_period - 1, frame_width, frame_height));
+	    global_flags.x264_video_to_http ||
+	    global_flags.shm_output_raw) {
+		reorderer.reset(new FrameReorderer(ip_period - 1));
 	}
 	if (global_flags.x264_video_to_http) {
-		x264_encoder.reset(new X264Encoder(stream_mux.get()));
+		x264_encoder.reset(new X264Encoder(get_main_stream_muxes(), frame_width, frame_height, global_flags.x264_bitrate, [this]{
+			// The outputs get the same data, so go by the one that is furthest behind.
+			size_t backlog = 0;
+			for (const unique_ptr<StreamOutput> &output : stream_outputs) {
+				if (!output->udp_stream) {
+					backlog = max(backlog, this->httpd->get_average_client_backlog_bytes(output->httpd_output));
+				}
+			}
+			return backlog;
+		}));
+	}
+	for (unique_ptr<Rendition> &rendition : renditions) {
+		Rendition *r = rendition.get();
+		r->reorderer.reset(new FrameReorderer(ip_period - 1));
+		r->x264_encoder.reset(new X264Encoder({ r->output.mux.get() }, r->config.width, r->config.height, r->config.bitrate, [r]{
+			return r->output.httpd->get_average_client_backlog_bytes(r->output.httpd_output);
+		}));
 	}
 
 	init_va(va_display);
@@ -1990,12 +1960,6 @@ H264EncoderImpl::H264EncoderImpl(QSurface *surface, const string &va_display, in
 H264EncoderImpl::~H264EncoderImpl()
 {
 	shutdown();
-	av_frame_free(&audio_frame);
-	avresample_free(&resampler_audio_file);
-	avresample_free(&resampler_audio_stream);
-	avcodec_free_context(&context_audio_file);
-	avcodec_free_context(&context_audio_stream);
-	close_output_stream();
 }
 
 bool H264EncoderImpl::begin_frame(GLuint *y_tex, GLuint *cbcr_tex)
@@ -2007,8 +1971,15 @@ bool H264EncoderImpl::begin_frame(GLuint *y_tex, GLuint *cbcr_tex)
 		if (srcsurface_status[current_storage_frame % SURFACE_NUM] != SRC_SURFACE_FREE) {
 			fprintf(stderr, "Warning: Slot %d (for frame %d) is still encoding, rendering has to wait for H.264 encoder\n",
 				current_storage_frame % SURFACE_NUM, current_storage_frame);
+		} else if (readback_refs[current_storage_frame % SURFACE_NUM] != 0) {
+			fprintf(stderr, "Warning: Slot %d (for frame %d) is still being read by x264, rendering has to wait\n",
+				current_storage_frame % SURFACE_NUM, current_storage_frame);
 		}
-		storage_task_queue_changed.wait(lock, [this]{ return storage_thread_should_quit || (srcsurface_status[current_storage_frame % SURFACE_NUM] == SRC_SURFACE_FREE); });
+		storage_task_queue_changed.wait(lock, [this]{
+			return storage_thread_should_quit ||
+				(srcsurface_status[current_storage_frame % SURFACE_NUM] == SRC_SURFACE_FREE &&
+				 readback_refs[current_storage_frame % SURFACE_NUM] == 0);
+		});
 		srcsurface_status[current_storage_frame % SURFACE_NUM] = SRC_SURFACE_IN_ENCODING;
 		if (storage_thread_should_quit) return false;
 	}
@@ -2079,6 +2050,18 @@ void H264EncoderImpl::add_audio(int64_t pts, vector<float> audio)
 	frame_queue_nonempty.notify_all();
 }
 
+vector<H264Encoder::RenditionTextures> H264EncoderImpl::get_rendition_textures()
+{
+	const GLSurface *surf = &gl_surfaces[current_storage_frame % SURFACE_NUM];
+	vector<H264Encoder::RenditionTextures> ret;
+	for (unsigned i = 0; i < renditions.size(); ++i) {
+		ret.push_back(H264Encoder::RenditionTextures{
+			renditions[i]->config.width, renditions[i]->config.height,
+			surf->renditions[i].y_tex, surf->renditions[i].cbcr_tex });
+	}
+	return ret;
+}
+
 RefCountedGLsync H264EncoderImpl::end_frame(int64_t pts, const vector<RefCountedFrame> &input_frames)
 {
 	assert(!is_shutdown);
@@ -2102,6 +2085,24 @@ RefCountedGLsync H264EncoderImpl::end_frame(int64_t pts, const vector<RefCounted
 		glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_UNSIGNED_BYTE, BUFFER_OFFSET(surf->cbcr_offset));
 		check_error();
 
+		for (unsigned i = 0; i < renditions.size(); ++i) {
+			const GLSurface::RenditionSurface &rsurf = surf->renditions[i];
+			const int width = renditions[i]->config.width, height = renditions[i]->config.height;
+
+			glBindBuffer(GL_PIXEL_PACK_BUFFER, rsurf.pbo);
+			check_error();
+
+			glBindTexture(GL_TEXTURE_2D, rsurf.y_tex);
+			check_error();
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RED, GL_UNSIGNED_BYTE, BUFFER_OFFSET(0));
+			check_error();
+
+			glBindTexture(GL_TEXTURE_2D, rsurf.cbcr_tex);
+			check_error();
+			glGetTexImage(GL_TEXTURE_2D, 0, GL_RG, GL_UNSIGNED_BYTE, BUFFER_OFFSET(width * height));
+			check_error();
+		}
+
 		glBindTexture(GL_TEXTURE_2D, 0);
 		check_error();
 		glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
@@ -2138,6 +2139,9 @@ void H264EncoderImpl::shutdown()
 	}
 	encode_thread.join();
 	x264_encoder.reset();
+	for (unique_ptr<Rendition> &rendition : renditions) {
+		rendition->x264_encoder.reset();
+	}
 	{
 		unique_lock<mutex> lock(storage_task_queue_mutex);
 		storage_thread_should_quit = true;
@@ -2146,11 +2150,29 @@ void H264EncoderImpl::shutdown()
 	}
 	storage_thread.join();
 
+	// Encode any leftover audio in the queues, and also any delayed frames.
+	// This blocks until the audio encoder threads are done.
+	file_audio_encoder->encode_last_audio();
+	if (stream_audio_encoder) {
+		stream_audio_encoder->encode_last_audio();
+	}
+
+	// Nothing more will come to the muxes, so finish them now; the next
+	// encoder may already be sending to the same PersistentOutputs.
+	close_output_stream();
+
 	release_encode();
 	deinit_va();
 	is_shutdown = true;
 }
 
+void H264EncoderImpl::change_x264_rate_control(int bitrate_kbit, int vbv_max_bitrate_kbit, int vbv_buffer_size_kbit)
+{
+	if (x264_encoder) {
+		x264_encoder->change_rate_control(bitrate_kbit, vbv_max_bitrate_kbit, vbv_buffer_size_kbit);
+	}
+}
+
 void H264EncoderImpl::open_output_file(const std::string &filename)
 {
 	AVFormatContext *avctx = avformat_alloc_context();
@@ -2166,35 +2188,20 @@ void H264EncoderImpl::open_output_file(const std::string &filename)
 		exit(1);
 	}
 
-	file_mux.reset(new Mux(avctx, frame_width, frame_height, Mux::CODEC_H264, context_audio_file->codec, TIMEBASE, DEFAULT_AUDIO_OUTPUT_BIT_RATE, nullptr));
+	file_mux.reset(new Mux(avctx, frame_width, frame_height, Mux::CODEC_H264, file_audio_encoder->get_codec(), TIMEBASE, DEFAULT_AUDIO_OUTPUT_BIT_RATE, nullptr));
+	file_audio_encoder->add_mux(file_mux.get());
 }
 
 void H264EncoderImpl::close_output_file()
 {
+	if (file_mux) {
+		file_audio_encoder->remove_mux(file_mux.get());
+	}
         file_mux.reset();
 }
 
 void H264EncoderImpl::open_output_stream()
 {
-	AVFormatContext *avctx = avformat_alloc_context();
-	AVOutputFormat *oformat = av_guess_format(global_flags.stream_mux_name.c_str(), nullptr, nullptr);
-	assert(oformat != nullptr);
-	avctx->oformat = oformat;
-
-	string codec_name;
-	int bit_rate;
-
-	if (global_flags.stream_audio_codec_name.empty()) {
-		codec_name = AUDIO_OUTPUT_CODEC_NAME;
-		bit_rate = DEFAULT_AUDIO_OUTPUT_BIT_RATE;
-	} else {
-		codec_name = global_flags.stream_audio_codec_name;
-		bit_rate = global_flags.stream_audio_codec_bitrate;
-	}
-
-	uint8_t *buf = (uint8_t *)av_malloc(MUX_BUFFER_SIZE);
-	avctx->pb = avio_alloc_context(buf, MUX_BUFFER_SIZE, 1, this, nullptr, &H264EncoderImpl::write_packet_thunk, nullptr);
-
 	Mux::Codec video_codec;
 	if (global_flags.uncompressed_video_to_http) {
 		video_codec = Mux::CODEC_NV12;
@@ -2202,39 +2209,133 @@ void H264EncoderImpl::open_output_stream()
 		video_codec = Mux::CODEC_H264;
 	}
 
-	avctx->flags = AVFMT_FLAG_CUSTOM_IO;
-	AVCodec *codec_audio = avcodec_find_encoder_by_name(codec_name.c_str());
-	if (codec_audio == nullptr) {
-		fprintf(stderr, "ERROR: Could not find codec '%s'\n", codec_name.c_str());
+	for (unique_ptr<StreamOutput> &output : stream_outputs) {
+		open_stream_output(output.get(), frame_width, frame_height, video_codec);
+	}
+	if (shm_output) {
+		// All the main stream muxes get the same packets, so any of them will do.
+		stream_outputs[0]->mux->set_packet_tap(shm_output);
+	}
+	for (unique_ptr<Rendition> &rendition : renditions) {
+		open_stream_output(&rendition->output, rendition->config.width, rendition->config.height, Mux::CODEC_H264);
+	}
+}
+
+void H264EncoderImpl::open_stream_output(StreamOutput *output, int width, int height, Mux::Codec video_codec)
+{
+	AVFormatContext *avctx = avformat_alloc_context();
+	AVOutputFormat *oformat = av_guess_format(output->mux_name.c_str(), nullptr, nullptr);
+	if (oformat == nullptr) {
+		fprintf(stderr, "ERROR: Unknown mux '%s'\n", output->mux_name.c_str());
 		exit(1);
 	}
+	avctx->oformat = oformat;
+
+	AudioEncoder *audio_encoder = stream_audio_encoder ? stream_audio_encoder.get() : file_audio_encoder.get();
+
+	// The UDP stream does its own pacing, so there is no point in holding
+	// data back in a large buffer; pass on one datagram's worth at a time.
+	// Also have the mux pad with null packets up to a constant bitrate.
+	const int buffer_size = output->udp_stream ? 7 * 188 : MUX_BUFFER_SIZE;
+	vector<pair<string, string>> extra_options;
+	if (output->udp_stream) {
+		extra_options.emplace_back("muxrate", to_string(int64_t(global_flags.udp_mux_rate_kbit) * 1000));
+	}
+
+	uint8_t *buf = (uint8_t *)av_malloc(buffer_size);
+	avctx->pb = avio_alloc_context(buf, buffer_size, 1, output, nullptr, &StreamOutput::write_packet_thunk, nullptr);
+
+	avctx->flags = AVFMT_FLAG_CUSTOM_IO;
 
 	int time_base = global_flags.stream_coarse_timebase ? COARSE_TIMEBASE : TIMEBASE;
-	stream_mux_writing_header = true;
-	stream_mux.reset(new Mux(avctx, frame_width, frame_height, video_codec, codec_audio, time_base, bit_rate, this));
-	stream_mux_writing_header = false;
-	httpd->set_header(stream_mux_header);
-	stream_mux_header.clear();
+	output->writing_header = true;
+	output->mux.reset(new Mux(avctx, width, height, video_codec, audio_encoder->get_codec(), time_base, audio_encoder->get_bit_rate(), output, extra_options));
+	output->writing_header = false;
+	audio_encoder->add_mux(output->mux.get());
+
+	if (output->udp_stream) {
+		// Nobody joins a UDP stream at the start, so the header is just data.
+		output->udp_stream->add_data(output->header.data(), output->header.size());
+		output->header.clear();
+		return;
+	}
+	httpd->set_header(output->httpd_output, output->header);
+	if (output->hls_segmenter) {
+		output->hls_segmenter->set_header(output->header);
+	}
+	output->header.clear();
+}
+
+vector<Mux *> H264EncoderImpl::get_main_stream_muxes() const
+{
+	vector<Mux *> muxes;
+	for (const unique_ptr<StreamOutput> &output : stream_outputs) {
+		muxes.push_back(output->mux.get());
+	}
+	return muxes;
 }
 
 void H264EncoderImpl::close_output_stream()
 {
-	stream_mux.reset();
+	AudioEncoder *audio_encoder = stream_audio_encoder ? stream_audio_encoder.get() : file_audio_encoder.get();
+	for (unique_ptr<StreamOutput> &output : stream_outputs) {
+		if (output->mux) {
+			audio_encoder->remove_mux(output->mux.get());
+		}
+		output->mux.reset();
+	}
+	for (unique_ptr<Rendition> &rendition : renditions) {
+		if (rendition->output.mux) {
+			audio_encoder->remove_mux(rendition->output.mux.get());
+		}
+		rendition->output.mux.reset();
+	}
+}
+
+void H264EncoderImpl::set_hls_master_playlist()
+{
+	// BANDWIDTH is supposed to be the peak bitrate, so use the VBV maximum
+	// where we have one. We don't know the exact audio bitrate for every codec,
+	// but it is small compared to the video.
+	const int audio_bitrate = stream_audio_encoder ? stream_audio_encoder->get_bit_rate() : file_audio_encoder->get_bit_rate();
+	const double vbv_factor = (global_flags.x264_vbv_max_bitrate > 0) ?
+		double(global_flags.x264_vbv_max_bitrate) / global_flags.x264_bitrate : 1.0;
+
+	string playlist = "#EXTM3U\n#EXT-X-VERSION:7\n";
+	char buf[256];
+	snprintf(buf, sizeof(buf), "#EXT-X-STREAM-INF:BANDWIDTH=%ld,RESOLUTION=%dx%d\n",
+		lrint(global_flags.x264_bitrate * 1000 * vbv_factor) + audio_bitrate, frame_width, frame_height);
+	playlist += buf;
+	playlist += stream_outputs[0]->hls_segmenter->get_playlist_filename() + "\n";
+	for (const unique_ptr<Rendition> &rendition : renditions) {
+		snprintf(buf, sizeof(buf), "#EXT-X-STREAM-INF:BANDWIDTH=%ld,RESOLUTION=%dx%d\n",
+			lrint(rendition->config.bitrate * 1000 * vbv_factor) + audio_bitrate,
+			rendition->config.width, rendition->config.height);
+		playlist += buf;
+		playlist += rendition->output.hls_segmenter->get_playlist_filename() + "\n";
+	}
+	httpd->set_static_file("/hls/master.m3u8", make_shared<string>(move(playlist)),
+		"application/vnd.apple.mpegurl", "no-cache");
 }
 
-int H264EncoderImpl::write_packet_thunk(void *opaque, uint8_t *buf, int buf_size)
+int H264EncoderImpl::StreamOutput::write_packet_thunk(void *opaque, uint8_t *buf, int buf_size)
 {
-	H264EncoderImpl *h264_encoder = (H264EncoderImpl *)opaque;
-	return h264_encoder->write_packet(buf, buf_size);
+	StreamOutput *output = (StreamOutput *)opaque;
+	return output->write_packet(buf, buf_size);
 }
 
-int H264EncoderImpl::write_packet(uint8_t *buf, int buf_size)
+int H264EncoderImpl::StreamOutput::write_packet(uint8_t *buf, int buf_size)
 {
-	if (stream_mux_writing_header) {
-		stream_mux_header.append((char *)buf, buf_size);
+	if (writing_header) {
+		header.append((char *)buf, buf_size);
+	} else if (udp_stream) {
+		udp_stream->add_data((char *)buf, buf_size);
 	} else {
-		httpd->add_data((char *)buf, buf_size, stream_mux_writing_keyframes);
-		stream_mux_writing_keyframes = false;
+		httpd->add_data(httpd_output, (char *)buf, buf_size, writing_keyframes);
+		if (hls_segmenter) {
+			hls_segmenter->add_data((char *)buf, buf_size, writing_keyframes, keyframe_pts);
+		}
+		writing_keyframes = false;
 	}
 	return buf_size;
 }
@@ -2305,17 +2406,17 @@ void H264EncoderImpl::encode_remaining_frames_as_p(int encoding_frame_num, int g
 		last_dts = dts;
 	}
 
-	if (global_flags.uncompressed_video_to_http ||
-	    global_flags.x264_video_to_http) {
+	if (reorderer) {
 		// Add frames left in reorderer.
 		while (!reorderer->empty()) {
-			pair<int64_t, const uint8_t *> output_frame = reorderer->get_first_frame();
-			if (global_flags.uncompressed_video_to_http) {
-				add_packet_for_uncompressed_frame(output_frame.first, output_frame.second);
-			} else {
-				assert(global_flags.x264_video_to_http);
-				x264_encoder->add_frame(output_frame.first, output_frame.second);
-			}
+			pair<int64_t, shared_ptr<const uint8_t>> output_frame = reorderer->get_first_frame();
+			add_uncompressed_frame(output_frame.first, move(output_frame.second));
+		}
+	}
+	for (unique_ptr<Rendition> &rendition : renditions) {
+		while (!rendition->reorderer->empty()) {
+			pair<int64_t, shared_ptr<const uint8_t>> output_frame = rendition->reorderer->get_first_frame();
+			rendition->x264_encoder->add_frame(output_frame.first, move(output_frame.second));
 		}
 	}
 }
@@ -2324,26 +2425,12 @@ void H264EncoderImpl::encode_remaining_audio()
 {
 	// This really ought to be empty by now, but just to be sure...
 	for (auto &pending_frame : pending_audio_frames) {
-		int64_t audio_pts = pending_frame.first;
-		vector<float> audio = move(pending_frame.second);
-
-		if (context_audio_stream) {
-			encode_audio(audio, &audio_queue_file, audio_pts, context_audio_file, resampler_audio_file, { file_mux.get() });
-			encode_audio(audio, &audio_queue_stream, audio_pts, context_audio_stream, resampler_audio_stream, { stream_mux.get() });
-		} else {
-			encode_audio(audio, &audio_queue_file, audio_pts, context_audio_file, resampler_audio_file, { stream_mux.get(), file_mux.get() });
-		}
-		last_audio_pts = audio_pts + audio.size() * TIMEBASE / (OUTPUT_FREQUENCY * 2);
+		encode_audio(move(pending_frame.second), pending_frame.first);
 	}
 	pending_audio_frames.clear();
 
-	// Encode any leftover audio in the queues, and also any delayed frames.
-	if (context_audio_stream) {
-		encode_last_audio(&audio_queue_file, last_audio_pts, context_audio_file, resampler_audio_file, { file_mux.get() });
-		encode_last_audio(&audio_queue_stream, last_audio_pts, context_audio_stream, resampler_audio_stream, { stream_mux.get() });
-	} else {
-		encode_last_audio(&audio_queue_file, last_audio_pts, context_audio_file, resampler_audio_file, { stream_mux.get(), file_mux.get() });
-	}
+	// Any leftover audio in the encoders' queues, and any delayed frames,
+	// are flushed in shutdown(), once the storage thread is done.
 }
 
 void H264EncoderImpl::add_packet_for_uncompressed_frame(int64_t pts, const uint8_t *data)
@@ -2355,7 +2442,39 @@ void H264EncoderImpl::add_packet_for_uncompressed_frame(int64_t pts, const uint8
 	pkt.size = frame_width * frame_height * 2;
 	pkt.stream_index = 0;
 	pkt.flags = AV_PKT_FLAG_KEY;
-	stream_mux->add_packet(pkt, pts, pts);
+	for (const unique_ptr<StreamOutput> &output : stream_outputs) {
+		output->mux->add_packet(pkt, pts, pts);
+	}
+}
+
+void H264EncoderImpl::add_uncompressed_frame(int64_t pts, shared_ptr<const uint8_t> data)
+{
+	if (global_flags.shm_output_raw) {
+		shm_output->add_raw_frame(pts, data.get());
+	}
+	if (global_flags.uncompressed_video_to_http) {
+		add_packet_for_uncompressed_frame(pts, data.get());
+	} else if (global_flags.x264_video_to_http) {
+		x264_encoder->add_frame(pts, move(data));
+	}
+}
+
+// Gives out a reference to a readback buffer (NV12) for the given surface;
+// either the main one or one of the renditions'. The surface will not be
+// rendered to again until all such references are gone, so the reorderers
+// and x264 can use the data directly instead of taking their own copies.
+shared_ptr<const uint8_t> H264EncoderImpl::get_readback_frame(unsigned surface_num, const uint8_t *data)
+{
+	{
+		unique_lock<mutex> lock(storage_task_queue_mutex);
+		++readback_refs[surface_num];
+	}
+	return shared_ptr<const uint8_t>(data, [this, surface_num](const uint8_t *) {
+		unique_lock<mutex> lock(storage_task_queue_mutex);
+		assert(readback_refs[surface_num] > 0);
+		--readback_refs[surface_num];
+		storage_task_queue_changed.notify_all();
+	});
 }
 
 namespace {
@@ -2410,18 +2529,21 @@ void H264EncoderImpl::encode_frame(H264EncoderImpl::PendingFrame frame, int enco
 		va_status = vaUnmapBuffer(va_dpy, surf->surface_image.buf);
 		CHECK_VASTATUS(va_status, "vaUnmapBuffer");
 
-		if (global_flags.uncompressed_video_to_http ||
-		    global_flags.x264_video_to_http) {
+		if (reorderer) {
 			// Add uncompressed video. (Note that pts == dts here.)
 			// Delay needs to match audio.
-			pair<int64_t, const uint8_t *> output_frame = reorderer->reorder_frame(pts + global_delay(), reinterpret_cast<uint8_t *>(surf->y_ptr));
+			pair<int64_t, shared_ptr<const uint8_t>> output_frame =
+				reorderer->reorder_frame(pts + global_delay(), get_readback_frame(display_frame_num % SURFACE_NUM, surf->y_ptr));
 			if (output_frame.second != nullptr) {
-				if (global_flags.uncompressed_video_to_http) {
-					add_packet_for_uncompressed_frame(output_frame.first, output_frame.second);
-				} else {
-					assert(global_flags.x264_video_to_http);
-					x264_encoder->add_frame(output_frame.first, output_frame.second);
-				}
+				add_uncompressed_frame(output_frame.first, move(output_frame.second));
+			}
+		}
+		for (unsigned i = 0; i < renditions.size(); ++i) {
+			Rendition *rendition = renditions[i].get();
+			pair<int64_t, shared_ptr<const uint8_t>> output_frame =
+				rendition->reorderer->reorder_frame(pts + global_delay(), get_readback_frame(display_frame_num % SURFACE_NUM, surf->renditions[i].ptr));
+			if (output_frame.second != nullptr) {
+				rendition->x264_encoder->add_frame(output_frame.first, move(output_frame.second));
 			}
 		}
 	}
@@ -2463,8 +2585,13 @@ void H264EncoderImpl::encode_frame(H264EncoderImpl::PendingFrame frame, int enco
 }
 
 // Proxy object.
-H264Encoder::H264Encoder(QSurface *surface, const string &va_display, int width, int height, HTTPD *httpd)
-	: impl(new H264EncoderImpl(surface, va_display, width, height, httpd)) {}
+H264Encoder::PersistentOutputs::PersistentOutputs() {}
+
+// Must be defined here because unique_ptr<> destructor needs to know the outputs.
+H264Encoder::PersistentOutputs::~PersistentOutputs() {}
+
+H264Encoder::H264Encoder(QSurface *surface, const string &va_display, int width, int height, HTTPD *httpd, PersistentOutputs *persistent_outputs)
+	: impl(new H264EncoderImpl(surface, va_display, width, height, httpd, persistent_outputs)) {}
 
 // Must be defined here because unique_ptr<> destructor needs to know the impl.
 H264Encoder::~H264Encoder() {}
@@ -2479,6 +2606,11 @@ bool H264Encoder::begin_frame(GLuint *y_tex, GLuint *cbcr_tex)
 	return impl->begin_frame(y_tex, cbcr_tex);
 }
 
+vector<H264Encoder::RenditionTextures> H264Encoder::get_rendition_textures()
+{
+	return impl->get_rendition_textures();
+}
+
 RefCountedGLsync H264Encoder::end_frame(int64_t pts, const vector<RefCountedFrame> &input_frames)
 {
 	return impl->end_frame(pts, input_frames);
@@ -2489,6 +2621,11 @@ void H264Encoder::shutdown()
 	impl->shutdown();
 }
 
+void H264Encoder::change_x264_rate_control(int bitrate_kbit, int vbv_max_bitrate_kbit, int vbv_buffer_size_kbit)
+{
+	impl->change_x264_rate_control(bitrate_kbit, vbv_max_bitrate_kbit, vbv_buffer_size_kbit);
+}
+
 void H264Encoder::open_output_file(const std::string &filename)
 {
 	impl->open_output_file(filename);
@@ -37,22 +37,58 @@
 #include "ref_counted_gl_sync.h"
 
 class H264EncoderImpl;
+class HLSSegmenter;
 class HTTPD;
 class QSurface;
+class ShmOutput;
+class UDPStream;
 
 // This is just a pimpl, because including anything X11-related in a .h file
 // tends to trip up Qt. All the real logic is in H264EncoderImpl, defined in the
 // .cpp file.
 class H264Encoder {
 public:
-        H264Encoder(QSurface *surface, const std::string &va_display, int width, int height, HTTPD *httpd);
+	// Outputs that must not notice cuts (which make a new H264Encoder),
+	// so they live outside any single encoder: The first encoder creates
+	// them, and the owner (normally Mixer) keeps them and gives them
+	// to every later encoder. See e.g. HLSSegmenter.
+	struct PersistentOutputs {
+		PersistentOutputs();
+		~PersistentOutputs();
+
+		bool created = false;
+		std::unique_ptr<HLSSegmenter> main_hls_segmenter;  // nullptr if not using --http-hls.
+		std::vector<std::unique_ptr<HLSSegmenter>> rendition_hls_segmenters;  // In the order of global_flags.x264_renditions.
+		std::unique_ptr<UDPStream> udp_stream;  // nullptr if not using --udp-output.
+		std::unique_ptr<ShmOutput> shm_output;  // nullptr if not using --shm-output.
+	};
+
+	// <persistent_outputs> must outlive the encoder. Any data written
+	// to them stops in shutdown().
+        H264Encoder(QSurface *surface, const std::string &va_display, int width, int height, HTTPD *httpd, PersistentOutputs *persistent_outputs);
         ~H264Encoder();
 
 	void add_audio(int64_t pts, std::vector<float> audio);
 	bool begin_frame(GLuint *y_tex, GLuint *cbcr_tex);
+
+	// For --x264-rendition. Between begin_frame() and end_frame(), the caller
+	// should render a downscaled version of the frame into each of these
+	// (Y' in full rendition resolution, CbCr in half), in the same order
+	// as global_flags.x264_renditions. They are read back in end_frame().
+	struct RenditionTextures {
+		int width, height;
+		GLuint y_tex, cbcr_tex;
+	};
+	std::vector<RenditionTextures> get_rendition_textures();
+
 	RefCountedGLsync end_frame(int64_t pts, const std::vector<RefCountedFrame> &input_frames);
 	void shutdown();  // Blocking.
 
+	// Only has an effect if --http-x264-video is in use.
+	// See X264Encoder::change_rate_control(). Only affects the main stream,
+	// not any renditions.
+	void change_x264_rate_control(int bitrate_kbit, int vbv_max_bitrate_kbit, int vbv_buffer_size_kbit);
+
 	// You can only have one going at the same time.
 	void open_output_file(const std::string &filename);
 	void close_output_file();
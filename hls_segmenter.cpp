@@ -0,0 +1,160 @@
+#include "hls_segmenter.h"
+
+#include <math.h>
+#include <stdio.h>
+
+#include <algorithm>
+#include <memory>
+#include <string>
+
+#include "flags.h"
+#include "httpd.h"
+#include "timebase.h"
+
+using namespace std;
+
+namespace {
+
+// Segments that have just dropped out of the playlist are kept around for a
+// little while longer, for clients that fetched the playlist just before.
+constexpr unsigned extra_segments_kept = 3;
+
+}  // namespace
+
+HLSSegmenter::HLSSegmenter(HTTPD *httpd, const string &prefix)
+	: httpd(httpd), prefix(prefix), target_duration(global_flags.hls_segment_duration)
+{
+	size_t slash = prefix.rfind('/');
+	basename = (slash == string::npos) ? prefix : prefix.substr(slash + 1);
+}
+
+HLSSegmenter::~HLSSegmenter()
+{
+	httpd->remove_static_file(prefix + ".m3u8");
+	if (has_header) {
+		unsigned first_header_number = segments.empty() ? header_number : segments.front().header_number;
+		for (unsigned i = first_header_number; i <= header_number; ++i) {
+			httpd->remove_static_file(get_init_url(i));
+		}
+	}
+	for (const Segment &segment : segments) {
+		httpd->remove_static_file(segment.url);
+	}
+}
+
+void HLSSegmenter::set_header(const string &data)
+{
+	unique_lock<mutex> lock(mu);
+	if (has_header) {
+		// A new mux, after a cut. The segments from the old one may still
+		// be in the playlist, so keep their header around for as long as they are.
+		if (segments.empty() || segments.back().header_number != header_number) {
+			httpd->remove_static_file(get_init_url(header_number));
+		}
+		++header_number;
+		pending_discontinuity = true;
+	}
+	// The header never changes for a given URL, so clients and caches can keep it.
+	httpd->set_static_file(get_init_url(header_number), make_shared<string>(data), "video/mp4", "max-age=3600");
+	has_header = true;
+	in_segment = false;
+	current_segment.clear();
+}
+
+void HLSSegmenter::add_data(const char *buf, size_t size, bool keyframe, int64_t pts)
+{
+	unique_lock<mutex> lock(mu);
+	if (!has_header) {
+		return;
+	}
+	if (keyframe) {
+		const int64_t segment_ticks = int64_t(global_flags.hls_segment_duration) * TIMEBASE;
+		if (!in_segment) {
+			in_segment = true;
+			current_segment_start_pts = pts;
+		} else if (pts / segment_ticks != current_segment_start_pts / segment_ticks) {
+			finish_segment(pts);
+			current_segment_start_pts = pts;
+		}
+	}
+	if (in_segment) {
+		current_segment.append(buf, size);
+	}
+}
+
+string HLSSegmenter::get_playlist_filename() const
+{
+	return basename + ".m3u8";
+}
+
+void HLSSegmenter::finish_segment(int64_t end_pts)
+{
+	Segment segment;
+	segment.sequence_number = next_sequence_number++;
+	segment.discontinuity = pending_discontinuity;
+	if (pending_discontinuity) {
+		++discontinuity_sequence;
+		pending_discontinuity = false;
+	}
+	segment.discontinuity_sequence = discontinuity_sequence;
+	segment.header_number = header_number;
+	segment.duration = double(end_pts - current_segment_start_pts) / TIMEBASE;
+	segment.url = prefix + "-" + to_string(segment.sequence_number) + ".m4s";
+
+	// Once published, a segment never changes, so clients and caches can keep it.
+	shared_ptr<string> contents = make_shared<string>();
+	contents->swap(current_segment);
+	httpd->set_static_file(segment.url, move(contents), "video/iso.segment", "max-age=3600");
+	segments.push_back(segment);
+
+	while (segments.size() > unsigned(global_flags.hls_playlist_segments) + extra_segments_kept) {
+		const Segment &oldest = segments.front();
+		httpd->remove_static_file(oldest.url);
+		if (oldest.header_number != segments[1].header_number) {
+			// The last segment using this header.
+			httpd->remove_static_file(get_init_url(oldest.header_number));
+		}
+		segments.pop_front();
+	}
+
+	// Should not happen unless the GOP is longer than the segment duration,
+	// but the playlist must not claim shorter segments than it has.
+	target_duration = max<int>(target_duration, lrint(segment.duration));
+
+	update_playlist();
+}
+
+void HLSSegmenter::update_playlist()
+{
+	size_t num_segments = min<size_t>(segments.size(), global_flags.hls_playlist_segments);
+	auto first_it = segments.end() - num_segments;
+
+	// The discontinuity sequence number is that of the first segment
+	// we list, not counting its own EXT-X-DISCONTINUITY (if any).
+	char buf[256];
+	snprintf(buf, sizeof(buf), "#EXTM3U\n#EXT-X-VERSION:7\n#EXT-X-TARGETDURATION:%d\n#EXT-X-MEDIA-SEQUENCE:%llu\n#EXT-X-DISCONTINUITY-SEQUENCE:%llu\n",
+		target_duration, (unsigned long long)first_it->sequence_number,
+		(unsigned long long)(first_it->discontinuity_sequence - first_it->discontinuity));
+	string playlist = buf;
+	for (auto it = first_it; it != segments.end(); ++it) {
+		if (it->discontinuity) {
+			playlist += "#EXT-X-DISCONTINUITY\n";
+		}
+		if (it == first_it || it->header_number != (it - 1)->header_number) {
+			playlist += "#EXT-X-MAP:URI=\"" + basename + "-init-" + to_string(it->header_number) + ".mp4\"\n";
+		}
+		snprintf(buf, sizeof(buf), "#EXTINF:%.3f,\n%s-%llu.m4s\n",
+			it->duration, basename.c_str(), (unsigned long long)it->sequence_number);
+		playlist += buf;
+	}
+
+	// The playlist changes with every segment, so it should not be cached
+	// for longer than it takes to produce one.
+	httpd->set_static_file(prefix + ".m3u8", make_shared<string>(move(playlist)),
+		"application/vnd.apple.mpegurl", "max-age=1");
+}
+
+string HLSSegmenter::get_init_url(unsigned header_number) const
+{
+	return prefix + "-init-" + to_string(header_number) + ".mp4";
+}
@@ -0,0 +1,91 @@
+#ifndef _HLS_SEGMENTER_H
+#define _HLS_SEGMENTER_H 1
+
+// Cuts a fragmented MP4 stream (as produced by the stream mux with
+// --http-mux=mp4) into HLS segments, and serves them through HTTPD
+// together with a playlist.
+//
+// The mux starts a new fragment at every keyframe, and the mux header
+// (ftyp + moov) is a valid initialization segment, so no remuxing is needed;
+// we just collect the fragments into segments of about the desired length.
+// Each segment is built once and then served from memory to any number of
+// clients; we keep only the last few, so memory usage is bounded.
+//
+// Segments are cut at the first keyframe after a multiple of the segment
+// duration (in pts), so that different renditions get segments with the
+// same boundaries as long as their keyframes are aligned.
+//
+// The segmenter outlives the muxes feeding it (see
+// H264Encoder::PersistentOutputs), so that a cut does not disturb clients:
+// the new mux just gives us a new header, and we continue the same playlist
+// with an EXT-X-DISCONTINUITY, keeping the sequence numbers going.
+// Each header gets its own initialization segment URL, since segments
+// from before the cut may still be in the playlist.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class HTTPD;
+
+class HLSSegmenter {
+public:
+	// Serves the playlist at <prefix>.m3u8, the initialization segments at
+	// <prefix>-init-<number>.mp4 and the media segments at <prefix>-<number>.m4s.
+	HLSSegmenter(HTTPD *httpd, const std::string &prefix);
+	~HLSSegmenter();
+
+	// The mux header, i.e., the initialization segment. Drops any data
+	// we have collected but not yet made into a segment. If there was
+	// a header before (i.e., a new mux after a cut), the next segment
+	// is marked as a discontinuity.
+	void set_header(const std::string &data);
+
+	// Data from the mux, in the same form as HTTPD::add_data(). For keyframes,
+	// <pts> (in TIMEBASE units) is the pts of the keyframe that starts
+	// this data; it is ignored otherwise.
+	void add_data(const char *buf, size_t size, bool keyframe, int64_t pts);
+
+	// Useful as an URI in a master playlist, next to the playlist itself.
+	std::string get_playlist_filename() const;
+
+private:
+	struct Segment {
+		uint64_t sequence_number;
+		uint64_t discontinuity_sequence;  // As in EXT-X-DISCONTINUITY-SEQUENCE.
+		bool discontinuity;  // Starts a new header.
+		unsigned header_number;  // Which initialization segment it goes with.
+		double duration;  // In seconds.
+		std::string url;
+	};
+
+	// Must be called with <mu> held.
+	void finish_segment(int64_t end_pts);
+	void update_playlist();
+	std::string get_init_url(unsigned header_number) const;
+
+	HTTPD *httpd;
+	const std::string prefix;
+	std::string basename;  // <prefix> without the directory, for relative URIs.
+
+	std::mutex mu;
+
+	// Everything below is protected by <mu>.
+	bool has_header = false;
+	unsigned header_number = 0;  // Of the current header, if <has_header>.
+	bool pending_discontinuity = false;  // For the next segment.
+	bool in_segment = false;  // False until we've seen the first keyframe.
+	std::string current_segment;
+	int64_t current_segment_start_pts = 0;
+	uint64_t next_sequence_number = 0;
+	uint64_t discontinuity_sequence = 0;
+
+	std::deque<Segment> segments;  // Still available from HTTPD, oldest first.
+	int target_duration;  // In whole seconds, as in EXT-X-TARGETDURATION.
+};
+
+#endif  // !defined(_HLS_SEGMENTER_H)
@@ -0,0 +1,278 @@
+// A simple load tester for the HTTP server: Opens a given number of clients
+// against a running Nageru, reads as fast as it can from all of them for
+// a while, and then reports how much CPU time the server used per client,
+// so that changes to HTTPD can be measured.
+//
+// Usage: http_load_test [-n CLIENTS] [-t SECONDS] [-u URL] [-p PORT] [-P PID]
+//
+// The server's CPU time is read from /proc/PID/stat; if -P is not given,
+// we look for a process named “nageru”. Only connects to localhost.
+
+#include <arpa/inet.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <math.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+struct Client {
+	int sock;
+	size_t bytes_received = 0;
+	bool connected = true;
+};
+
+void usage()
+{
+	fprintf(stderr, "Usage: http_load_test [OPTION]...\n");
+	fprintf(stderr, "\n");
+	fprintf(stderr, "  -n, --clients=NUM    number of clients to open (default 100)\n");
+	fprintf(stderr, "  -t, --time=SECONDS   how long to measure for (default 10)\n");
+	fprintf(stderr, "  -u, --url=URL        URL path to request (default /)\n");
+	fprintf(stderr, "  -p, --port=PORT      server port on localhost (default 9095)\n");
+	fprintf(stderr, "  -P, --pid=PID        server process ID (default: find “nageru”)\n");
+}
+
+// Returns -1 if not found.
+pid_t find_server_pid()
+{
+	DIR *dir = opendir("/proc");
+	if (dir == nullptr) {
+		perror("/proc");
+		exit(1);
+	}
+	pid_t ret = -1;
+	while (dirent *de = readdir(dir)) {
+		pid_t pid = atoi(de->d_name);
+		if (pid <= 0) {
+			continue;
+		}
+		char filename[256];
+		snprintf(filename, sizeof(filename), "/proc/%d/comm", pid);
+		FILE *fp = fopen(filename, "r");
+		if (fp == nullptr) {
+			continue;
+		}
+		char comm[256];
+		if (fgets(comm, sizeof(comm), fp) != nullptr && strcmp(comm, "nageru\n") == 0) {
+			ret = pid;
+		}
+		fclose(fp);
+		if (ret != -1) {
+			break;
+		}
+	}
+	closedir(dir);
+	return ret;
+}
+
+// Returns user + system CPU time of the given process, in seconds.
+double get_cpu_time(pid_t pid)
+{
+	char filename[256];
+	snprintf(filename, sizeof(filename), "/proc/%d/stat", pid);
+	FILE *fp = fopen(filename, "r");
+	if (fp == nullptr) {
+		perror(filename);
+		exit(1);
+	}
+	char buf[4096];
+	if (fgets(buf, sizeof(buf), fp) == nullptr) {
+		fprintf(stderr, "%s: Could not read\n", filename);
+		exit(1);
+	}
+	fclose(fp);
+
+	// The process name can contain spaces, so start after its closing parenthesis.
+	// utime and stime are fields 14 and 15, counting the name as field 2.
+	const char *ptr = strrchr(buf, ')');
+	if (ptr == nullptr) {
+		fprintf(stderr, "%s: Could not parse\n", filename);
+		exit(1);
+	}
+	unsigned long utime, stime;
+	if (sscanf(ptr + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2) {
+		fprintf(stderr, "%s: Could not parse\n", filename);
+		exit(1);
+	}
+	return double(utime + stime) / sysconf(_SC_CLK_TCK);
+}
+
+int connect_client(int port, const string &url)
+{
+	int sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (sock == -1) {
+		perror("socket");
+		exit(1);
+	}
+
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	addr.sin_port = htons(port);
+	if (connect(sock, (sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("connect");
+		exit(1);
+	}
+
+	string request = "GET " + url + " HTTP/1.1\r\nHost: localhost\r\n\r\n";
+	if (write(sock, request.data(), request.size()) != ssize_t(request.size())) {
+		perror("write");
+		exit(1);
+	}
+	return sock;
+}
+
+}  // namespace
+
+int main(int argc, char **argv)
+{
+	int num_clients = 100, seconds = 10, port = 9095;
+	string url = "/";
+	pid_t pid = -1;
+
+	static const option long_options[] = {
+		{ "help", no_argument, 0, 'h' },
+		{ "clients", required_argument, 0, 'n' },
+		{ "time", required_argument, 0, 't' },
+		{ "url", required_argument, 0, 'u' },
+		{ "port", required_argument, 0, 'p' },
+		{ "pid", required_argument, 0, 'P' },
+		{ 0, 0, 0, 0 }
+	};
+	for ( ;; ) {
+		int option_index = 0;
+		int c = getopt_long(argc, argv, "hn:t:u:p:P:", long_options, &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'n':
+			num_clients = atoi(optarg);
+			break;
+		case 't':
+			seconds = atoi(optarg);
+			break;
+		case 'u':
+			url = optarg;
+			break;
+		case 'p':
+			port = atoi(optarg);
+			break;
+		case 'P':
+			pid = atoi(optarg);
+			break;
+		case 'h':
+			usage();
+			exit(0);
+		default:
+			usage();
+			exit(1);
+		}
+	}
+
+	if (pid == -1) {
+		pid = find_server_pid();
+		if (pid == -1) {
+			fprintf(stderr, "Could not find a running nageru process; use --pid.\n");
+			exit(1);
+		}
+	}
+
+	int epoll_fd = epoll_create1(0);
+	if (epoll_fd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	vector<Client> clients(num_clients);
+	for (int i = 0; i < num_clients; ++i) {
+		clients[i].sock = connect_client(port, url);
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN;
+		ev.data.u32 = i;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, clients[i].sock, &ev) == -1) {
+			perror("epoll_ctl");
+			exit(1);
+		}
+	}
+	printf("Connected %d clients to localhost:%d%s (server pid %d); measuring for %d seconds...\n",
+		num_clients, port, url.c_str(), pid, seconds);
+
+	steady_clock::time_point start = steady_clock::now();
+	double start_cpu = get_cpu_time(pid);
+	int num_connected = num_clients;
+
+	constexpr int max_events = 64;
+	epoll_event events[max_events];
+	char buf[65536];
+	for ( ;; ) {
+		double elapsed = duration<double>(steady_clock::now() - start).count();
+		if (elapsed >= seconds) {
+			break;
+		}
+		int timeout_ms = max<int>(lrint((seconds - elapsed) * 1000.0), 1);
+		int num_events = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+		if (num_events == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(1);
+		}
+		for (int i = 0; i < num_events; ++i) {
+			Client *client = &clients[events[i].data.u32];
+			ssize_t ret = read(client->sock, buf, sizeof(buf));
+			if (ret <= 0) {
+				client->connected = false;
+				--num_connected;
+				close(client->sock);  // Also removes it from the epoll set.
+				continue;
+			}
+			client->bytes_received += ret;
+		}
+	}
+
+	double elapsed = duration<double>(steady_clock::now() - start).count();
+	double cpu = get_cpu_time(pid) - start_cpu;
+
+	size_t total_bytes = 0;
+	for (const Client &client : clients) {
+		total_bytes += client.bytes_received;
+	}
+
+	printf("\n");
+	printf("Clients still connected:  %d of %d\n", num_connected, num_clients);
+	printf("Average throughput:       %.1f kbit/sec per client (%.1f Mbit/sec total)\n",
+		total_bytes * 8.0 / elapsed / num_clients / 1e3, total_bytes * 8.0 / elapsed / 1e6);
+	printf("Server CPU usage:         %.1f%% of one core in total (including mixing and encoding)\n",
+		100.0 * cpu / elapsed);
+	printf("Server CPU per client:    %.3f%% of one core\n", 100.0 * cpu / elapsed / num_clients);
+	printf("\n");
+	printf("Run again with a different number of clients and compare, to factor out\n");
+	printf("the CPU usage that does not depend on the clients.\n");
+
+	for (const Client &client : clients) {
+		if (client.connected) {
+			close(client.sock);
+		}
+	}
+	close(epoll_fd);
+}
@@ -1,184 +1,958 @@
 #include <arpa/inet.h>
 #include <assert.h>
-#include <microhttpd.h>
+#include <errno.h>
+#include <netinet/in.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <memory>
 #include <vector>
 
 #include "httpd.h"
 
-#include "defs.h"
 #include "flags.h"
 #include "metacube2.h"
-#include "timebase.h"
-
-struct MHD_Connection;
-struct MHD_Response;
+#include "metrics.h"
 
 using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// Requests are tiny (we only look at the request line), so anything
+// larger than this is either broken or malicious.
+constexpr size_t max_request_size = 16384;
+
+// Markers for the epoll events that are not for a client connection.
+int listen_marker, wakeup_marker;
+
+int hex_digit_value(char ch)
+{
+	if (ch >= '0' && ch <= '9') return ch - '0';
+	if (ch >= 'a' && ch <= 'f') return ch - 'a' + 10;
+	if (ch >= 'A' && ch <= 'F') return ch - 'A' + 10;
+	return -1;
+}
+
+string url_decode(const string &str)
+{
+	string ret;
+	for (size_t i = 0; i < str.size(); ++i) {
+		if (str[i] == '+') {
+			ret.push_back(' ');
+		} else if (str[i] == '%' && i + 2 < str.size() &&
+		           hex_digit_value(str[i + 1]) != -1 && hex_digit_value(str[i + 2]) != -1) {
+			ret.push_back(char(hex_digit_value(str[i + 1]) * 16 + hex_digit_value(str[i + 2])));
+			i += 2;
+		} else {
+			ret.push_back(str[i]);
+		}
+	}
+	return ret;
+}
+
+// Parses “a=1&b=2” into a map.
+map<string, string> parse_query_string(const string &query)
+{
+	map<string, string> args;
+	size_t pos = 0;
+	while (pos < query.size()) {
+		size_t end = query.find('&', pos);
+		if (end == string::npos) {
+			end = query.size();
+		}
+		string arg = query.substr(pos, end - pos);
+		if (!arg.empty()) {
+			size_t eq = arg.find('=');
+			if (eq == string::npos) {
+				args[url_decode(arg)] = "";
+			} else {
+				args[url_decode(arg.substr(0, eq))] = url_decode(arg.substr(eq + 1));
+			}
+		}
+		pos = end + 1;
+	}
+	return args;
+}
+
+string make_error_response(const char *status)
+{
+	return string("HTTP/1.1 ") + status + "\r\nContent-length: 0\r\nConnection: close\r\n\r\n";
+}
+
+string format_address(const sockaddr_in6 &addr)
+{
+	char buf[INET6_ADDRSTRLEN];
+	if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr)) {
+		inet_ntop(AF_INET, &addr.sin6_addr.s6_addr[12], buf, sizeof(buf));
+		return string(buf) + ":" + to_string(ntohs(addr.sin6_port));
+	} else {
+		inet_ntop(AF_INET6, &addr.sin6_addr, buf, sizeof(buf));
+		return string("[") + buf + "]:" + to_string(ntohs(addr.sin6_port));
+	}
+}
+
+bool is_loopback(const sockaddr_in6 &addr)
+{
+	if (IN6_IS_ADDR_V4MAPPED(&addr.sin6_addr)) {
+		return addr.sin6_addr.s6_addr[12] == 127;
+	} else {
+		return IN6_IS_ADDR_LOOPBACK(&addr.sin6_addr);
+	}
+}
+
+// Shared between all HTTPD instances (there is normally only one).
+atomic<int64_t> metric_slow_client_skips{0};
+atomic<int64_t> metric_slow_client_skipped_bytes{0};
+atomic<int64_t> metric_slow_client_disconnects{0};
+once_flag metrics_registered;
+
+void register_metrics()
+{
+	global_metrics.add("http_slow_client_skips", &metric_slow_client_skips);
+	global_metrics.add("http_slow_client_skipped_bytes", &metric_slow_client_skipped_bytes);
+	global_metrics.add("http_slow_client_disconnects", &metric_slow_client_disconnects);
+}
+
+}  // namespace
 
 HTTPD::HTTPD()
 {
+	call_once(metrics_registered, register_metrics);
+	outputs.resize(1);  // The default output.
+	add_endpoint("/clients", [this](const map<string, string> &) { return clients_endpoint(); });
+}
+
+HTTPD::~HTTPD()
+{
+	if (!server_thread.joinable()) {
+		return;
+	}
+
+	should_quit = true;
+	uint64_t one = 1;
+	if (write(wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+		perror("write(eventfd)");
+	}
+	server_thread.join();
+
+	for (Connection *conn : vector<Connection *>(connections.begin(), connections.end())) {
+		close_connection(conn);
+	}
+	close(listen_sock);
+	close(wakeup_fd);
+	close(epoll_fd);
+}
+
+unsigned HTTPD::add_output(const string &url)
+{
+	Output output;
+	output.url = url;
+	outputs.push_back(move(output));
+	return outputs.size() - 1;
+}
+
+void HTTPD::set_header(unsigned output, const string &data)
+{
+	shared_ptr<const Chunk> header = make_shared<Chunk>(data.data(), data.size(), DATA_TYPE_HEADER);
+	unique_lock<mutex> lock(streams_mutex);
+	outputs[output].header = move(header);
+}
+
+unsigned HTTPD::find_output(const string &url) const
+{
+	for (unsigned i = 1; i < outputs.size(); ++i) {
+		if (outputs[i].url == url) {
+			return i;
+		}
+	}
+	assert(false);
+	return 0;
+}
+
+void HTTPD::set_static_file(const string &url, shared_ptr<const string> contents,
+                            const string &content_type, const string &cache_control)
+{
+	StaticFile file;
+	file.response_header = "HTTP/1.1 200 OK\r\nContent-type: " + content_type +
+		"\r\nContent-length: " + to_string(contents->size()) +
+		"\r\nCache-control: " + cache_control +
+		"\r\nAccess-Control-Allow-Origin: *\r\nConnection: close\r\n\r\n";
+	file.contents = move(contents);
+
+	unique_lock<mutex> lock(static_files_mutex);
+	static_files[url] = move(file);
+}
+
+void HTTPD::remove_static_file(const string &url)
+{
+	unique_lock<mutex> lock(static_files_mutex);
+	static_files.erase(url);
 }
 
 void HTTPD::start(int port)
 {
-	MHD_start_daemon(MHD_USE_THREAD_PER_CONNECTION | MHD_USE_POLL_INTERNALLY | MHD_USE_DUAL_STACK,
-	                 port,
-			 nullptr, nullptr,
-			 &answer_to_connection_thunk, this,
-	                 MHD_OPTION_NOTIFY_COMPLETED, &request_completed_thunk, this, 
-	                 MHD_OPTION_END);
+	listen_sock = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, IPPROTO_TCP);
+	if (listen_sock == -1) {
+		perror("socket");
+		exit(1);
+	}
+
+	int zero = 0, one = 1;
+	if (setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero)) == -1) {
+		perror("setsockopt(IPV6_V6ONLY)");
+		exit(1);
+	}
+	if (setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1) {
+		perror("setsockopt(SO_REUSEADDR)");
+		exit(1);
+	}
+
+	sockaddr_in6 addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin6_family = AF_INET6;
+	addr.sin6_addr = in6addr_any;
+	addr.sin6_port = htons(port);
+	if (bind(listen_sock, (sockaddr *)&addr, sizeof(addr)) == -1) {
+		perror("bind");
+		exit(1);
+	}
+	if (listen(listen_sock, SOMAXCONN) == -1) {
+		perror("listen");
+		exit(1);
+	}
+
+	wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (wakeup_fd == -1) {
+		perror("eventfd");
+		exit(1);
+	}
+
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (epoll_fd == -1) {
+		perror("epoll_create1");
+		exit(1);
+	}
+
+	epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &listen_marker;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) == -1) {
+		perror("epoll_ctl(listen socket)");
+		exit(1);
+	}
+	ev.data.ptr = &wakeup_marker;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wakeup_fd, &ev) == -1) {
+		perror("epoll_ctl(eventfd)");
+		exit(1);
+	}
+
+	server_thread = thread(&HTTPD::server_thread_func, this);
 }
 
-void HTTPD::add_data(const char *buf, size_t size, bool keyframe)
+void HTTPD::add_data(unsigned output, const char *buf, size_t size, bool keyframe)
+{
+	if (size == 0) {
+		return;
+	}
+
+	// Build the chunk (including the Metacube header) before taking the lock;
+	// this is the only copy of the data we make, no matter how many clients.
+	shared_ptr<Chunk> chunk = make_shared<Chunk>(buf, size,
+		keyframe ? DATA_TYPE_KEYFRAME : DATA_TYPE_OTHER);
+
+	{
+		unique_lock<mutex> lock(streams_mutex);
+		Output *out = &outputs[output];
+		chunk->stream_offset = out->total_bytes;
+		if (keyframe) {
+			out->last_keyframe_chunk = out->first_chunk + out->chunks.size();
+		}
+		out->chunks.push_back(move(chunk));
+		out->total_bytes += size;
+		enforce_backlog_limits(output);
+		trim_chunks(output);
+	}
+
+	// Wake up the server thread, so that it can send the new data
+	// to all the clients that are waiting for it.
+	if (wakeup_fd != -1) {
+		uint64_t one = 1;
+		if (write(wakeup_fd, &one, sizeof(one)) != sizeof(one)) {
+			perror("write(eventfd)");
+		}
+	}
+}
+
+void HTTPD::trim_chunks(unsigned output)
+{
+	Output *out = &outputs[output];
+	uint64_t min_next_chunk = out->first_chunk + out->chunks.size();
+	if (out->last_keyframe_chunk != -1) {
+		min_next_chunk = min<uint64_t>(min_next_chunk, out->last_keyframe_chunk);
+	}
+	for (const Stream *stream : streams) {
+		if (stream->get_output() == output) {
+			min_next_chunk = min(min_next_chunk, stream->get_next_chunk());
+		}
+	}
+	while (out->first_chunk < min_next_chunk) {
+		out->chunks.pop_front();
+		++out->first_chunk;
+	}
+}
+
+void HTTPD::enforce_backlog_limits(unsigned output)
+{
+	const size_t max_bytes = size_t(global_flags.http_max_client_backlog_kb) * 1024;
+	const double max_lag = global_flags.http_max_client_lag_seconds;
+	if (max_bytes == 0 && max_lag <= 0.0) {
+		return;
+	}
+
+	steady_clock::time_point now = steady_clock::now();
+	for (Stream *stream : streams) {
+		if (stream->get_output() != output || stream->is_kicked()) {
+			continue;
+		}
+		size_t backlog = stream->get_buffered_bytes();
+		double lag = stream->get_lag_seconds(now);
+		if ((max_bytes == 0 || backlog <= max_bytes) && (max_lag <= 0.0 || lag <= max_lag)) {
+			continue;
+		}
+
+		if (global_flags.http_slow_client_policy == SLOW_CLIENT_SKIP) {
+			uint64_t skipped_before = stream->get_skipped_bytes();
+			if (stream->skip_to_newest_keyframe()) {
+				++metric_slow_client_skips;
+				metric_slow_client_skipped_bytes += stream->get_skipped_bytes() - skipped_before;
+				continue;
+			}
+			// Still too far behind even from the newest keyframe,
+			// so skipping cannot help; disconnect instead.
+		}
+		stream->kick();  // The server thread will close the connection when it wakes up.
+		++metric_slow_client_disconnects;
+	}
+}
+
+size_t HTTPD::get_average_client_backlog_bytes(unsigned output)
 {
 	unique_lock<mutex> lock(streams_mutex);
+	size_t total_bytes = 0, num_streams = 0;
 	for (Stream *stream : streams) {
-		stream->add_data(buf, size, keyframe ? Stream::DATA_TYPE_KEYFRAME : Stream::DATA_TYPE_OTHER);
+		if (stream->get_output() == output) {
+			total_bytes += stream->get_buffered_bytes();
+			++num_streams;
+		}
+	}
+	return (num_streams == 0) ? 0 : total_bytes / num_streams;
+}
+
+void HTTPD::server_thread_func()
+{
+	constexpr int max_events = 64;
+	epoll_event events[max_events];
+	vector<Connection *> to_close;
+	while (!should_quit) {
+		int num_events = epoll_wait(epoll_fd, events, max_events, -1);
+		if (num_events == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			perror("epoll_wait");
+			exit(1);
+		}
+
+		bool new_data = false;
+		for (int i = 0; i < num_events; ++i) {
+			if (events[i].data.ptr == &listen_marker) {
+				accept_new_connections();
+				continue;
+			}
+			if (events[i].data.ptr == &wakeup_marker) {
+				uint64_t count;
+				if (read(wakeup_fd, &count, sizeof(count)) == -1 && errno != EAGAIN) {
+					perror("read(eventfd)");
+				}
+				new_data = true;
+				continue;
+			}
+
+			Connection *conn = (Connection *)events[i].data.ptr;
+			bool keep = true;
+			if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+				keep = false;
+			}
+			if (keep && (events[i].events & (EPOLLIN | EPOLLRDHUP))) {
+				keep = read_request(conn);
+			}
+			if (keep && (events[i].events & EPOLLOUT)) {
+				conn->blocked = false;
+				if (conn->state == Connection::SENDING_RESPONSE) {
+					keep = send_response(conn);
+				} else if (conn->state == Connection::STREAMING) {
+					keep = send_stream_data(conn);
+				}
+			}
+			if (!keep) {
+				to_close.push_back(conn);
+			}
+		}
+
+		// Send the new data to everybody who is not already waiting
+		// for their socket to become writable, and get rid of anybody
+		// who has been kicked for being too slow.
+		if (new_data) {
+			for (Connection *conn : connections) {
+				if (conn->state != Connection::STREAMING ||
+				    find(to_close.begin(), to_close.end(), conn) != to_close.end()) {
+					continue;
+				}
+				if (conn->stream->is_kicked()) {
+					fprintf(stderr, "HTTP client %s could not keep up, disconnecting.\n", conn->remote_addr.c_str());
+					to_close.push_back(conn);
+				} else if (!conn->blocked && !send_stream_data(conn)) {
+					to_close.push_back(conn);
+				}
+			}
+		}
+
+		for (Connection *conn : to_close) {
+			if (connections.count(conn)) {
+				close_connection(conn);
+			}
+		}
+		to_close.clear();
 	}
 }
 
-int HTTPD::answer_to_connection_thunk(void *cls, MHD_Connection *connection,
-                                      const char *url, const char *method,
-                                      const char *version, const char *upload_data,
-                                      size_t *upload_data_size, void **con_cls)
+void HTTPD::accept_new_connections()
 {
-	HTTPD *httpd = (HTTPD *)cls;
-	return httpd->answer_to_connection(connection, url, method, version, upload_data, upload_data_size, con_cls);
+	for ( ;; ) {
+		sockaddr_in6 addr;
+		socklen_t addr_len = sizeof(addr);
+		int sock = accept4(listen_sock, (sockaddr *)&addr, &addr_len, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (sock == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept4");
+			}
+			return;
+		}
+
+		Connection *conn = new Connection;
+		conn->sock = sock;
+		conn->remote_addr = format_address(addr);
+		conn->local = is_loopback(addr);
+
+		// Edge-triggered, so that we only hear about writability
+		// after we have actually filled up the socket buffer.
+		epoll_event ev;
+		memset(&ev, 0, sizeof(ev));
+		ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		ev.data.ptr = conn;
+		if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev) == -1) {
+			perror("epoll_ctl(client socket)");
+			close(sock);
+			delete conn;
+			continue;
+		}
+		connections.insert(conn);
+	}
 }
 
-int HTTPD::answer_to_connection(MHD_Connection *connection,
-                                const char *url, const char *method,
-				const char *version, const char *upload_data,
-				size_t *upload_data_size, void **con_cls)
+bool HTTPD::read_request(Connection *conn)
 {
+	char buf[4096];
+	for ( ;; ) {
+		ssize_t ret = recv(conn->sock, buf, sizeof(buf), 0);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		if (ret == 0 && conn->state != Connection::READING_REQUEST) {
+			// The client has closed its end after sending the request
+			// (e.g. a half-closed socket); that is fine, since we never read
+			// anything more. Keep sending until writing fails or we get
+			// EPOLLHUP/EPOLLERR.
+			return true;
+		}
+		if (ret <= 0) {
+			// Error, or the client closed the connection.
+			return false;
+		}
+		if (conn->state != Connection::READING_REQUEST) {
+			// We don't support pipelining or keepalive, so just ignore
+			// anything that comes after the request.
+			continue;
+		}
+
+		conn->request.append(buf, ret);
+		if (conn->request.find("\r\n\r\n") != string::npos ||
+		    conn->request.find("\n\n") != string::npos) {
+			if (!process_request(conn)) {
+				return false;
+			}
+		} else if (conn->request.size() > max_request_size) {
+			return false;
+		}
+	}
+}
+
+bool HTTPD::process_request(Connection *conn)
+{
+	// Parse the request line: “GET /url?args HTTP/1.1”.
+	string line = conn->request.substr(0, conn->request.find_first_of("\r\n"));
+	conn->request.clear();
+
+	size_t space1 = line.find(' ');
+	size_t space2 = (space1 == string::npos) ? string::npos : line.find(' ', space1 + 1);
+	if (space1 == string::npos) {
+		conn->state = Connection::SENDING_RESPONSE;
+		conn->response = make_error_response("400 Bad Request");
+		return send_response(conn);
+	}
+	string method = line.substr(0, space1);
+	string url = line.substr(space1 + 1, (space2 == string::npos) ? string::npos : space2 - space1 - 1);
+	if (method != "GET" && method != "POST") {
+		conn->state = Connection::SENDING_RESPONSE;
+		conn->response = make_error_response("405 Method Not Allowed");
+		return send_response(conn);
+	}
+
+	string query;
+	size_t question_mark = url.find('?');
+	if (question_mark != string::npos) {
+		query = url.substr(question_mark + 1);
+		url.resize(question_mark);
+	}
+
+	// Only control endpoints take POST (with their arguments in the query
+	// string, like everything else); a plain link or prefetch must never
+	// change anything.
+	auto endpoint_it = endpoints.find(url);
+	bool control = (endpoint_it != endpoints.end() && endpoint_it->second.type == ENDPOINT_CONTROL);
+	if (method != (control ? "POST" : "GET")) {
+		conn->state = Connection::SENDING_RESPONSE;
+		conn->response = make_error_response("405 Method Not Allowed");
+		return send_response(conn);
+	}
+	if (control && !conn->local) {
+		conn->state = Connection::SENDING_RESPONSE;
+		conn->response = make_error_response("403 Forbidden");
+		return send_response(conn);
+	}
+
+	if (endpoint_it != endpoints.end()) {
+		pair<string, string> contents_and_type = endpoint_it->second.callback(parse_query_string(query));
+		char header[256];
+		snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\nContent-type: %s\r\nContent-length: %zu\r\nConnection: close\r\n\r\n",
+			contents_and_type.second.c_str(), contents_and_type.first.size());
+		conn->state = Connection::SENDING_RESPONSE;
+		conn->response = header + contents_and_type.first;
+		return send_response(conn);
+	}
+
+	{
+		unique_lock<mutex> lock(static_files_mutex);
+		auto file_it = static_files.find(url);
+		if (file_it != static_files.end()) {
+			// Keep a reference, so that the file can be replaced or removed
+			// while we are still sending it.
+			conn->state = Connection::SENDING_RESPONSE;
+			conn->response = file_it->second.response_header;
+			conn->response_body = file_it->second.contents;
+			lock.unlock();
+			return send_response(conn);
+		}
+	}
+
 	// See if the URL ends in “.metacube”.
-	HTTPD::Stream::Framing framing;
-	if (strstr(url, ".metacube") == url + strlen(url) - strlen(".metacube")) {
-		framing = HTTPD::Stream::FRAMING_METACUBE;
+	Stream::Framing framing;
+	const string metacube_suffix = ".metacube";
+	if (url.size() >= metacube_suffix.size() &&
+	    url.compare(url.size() - metacube_suffix.size(), string::npos, metacube_suffix) == 0) {
+		framing = Stream::FRAMING_METACUBE;
+		url.resize(url.size() - metacube_suffix.size());
 	} else {
-		framing = HTTPD::Stream::FRAMING_RAW;
+		framing = Stream::FRAMING_RAW;
+	}
+
+	unsigned output = 0;
+	for (unsigned i = 1; i < outputs.size(); ++i) {
+		if (outputs[i].url == url) {
+			output = i;
+			break;
+		}
 	}
 
-	HTTPD::Stream *stream = new HTTPD::Stream(framing);
-	stream->add_data(header.data(), header.size(), Stream::DATA_TYPE_HEADER);
 	{
+		// Start at the newest keyframe we have, so that the client can start
+		// playing immediately. If there is none, start at the end, and wait
+		// for the first one.
 		unique_lock<mutex> lock(streams_mutex);
-		streams.insert(stream);
+		const Output &out = outputs[output];
+		uint64_t end_chunk = out.first_chunk + out.chunks.size();
+		uint64_t start_chunk = (out.last_keyframe_chunk == -1) ? end_chunk : out.last_keyframe_chunk;
+		conn->stream = new Stream(this, output, framing, out.header, start_chunk);
+		streams.insert(conn->stream);
+
+		if (global_flags.http_startup_burst_rate_kbit > 0 && start_chunk != end_chunk) {
+			conn->burst_end_chunk = end_chunk;
+			set_pacing(conn, true);
+		}
+	}
+
+	// No Content-length, so the stream just goes on until the connection is closed.
+	conn->state = Connection::STREAMING;
+	conn->response = "HTTP/1.1 200 OK\r\n";
+	if (framing == Stream::FRAMING_METACUBE) {
+		conn->response += "Content-encoding: metacube\r\n";
 	}
-	*con_cls = stream;
+	conn->response += "Connection: close\r\n\r\n";
+	return send_stream_data(conn);
+}
 
-	// Does not strictly have to be equal to MUX_BUFFER_SIZE.
-	MHD_Response *response = MHD_create_response_from_callback(
-		(size_t)-1, MUX_BUFFER_SIZE, &HTTPD::Stream::reader_callback_thunk, stream, &HTTPD::free_stream);
+bool HTTPD::send_response(Connection *conn)
+{
+	const size_t body_size = (conn->response_body == nullptr) ? 0 : conn->response_body->size();
+	while (conn->response_sent < conn->response.size() + body_size) {
+		iovec iov[2];
+		int num_iov = 0;
+		size_t body_sent = 0;
+		if (conn->response_sent < conn->response.size()) {
+			iov[num_iov].iov_base = const_cast<char *>(conn->response.data() + conn->response_sent);
+			iov[num_iov].iov_len = conn->response.size() - conn->response_sent;
+			++num_iov;
+		} else {
+			body_sent = conn->response_sent - conn->response.size();
+		}
+		if (body_size > 0) {
+			iov[num_iov].iov_base = const_cast<char *>(conn->response_body->data() + body_sent);
+			iov[num_iov].iov_len = body_size - body_sent;
+			++num_iov;
+		}
 
-	// TODO: Content-type?
-	if (framing == HTTPD::Stream::FRAMING_METACUBE) {
-		MHD_add_response_header(response, "Content-encoding", "metacube");
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = num_iov;
+		ssize_t ret = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			conn->blocked = true;
+			return true;
+		}
+		if (ret == -1) {
+			return false;
+		}
+		conn->response_sent += ret;
 	}
-	int ret = MHD_queue_response(connection, MHD_HTTP_OK, response);
-	//MHD_destroy_response(response);
 
-	return ret;
+	// A complete response has been sent; we're done with this connection.
+	// (For STREAMING, this is only the HTTP header, so we go on.)
+	return conn->state == Connection::STREAMING;
 }
 
-void HTTPD::free_stream(void *cls)
+bool HTTPD::send_stream_data(Connection *conn)
 {
-	// FIXME: When is this actually called, if ever?
-	// Also, shouldn't we remove it from streams?
-	HTTPD::Stream *stream = (HTTPD::Stream *)cls;
-	delete stream;
+	if (conn->response_sent < conn->response.size()) {
+		if (!send_response(conn)) {
+			return false;
+		}
+		if (conn->blocked) {
+			return true;
+		}
+	}
+
+	for ( ;; ) {
+		shared_ptr<const Chunk> chunk;
+		size_t used;
+		{
+			unique_lock<mutex> lock(streams_mutex);
+			if (conn->stream->is_kicked()) {
+				return false;
+			}
+			chunk = conn->stream->get_current_chunk(&used);
+		}
+		if (chunk == nullptr) {
+			// Nothing more to send right now.
+			return true;
+		}
+
+		// The chunk cannot go away or change under us, since we hold
+		// a reference to it, so we don't need the lock while sending.
+		iovec iov[2];
+		int num_iov = 0;
+		if (conn->stream->get_framing() == Stream::FRAMING_METACUBE) {
+			if (used < chunk->metacube_header.size()) {
+				iov[num_iov].iov_base = const_cast<char *>(chunk->metacube_header.data() + used);
+				iov[num_iov].iov_len = chunk->metacube_header.size() - used;
+				++num_iov;
+				used = 0;
+			} else {
+				used -= chunk->metacube_header.size();
+			}
+		}
+		iov[num_iov].iov_base = const_cast<char *>(chunk->data.data() + used);
+		iov[num_iov].iov_len = chunk->data.size() - used;
+		++num_iov;
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = num_iov;
+		ssize_t ret = sendmsg(conn->sock, &msg, MSG_NOSIGNAL);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			conn->blocked = true;
+			return true;
+		}
+		if (ret == -1) {
+			return false;
+		}
+
+		unique_lock<mutex> lock(streams_mutex);
+		conn->stream->consume(ret);
+		if (conn->paced && conn->stream->get_next_chunk() >= conn->burst_end_chunk) {
+			// Caught up with what was cached when the client connected;
+			// from now on, data can only come as fast as it is produced.
+			set_pacing(conn, false);
+		}
+	}
 }
 
-void HTTPD::request_completed_thunk(void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe)
+void HTTPD::set_pacing(Connection *conn, bool paced)
 {
-	HTTPD *httpd = (HTTPD *)cls;
-	return httpd->request_completed(connection, con_cls, toe);
+	// In bytes per second; ~0 means no limit.
+	unsigned rate = paced ? global_flags.http_startup_burst_rate_kbit * (1000 / 8) : ~0U;
+	if (setsockopt(conn->sock, SOL_SOCKET, SO_MAX_PACING_RATE, &rate, sizeof(rate)) == -1) {
+		// Not fatal; the client just gets the data as fast as it can take it.
+		perror("setsockopt(SO_MAX_PACING_RATE)");
+	}
+	conn->paced = paced;
 }
 
-void HTTPD::request_completed(struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe)
+void HTTPD::close_connection(Connection *conn)
 {
-	if (con_cls == nullptr) {
-		// Request was never set up.
-		return;
-	}
-	HTTPD::Stream *stream = (HTTPD::Stream *)*con_cls;
-	{
+	if (conn->stream != nullptr) {
 		unique_lock<mutex> lock(streams_mutex);
-		delete stream;
-		streams.erase(stream);
+		unsigned output = conn->stream->get_output();
+		streams.erase(conn->stream);
+		delete conn->stream;
+		trim_chunks(output);
 	}
+	close(conn->sock);  // Also removes it from the epoll set.
+	connections.erase(conn);
+	delete conn;
 }
 
-ssize_t HTTPD::Stream::reader_callback_thunk(void *cls, uint64_t pos, char *buf, size_t max)
+pair<string, string> HTTPD::clients_endpoint()
 {
-	HTTPD::Stream *stream = (HTTPD::Stream *)cls;
-	return stream->reader_callback(pos, buf, max);
+	steady_clock::time_point now = steady_clock::now();
+	string ret = "# address url bytes_sent backlog_bytes lag_seconds skips skipped_bytes\n";
+	unique_lock<mutex> lock(streams_mutex);
+	for (const Connection *conn : connections) {
+		if (conn->state != Connection::STREAMING) {
+			continue;
+		}
+		const Stream *stream = conn->stream;
+		string url = outputs[stream->get_output()].url;
+		if (url.empty()) {
+			url = "/";
+		}
+		if (stream->get_framing() == Stream::FRAMING_METACUBE) {
+			url += ".metacube";
+		}
+		char buf[1024];
+		snprintf(buf, sizeof(buf), "%s %s %llu %zu %.3f %u %llu\n",
+			conn->remote_addr.c_str(), url.c_str(),
+			(unsigned long long)stream->get_bytes_sent(), stream->get_buffered_bytes(),
+			stream->get_lag_seconds(now), stream->get_num_skips(),
+			(unsigned long long)stream->get_skipped_bytes());
+		ret += buf;
+	}
+	return make_pair(ret, "text/plain");
 }
 
-ssize_t HTTPD::Stream::reader_callback(uint64_t pos, char *buf, size_t max)
+HTTPD::Chunk::Chunk(const char *buf, size_t size, DataType data_type)
+	: data_type(data_type), arrival_time(steady_clock::now()), data(buf, size)
 {
-	unique_lock<mutex> lock(buffer_mutex);
-	has_buffered_data.wait(lock, [this]{ return !buffered_data.empty(); });
+	metacube2_block_header hdr;
+	memcpy(hdr.sync, METACUBE2_SYNC, sizeof(hdr.sync));
+	hdr.size = htonl(size);
+	int flags = 0;
+	if (data_type == DATA_TYPE_HEADER) {
+		flags |= METACUBE_FLAGS_HEADER;
+	} else if (data_type == DATA_TYPE_OTHER) {
+		flags |= METACUBE_FLAGS_NOT_SUITABLE_FOR_STREAM_START;
+	}
+	hdr.flags = htons(flags);
+	hdr.csum = htons(metacube2_compute_crc(&hdr));
+	metacube_header.assign((char *)&hdr, sizeof(hdr));
+}
 
-	ssize_t ret = 0;
-	while (max > 0 && !buffered_data.empty()) {
-		const string &s = buffered_data.front();
-		assert(s.size() > used_of_buffered_data);
-		size_t len = s.size() - used_of_buffered_data;
-		if (max >= len) {
-			// Consume the entire (rest of the) string.
-			memcpy(buf, s.data() + used_of_buffered_data, len);
-			buf += len;
-			ret += len;
-			max -= len;
-			buffered_data.pop_front();
-			used_of_buffered_data = 0;
+HTTPD::Stream::Stream(HTTPD *httpd, unsigned output, Framing framing, shared_ptr<const Chunk> header, uint64_t next_chunk)
+	: httpd(httpd), output(output), framing(framing), pending_chunk(move(header)), next_chunk(next_chunk)
+{
+	if (pending_chunk != nullptr && pending_chunk->data.empty()) {
+		pending_chunk.reset();
+	}
+}
+
+shared_ptr<const HTTPD::Chunk> HTTPD::Stream::get_current_chunk(size_t *used)
+{
+	*used = used_of_next_chunk;
+	if (pending_chunk != nullptr) {
+		return pending_chunk;
+	}
+	if (!skip_to_usable_data()) {
+		return nullptr;
+	}
+	const Output &out = httpd->outputs[output];
+	return out.chunks[next_chunk - out.first_chunk];
+}
+
+void HTTPD::Stream::consume(size_t bytes)
+{
+	used_of_next_chunk += bytes;
+	bytes_sent += bytes;
+
+	const Chunk *chunk;
+	if (pending_chunk != nullptr) {
+		chunk = pending_chunk.get();
+	} else {
+		const Output &out = httpd->outputs[output];
+		chunk = out.chunks[next_chunk - out.first_chunk].get();
+	}
+	assert(used_of_next_chunk <= get_chunk_size(*chunk));
+	if (used_of_next_chunk == get_chunk_size(*chunk)) {
+		// Done with this chunk; move on to the next one.
+		used_of_next_chunk = 0;
+		if (pending_chunk != nullptr) {
+			pending_chunk.reset();
 		} else {
-			// We don't need the entire string; just use the first part of it.
-			memcpy(buf, s.data() + used_of_buffered_data, max);
-			buf += max;
-			used_of_buffered_data += max;
-			ret += max;
-			max = 0;
+			++next_chunk;
 		}
 	}
+}
 
-	return ret;
+size_t HTTPD::Stream::get_chunk_size(const Chunk &chunk) const
+{
+	if (framing == FRAMING_METACUBE) {
+		return chunk.metacube_header.size() + chunk.data.size();
+	} else {
+		return chunk.data.size();
+	}
 }
 
-void HTTPD::Stream::add_data(const char *buf, size_t buf_size, HTTPD::Stream::DataType data_type)
+bool HTTPD::Stream::skip_to_usable_data()
 {
-	if (buf_size == 0) {
-		return;
+	if (pending_chunk != nullptr) {
+		return true;
 	}
-	if (data_type == DATA_TYPE_KEYFRAME) {
-		seen_keyframe = true;
-	} else if (data_type == DATA_TYPE_OTHER && !seen_keyframe) {
+	const Output &out = httpd->outputs[output];
+	const uint64_t end_chunk = out.first_chunk + out.chunks.size();
+	if (!seen_keyframe) {
 		// Start sending only once we see a keyframe.
-		return;
+		while (next_chunk < end_chunk &&
+		       out.chunks[next_chunk - out.first_chunk]->data_type != DATA_TYPE_KEYFRAME) {
+			++next_chunk;
+		}
+		if (next_chunk < end_chunk) {
+			seen_keyframe = true;
+		}
 	}
+	return next_chunk < end_chunk;
+}
 
-	unique_lock<mutex> lock(buffer_mutex);
-
+size_t HTTPD::Stream::get_buffered_bytes() const
+{
+	const Output &out = httpd->outputs[output];
+	if (next_chunk == out.first_chunk + out.chunks.size()) {
+		return 0;
+	}
+	const Chunk *chunk = out.chunks[next_chunk - out.first_chunk].get();
+	size_t used_data = used_of_next_chunk;
 	if (framing == FRAMING_METACUBE) {
-		metacube2_block_header hdr;
-		memcpy(hdr.sync, METACUBE2_SYNC, sizeof(hdr.sync));
-		hdr.size = htonl(buf_size);
-		int flags = 0;
-		if (data_type == DATA_TYPE_HEADER) {
-			flags |= METACUBE_FLAGS_HEADER;
-		} else if (data_type == DATA_TYPE_OTHER) {
-			flags |= METACUBE_FLAGS_NOT_SUITABLE_FOR_STREAM_START;
+		used_data = (used_data > chunk->metacube_header.size()) ? used_data - chunk->metacube_header.size() : 0;
+	}
+	return out.total_bytes - chunk->stream_offset - used_data;
+}
+
+double HTTPD::Stream::get_lag_seconds(steady_clock::time_point now) const
+{
+	const Output &out = httpd->outputs[output];
+	if (next_chunk == out.first_chunk + out.chunks.size()) {
+		return 0.0;
+	}
+	const Chunk *chunk = out.chunks[next_chunk - out.first_chunk].get();
+	return duration<double>(now - chunk->arrival_time).count();
+}
+
+bool HTTPD::Stream::skip_to_newest_keyframe()
+{
+	const Output &out = httpd->outputs[output];
+	const uint64_t end_chunk = out.first_chunk + out.chunks.size();
+
+	// If we are in the middle of a chunk, hold on to it so that it can be
+	// finished; the client would not be able to make sense of the rest otherwise.
+	if (pending_chunk == nullptr && used_of_next_chunk > 0) {
+		pending_chunk = out.chunks[next_chunk - out.first_chunk];
+		++next_chunk;
+	}
+	if (next_chunk == end_chunk) {
+		return false;
+	}
+
+	// Find the newest chunk that is not marked as unsuitable for stream start.
+	uint64_t new_next_chunk = end_chunk;
+	for (uint64_t i = end_chunk; i > next_chunk; --i) {
+		if (out.chunks[i - 1 - out.first_chunk]->data_type == DATA_TYPE_KEYFRAME) {
+			new_next_chunk = i - 1;
+			break;
 		}
-		hdr.flags = htons(flags);
-		hdr.csum = htons(metacube2_compute_crc(&hdr));
-		buffered_data.emplace_back((char *)&hdr, sizeof(hdr));
 	}
-	buffered_data.emplace_back(buf, buf_size);
-	has_buffered_data.notify_all();	
+	if (new_next_chunk == next_chunk) {
+		// Already at the newest keyframe; nothing to skip.
+		return false;
+	}
+
+	uint64_t new_offset = (new_next_chunk == end_chunk) ? out.total_bytes :
+		out.chunks[new_next_chunk - out.first_chunk]->stream_offset;
+	skipped_bytes += new_offset - out.chunks[next_chunk - out.first_chunk]->stream_offset;
+	++num_skips;
+
+	next_chunk = new_next_chunk;
+	if (next_chunk == end_chunk) {
+		// No keyframe yet, so wait for one, like a new client would.
+		seen_keyframe = false;
+	}
+	return true;
 }
 
+void HTTPD::Stream::kick()
+{
+	const Output &out = httpd->outputs[output];
+	kicked = true;
+	pending_chunk.reset();
+	next_chunk = out.first_chunk + out.chunks.size();
+	used_of_next_chunk = 0;
+}
@@ -2,81 +2,285 @@
 #define _HTTPD_H
 
 // A class dealing with stream output to HTTP.
+//
+// We run our own small HTTP server instead of using a general-purpose
+// library, since our needs are very specific: possibly hundreds of
+// long-lived clients that all get the same data, plus a few tiny control
+// endpoints. All connections are handled by a single thread running an
+// epoll loop over non-blocking sockets. Stream data is written directly
+// out of the shared chunks (see Chunk), so each new block of data costs
+// one write per client, instead of a copy and a thread wakeup per client.
+//
+// Clients that cannot keep up are not allowed to hold on to unbounded
+// amounts of data; if a client gets more than --http-max-client-backlog
+// bytes or --http-max-client-lag seconds behind, it is either skipped
+// forward to the newest keyframe or disconnected (--http-slow-client-policy).
+// Per-client statistics are available at /clients.
+//
+// To let players start right away instead of waiting for the next keyframe,
+// each output keeps the chunks from its newest keyframe on, and new clients
+// start from there. This initial burst can be rate-limited
+// (--http-startup-burst-rate), using the kernel's socket pacing.
 
-#include <microhttpd.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <sys/types.h>
-#include <condition_variable>
+#include <atomic>
+#include <chrono>
 #include <deque>
+#include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <set>
 #include <string>
-
-struct MHD_Connection;
+#include <thread>
+#include <utility>
+#include <vector>
 
 class HTTPD {
 public:
 	HTTPD();
+	~HTTPD();
+
+	// Each output is a separate stream, with its own header and data;
+	// clients choose between them by URL (optionally with “.metacube” added).
+	// Output 0 always exists, and is served for all URLs that do not match
+	// another output (or an endpoint). Should be called before start().
+	unsigned add_output(const std::string &url);
+
+	// Returns the output added for <url>, which must exist.
+	unsigned find_output(const std::string &url) const;
 
-	// Should be called before start().
-	void set_header(const std::string &data) {
-		header = data;
+	// Clients that connect after this get <data> before any stream data.
+	// Can be called from any thread.
+	void set_header(unsigned output, const std::string &data);
+
+	// Serves <url> (exact match) by calling <callback> with the query string
+	// arguments of the request, instead of sending the stream. The callback
+	// returns the response body and its Content-type. It is called from the
+	// server thread, so it should be fast. Should be called before start().
+	//
+	// Read-only endpoints answer GET from anyone. Endpoints that change state
+	// (ENDPOINT_CONTROL) answer only POST, and only from localhost, since
+	// the port is typically open to the world for the stream.
+	enum EndpointType {
+		ENDPOINT_READ_ONLY,
+		ENDPOINT_CONTROL
+	};
+	typedef std::function<std::pair<std::string, std::string>(const std::map<std::string, std::string> &args)> EndpointCallback;
+	void add_endpoint(const std::string &url, const EndpointCallback &callback, EndpointType type = ENDPOINT_READ_ONLY) {
+		endpoints[url] = Endpoint{ callback, type };
 	}
 
-	void start(int port);
-	void add_data(const char *buf, size_t size, bool keyframe);
+	// Serves <contents> at <url> (exact match) as a complete response with
+	// the given Content-type and Cache-control headers, until it is replaced
+	// or removed. The contents are sent directly out of the given string,
+	// no matter how many clients fetch it, so it must not be changed afterwards.
+	// Can be called from any thread.
+	void set_static_file(const std::string &url, std::shared_ptr<const std::string> contents,
+	                     const std::string &content_type, const std::string &cache_control);
+	void remove_static_file(const std::string &url);
 
-private:
-	static int answer_to_connection_thunk(void *cls, MHD_Connection *connection,
-	                                      const char *url, const char *method,
-	                                      const char *version, const char *upload_data,
-	                                      size_t *upload_data_size, void **con_cls);
+	void start(int port);
+	void add_data(unsigned output, const char *buf, size_t size, bool keyframe);
 
-	int answer_to_connection(MHD_Connection *connection,
-	                         const char *url, const char *method,
-	                         const char *version, const char *upload_data,
-	                         size_t *upload_data_size, void **con_cls);
+	// Average number of bytes queued up for the clients of the given output
+	// that they have not yet received; zero if there are no such clients.
+	// Can be called from any thread.
+	size_t get_average_client_backlog_bytes(unsigned output);
 
-	static void free_stream(void *cls);
+private:
+	enum DataType {
+		DATA_TYPE_HEADER,
+		DATA_TYPE_KEYFRAME,
+		DATA_TYPE_OTHER
+	};
 
-	static void request_completed_thunk(void *cls, struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe);
+	// A block of muxed data, as given to add_data(). It is stored only once
+	// no matter how many clients there are, and never changed after it has
+	// been added to an output, so the clients can read from it without copying.
+	struct Chunk {
+		Chunk(const char *buf, size_t size, DataType data_type);
 
-	void request_completed(struct MHD_Connection *connection, void **con_cls, enum MHD_RequestTerminationCode toe);
+		const DataType data_type;
+		const std::chrono::steady_clock::time_point arrival_time;
+		uint64_t stream_offset = 0;  // Total size of all earlier chunks in the output (not counting Metacube headers). Set when added.
+		std::string metacube_header;  // Precomputed, for clients that want Metacube framing.
+		const std::string data;
+	};
 
+	struct Output;
 
+	// The streaming state of one client; essentially a cursor into the
+	// chunks of its output.
 	class Stream {
 	public:
 		enum Framing {
 			FRAMING_RAW,
 			FRAMING_METACUBE
 		};
-		Stream(Framing framing) : framing(framing) {}
+		Stream(HTTPD *httpd, unsigned output, Framing framing, std::shared_ptr<const Chunk> header, uint64_t next_chunk);
 
-		static ssize_t reader_callback_thunk(void *cls, uint64_t pos, char *buf, size_t max);
-		ssize_t reader_callback(uint64_t pos, char *buf, size_t max);
+		unsigned get_output() const { return output; }
+		Framing get_framing() const { return framing; }
+		uint64_t get_next_chunk() const { return next_chunk; }
 
-		enum DataType {
-			DATA_TYPE_HEADER,
-			DATA_TYPE_KEYFRAME,
-			DATA_TYPE_OTHER
-		};
-		void add_data(const char *buf, size_t size, DataType data_type);
+		// Returns the chunk to send data from next (nullptr if there is
+		// nothing to send yet), and how many bytes of it (including any
+		// Metacube header) have already been sent.
+		// Must be called with <streams_mutex> held.
+		std::shared_ptr<const Chunk> get_current_chunk(size_t *used);
+
+		// Marks <bytes> more of the current chunk as sent.
+		// Must be called with <streams_mutex> held.
+		void consume(size_t bytes);
+
+		// Must be called with <streams_mutex> held.
+		size_t get_buffered_bytes() const;
+
+		// How long ago the oldest data we have yet to send was added;
+		// zero if we are all caught up.
+		// Must be called with <streams_mutex> held.
+		double get_lag_seconds(std::chrono::steady_clock::time_point now) const;
+
+		// Drops everything we have not started sending yet, up to the newest
+		// chunk that a client can start from (the newest keyframe); if there
+		// is no such chunk, waits for the next keyframe. Any partially sent
+		// chunk is finished first, so that we never cut a chunk in half.
+		// Returns false if there was nothing to skip (e.g. we are already
+		// at the newest keyframe), so that skipping cannot help.
+		// Must be called with <streams_mutex> held.
+		bool skip_to_newest_keyframe();
+
+		// Marks the stream for disconnection by the server thread, and
+		// releases all chunks it holds on to.
+		// Must be called with <streams_mutex> held.
+		void kick();
+		bool is_kicked() const { return kicked; }
+
+		// Statistics. Must be called with <streams_mutex> held.
+		uint64_t get_bytes_sent() const { return bytes_sent; }
+		unsigned get_num_skips() const { return num_skips; }
+		uint64_t get_skipped_bytes() const { return skipped_bytes; }
 
 	private:
+		// Skips past chunks we cannot send yet (if we haven't seen a keyframe),
+		// and returns whether there is anything to send.
+		bool skip_to_usable_data();
+
+		size_t get_chunk_size(const Chunk &chunk) const;
+
+		// Everything below is protected by the HTTPD's <streams_mutex>,
+		// except <kicked>, which the server thread can read at any time.
+		HTTPD *httpd;
+		unsigned output;
 		Framing framing;
 
-		std::mutex buffer_mutex;
-		std::condition_variable has_buffered_data;
-		std::deque<std::string> buffered_data;  // Protected by <mutex>.
-		size_t used_of_buffered_data = 0;  // How many bytes of the first element of <buffered_data> that is already used. Protected by <mutex>.
-		size_t seen_keyframe = false;
+		// A chunk to send before continuing from <next_chunk>: the header,
+		// or a partially sent chunk that we skipped away from. nullptr if none.
+		std::shared_ptr<const Chunk> pending_chunk;
+
+		uint64_t next_chunk;  // Our cursor into the output's <chunks>; see Output.
+		size_t used_of_next_chunk = 0;  // Bytes of the current chunk already sent, including any Metacube header.
+		bool seen_keyframe = false;
+		std::atomic<bool> kicked{false};
+
+		uint64_t bytes_sent = 0;  // Including any Metacube headers.
+		unsigned num_skips = 0;
+		uint64_t skipped_bytes = 0;
+	};
+
+	// A client connection. Only touched by the server thread.
+	struct Connection {
+		int sock;
+		std::string remote_addr;  // For statistics only.
+		bool local;  // Connected over loopback; allowed to use ENDPOINT_CONTROL.
+		enum State {
+			READING_REQUEST,
+			SENDING_RESPONSE,  // A complete response (e.g. from an endpoint); close when sent.
+			STREAMING,  // Sending <response> (the HTTP header), then the stream.
+		};
+		State state = READING_REQUEST;
+		std::string request;  // Until the request has been read.
+		std::string response;
+		std::shared_ptr<const std::string> response_body;  // Sent after <response> if set. Only for SENDING_RESPONSE.
+		size_t response_sent = 0;  // Counting both <response> and <response_body>.
+		Stream *stream = nullptr;  // Owned, and in <streams>. Only if STREAMING.
+		bool blocked = false;  // The socket buffer was full at last write; waiting for EPOLLOUT.
+
+		// If true, the socket is paced to --http-startup-burst-rate until the
+		// stream has sent everything up to <burst_end_chunk> (the data that
+		// was already there when the client connected).
+		bool paced = false;
+		uint64_t burst_end_chunk = 0;
 	};
 
+	void server_thread_func();
+	void accept_new_connections();
+
+	// These return false if the connection should be closed.
+	bool read_request(Connection *conn);
+	bool process_request(Connection *conn);
+	bool send_response(Connection *conn);
+	bool send_stream_data(Connection *conn);
+
+	void close_connection(Connection *conn);
+
+	// Turns socket pacing on or off for the given connection.
+	void set_pacing(Connection *conn, bool paced);
+
+	int listen_sock = -1, epoll_fd = -1, wakeup_fd = -1;
+	std::thread server_thread;
+	std::atomic<bool> should_quit{false};
+	std::set<Connection *> connections;  // Owned. Only touched by the server thread.
+
+	// Protects <streams>, all the Stream objects in it, and the headers
+	// and chunks of all the outputs.
 	std::mutex streams_mutex;
 	std::set<Stream *> streams;  // Not owned.
-	std::string header;
+
+	struct Output {
+		std::string url;
+		std::shared_ptr<const Chunk> header;
+
+		// All chunks that at least one client still has left to send,
+		// plus everything from the newest keyframe on (which is where new
+		// clients start). Chunks are numbered consecutively from the start
+		// of the output, so chunks[i] is chunk number <first_chunk> + i.
+		std::deque<std::shared_ptr<const Chunk>> chunks;
+		uint64_t first_chunk = 0;
+		uint64_t total_bytes = 0;  // Sum of the data sizes of all chunks ever added.
+
+		// Number of the newest keyframe chunk, or -1 if there has been none yet.
+		int64_t last_keyframe_chunk = -1;
+	};
+	std::vector<Output> outputs;
+
+	// Removes chunks that no client of the given output needs anymore.
+	// Must be called with <streams_mutex> held.
+	void trim_chunks(unsigned output);
+
+	// Applies --http-slow-client-policy to all clients of the given output
+	// that have fallen too far behind.
+	// Must be called with <streams_mutex> held.
+	void enforce_backlog_limits(unsigned output);
+
+	// The /clients endpoint. Called from the server thread.
+	std::pair<std::string, std::string> clients_endpoint();
+
+	struct Endpoint {
+		EndpointCallback callback;
+		EndpointType type;
+	};
+	std::map<std::string, Endpoint> endpoints;
+
+	struct StaticFile {
+		std::string response_header;  // The entire HTTP header.
+		std::shared_ptr<const std::string> contents;
+	};
+	std::mutex static_files_mutex;
+	std::map<std::string, StaticFile> static_files;  // Under <static_files_mutex>.
 };
 
 #endif  // !defined(_HTTPD_H)
@@ -1,111 +1,110 @@
 #include "image_input.h"
 
+#include <epoxy/egl.h>
 #include <movit/image_format.h>
+#include <movit/util.h>
 
 extern "C" {
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
-#include <libavutil/imgutils.h>
 #include <libavutil/pixfmt.h>
 #include <libswscale/swscale.h>
 }
 
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdio.h>
+#include <sys/inotify.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#include <algorithm>
+#include <cmath>
 #include <mutex>
+#include <set>
 #include <thread>
 
+#include "context.h"
+#include "defs.h"
+#include "ffmpeg_raii.h"
+#include "flags.h"
+#include "metrics.h"
+
+#define BUFFER_OFFSET(i) ((char *)nullptr + (i))
+
 using namespace std;
 
 ImageInput::ImageInput(const string &filename)
+	: ImageInput(filename, WIDTH, HEIGHT) {}
+
+ImageInput::ImageInput(const string &filename, unsigned max_width, unsigned max_height)
 	: movit::FlatInput({movit::COLORSPACE_sRGB, movit::GAMMA_sRGB}, movit::FORMAT_RGBA_POSTMULTIPLIED_ALPHA,
-	                   GL_UNSIGNED_BYTE, 1280, 720),  // FIXME
-	  filename(filename),
-	  current_image(load_image(filename))
+	                   GL_UNSIGNED_BYTE, max_width, max_height),  // Set to the real size below.
+	  key(filename, max_width, max_height),
+	  current_image(load_image(key))
 {
 	if (current_image == nullptr) {
 		fprintf(stderr, "Couldn't load image, exiting.\n");
 		exit(1);
 	}
-	set_pixel_data(current_image->pixels.get());
+	set_width(current_image->width);
+	set_height(current_image->height);
+	set_texture_num(current_image->tex);
 }
 
 void ImageInput::set_gl_state(GLuint glsl_program_num, const string& prefix, unsigned *sampler_num)
 {
 	// See if the background thread has given us a new version of our image.
 	// Note: The old version might still be lying around in other ImageInputs
-	// (in fact, it's likely), but at least the total amount of memory used
-	// is bounded. Currently we don't even share textures between them,
-	// so there's a fair amount of OpenGL memory waste anyway (the cache
-	// is mostly there to save startup time, not RAM).
+	// (in fact, it's likely), until they are rendered the next time,
+	// but at least the total amount of memory used is bounded.
+	// Swapping out the shared_ptr might delete the old texture, but only
+	// after we have stopped using it.
 	{
 		unique_lock<mutex> lock(all_images_lock);
-		if (all_images[filename] != current_image) {
-			current_image = all_images[filename];
-			set_pixel_data(current_image->pixels.get());
+		if (all_images[key] != current_image) {
+			current_image = all_images[key];
+			set_width(current_image->width);
+			set_height(current_image->height);
+			set_texture_num(current_image->tex);
 		}
 	}
 	movit::FlatInput::set_gl_state(glsl_program_num, prefix, sampler_num);
 }
 
-shared_ptr<const ImageInput::Image> ImageInput::load_image(const string &filename)
+shared_ptr<const ImageInput::Image> ImageInput::load_image(const ImageKey &key)
 {
 	unique_lock<mutex> lock(all_images_lock);  // Held also during loading.
-	if (all_images.count(filename)) {
-		return all_images[filename];
+	if (all_images.count(key)) {
+		return all_images[key];
 	}
 
-	all_images[filename] = load_image_raw(filename);
-	timespec first_modified = all_images[filename]->last_modified;
-	update_threads[filename] =
-		thread(bind(update_thread_func, filename, first_modified));
-
-	return all_images[filename];
-}
-
-// Some helpers to make RAII versions of FFmpeg objects.
-// The cleanup functions don't interact all that well with unique_ptr,
-// so things get a bit messy and verbose, but overall it's worth it to ensure
-// we never leak things by accident in error paths.
-
-namespace {
-
-void avformat_close_input_unique(AVFormatContext *format_ctx)
-{
-	avformat_close_input(&format_ctx);
+	shared_ptr<const Image> image = load_image_raw(key);
+	if (image != nullptr) {
+		// The update thread will pick it up from here.
+		set_image(key, image);
+	}
+	return image;
 }
 
-unique_ptr<AVFormatContext, decltype(avformat_close_input_unique)*>
-avformat_open_input_unique(const char *filename,
-                           AVInputFormat *fmt, AVDictionary **options)
+void ImageInput::set_image(const ImageKey &key, shared_ptr<const Image> image)
 {
-	AVFormatContext *format_ctx = nullptr;
-	if (avformat_open_input(&format_ctx, filename, fmt, options) != 0) {
-		format_ctx = nullptr;
+	if (!metric_image_bytes.count(key)) {
+		char max_size[64];
+		snprintf(max_size, sizeof(max_size), "%ux%u", get<1>(key), get<2>(key));
+		global_metrics.add("image_input_bytes", {{ "filename", get<0>(key) }, { "max_size", max_size }},
+			&metric_image_bytes[key], Metrics::TYPE_GAUGE);
 	}
-	return unique_ptr<AVFormatContext, decltype(avformat_close_input_unique)*>(
-		format_ctx, avformat_close_input_unique);
+	metric_image_bytes[key] = image->bytes;
+	all_images[key] = image;
 }
 
-void av_frame_free_unique(AVFrame *frame)
+shared_ptr<const ImageInput::Image> ImageInput::load_image_raw(const ImageKey &key)
 {
-	av_frame_free(&frame);
-}
+	const string &filename = get<0>(key);
 
-unique_ptr<AVFrame, decltype(av_frame_free_unique)*>
-av_frame_alloc_unique()
-{
-	AVFrame *frame = av_frame_alloc();
-	return unique_ptr<AVFrame, decltype(av_frame_free_unique)*>(
-		frame, av_frame_free_unique);
-}
-
-}  // namespace
-
-shared_ptr<const ImageInput::Image> ImageInput::load_image_raw(const string &filename)
-{
 	// Note: Call before open, not after; otherwise, there's a race.
 	// (There is now, too, but it tips the correct way. We could use fstat()
 	// if we had the file descriptor.)
@@ -190,65 +189,251 @@ shared_ptr<const ImageInput::Image> ImageInput::load_image_raw(const string &fil
 		return nullptr;
 	}
 
-	// TODO: Scale down if needed!
-	uint8_t *pic_data[4] = {nullptr};
-	unique_ptr<uint8_t *, decltype(av_freep)*> pic_data_cleanup(
-		&pic_data[0], av_freep);
-	int linesizes[4];
-	if (av_image_alloc(pic_data, linesizes, frame->width, frame->height, AV_PIX_FMT_RGBA, 1) < 0) {
-		fprintf(stderr, "%s: Could not allocate picture data\n", filename.c_str());
-		return nullptr;
+	// Scale down (never up) to fit within the size we were asked for,
+	// keeping the aspect ratio. A huge image would otherwise cost us
+	// both the memory and the time to upload it, for no gain.
+	unsigned width = frame->width, height = frame->height;
+	const double scale = min(1.0, min(double(get<1>(key)) / width, double(get<2>(key)) / height));
+	if (scale < 1.0) {
+		width = max<unsigned>(lrint(width * scale), 1);
+		height = max<unsigned>(lrint(height * scale), 1);
 	}
+
+	// Convert straight into a PBO, so that the driver can do the upload
+	// by DMA, and we do not need to keep a copy of the pixels around.
+	const size_t len = width * height * 4;
+	GLuint pbo;
+	glGenBuffers(1, &pbo);
+	check_error();
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+	check_error();
+	glBufferData(GL_PIXEL_UNPACK_BUFFER, len, nullptr, GL_STREAM_DRAW);
+	check_error();
+	uint8_t *ptr = (uint8_t *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, len, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	check_error();
+
 	unique_ptr<SwsContext, decltype(sws_freeContext)*> sws_ctx(
 		sws_getContext(frame->width, frame->height,
-			(AVPixelFormat)frame->format, frame->width, frame->height,
+			(AVPixelFormat)frame->format, width, height,
 			AV_PIX_FMT_RGBA, SWS_BICUBIC, nullptr, nullptr, nullptr),
 		sws_freeContext);
 	if (sws_ctx == nullptr) {
 		fprintf(stderr, "%s: Could not create scaler context\n", filename.c_str());
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glDeleteBuffers(1, &pbo);
 		return nullptr;
 	}
+	uint8_t *pic_data[4] = { ptr, nullptr, nullptr, nullptr };
+	int linesizes[4] = { int(width * 4), 0, 0, 0 };
 	sws_scale(sws_ctx.get(), frame->data, frame->linesize, 0, frame->height, pic_data, linesizes);
+	glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+	check_error();
 
-	size_t len = frame->width * frame->height * 4;
-	unique_ptr<uint8_t[]> image_data(new uint8_t[len]);
-	av_image_copy_to_buffer(image_data.get(), len, pic_data, linesizes, AV_PIX_FMT_RGBA, frame->width, frame->height, 1);
+	// Same format as FlatInput would have used for an sRGB input,
+	// unless we are asked to let the driver compress it. Compressed
+	// formats cannot have mipmaps generated, but since we have already
+	// scaled the image down, we should not need them much.
+	const bool compress = global_flags.compress_images;
+	GLuint tex;
+	glGenTextures(1, &tex);
+	check_error();
+	glBindTexture(GL_TEXTURE_2D, tex);
+	check_error();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, compress ? GL_LINEAR : GL_LINEAR_MIPMAP_LINEAR);
+	check_error();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	check_error();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	check_error();
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+	check_error();
+	glTexImage2D(GL_TEXTURE_2D, 0, compress ? GL_COMPRESSED_SRGB_ALPHA : GL_SRGB8_ALPHA8,
+		width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, BUFFER_OFFSET(0));
+	check_error();
 
-	shared_ptr<Image> image(new Image{move(image_data), last_modified});
-	return image;
+	// The driver is free not to compress, so ask what we actually got.
+	size_t bytes;
+	GLint is_compressed = GL_FALSE;
+	if (compress) {
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED, &is_compressed);
+		check_error();
+	}
+	if (is_compressed) {
+		GLint compressed_size;
+		glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_COMPRESSED_IMAGE_SIZE, &compressed_size);
+		check_error();
+		bytes = compressed_size;
+	} else if (compress) {
+		bytes = len;
+	} else {
+		glGenerateMipmap(GL_TEXTURE_2D);
+		check_error();
+		bytes = len * 4 / 3;
+	}
+	glBindTexture(GL_TEXTURE_2D, 0);
+	check_error();
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	check_error();
+	glDeleteBuffers(1, &pbo);  // Deferred by the driver until the upload is done.
+	check_error();
+
+	// The texture will be used from other contexts, so it needs to be
+	// completely uploaded before we hand it out. This only blocks us,
+	// not whoever is rendering.
+	GLsync sync = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, /*flags=*/0);
+	check_error();
+	glClientWaitSync(sync, GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+	check_error();
+	glDeleteSync(sync);
+	check_error();
+
+	return make_shared<Image>(tex, width, height, bytes, last_modified);
 }
 
-// Fire up a thread to update the image every second.
-// We could do inotify, but this is good enough for now.
-// TODO: These don't really quit, ever. Should they?
-void ImageInput::update_thread_func(const std::string &filename, const timespec &first_modified)
+namespace {
+
+// Splits a path into the directory (for watching) and the file name
+// (which is what inotify gives us back).
+pair<string, string> split_path(const string &filename)
 {
-	timespec last_modified = first_modified;
-	struct stat buf;
-	for ( ;; ) {
-		sleep(1);
+	size_t pos = filename.rfind('/');
+	if (pos == string::npos) {
+		return make_pair(".", filename);
+	} else if (pos == 0) {
+		return make_pair("/", filename.substr(1));
+	} else {
+		return make_pair(filename.substr(0, pos), filename.substr(pos + 1));
+	}
+}
 
-		if (stat(filename.c_str(), &buf) != 0) {
-			fprintf(stderr, "%s: Couldn't check for new version, leaving the old in place.\n", filename.c_str());
-			continue;
+}  // namespace
+
+void ImageInput::start_update_thread(QSurface *surface)
+{
+	update_thread_should_quit = false;
+	update_thread = thread(update_thread_func, surface);
+}
+
+void ImageInput::end_update_thread()
+{
+	update_thread_should_quit = true;
+	update_thread.join();
+}
+
+// A single thread that watches the directories of all images with inotify,
+// and reloads any that change. We watch directories and not the files
+// themselves, so that we also see files that are replaced by renaming
+// a new version over them, which is what most programs do when saving.
+void ImageInput::update_thread_func(QSurface *surface)
+{
+	eglBindAPI(EGL_OPENGL_API);
+	QOpenGLContext *context = create_context(surface);
+	if (!make_current(context, surface)) {
+		printf("Couldn't make context current\n");
+		exit(1);
+	}
+
+	int inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd == -1) {
+		perror("inotify_init1");
+		exit(1);
+	}
+
+	map<string, int> dir_to_wd;
+	map<int, map<string, set<ImageKey>>> watched_files;  // Watch descriptor -> file name in directory -> images.
+	while (!update_thread_should_quit) {
+		// Watch any images that came in since last time.
+		{
+			unique_lock<mutex> lock(all_images_lock);
+			for (const auto &key_and_image : all_images) {
+				const ImageKey &key = key_and_image.first;
+				const string &filename = get<0>(key);
+				pair<string, string> dir_and_name = split_path(filename);
+				if (!dir_to_wd.count(dir_and_name.first)) {
+					int wd = inotify_add_watch(inotify_fd, dir_and_name.first.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+					if (wd == -1) {
+						perror(dir_and_name.first.c_str());
+						fprintf(stderr, "%s: Will not be reloaded when it changes.\n", filename.c_str());
+					}
+					dir_to_wd[dir_and_name.first] = wd;
+				}
+				int wd = dir_to_wd[dir_and_name.first];
+				if (wd != -1) {
+					watched_files[wd][dir_and_name.second].insert(key);
+				}
+			}
 		}
-		if (buf.st_mtim.tv_sec == last_modified.tv_sec &&
-		    buf.st_mtim.tv_nsec == last_modified.tv_nsec) {
-			// Not changed.
-			continue;
+
+		// Wake up every now and then to check for new images and for quitting.
+		pollfd pfd;
+		pfd.fd = inotify_fd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		int ret = poll(&pfd, 1, /*timeout=*/100);
+		if (ret == -1 && errno != EINTR) {
+			perror("poll");
+			exit(1);
 		}
-		shared_ptr<const Image> image = load_image_raw(filename);
-		if (image == nullptr) {
-			fprintf(stderr, "Couldn't load image, leaving the old in place.\n");
+		if (ret <= 0) {
 			continue;
 		}
-		fprintf(stderr, "Loaded new version of %s from disk.\n", filename.c_str());
-		unique_lock<mutex> lock(all_images_lock);
-		all_images[filename] = image;
-		last_modified = image->last_modified;
+
+		// Collect all the changes first, so that a file that is written
+		// in several steps is only loaded once.
+		set<ImageKey> changed_images;
+		alignas(inotify_event) char buf[16 * (sizeof(inotify_event) + NAME_MAX + 1)];
+		for ( ;; ) {
+			ssize_t len = read(inotify_fd, buf, sizeof(buf));
+			if (len == -1 && errno == EINTR) {
+				continue;
+			}
+			if (len <= 0) {
+				break;
+			}
+			for (char *ptr = buf; ptr < buf + len; ) {
+				const inotify_event *event = (const inotify_event *)ptr;
+				ptr += sizeof(inotify_event) + event->len;
+				if (event->len == 0 || !watched_files.count(event->wd)) {
+					continue;
+				}
+				const map<string, set<ImageKey>> &files = watched_files[event->wd];
+				auto it = files.find(event->name);
+				if (it != files.end()) {
+					changed_images.insert(it->second.begin(), it->second.end());
+				}
+			}
+		}
+
+		for (const ImageKey &key : changed_images) {
+			const string &filename = get<0>(key);
+
+			// Closing a file after writing does not necessarily mean it changed.
+			struct stat buf;
+			if (stat(filename.c_str(), &buf) == 0) {
+				unique_lock<mutex> lock(all_images_lock);
+				const timespec &last_modified = all_images[key]->last_modified;
+				if (buf.st_mtim.tv_sec == last_modified.tv_sec &&
+				    buf.st_mtim.tv_nsec == last_modified.tv_nsec) {
+					continue;
+				}
+			}
+
+			shared_ptr<const Image> image = load_image_raw(key);
+			if (image == nullptr) {
+				fprintf(stderr, "Couldn't load image, leaving the old in place.\n");
+				continue;
+			}
+			fprintf(stderr, "Loaded new version of %s from disk.\n", filename.c_str());
+			unique_lock<mutex> lock(all_images_lock);
+			set_image(key, image);
+		}
 	}
+	close(inotify_fd);
 }
 
 mutex ImageInput::all_images_lock;
-map<string, shared_ptr<const ImageInput::Image>> ImageInput::all_images;
-map<string, thread> ImageInput::update_threads;
+map<ImageInput::ImageKey, shared_ptr<const ImageInput::Image>> ImageInput::all_images;
+map<ImageInput::ImageKey, atomic<int64_t>> ImageInput::metric_image_bytes;
+thread ImageInput::update_thread;
+atomic<bool> ImageInput::update_thread_should_quit{false};
@@ -1,41 +1,76 @@
 #ifndef _IMAGE_INPUT_H
 #define _IMAGE_INPUT_H 1
 
+#include <epoxy/gl.h>
+#include <atomic>
 #include <map>
 #include <memory>
 #include <mutex>
 #include <string>
 #include <thread>
+#include <tuple>
 
 #include <time.h>
 
 #include <movit/flat_input.h>
 
+class QSurface;
+
 // An output that takes its input from a static image, loaded with ffmpeg.
-// comes from a single 2D array with chunky pixels. The image is refreshed
-// from disk about every second.
+// comes from a single 2D array with chunky pixels. The image is reloaded
+// from disk whenever it changes.
+//
+// All ImageInputs for the same file share the same texture; a new version
+// of the file gets a new texture, which each ImageInput picks up the next
+// time it is rendered. The old one goes away when nobody uses it anymore.
+//
+// Images are scaled down on load to fit within the given size (by default,
+// the output resolution), keeping the aspect ratio; there is no point in
+// keeping more pixels around than we can ever show.
 class ImageInput : public movit::FlatInput {
 public:
+	// Note: You need to have an OpenGL context when calling the constructors.
 	ImageInput(const std::string &filename);
+	ImageInput(const std::string &filename, unsigned max_width, unsigned max_height);
 
 	std::string effect_type_id() const override { return "ImageInput"; }
 	void set_gl_state(GLuint glsl_program_num, const std::string& prefix, unsigned *sampler_num) override;
 
+	// Watches the files of all ImageInputs for changes, and loads and uploads
+	// new versions in the background, using an OpenGL context on <surface>.
+	static void start_update_thread(QSurface *surface);
+	static void end_update_thread();
+
 private:
+	// Filename, max width and max height.
+	typedef std::tuple<std::string, unsigned, unsigned> ImageKey;
+
 	struct Image {
-		std::unique_ptr<uint8_t[]> pixels;
+		Image(GLuint tex, unsigned width, unsigned height, size_t bytes, const timespec &last_modified)
+			: tex(tex), width(width), height(height), bytes(bytes), last_modified(last_modified) {}
+
+		// Needs an OpenGL context, but anyone who can let go of an Image
+		// has one (they were either rendering or uploading).
+		~Image() { glDeleteTextures(1, &tex); }
+
+		GLuint tex;
+		unsigned width, height;
+		size_t bytes;  // Of GPU memory, including mipmaps.
 		timespec last_modified;
 	};
 
-	std::string filename;
+	const ImageKey key;
 	std::shared_ptr<const Image> current_image;
 
-	static std::shared_ptr<const Image> load_image(const std::string &filename);
-	static std::shared_ptr<const Image> load_image_raw(const std::string &filename);
-	static void update_thread_func(const std::string &filename, const timespec &first_modified);
+	static std::shared_ptr<const Image> load_image(const ImageKey &key);
+	static std::shared_ptr<const Image> load_image_raw(const ImageKey &key);
+	static void set_image(const ImageKey &key, std::shared_ptr<const Image> image);  // Needs <all_images_lock>.
+	static void update_thread_func(QSurface *surface);
 	static std::mutex all_images_lock;
-	static std::map<std::string, std::shared_ptr<const Image>> all_images;
-	static std::map<std::string, std::thread> update_threads;
+	static std::map<ImageKey, std::shared_ptr<const Image>> all_images;
+	static std::map<ImageKey, std::atomic<int64_t>> metric_image_bytes;  // Under <all_images_lock>, except for reading.
+	static std::thread update_thread;
+	static std::atomic<bool> update_thread_should_quit;
 };
 
 #endif // !defined(_IMAGE_INPUT_H)
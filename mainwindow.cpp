@@ -15,9 +15,12 @@
 #include <QShortcut>
 #include <QSize>
 #include <QString>
+#include <QTimer>
 
 #include "aboutdialog.h"
+#include "flags.h"
 #include "glwidget.h"
+#include "gpu_timing.h"
 #include "lrameter.h"
 #include "mixer.h"
 #include "post_to_main_thread.h"
@@ -70,6 +73,16 @@ MainWindow::MainWindow()
 	qRegisterMetaType<vector<string>>("std::vector<std::string>");
 	connect(ui->me_preview, &GLWidget::transition_names_updated, this, &MainWindow::set_transition_names);
 	qRegisterMetaType<Mixer::Output>("Mixer::Output");
+
+	if (global_flags.gpu_timing_overlay) {
+		// Show the GPU timings (median/99th percentile) under the live display.
+		ui->label_live->setWordWrap(true);
+		QTimer *timer = new QTimer(this);
+		connect(timer, &QTimer::timeout, [this]{
+			ui->label_live->setText(QString::fromStdString("Live (GPU: " + gpu_timing_summary() + ")"));
+		});
+		timer->start(500);
+	}
 }
 
 void MainWindow::resizeEvent(QResizeEvent* event)
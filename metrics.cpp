@@ -0,0 +1,106 @@
+#include "metrics.h"
+
+#include <stdio.h>
+
+using namespace std;
+
+Metrics global_metrics;
+
+namespace {
+
+// Label values can be e.g. filenames from the theme, so they need to be
+// escaped as the Prometheus text format says.
+string escape_label_value(const string &value)
+{
+	string ret;
+	for (char ch : value) {
+		if (ch == '\\') {
+			ret += "\\\\";
+		} else if (ch == '"') {
+			ret += "\\\"";
+		} else if (ch == '\n') {
+			ret += "\\n";
+		} else {
+			ret += ch;
+		}
+	}
+	return ret;
+}
+
+string serialize_labels(const Metrics::Labels &labels)
+{
+	if (labels.empty()) {
+		return "";
+	}
+
+	string ret = "{";
+	for (const pair<string, string> &label : labels) {
+		if (ret.size() > 1) {
+			ret += ",";
+		}
+		ret += label.first + "=\"" + escape_label_value(label.second) + "\"";
+	}
+	return ret + "}";
+}
+
+}  // namespace
+
+void Metrics::add(const string &name, const Labels &labels, atomic<int64_t> *location, Metrics::Type type)
+{
+	Metric metric;
+	metric.data_type = DATA_TYPE_INT64;
+	metric.type = type;
+	metric.location_int64 = location;
+
+	lock_guard<mutex> lock(mu);
+	metrics[make_pair(name, labels)] = metric;
+}
+
+void Metrics::add(const string &name, const Labels &labels, atomic<double> *location, Metrics::Type type)
+{
+	Metric metric;
+	metric.data_type = DATA_TYPE_DOUBLE;
+	metric.type = type;
+	metric.location_double = location;
+
+	lock_guard<mutex> lock(mu);
+	metrics[make_pair(name, labels)] = metric;
+}
+
+void Metrics::remove(const string &name, const Labels &labels)
+{
+	lock_guard<mutex> lock(mu);
+	metrics.erase(make_pair(name, labels));
+}
+
+string Metrics::serialize() const
+{
+	string ret;
+	string last_name;
+
+	lock_guard<mutex> lock(mu);
+	for (const auto &key_and_metric : metrics) {
+		const string &name = key_and_metric.first.first;
+		const Labels &labels = key_and_metric.first.second;
+		const Metric &metric = key_and_metric.second;
+
+		if (name != last_name) {
+			if (metric.type == TYPE_COUNTER) {
+				ret += "# TYPE nageru_" + name + " counter\n";
+			} else {
+				ret += "# TYPE nageru_" + name + " gauge\n";
+			}
+			last_name = name;
+		}
+
+		char buf[64];
+		if (metric.data_type == DATA_TYPE_INT64) {
+			snprintf(buf, sizeof(buf), "%ld", metric.location_int64->load());
+		} else {
+			snprintf(buf, sizeof(buf), "%.9g", metric.location_double->load());
+		}
+		ret += "nageru_" + name + serialize_labels(labels) + " " + buf + "\n";
+	}
+
+	return ret;
+}
@@ -0,0 +1,66 @@
+#ifndef _METRICS_H
+#define _METRICS_H 1
+
+// A simple global class to keep track of metrics export in Prometheus format.
+// It would be better to use a more full-featured Prometheus client library for this,
+// but it would introduce a dependency that is not commonly packaged in distributions,
+// which makes it quite unwieldy. Thus, we'll package our own for the time being.
+//
+// Metrics are registered by pointing to an atomic that the owner updates
+// as it sees fit; serialize() just reads them. Whoever registers a metric
+// must keep the atomic alive until it is removed again.
+
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+class Metrics {
+public:
+	enum Type {
+		TYPE_COUNTER,
+		TYPE_GAUGE,
+	};
+	typedef std::vector<std::pair<std::string, std::string>> Labels;
+
+	void add(const std::string &name, std::atomic<int64_t> *location, Type type = TYPE_COUNTER)
+	{
+		add(name, {}, location, type);
+	}
+
+	void add(const std::string &name, std::atomic<double> *location, Type type = TYPE_GAUGE)
+	{
+		add(name, {}, location, type);
+	}
+
+	void add(const std::string &name, const Labels &labels, std::atomic<int64_t> *location, Type type = TYPE_COUNTER);
+	void add(const std::string &name, const Labels &labels, std::atomic<double> *location, Type type = TYPE_GAUGE);
+
+	void remove(const std::string &name, const Labels &labels = {});
+
+	// In Prometheus' text exposition format.
+	std::string serialize() const;
+
+private:
+	enum DataType {
+		DATA_TYPE_INT64,
+		DATA_TYPE_DOUBLE,
+	};
+	struct Metric {
+		DataType data_type;
+		Type type;
+		union {
+			std::atomic<int64_t> *location_int64;
+			std::atomic<double> *location_double;
+		};
+	};
+
+	mutable std::mutex mu;
+	std::map<std::pair<std::string, Labels>, Metric> metrics;  // Under <mu>. Sorted, so that all labels for a name come together.
+};
+
+extern Metrics global_metrics;
+
+#endif  // !defined(_METRICS_H)
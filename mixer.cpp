@@ -34,9 +34,14 @@
 #include "defs.h"
 #include "flags.h"
 #include "h264encode.h"
+#include "image_input.h"
+#include "metrics.h"
 #include "pbo_frame_allocator.h"
+#include "program_cache.h"
 #include "ref_counted_gl_sync.h"
+#include "shm_capture.h"
 #include "timebase.h"
+#include "video_input.h"
 
 class QOpenGLContext;
 
@@ -143,11 +148,18 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	  num_cards(num_cards),
 	  mixer_surface(create_surface(format)),
 	  h264_encoder_surface(create_surface(format)),
+	  image_update_surface(create_surface(format)),
+	  chain_finalize_surface(create_surface(format)),
+	  video_shutdown_surface(create_surface(format)),
 	  correlation(OUTPUT_FREQUENCY),
 	  level_compressor(OUTPUT_FREQUENCY),
 	  limiter(OUTPUT_FREQUENCY),
 	  compressor(OUTPUT_FREQUENCY)
 {
+	// Before Movit (or the theme) gets to compile anything.
+	if (!global_flags.program_cache_dir.empty()) {
+		init_program_cache(global_flags.program_cache_dir);
+	}
 	CHECK(init_movit(MOVIT_SHADER_DIR, MOVIT_DEBUG_OFF));
 	check_error();
 
@@ -156,7 +168,8 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	movit_texel_subpixel_precision /= 2.0;
 
 	resource_pool.reset(new ResourcePool);
-	theme.reset(new Theme(global_flags.theme_filename.c_str(), resource_pool.get(), num_cards));
+	ImageInput::start_update_thread(image_update_surface);
+	theme.reset(new Theme(global_flags.theme_filename.c_str(), resource_pool.get(), num_cards, chain_finalize_surface));
 	for (unsigned i = 0; i < NUM_OUTPUTS; ++i) {
 		output_channel[i].parent = this;
 	}
@@ -174,19 +187,41 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	display_chain->set_dither_bits(0);  // Don't bother.
 	display_chain->finalize();
 
-	h264_encoder.reset(new H264Encoder(h264_encoder_surface, global_flags.va_display, WIDTH, HEIGHT, &httpd));
+	// Must be before H264Encoder is created, as it sets the headers of the outputs.
+	for (const X264Rendition &rendition : global_flags.x264_renditions) {
+		httpd.add_output(rendition.url);
+	}
+	for (const HTTPOutput &output : global_flags.http_outputs) {
+		httpd.add_output(output.url);
+	}
+
+	h264_encoder.reset(new H264Encoder(h264_encoder_surface, global_flags.va_display, WIDTH, HEIGHT, &httpd, &h264_persistent_outputs));
 	h264_encoder->open_output_file(generate_local_dump_filename(/*frame=*/0).c_str());
 
+	if (global_flags.x264_video_to_http) {
+		httpd.add_endpoint("/control/x264", bind(&Mixer::x264_control_endpoint, this, _1), HTTPD::ENDPOINT_CONTROL);
+	}
+	httpd.add_endpoint("/metrics", [](const map<string, string> &) {
+		return make_pair(global_metrics.serialize(), string("text/plain; version=0.0.4"));
+	});
+	if (global_flags.gpu_timing) {
+		httpd.add_endpoint("/gpu_timing", [](const map<string, string> &) {
+			return make_pair(gpu_timing_report(), string("text/plain"));
+		});
+	}
+
 	// Start listening for clients only once H264Encoder has written its header, if any.
 	httpd.start(9095);
 
 	// First try initializing the PCI devices, then USB, until we have the desired number of cards.
+	// Any --shm-input cards come last.
 	unsigned num_pci_devices = 0, num_usb_devices = 0;
 	unsigned card_index = 0;
+	const unsigned num_hardware_cards = num_cards - global_flags.shm_inputs.size();
 
 	IDeckLinkIterator *decklink_iterator = CreateDeckLinkIteratorInstance();
 	if (decklink_iterator != nullptr) {
-		for ( ; card_index < num_cards; ++card_index) {
+		for ( ; card_index < num_hardware_cards; ++card_index) {
 			IDeckLink *decklink;
 			if (decklink_iterator->Next(&decklink) != S_OK) {
 				break;
@@ -200,10 +235,14 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	} else {
 		fprintf(stderr, "DeckLink drivers not found. Probing for USB cards only.\n");
 	}
-	for ( ; card_index < num_cards; ++card_index) {
+	for ( ; card_index < num_hardware_cards; ++card_index) {
 		configure_card(card_index, format, new BMUSBCapture(card_index - num_pci_devices));
 		++num_usb_devices;
 	}
+	for (const string &name : global_flags.shm_inputs) {
+		configure_card(card_index, format, new ShmCapture(name, card_index));
+		++card_index;
+	}
 
 	if (num_usb_devices > 0) {
 		BMUSBCapture::start_bm_thread();
@@ -257,6 +296,40 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 	cbcr_position_attribute_index = glGetAttribLocation(cbcr_program_num, "position");
 	cbcr_texcoord_attribute_index = glGetAttribLocation(cbcr_program_num, "texcoord");
 
+	// Downscaling shader, for --x264-rendition. Works on both Y' and CbCr.
+	// Four bilinear taps spread over the destination pixel give us something
+	// close to a box filter for the downscaling factors we care about
+	// (up to about 4x), which is good enough for a lower-quality stream.
+	string downscale_vert_shader =
+		"#version 130 \n"
+		" \n"
+		"in vec2 position; \n"
+		"in vec2 texcoord; \n"
+		"out vec2 tc; \n"
+		"uniform vec2 foo_offset; \n"
+		" \n"
+		"void main() \n"
+		"{ \n"
+		"    gl_Position = vec4(2.0 * position.x - 1.0, 2.0 * position.y - 1.0, -1.0, 1.0); \n"
+		"    tc = texcoord + foo_offset; \n"
+		"} \n";
+	string downscale_frag_shader =
+		"#version 130 \n"
+		"in vec2 tc; \n"
+		"uniform sampler2D src_tex; \n"
+		"uniform vec2 foo_tap_offset; \n"
+		"out vec4 FragColor; \n"
+		"void main() { \n"
+		"    vec2 o = foo_tap_offset; \n"
+		"    FragColor = 0.25 * (texture(src_tex, tc + vec2(-o.x, -o.y)) + \n"
+		"                        texture(src_tex, tc + vec2( o.x, -o.y)) + \n"
+		"                        texture(src_tex, tc + vec2(-o.x,  o.y)) + \n"
+		"                        texture(src_tex, tc + vec2( o.x,  o.y))); \n"
+		"} \n";
+	downscale_program_num = resource_pool->compile_glsl_program(downscale_vert_shader, downscale_frag_shader, frag_shader_outputs);
+	downscale_position_attribute_index = glGetAttribLocation(downscale_program_num, "position");
+	downscale_texcoord_attribute_index = glGetAttribLocation(downscale_program_num, "texcoord");
+
 	r128.init(2, OUTPUT_FREQUENCY);
 	r128.integr_start();
 
@@ -280,6 +353,7 @@ Mixer::Mixer(const QSurfaceFormat &format, unsigned num_cards)
 Mixer::~Mixer()
 {
 	resource_pool->release_glsl_program(cbcr_program_num);
+	resource_pool->release_glsl_program(downscale_program_num);
 	glDeleteBuffers(1, &cbcr_vbo);
 	BMUSBCapture::stop_bm_thread();
 
@@ -616,6 +690,9 @@ void Mixer::thread_func()
 		exit(1);
 	}
 
+	quality_governor.reset(new QualityGovernor);
+	gpu_timers.reset(new GPUTimers);
+
 	struct timespec start, now;
 	clock_gettime(CLOCK_MONOTONIC, &start);
 
@@ -676,7 +753,7 @@ void Mixer::thread_func()
 			}
 		}
 
-		render_one_frame();
+		render_one_frame(new_frames[master_card_index].length);
 		++frame;
 		pts_int += new_frames[master_card_index].length;
 
@@ -695,8 +772,18 @@ void Mixer::thread_func()
 			printf("Starting new recording: %s\n", filename.c_str());
 			h264_encoder->close_output_file();
 			h264_encoder->shutdown();
-			h264_encoder.reset(new H264Encoder(h264_encoder_surface, global_flags.va_display, WIDTH, HEIGHT, &httpd));
+			h264_encoder.reset(new H264Encoder(h264_encoder_surface, global_flags.va_display, WIDTH, HEIGHT, &httpd, &h264_persistent_outputs));
 			h264_encoder->open_output_file(filename.c_str());
+
+			// The new encoder starts out with the command-line settings,
+			// so give it any runtime changes again.
+			if (x264_bitrate_kbit != -1 || x264_vbv_max_bitrate_kbit != -1 || x264_vbv_buffer_size_kbit != -1) {
+				x264_rate_control_changed = true;
+			}
+		}
+
+		if (x264_rate_control_changed.exchange(false)) {  // Test and clear.
+			h264_encoder->change_x264_rate_control(x264_bitrate_kbit, x264_vbv_max_bitrate_kbit, x264_vbv_buffer_size_kbit);
 		}
 
 #if 0
@@ -712,6 +799,8 @@ void Mixer::thread_func()
 		check_error();
 	}
 
+	quality_governor.reset();
+	gpu_timers.reset();
 	resource_pool->clean_context();
 }
 
@@ -774,10 +863,11 @@ void Mixer::schedule_audio_resampling_tasks(unsigned dropped_frames, int num_sam
 	}
 }
 
-void Mixer::render_one_frame()
+void Mixer::render_one_frame(int64_t duration)
 {
 	// Get the main chain from the theme, and set its state immediately.
-	Theme::Chain theme_main_chain = theme->get_chain(0, pts(), WIDTH, HEIGHT, input_state);
+	QualityGovernor::Quality quality = quality_governor->get_quality();
+	Theme::Chain theme_main_chain = theme->get_chain(0, pts(), WIDTH, HEIGHT, input_state, quality);
 	EffectChain *chain = theme_main_chain.chain;
 	theme_main_chain.setup_chain();
 	//theme_main_chain.chain->enable_phase_timing(true);
@@ -786,17 +876,37 @@ void Mixer::render_one_frame()
 	bool got_frame = h264_encoder->begin_frame(&y_tex, &cbcr_tex);
 	assert(got_frame);
 
-	// Render main chain.
+	// Render main chain. Everything up to the end of the renditions counts
+	// towards the GPU time budget.
+	quality_governor->begin_frame();
 	GLuint cbcr_full_tex = resource_pool->create_2d_texture(GL_RG8, WIDTH, HEIGHT);
 	GLuint rgba_tex = resource_pool->create_2d_texture(GL_RGB565, WIDTH, HEIGHT);  // Saves texture bandwidth, although dithering gets messed up.
 	GLuint fbo = resource_pool->create_fbo(y_tex, cbcr_full_tex, rgba_tex);
 	check_error();
+	gpu_timers->begin("live: " + theme_main_chain.name);
 	chain->render_to_fbo(fbo, WIDTH, HEIGHT);
+	gpu_timers->end();
 	resource_pool->release_fbo(fbo);
 
+	gpu_timers->begin("subsample_chroma");
 	subsample_chroma(cbcr_full_tex, cbcr_tex);
+	gpu_timers->end();
 	resource_pool->release_2d_texture(cbcr_full_tex);
 
+	// Make the downscaled versions for the renditions, if any.
+	vector<H264Encoder::RenditionTextures> rendition_textures = h264_encoder->get_rendition_textures();
+	if (!rendition_textures.empty()) {
+		gpu_timers->begin("renditions");
+	}
+	for (const H264Encoder::RenditionTextures &rendition : rendition_textures) {
+		downscale_texture(y_tex, WIDTH, rendition.y_tex, rendition.width, rendition.height, /*chroma=*/false);
+		downscale_texture(cbcr_tex, WIDTH / 2, rendition.cbcr_tex, rendition.width / 2, rendition.height / 2, /*chroma=*/true);
+	}
+	if (!rendition_textures.empty()) {
+		gpu_timers->end();
+	}
+	quality_governor->end_frame(duration);
+
 	// Set the right state for rgba_tex.
 	glBindFramebuffer(GL_FRAMEBUFFER, 0);
 	glBindTexture(GL_TEXTURE_2D, rgba_tex);
@@ -805,7 +915,9 @@ void Mixer::render_one_frame()
 	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
 	const int64_t av_delay = TIMEBASE / 10;  // Corresponds to the fixed delay in resampling_queue.h. TODO: Make less hard-coded.
+	gpu_timers->begin("readback");  // Only actually reading back if not using zerocopy.
 	RefCountedGLsync fence = h264_encoder->end_frame(pts_int + av_delay, theme_main_chain.input_frames);
+	gpu_timers->end();
 
 	// The live frame just shows the RGBA texture we just rendered.
 	// It owns rgba_tex now.
@@ -817,18 +929,60 @@ void Mixer::render_one_frame()
 	live_frame.ready_fence = fence;
 	live_frame.input_frames = {};
 	live_frame.temp_textures = { rgba_tex };
+	live_frame.chain_name = "live display";
 	output_channel[OUTPUT_LIVE].output_frame(live_frame);
 
-	// Set up preview and any additional channels.
+	// Set up preview and any additional channels. We render them here,
+	// at the size they are shown on screen, so that the UI thread only needs
+	// to copy them; only if we do not know the size yet (e.g. before
+	// the UI is laid out) is the chain given to the UI to render at full size.
+	vector<pair<int, DisplayFrame>> rendered_frames;
 	for (int i = 1; i < theme->get_num_channels() + 2; ++i) {
 		DisplayFrame display_frame;
-		Theme::Chain chain = theme->get_chain(i, pts(), WIDTH, HEIGHT, input_state);  // FIXME: dimensions
-		display_frame.chain = chain.chain;
-		display_frame.setup_chain = chain.setup_chain;
-		display_frame.ready_fence = fence;
+		unsigned width, height;
+		if (!output_channel[i].get_display_size(&width, &height)) {
+			Theme::Chain chain = theme->get_chain(i, pts(), WIDTH, HEIGHT, input_state, quality);
+			display_frame.chain = chain.chain;
+			display_frame.setup_chain = chain.setup_chain;
+			display_frame.ready_fence = fence;
+			display_frame.input_frames = chain.input_frames;
+			display_frame.temp_textures = {};
+			display_frame.chain_name = chain.name;
+			output_channel[i].output_frame(display_frame);
+			continue;
+		}
+
+		Theme::Chain chain = theme->get_chain(i, pts(), width, height, input_state, quality);
+		chain.setup_chain();
+		GLuint preview_tex = resource_pool->create_2d_texture(GL_RGBA8, width, height);
+		GLuint fbo = resource_pool->create_fbo(preview_tex);
+		check_error();
+		gpu_timers->begin("preview: " + chain.name);
+		chain.chain->render_to_fbo(fbo, width, height);
+		gpu_timers->end();
+		resource_pool->release_fbo(fbo);
+
+		display_frame.chain = nullptr;
+		display_frame.texture = preview_tex;
+		display_frame.texture_width = width;
+		display_frame.texture_height = height;
 		display_frame.input_frames = chain.input_frames;
-		display_frame.temp_textures = {};
-		output_channel[i].output_frame(display_frame);
+		display_frame.temp_textures = { preview_tex };
+		display_frame.chain_name = chain.name;
+		rendered_frames.emplace_back(i, display_frame);
+	}
+	if (rendered_frames.empty()) {
+		return;
+	}
+
+	// One fence for all the previews we rendered.
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	RefCountedGLsync preview_fence(GL_SYNC_GPU_COMMANDS_COMPLETE, /*flags=*/0);
+	check_error();
+	glFlush();  // Make the UI thread see the fence as soon as possible.
+	for (pair<int, DisplayFrame> &output_and_frame : rendered_frames) {
+		output_and_frame.second.ready_fence = preview_fence;
+		output_channel[output_and_frame.first].output_frame(output_and_frame.second);
 	}
 }
 
@@ -1088,6 +1242,77 @@ void Mixer::subsample_chroma(GLuint src_tex, GLuint dst_tex)
 	glDeleteVertexArrays(1, &vao);
 }
 
+void Mixer::downscale_texture(GLuint src_tex, int src_width, GLuint dst_tex, int dst_width, int dst_height, bool chroma)
+{
+	GLuint vao;
+	glGenVertexArrays(1, &vao);
+	check_error();
+
+	glBindVertexArray(vao);
+	check_error();
+
+	GLuint fbo = resource_pool->create_fbo(dst_tex);
+	glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+	glViewport(0, 0, dst_width, dst_height);
+	check_error();
+
+	glUseProgram(downscale_program_num);
+	check_error();
+
+	glActiveTexture(GL_TEXTURE0);
+	check_error();
+	glBindTexture(GL_TEXTURE_2D, src_tex);
+	check_error();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+	check_error();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	check_error();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	check_error();
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	check_error();
+
+	// Our chroma is sited left (see subsample_chroma()), so chroma sample j
+	// in the destination should come from chroma sample j * scale in the
+	// source, not from the center of the corresponding source area.
+	// Luma is center-sited, so it needs no adjustment.
+	float offset[] = { 0.0f, 0.0f };
+	if (chroma) {
+		float scale = float(src_width) / dst_width;
+		offset[0] = 0.5f * (1.0f - scale) / src_width;
+	}
+	set_uniform_vec2(downscale_program_num, "foo", "offset", offset);
+
+	float tap_offset[] = { 0.25f / dst_width, 0.25f / dst_height };
+	set_uniform_vec2(downscale_program_num, "foo", "tap_offset", tap_offset);
+
+	glBindBuffer(GL_ARRAY_BUFFER, cbcr_vbo);
+	check_error();
+
+	for (GLint attr_index : { downscale_position_attribute_index, downscale_texcoord_attribute_index }) {
+		glEnableVertexAttribArray(attr_index);
+		check_error();
+		glVertexAttribPointer(attr_index, 2, GL_FLOAT, GL_FALSE, 0, BUFFER_OFFSET(0));
+		check_error();
+	}
+
+	glDrawArrays(GL_TRIANGLES, 0, 3);
+	check_error();
+
+	for (GLint attr_index : { downscale_position_attribute_index, downscale_texcoord_attribute_index }) {
+		glDisableVertexAttribArray(attr_index);
+		check_error();
+	}
+
+	glUseProgram(0);
+	check_error();
+	glBindFramebuffer(GL_FRAMEBUFFER, 0);
+	check_error();
+
+	resource_pool->release_fbo(fbo);
+	glDeleteVertexArrays(1, &vao);
+}
+
 void Mixer::release_display_frame(DisplayFrame *frame)
 {
 	for (GLuint texnum : frame->temp_textures) {
@@ -1098,6 +1323,55 @@ void Mixer::release_display_frame(DisplayFrame *frame)
 	frame->input_frames.clear();
 }
 
+void Mixer::change_x264_rate_control(int bitrate_kbit, int vbv_max_bitrate_kbit, int vbv_buffer_size_kbit)
+{
+	lock_guard<mutex> lock(x264_rate_control_mutex);
+	bool vbv_was_on = (x264_vbv_max_bitrate_kbit != -1 ? x264_vbv_max_bitrate_kbit.load() : global_flags.x264_vbv_max_bitrate) > 0;
+	if (bitrate_kbit > 0) x264_bitrate_kbit = bitrate_kbit;
+	if (vbv_max_bitrate_kbit >= 0) x264_vbv_max_bitrate_kbit = vbv_max_bitrate_kbit;
+	if (vbv_buffer_size_kbit >= 0) x264_vbv_buffer_size_kbit = vbv_buffer_size_kbit;
+	x264_rate_control_changed = true;
+
+	bool vbv_is_on = (x264_vbv_max_bitrate_kbit != -1 ? x264_vbv_max_bitrate_kbit.load() : global_flags.x264_vbv_max_bitrate) > 0;
+	if (vbv_is_on != vbv_was_on) {
+		// The new encoder gets the change before its first frame;
+		// see X264Encoder::change_rate_control().
+		printf("Turning x264 VBV %s; making a cut.\n", vbv_is_on ? "on" : "off");
+		schedule_cut();
+	}
+}
+
+// Handles POST /control/x264?bitrate=...&vbv_max_bitrate=...&vbv_bufsize=...
+// (all optional, in kilobit/sec or kilobits; as on the command line, zero
+// vbv_max_bitrate turns VBV off, and zero vbv_bufsize means a one-frame VBV).
+// Only available from localhost; see HTTPD::ENDPOINT_CONTROL.
+// Returns the current settings.
+pair<string, string> Mixer::x264_control_endpoint(const map<string, string> &args)
+{
+	int values[3] = { -1, -1, -1 };
+	const char *names[3] = { "bitrate", "vbv_max_bitrate", "vbv_bufsize" };
+	for (unsigned i = 0; i < 3; ++i) {
+		auto it = args.find(names[i]);
+		if (it != args.end()) {
+			int value = atoi(it->second.c_str());
+			if (value < 0 || (i == 0 && value == 0)) {
+				return make_pair(string("ERROR: Invalid value for ") + names[i] + "\n", "text/plain");
+			}
+			values[i] = value;
+		}
+	}
+	if (values[0] != -1 || values[1] != -1 || values[2] != -1) {
+		change_x264_rate_control(values[0], values[1], values[2]);
+	}
+
+	char buf[256];
+	snprintf(buf, sizeof(buf), "bitrate=%d\nvbv_max_bitrate=%d\nvbv_bufsize=%d\n",
+		x264_bitrate_kbit != -1 ? x264_bitrate_kbit.load() : global_flags.x264_bitrate,
+		x264_vbv_max_bitrate_kbit != -1 ? x264_vbv_max_bitrate_kbit.load() : global_flags.x264_vbv_max_bitrate,
+		x264_vbv_buffer_size_kbit != -1 ? x264_vbv_buffer_size_kbit.load() : global_flags.x264_vbv_buffer_size);
+	return make_pair(string(buf), "text/plain");
+}
+
 void Mixer::start()
 {
 	mixer_thread = thread(&Mixer::thread_func, this);
@@ -1109,6 +1383,8 @@ void Mixer::quit()
 	should_quit = true;
 	mixer_thread.join();
 	audio_thread.join();
+	ImageInput::end_update_thread();
+	VideoInput::shutdown_players(video_shutdown_surface);
 }
 
 void Mixer::transition_clicked(int transition_num)
@@ -1206,4 +1482,22 @@ void Mixer::OutputChannel::set_frame_ready_callback(Mixer::new_frame_ready_callb
 	has_new_frame_ready_callback = true;
 }
 
+void Mixer::OutputChannel::set_display_size(unsigned width, unsigned height)
+{
+	unique_lock<mutex> lock(frame_mutex);
+	display_width = width;
+	display_height = height;
+}
+
+bool Mixer::OutputChannel::get_display_size(unsigned *width, unsigned *height)
+{
+	unique_lock<mutex> lock(frame_mutex);
+	if (display_width == 0 || display_height == 0) {
+		return false;
+	}
+	*width = display_width;
+	*height = display_height;
+	return true;
+}
+
 mutex RefCountedGLsync::fence_lock;
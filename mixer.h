@@ -15,6 +15,7 @@
 #include <condition_variable>
 #include <cstddef>
 #include <functional>
+#include <map>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -27,6 +28,7 @@
 #include "h264encode.h"
 #include "httpd.h"
 #include "pbo_frame_allocator.h"
+#include "quality_governor.h"
 #include "ref_counted_frame.h"
 #include "ref_counted_gl_sync.h"
 #include "resampling_queue.h"
@@ -34,6 +36,7 @@
 #include "timebase.h"
 #include "stereocompressor.h"
 #include "filter.h"
+#include "gpu_timing.h"
 #include "input_state.h"
 #include "correlation_measurer.h"
 
@@ -120,8 +123,15 @@ public:
 		// first wait for <ready_fence>, then call <setup_chain>
 		// to wire up all the inputs, and then finally call
 		// chain->render_to_screen() or similar.
+		//
+		// If <chain> is nullptr, the frame has already been rendered
+		// into <texture> (at the size given to set_display_size()),
+		// and just needs to be copied to the screen, after waiting
+		// for <ready_fence>.
 		movit::EffectChain *chain;
 		std::function<void()> setup_chain;
+		GLuint texture = 0;  // Also in <temp_textures>.
+		unsigned texture_width = 0, texture_height = 0;
 
 		// Asserted when all the inputs are ready; you cannot render the chain
 		// before this.
@@ -135,6 +145,9 @@ public:
 		// when this frame disappears, if any.
 		// TODO: Refcount these as well?
 		std::vector<GLuint> temp_textures;
+
+		// What to call the chain in GPU timings (see gpu_timing.h).
+		std::string chain_name;
 	};
 	// Implicitly frees the previous one if there's a new frame available.
 	bool get_display_frame(Output output, DisplayFrame *frame) {
@@ -147,6 +160,15 @@ public:
 		output_channel[output].set_frame_ready_callback(callback);
 	}
 
+	// Tells us how large (in pixels) <output> is on screen, so that we can
+	// render it at that size in the mixer thread, instead of the UI thread
+	// having to render its chain at full size. Not used for OUTPUT_LIVE,
+	// which is always rendered at full size anyway.
+	void set_display_size(Output output, unsigned width, unsigned height)
+	{
+		output_channel[output].set_display_size(width, height);
+	}
+
 	typedef std::function<void(float level_lufs, float peak_db,
 	                           float global_level_lufs, float range_low_lufs, float range_high_lufs,
 	                           float gain_staging_db, float final_makeup_gain_db,
@@ -292,6 +314,15 @@ public:
 		should_cut = true;
 	}
 
+	// Changes the x264 rate control on the fly (if --http-x264-video is in use);
+	// values are in kilobit/sec (or kilobits for the buffer size), and -1
+	// means to leave the value alone. As with the command-line flags, zero
+	// VBV max bitrate turns VBV off, and zero VBV buffer size means a one-frame
+	// VBV. Since x264 can only turn VBV on or off when it starts, doing so
+	// makes a cut. The change is applied by the mixer thread, and survives cuts.
+	// Can be called from any thread.
+	void change_x264_rate_control(int bitrate_kbit, int vbv_max_bitrate_kbit, int vbv_buffer_size_kbit);
+
 	void reset_meters();
 
 	unsigned get_num_cards() const { return num_cards; }
@@ -356,26 +387,33 @@ private:
 	void place_rectangle(movit::Effect *resample_effect, movit::Effect *padding_effect, float x0, float y0, float x1, float y1);
 	void thread_func();
 	void schedule_audio_resampling_tasks(unsigned dropped_frames, int num_samples_per_frame, int length_per_frame);
-	void render_one_frame();
+	void render_one_frame(int64_t duration);
 	void send_audio_level_callback();
 	void audio_thread_func();
 	void process_audio_one_frame(int64_t frame_pts_int, int num_samples);
 	void subsample_chroma(GLuint src_tex, GLuint dst_dst);
+	void downscale_texture(GLuint src_tex, int src_width, GLuint dst_tex, int dst_width, int dst_height, bool chroma);
 	void release_display_frame(DisplayFrame *frame);
+	std::pair<std::string, std::string> x264_control_endpoint(const std::map<std::string, std::string> &args);
 	double pts() { return double(pts_int) / TIMEBASE; }
 
 	HTTPD httpd;
 	unsigned num_cards;
 
-	QSurface *mixer_surface, *h264_encoder_surface;
+	QSurface *mixer_surface, *h264_encoder_surface, *image_update_surface, *chain_finalize_surface, *video_shutdown_surface;
 	std::unique_ptr<movit::ResourcePool> resource_pool;
 	std::unique_ptr<Theme> theme;
+	std::unique_ptr<QualityGovernor> quality_governor;  // Only used from the mixer thread (which owns its queries).
+	std::unique_ptr<GPUTimers> gpu_timers;  // Only used from the mixer thread (which owns its queries).
 	std::atomic<unsigned> audio_source_channel{0};
 	std::atomic<unsigned> master_clock_channel{0};
 	std::unique_ptr<movit::EffectChain> display_chain;
 	GLuint cbcr_program_num;  // Owned by <resource_pool>.
 	GLuint cbcr_vbo;  // Holds position and texcoord data.
 	GLuint cbcr_position_attribute_index, cbcr_texcoord_attribute_index;
+	GLuint downscale_program_num;  // Owned by <resource_pool>. Uses <cbcr_vbo>.
+	GLuint downscale_position_attribute_index, downscale_texcoord_attribute_index;
+	H264Encoder::PersistentOutputs h264_persistent_outputs;  // Must outlive <h264_encoder>.
 	std::unique_ptr<H264Encoder> h264_encoder;
 
 	// Effects part of <display_chain>. Owned by <display_chain>.
@@ -426,6 +464,10 @@ private:
 		void output_frame(DisplayFrame frame);
 		bool get_display_frame(DisplayFrame *frame);
 		void set_frame_ready_callback(new_frame_ready_callback_t callback);
+		void set_display_size(unsigned width, unsigned height);
+
+		// Returns false if set_display_size() has not been called.
+		bool get_display_size(unsigned *width, unsigned *height);
 
 	private:
 		friend class Mixer;
@@ -434,6 +476,7 @@ private:
 		std::mutex frame_mutex;
 		DisplayFrame current_frame, ready_frame;  // protected by <frame_mutex>
 		bool has_current_frame = false, has_ready_frame = false;  // protected by <frame_mutex>
+		unsigned display_width = 0, display_height = 0;  // protected by <frame_mutex>
 		new_frame_ready_callback_t new_frame_ready_callback;
 		bool has_new_frame_ready_callback = false;
 	};
@@ -444,6 +487,11 @@ private:
 	std::atomic<bool> should_quit{false};
 	std::atomic<bool> should_cut{false};
 
+	// See change_x264_rate_control(). -1 = not changed from the command line.
+	std::mutex x264_rate_control_mutex;  // Held while changing the values below.
+	std::atomic<int> x264_bitrate_kbit{-1}, x264_vbv_max_bitrate_kbit{-1}, x264_vbv_buffer_size_kbit{-1};
+	std::atomic<bool> x264_rate_control_changed{false};
+
 	audio_level_callback_t audio_level_callback = nullptr;
 	std::mutex compressor_mutex;
 	Ebu_r128_proc r128;  // Under compressor_mutex.
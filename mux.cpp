@@ -10,7 +10,8 @@
 
 using namespace std;
 
-Mux::Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const AVCodec *codec_audio, int time_base, int bit_rate, KeyFrameSignalReceiver *keyframe_signal_receiver)
+Mux::Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const AVCodec *codec_audio, int time_base, int bit_rate, KeyFrameSignalReceiver *keyframe_signal_receiver,
+         const vector<pair<string, string>> &extra_options)
 	: avctx(avctx), keyframe_signal_receiver(keyframe_signal_receiver)
 {
 	AVCodec *codec_video = avcodec_find_encoder((video_codec == CODEC_H264) ? AV_CODEC_ID_H264 : AV_CODEC_ID_RAWVIDEO);
@@ -64,6 +65,7 @@ Mux::Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const
 
 	AVDictionary *options = NULL;
 	vector<pair<string, string>> opts = MUX_OPTS;
+	opts.insert(opts.end(), extra_options.begin(), extra_options.end());
 	for (pair<string, string> opt : opts) {
 		av_dict_set(&options, opt.first.c_str(), opt.second.c_str(), 0);
 	}
@@ -86,6 +88,10 @@ Mux::~Mux()
 
 void Mux::add_packet(const AVPacket &pkt, int64_t pts, int64_t dts)
 {
+	if (packet_tap) {
+		packet_tap->tap_packet(pkt, pts, dts);
+	}
+
 	AVPacket pkt_copy;
 	if (av_copy_packet(&pkt_copy, &pkt) < 0) {
 		fprintf(stderr, "av_copy_packet() failed\n");
@@ -101,17 +107,18 @@ void Mux::add_packet(const AVPacket &pkt, int64_t pts, int64_t dts)
 		assert(false);
 	}
 
-	if (keyframe_signal_receiver) {
-		if (pkt.flags & AV_PKT_FLAG_KEY) {
-			if (avctx->oformat->flags & AVFMT_ALLOW_FLUSH) {
-				av_write_frame(avctx, nullptr);
-			}
-			keyframe_signal_receiver->signal_keyframe();
-		}
-	}
-
 	{
+		// The audio is added from a different thread than the video, so the
+		// keyframe flagging must not get in between another write and its output.
 		lock_guard<mutex> lock(ctx_mu);
+		if (keyframe_signal_receiver) {
+			if (pkt.flags & AV_PKT_FLAG_KEY) {
+				if (avctx->oformat->flags & AVFMT_ALLOW_FLUSH) {
+					av_write_frame(avctx, nullptr);
+				}
+				keyframe_signal_receiver->signal_keyframe(pts);
+			}
+		}
 		if (av_interleaved_write_frame(avctx, &pkt_copy) < 0) {
 			fprintf(stderr, "av_interleaved_write_frame() failed\n");
 			exit(1);
@@ -10,11 +10,22 @@ extern "C" {
 }
 
 #include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
 
 class KeyFrameSignalReceiver {
 public:
 	// Needs to automatically turn the flag off again after actually receiving data.
-	virtual void signal_keyframe() = 0;
+	// <pts> is that of the keyframe, in TIMEBASE units.
+	virtual void signal_keyframe(int64_t pts) = 0;
+};
+
+// Gets every packet that goes into a Mux, before it is muxed.
+// <pts> and <dts> are in TIMEBASE units.
+class PacketTap {
+public:
+	virtual void tap_packet(const AVPacket &pkt, int64_t pts, int64_t dts) = 0;
 };
 
 class Mux {
@@ -25,15 +36,21 @@ public:
 	};
 
 	// Takes ownership of avctx. <keyframe_signal_receiver> can be nullptr.
-	Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const AVCodec *codec_audio, int time_base, int bit_rate, KeyFrameSignalReceiver *keyframe_signal_receiver);
+	// <extra_options> are given to the mux in addition to MUX_OPTS.
+	Mux(AVFormatContext *avctx, int width, int height, Codec video_codec, const AVCodec *codec_audio, int time_base, int bit_rate, KeyFrameSignalReceiver *keyframe_signal_receiver,
+	    const std::vector<std::pair<std::string, std::string>> &extra_options = {});
 	~Mux();
 	void add_packet(const AVPacket &pkt, int64_t pts, int64_t dts);
 
+	// Does not take ownership. Must be set before any packets are added.
+	void set_packet_tap(PacketTap *tap) { packet_tap = tap; }
+
 private:
 	std::mutex ctx_mu;
 	AVFormatContext *avctx;  // Protected by <ctx_mu>.
 	AVStream *avstream_video, *avstream_audio;
 	KeyFrameSignalReceiver *keyframe_signal_receiver;
+	PacketTap *packet_tap = nullptr;
 };
 
 #endif  // !defined(_MUX_H)
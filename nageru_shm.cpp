@@ -0,0 +1,166 @@
+/*
+ * Reader side of the shared-memory output; see nageru_shm.h.
+ * (The writer is ShmOutput, in shm_output.cpp.)
+ *
+ * Note: This file is meant to compile as both C and C++, for easier inclusion
+ * in other projects.
+ */
+
+#include "nageru_shm.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+struct nageru_shm_reader {
+	const uint8_t *base;
+	size_t size;
+	const struct nageru_shm_header *hdr;
+	const struct nageru_shm_slot *slots;
+	uint64_t next_seq;
+};
+
+static void skip_ahead(struct nageru_shm_reader *reader)
+{
+	uint64_t num_packets = __atomic_load_n(&reader->hdr->num_packets, __ATOMIC_ACQUIRE);
+	uint64_t keyframe_seq = __atomic_load_n(&reader->hdr->last_keyframe_seq, __ATOMIC_ACQUIRE);
+	if (keyframe_seq != NAGERU_SHM_SEQ_INVALID && keyframe_seq > reader->next_seq) {
+		reader->next_seq = keyframe_seq;
+	} else {
+		/* No newer keyframe to go to (or even that one is gone); take whatever comes next. */
+		reader->next_seq = num_packets;
+	}
+}
+
+struct nageru_shm_reader *nageru_shm_open(const char *name)
+{
+	int fd = shm_open(name, O_RDONLY, 0);
+	if (fd == -1) {
+		return NULL;
+	}
+	struct stat buf;
+	if (fstat(fd, &buf) == -1) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	if ((size_t)buf.st_size < sizeof(struct nageru_shm_header)) {
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+	void *base = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		return NULL;
+	}
+
+	const struct nageru_shm_header *hdr = (const struct nageru_shm_header *)base;
+	if (hdr->magic != NAGERU_SHM_MAGIC || hdr->version != NAGERU_SHM_VERSION ||
+	    hdr->slots_offset + (uint64_t)hdr->num_slots * sizeof(struct nageru_shm_slot) > (uint64_t)buf.st_size ||
+	    hdr->data_offset + hdr->data_size > (uint64_t)buf.st_size) {
+		munmap(base, buf.st_size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct nageru_shm_reader *reader = (struct nageru_shm_reader *)malloc(sizeof(struct nageru_shm_reader));
+	if (reader == NULL) {
+		munmap(base, buf.st_size);
+		errno = ENOMEM;
+		return NULL;
+	}
+	reader->base = (const uint8_t *)base;
+	reader->size = buf.st_size;
+	reader->hdr = hdr;
+	reader->slots = (const struct nageru_shm_slot *)(reader->base + hdr->slots_offset);
+	reader->next_seq = 0;
+	skip_ahead(reader);
+	return reader;
+}
+
+void nageru_shm_close(struct nageru_shm_reader *reader)
+{
+	munmap((void *)reader->base, reader->size);
+	free(reader);
+}
+
+const struct nageru_shm_header *nageru_shm_get_header(const struct nageru_shm_reader *reader)
+{
+	return reader->hdr;
+}
+
+int nageru_shm_next(struct nageru_shm_reader *reader, struct nageru_shm_packet *packet)
+{
+	const struct nageru_shm_header *hdr = reader->hdr;
+	uint64_t num_packets = __atomic_load_n(&hdr->num_packets, __ATOMIC_ACQUIRE);
+	if (reader->next_seq >= num_packets) {
+		return 0;
+	}
+	if (num_packets - reader->next_seq > hdr->num_slots) {
+		skip_ahead(reader);
+		return -1;
+	}
+
+	/* The slot is protected by a seqlock; if the writer reused it while we
+	 * read it, we've been overrun. */
+	const struct nageru_shm_slot *slot = &reader->slots[reader->next_seq & (hdr->num_slots - 1)];
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != reader->next_seq) {
+		skip_ahead(reader);
+		return -1;
+	}
+	struct nageru_shm_slot copy = *slot;
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != reader->next_seq ||
+	    copy.offset < __atomic_load_n(&hdr->data_reclaimed, __ATOMIC_RELAXED)) {
+		skip_ahead(reader);
+		return -1;
+	}
+
+	packet->seq = reader->next_seq++;
+	packet->type = copy.type;
+	packet->flags = copy.flags;
+	packet->pts = copy.pts;
+	packet->dts = copy.dts;
+	packet->size = copy.size;
+	packet->data = reader->base + hdr->data_offset + (copy.offset & (hdr->data_size - 1));
+	packet->offset = copy.offset;
+	return 1;
+}
+
+int nageru_shm_packet_valid(const struct nageru_shm_reader *reader, const struct nageru_shm_packet *packet)
+{
+	/* The writer moves data_reclaimed forward before it overwrites anything,
+	 * so if it still has not passed the packet, what we read was intact. */
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return packet->offset >= __atomic_load_n(&reader->hdr->data_reclaimed, __ATOMIC_RELAXED);
+}
+
+int nageru_shm_wait(struct nageru_shm_reader *reader, int timeout_ms)
+{
+	const struct nageru_shm_header *hdr = reader->hdr;
+
+	/* Read the futex before checking for packets, so that we cannot miss
+	 * a wakeup between the check and the wait. */
+	uint32_t futex_val = __atomic_load_n(&hdr->futex, __ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE)) {
+		return 0;
+	}
+	if (reader->next_seq < __atomic_load_n(&hdr->num_packets, __ATOMIC_ACQUIRE)) {
+		return 1;
+	}
+
+	struct timespec timeout;
+	timeout.tv_sec = timeout_ms / 1000;
+	timeout.tv_nsec = (long)(timeout_ms % 1000) * 1000000;
+	syscall(SYS_futex, &hdr->futex, FUTEX_WAIT, futex_val, (timeout_ms < 0) ? NULL : &timeout, NULL, 0);
+
+	return !__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,116 @@
+#ifndef _NAGERU_SHM_H
+#define _NAGERU_SHM_H
+
+/*
+ * Layout of the shared-memory output (--shm-output), and a small library
+ * for reading from it. Meant for consumers running on the same machine
+ * as Nageru (recorders, analysis and so on), which can then get the encoded
+ * packets (and optionally raw NV12 frames) without going through HTTP.
+ *
+ * The segment consists of a header, a ring of packet slots and a ring of
+ * packet data. There is a single writer (Nageru), which never waits for
+ * the readers; a reader that falls behind by more than the size of
+ * the rings will notice that its packets have been overwritten, and skip
+ * ahead. Readers map the segment read-only, so they can come and go at any
+ * time (and crash) without affecting Nageru or each other.
+ *
+ * Note: This file is meant to compile as both C and C++, for easier inclusion
+ * in other projects.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NAGERU_SHM_MAGIC 0x4e475348  /* "NGSH". */
+#define NAGERU_SHM_VERSION 1
+
+/* Packet types. */
+#define NAGERU_SHM_TYPE_H264 1   /* Annex B, with SPS/PPS before every IDR frame. */
+#define NAGERU_SHM_TYPE_AUDIO 2  /* One encoded frame; see audio_codec in the header. */
+#define NAGERU_SHM_TYPE_NV12 3   /* width x height luma, then interleaved CbCr at half resolution. */
+
+/* Packet flags. */
+#define NAGERU_SHM_FLAG_KEYFRAME 0x1
+
+/* Marks a slot as being written to. */
+#define NAGERU_SHM_SEQ_INVALID UINT64_MAX
+
+struct nageru_shm_slot {
+	uint64_t seq;     /* Number of the packet in this slot, or NAGERU_SHM_SEQ_INVALID. */
+	uint64_t offset;  /* Position in the data ring, counted from the start of the stream. */
+	uint32_t size;
+	uint16_t type;    /* NAGERU_SHM_TYPE_*. */
+	uint16_t flags;   /* NAGERU_SHM_FLAG_*. */
+	int64_t pts, dts; /* In units of 1/timebase seconds. */
+};
+
+struct nageru_shm_header {
+	uint32_t magic;    /* NAGERU_SHM_MAGIC. */
+	uint32_t version;  /* NAGERU_SHM_VERSION. */
+
+	/* Fixed while the segment exists. */
+	uint32_t num_slots;       /* Power of two. */
+	uint32_t slots_offset;    /* From the start of the segment. */
+	uint64_t data_size;       /* Power of two. */
+	uint64_t data_offset;     /* From the start of the segment. */
+	uint32_t timebase;
+	uint32_t width, height;   /* Of the video, both H.264 and NV12. */
+	uint32_t audio_sample_rate, audio_channels;
+	char audio_codec[32];     /* FFmpeg codec name, zero-terminated. */
+	int32_t writer_pid;
+
+	/* Updated by the writer as it goes; read them with nageru_shm_*(). */
+	uint64_t num_packets;       /* Packets published so far; also the seq of the next one. */
+	uint64_t last_keyframe_seq; /* Newest keyframe in the stream's video (H.264 unless
+	                             * Nageru streams uncompressed video), or NAGERU_SHM_SEQ_INVALID. */
+	uint64_t data_reclaimed;    /* Data before this offset may have been overwritten. */
+	uint32_t futex;             /* Incremented (and woken) for every packet. */
+	uint32_t closed;            /* Nonzero after the writer has gone away. */
+};
+
+/* What the reader gets for each packet. <data> points directly into the
+ * shared memory; see nageru_shm_packet_valid(). */
+struct nageru_shm_packet {
+	uint64_t seq;
+	uint16_t type, flags;
+	int64_t pts, dts;
+	uint32_t size;
+	const uint8_t *data;
+	uint64_t offset;  /* Private; used by nageru_shm_packet_valid(). */
+};
+
+struct nageru_shm_reader;
+
+/* Maps the segment with the given name (as given to --shm-output), and
+ * positions the reader at the newest video keyframe. Returns NULL and sets
+ * errno on failure. */
+struct nageru_shm_reader *nageru_shm_open(const char *name);
+void nageru_shm_close(struct nageru_shm_reader *reader);
+
+const struct nageru_shm_header *nageru_shm_get_header(const struct nageru_shm_reader *reader);
+
+/* Gets the next packet. Returns 1 if there is one, 0 if there is none yet,
+ * and -1 if the reader fell so far behind that packets were lost; in that
+ * case, the reader has skipped ahead to the newest keyframe, and the next
+ * call will continue from there. */
+int nageru_shm_next(struct nageru_shm_reader *reader, struct nageru_shm_packet *packet);
+
+/* The data of a packet can be overwritten at any time if the reader is
+ * slow. Call this after you are done with packet->data (e.g. after copying
+ * it out or decoding it); if it returns 0, what you read may be garbage. */
+int nageru_shm_packet_valid(const struct nageru_shm_reader *reader, const struct nageru_shm_packet *packet);
+
+/* Waits until there may be new packets, or until <timeout_ms> has passed
+ * (-1 = forever). Returns 0 if the writer has gone away (then you should
+ * close the reader and try to open the segment again later), 1 otherwise. */
+int nageru_shm_wait(struct nageru_shm_reader *reader, int timeout_ms);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* !defined(_NAGERU_SHM_H) */
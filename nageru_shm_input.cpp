@@ -0,0 +1,154 @@
+/*
+ * Writer side of the shared-memory video input; see nageru_shm_input.h.
+ * (The reader is ShmCapture, in shm_capture.cpp.)
+ *
+ * Note: This file is meant to compile as both C and C++, for easier inclusion
+ * in other projects.
+ */
+
+#include "nageru_shm_input.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/* One being written, one being uploaded, and some slack for scheduling jitter. */
+#define NAGERU_SHM_INPUT_NUM_SLOTS 4
+
+struct nageru_shm_input_writer {
+	char *name;
+	uint8_t *base;
+	size_t size;
+	struct nageru_shm_input_header *hdr;
+	struct nageru_shm_input_slot *slots;
+};
+
+static size_t align_to_page(size_t x)
+{
+	size_t page_size = sysconf(_SC_PAGESIZE);
+	return (x + page_size - 1) / page_size * page_size;
+}
+
+struct nageru_shm_input_writer *nageru_shm_input_create(const char *name, unsigned width, unsigned height,
+                                                        unsigned frame_rate_nom, unsigned frame_rate_den)
+{
+	if (width % 2 != 0 || width == 0 || height == 0 || frame_rate_nom == 0 || frame_rate_den == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+
+	size_t slots_offset = align_to_page(sizeof(struct nageru_shm_input_header));
+	size_t frames_offset = align_to_page(slots_offset + NAGERU_SHM_INPUT_NUM_SLOTS * sizeof(struct nageru_shm_input_slot));
+	size_t slot_size = align_to_page((size_t)width * height * 2 + NAGERU_SHM_INPUT_MAX_AUDIO_SAMPLES * 2 * sizeof(int32_t));
+	size_t size = frames_offset + NAGERU_SHM_INPUT_NUM_SLOTS * slot_size;
+
+	shm_unlink(name);
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		return NULL;
+	}
+	if (ftruncate(fd, size) == -1) {
+		int err = errno;
+		close(fd);
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+	void *base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (base == MAP_FAILED) {
+		int err = errno;
+		shm_unlink(name);
+		errno = err;
+		return NULL;
+	}
+
+	struct nageru_shm_input_writer *writer = (struct nageru_shm_input_writer *)malloc(sizeof(struct nageru_shm_input_writer));
+	char *name_copy = strdup(name);
+	if (writer == NULL || name_copy == NULL) {
+		free(writer);
+		free(name_copy);
+		munmap(base, size);
+		shm_unlink(name);
+		errno = ENOMEM;
+		return NULL;
+	}
+	writer->name = name_copy;
+	writer->base = (uint8_t *)base;
+	writer->size = size;
+	writer->hdr = (struct nageru_shm_input_header *)base;
+	writer->slots = (struct nageru_shm_input_slot *)(writer->base + slots_offset);
+
+	/* The segment is zero-filled by ftruncate(). Set the magic last,
+	 * so that Nageru never sees a half-initialized header. */
+	struct nageru_shm_input_header *hdr = writer->hdr;
+	hdr->version = NAGERU_SHM_INPUT_VERSION;
+	hdr->width = width;
+	hdr->height = height;
+	hdr->frame_rate_nom = frame_rate_nom;
+	hdr->frame_rate_den = frame_rate_den;
+	hdr->num_slots = NAGERU_SHM_INPUT_NUM_SLOTS;
+	hdr->slots_offset = slots_offset;
+	hdr->frames_offset = frames_offset;
+	hdr->slot_size = slot_size;
+	hdr->writer_pid = getpid();
+	for (unsigned i = 0; i < NAGERU_SHM_INPUT_NUM_SLOTS; ++i) {
+		writer->slots[i].seq = NAGERU_SHM_INPUT_SEQ_INVALID;
+	}
+	__atomic_store_n(&hdr->magic, NAGERU_SHM_INPUT_MAGIC, __ATOMIC_RELEASE);
+	return writer;
+}
+
+void nageru_shm_input_destroy(struct nageru_shm_input_writer *writer)
+{
+	__atomic_store_n(&writer->hdr->closed, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&writer->hdr->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &writer->hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+
+	munmap(writer->base, writer->size);
+	shm_unlink(writer->name);
+	free(writer->name);
+	free(writer);
+}
+
+void nageru_shm_input_begin_frame(struct nageru_shm_input_writer *writer, struct nageru_shm_input_frame *frame)
+{
+	struct nageru_shm_input_header *hdr = writer->hdr;
+	uint64_t seq = hdr->num_frames;
+	unsigned slot_num = seq % hdr->num_slots;
+
+	/* The slot is a seqlock; invalidate it before we start overwriting
+	 * the data, so that a reader that is still copying out the previous
+	 * frame from it will know to throw it away. */
+	__atomic_store_n(&writer->slots[slot_num].seq, NAGERU_SHM_INPUT_SEQ_INVALID, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	uint8_t *data = writer->base + hdr->frames_offset + slot_num * hdr->slot_size;
+	frame->cbcr = data;
+	frame->y = data + (size_t)hdr->width * hdr->height;
+	frame->audio = (int32_t *)(data + (size_t)hdr->width * hdr->height * 2);
+}
+
+void nageru_shm_input_end_frame(struct nageru_shm_input_writer *writer, unsigned num_audio_samples)
+{
+	struct nageru_shm_input_header *hdr = writer->hdr;
+	uint64_t seq = hdr->num_frames;
+	struct nageru_shm_input_slot *slot = &writer->slots[seq % hdr->num_slots];
+
+	if (num_audio_samples > NAGERU_SHM_INPUT_MAX_AUDIO_SAMPLES) {
+		num_audio_samples = NAGERU_SHM_INPUT_MAX_AUDIO_SAMPLES;
+	}
+	slot->num_audio_samples = num_audio_samples;
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->num_frames, seq + 1, __ATOMIC_RELEASE);
+
+	__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
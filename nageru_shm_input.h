@@ -0,0 +1,98 @@
+#ifndef _NAGERU_SHM_INPUT_H
+#define _NAGERU_SHM_INPUT_H
+
+/*
+ * Layout of the shared-memory video input (--shm-input), and a small library
+ * for writing to it. Meant for programs that produce video on the same
+ * machine as Nageru (graphics, scoreboards and so on), so that they do not
+ * need to go through an SDI loopback to get into the mix.
+ *
+ * The writer creates the segment, and renders each frame directly into
+ * a slot in it, in the format Nageru uses for its capture cards, so that
+ * Nageru only needs to upload it; no conversion or extra copies are needed
+ * on either side. There are a few slots, used round-robin; the writer never
+ * waits for Nageru, so if Nageru falls behind, it will drop frames.
+ * The writer is responsible for producing frames at the rate it advertises.
+ *
+ * Note: This file is meant to compile as both C and C++, for easier inclusion
+ * in other projects.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define NAGERU_SHM_INPUT_MAGIC 0x4e475349  /* "NGSI". */
+#define NAGERU_SHM_INPUT_VERSION 1
+
+/* Nageru drops frames with more audio than this (see Mixer::bm_frame()). */
+#define NAGERU_SHM_INPUT_MAX_AUDIO_SAMPLES 4800
+
+/* Marks a slot as being written to. */
+#define NAGERU_SHM_INPUT_SEQ_INVALID UINT64_MAX
+
+struct nageru_shm_input_slot {
+	uint64_t seq;                /* Frame number, or NAGERU_SHM_INPUT_SEQ_INVALID. */
+	uint32_t num_audio_samples;  /* Per channel. */
+	uint32_t reserved;
+};
+
+/*
+ * The data for each slot, at frames_offset + slot_num * slot_size, is:
+ *
+ *  - width * height bytes of interleaved CbCr (4:2:2, so width/2 pairs per line, Cb first),
+ *  - width * height bytes of Y,
+ *  - NAGERU_SHM_INPUT_MAX_AUDIO_SAMPLES stereo samples of interleaved
+ *    32-bit signed audio, at 48 kHz.
+ *
+ * The video is limited-range Rec. 709.
+ */
+struct nageru_shm_input_header {
+	uint32_t magic;    /* NAGERU_SHM_INPUT_MAGIC. */
+	uint32_t version;  /* NAGERU_SHM_INPUT_VERSION. */
+
+	/* Fixed while the segment exists. */
+	uint32_t width, height;  /* Width must be even. */
+	uint32_t frame_rate_nom, frame_rate_den;
+	uint32_t num_slots;
+	uint32_t slots_offset;   /* From the start of the segment. */
+	uint64_t frames_offset;  /* From the start of the segment. */
+	uint64_t slot_size;
+	int32_t writer_pid;
+
+	/* Updated by the writer as it goes. */
+	uint64_t num_frames;  /* Frames published so far; also the seq of the next one. */
+	uint32_t futex;       /* Incremented (and woken) for every frame. */
+	uint32_t closed;      /* Nonzero after the writer has gone away. */
+};
+
+struct nageru_shm_input_frame {
+	uint8_t *cbcr;
+	uint8_t *y;
+	int32_t *audio;
+};
+
+struct nageru_shm_input_writer;
+
+/* Creates the segment (replacing any old one with the same name, which must
+ * start with a slash). Returns NULL and sets errno on failure. */
+struct nageru_shm_input_writer *nageru_shm_input_create(const char *name, unsigned width, unsigned height,
+                                                        unsigned frame_rate_nom, unsigned frame_rate_den);
+
+/* Marks the segment as closed, so that Nageru stops waiting for frames, and removes it. */
+void nageru_shm_input_destroy(struct nageru_shm_input_writer *writer);
+
+/* Gets pointers into the shared memory for the next frame. Fill in the
+ * video and up to NAGERU_SHM_INPUT_MAX_AUDIO_SAMPLES of audio, then call
+ * nageru_shm_input_end_frame(). */
+void nageru_shm_input_begin_frame(struct nageru_shm_input_writer *writer, struct nageru_shm_input_frame *frame);
+void nageru_shm_input_end_frame(struct nageru_shm_input_writer *writer, unsigned num_audio_samples);
+
+#ifdef __cplusplus
+}  /* extern "C" */
+#endif
+
+#endif  /* !defined(_NAGERU_SHM_INPUT_H) */
@@ -0,0 +1,381 @@
+#include "program_cache.h"
+
+#include <epoxy/gl.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "metrics.h"
+
+using namespace std;
+
+namespace {
+
+decltype(epoxy_glCompileShader) real_glCompileShader;
+decltype(epoxy_glGetShaderiv) real_glGetShaderiv;
+decltype(epoxy_glDeleteShader) real_glDeleteShader;
+decltype(epoxy_glBindAttribLocation) real_glBindAttribLocation;
+decltype(epoxy_glBindFragDataLocation) real_glBindFragDataLocation;
+decltype(epoxy_glLinkProgram) real_glLinkProgram;
+decltype(epoxy_glDeleteProgram) real_glDeleteProgram;
+
+string cache_dir;
+string driver_id;  // Vendor, renderer and version; part of every key.
+
+mutex mu;
+set<uint64_t> known_good_shaders;  // Hashes of shaders that have compiled (and linked) before. Under <mu>.
+set<GLuint> deferred_shaders;  // Not actually compiled yet. Under <mu>.
+map<GLuint, string> program_bindings;  // Attribute and output bindings, as text. Under <mu>.
+
+atomic<int64_t> metric_program_cache_hits{0};
+atomic<int64_t> metric_program_cache_misses{0};
+
+// FNV-1a; we only need to avoid accidental collisions, and it needs to be
+// stable across runs (which std::hash does not promise).
+uint64_t hash_string(const string &str)
+{
+	uint64_t h = 14695981039346656037ULL;
+	for (char ch : str) {
+		h ^= uint8_t(ch);
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+string hex(uint64_t x)
+{
+	char buf[17];
+	snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)x);
+	return buf;
+}
+
+uint64_t hash_shader(GLuint shader)
+{
+	GLint type = 0, len = 0;
+	real_glGetShaderiv(shader, GL_SHADER_TYPE, &type);
+	real_glGetShaderiv(shader, GL_SHADER_SOURCE_LENGTH, &len);
+	string source(max(len, 1), '\0');
+	glGetShaderSource(shader, len, nullptr, &source[0]);
+	source.resize(max(len - 1, 0));  // Drop the terminating zero.
+	return hash_string(to_string(type) + "\n" + source);
+}
+
+string known_shaders_filename()
+{
+	return cache_dir + "/known_shaders";
+}
+
+void mark_shaders_known_good(const vector<uint64_t> &hashes)
+{
+	vector<uint64_t> new_hashes;
+	{
+		lock_guard<mutex> lock(mu);
+		for (uint64_t hash : hashes) {
+			if (known_good_shaders.insert(hash).second) {
+				new_hashes.push_back(hash);
+			}
+		}
+	}
+	if (new_hashes.empty()) {
+		return;
+	}
+	FILE *fp = fopen(known_shaders_filename().c_str(), "a");
+	if (fp == nullptr) {
+		perror(known_shaders_filename().c_str());
+		return;
+	}
+	for (uint64_t hash : new_hashes) {
+		fprintf(fp, "%s\n", hex(hash).c_str());
+	}
+	fclose(fp);
+}
+
+void compile_if_deferred(GLuint shader)
+{
+	{
+		lock_guard<mutex> lock(mu);
+		if (deferred_shaders.erase(shader) == 0) {
+			return;
+		}
+	}
+	real_glCompileShader(shader);
+}
+
+bool read_program_binary(const string &filename, GLenum *format, vector<uint8_t> *data)
+{
+	FILE *fp = fopen(filename.c_str(), "rb");
+	if (fp == nullptr) {
+		return false;
+	}
+	uint32_t format32;
+	bool ok = (fread(&format32, sizeof(format32), 1, fp) == 1);
+	if (ok) {
+		*format = format32;
+		uint8_t buf[65536];
+		size_t ret;
+		while ((ret = fread(buf, 1, sizeof(buf), fp)) > 0) {
+			data->insert(data->end(), buf, buf + ret);
+		}
+		ok = !ferror(fp) && !data->empty();
+	}
+	fclose(fp);
+	return ok;
+}
+
+void write_program_binary(const string &filename, GLenum format, const vector<uint8_t> &data)
+{
+	// Write to a temporary file and rename it into place, so that we
+	// never leave a half-written binary behind if we crash.
+	const string tmp_filename = filename + ".tmp." + to_string(getpid());
+	FILE *fp = fopen(tmp_filename.c_str(), "wb");
+	if (fp == nullptr) {
+		perror(tmp_filename.c_str());
+		return;
+	}
+	const uint32_t format32 = format;
+	if (fwrite(&format32, sizeof(format32), 1, fp) != 1 ||
+	    fwrite(data.data(), data.size(), 1, fp) != 1) {
+		perror(tmp_filename.c_str());
+		fclose(fp);
+		unlink(tmp_filename.c_str());
+		return;
+	}
+	if (fclose(fp) != 0) {
+		perror(tmp_filename.c_str());
+		unlink(tmp_filename.c_str());
+		return;
+	}
+	if (rename(tmp_filename.c_str(), filename.c_str()) == -1) {
+		perror(filename.c_str());
+		unlink(tmp_filename.c_str());
+	}
+}
+
+void hooked_glCompileShader(GLuint shader)
+{
+	const uint64_t hash = hash_shader(shader);
+	{
+		lock_guard<mutex> lock(mu);
+		if (known_good_shaders.count(hash)) {
+			// Wait and see if it is part of a program we have a binary for.
+			deferred_shaders.insert(shader);
+			return;
+		}
+	}
+	real_glCompileShader(shader);
+}
+
+void hooked_glGetShaderiv(GLuint shader, GLenum pname, GLint *params)
+{
+	{
+		lock_guard<mutex> lock(mu);
+		if (deferred_shaders.count(shader)) {
+			if (pname == GL_COMPILE_STATUS) {
+				*params = GL_TRUE;  // It did the last time.
+				return;
+			}
+			if (pname == GL_INFO_LOG_LENGTH) {
+				*params = 0;
+				return;
+			}
+		}
+	}
+	real_glGetShaderiv(shader, pname, params);
+}
+
+void hooked_glDeleteShader(GLuint shader)
+{
+	{
+		lock_guard<mutex> lock(mu);
+		deferred_shaders.erase(shader);
+	}
+	real_glDeleteShader(shader);
+}
+
+void hooked_glBindAttribLocation(GLuint program, GLuint index, const GLchar *name)
+{
+	{
+		lock_guard<mutex> lock(mu);
+		program_bindings[program] += "attrib " + to_string(index) + " " + name + "\n";
+	}
+	real_glBindAttribLocation(program, index, name);
+}
+
+void hooked_glBindFragDataLocation(GLuint program, GLuint color, const GLchar *name)
+{
+	{
+		lock_guard<mutex> lock(mu);
+		program_bindings[program] += "output " + to_string(color) + " " + name + "\n";
+	}
+	real_glBindFragDataLocation(program, color, name);
+}
+
+void hooked_glDeleteProgram(GLuint program)
+{
+	{
+		lock_guard<mutex> lock(mu);
+		program_bindings.erase(program);
+	}
+	real_glDeleteProgram(program);
+}
+
+void hooked_glLinkProgram(GLuint program)
+{
+	GLint num_shaders = 0;
+	glGetProgramiv(program, GL_ATTACHED_SHADERS, &num_shaders);
+	vector<GLuint> shaders(num_shaders);
+	if (num_shaders > 0) {
+		glGetAttachedShaders(program, num_shaders, nullptr, shaders.data());
+	}
+
+	vector<uint64_t> shader_hashes;
+	for (GLuint shader : shaders) {
+		shader_hashes.push_back(hash_shader(shader));
+	}
+	sort(shader_hashes.begin(), shader_hashes.end());
+
+	string key = driver_id;
+	{
+		lock_guard<mutex> lock(mu);
+		key += program_bindings[program];
+	}
+	for (uint64_t hash : shader_hashes) {
+		key += hex(hash) + "\n";
+	}
+	const string filename = cache_dir + "/" + hex(hash_string(key)) + ".bin";
+
+	GLenum format;
+	vector<uint8_t> data;
+	if (read_program_binary(filename, &format, &data)) {
+		glProgramBinary(program, format, data.data(), data.size());
+		GLint link_status = GL_FALSE;
+		glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+		if (link_status == GL_TRUE) {
+			++metric_program_cache_hits;
+			return;
+		}
+
+		// Probably a driver upgrade that did not change the version string.
+		// Link as usual; we will overwrite the binary below.
+	}
+	++metric_program_cache_misses;
+
+	for (GLuint shader : shaders) {
+		compile_if_deferred(shader);
+	}
+	glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+	real_glLinkProgram(program);
+
+	GLint link_status = GL_FALSE;
+	glGetProgramiv(program, GL_LINK_STATUS, &link_status);
+	if (link_status != GL_TRUE) {
+		// Leave it to the caller to complain.
+		return;
+	}
+	GLint len = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &len);
+	if (len <= 0) {
+		return;
+	}
+	data.resize(len);
+	glGetProgramBinary(program, len, nullptr, &format, data.data());
+	write_program_binary(filename, format, data);
+	mark_shaders_known_good(shader_hashes);
+}
+
+// libepoxy resolves each function the first time it is called, and then
+// rewrites its dispatch pointer to point straight to the driver.
+// Make sure that has happened before we take the pointers over,
+// so that it does not overwrite our hooks later. None of these calls
+// do anything but set an error, which we clear.
+void resolve_epoxy_pointers()
+{
+	GLint dummy;
+	epoxy_glCompileShader(0);
+	epoxy_glGetShaderiv(0, GL_COMPILE_STATUS, &dummy);
+	epoxy_glDeleteShader(0);
+	epoxy_glBindAttribLocation(0, 0, "dummy");
+	epoxy_glBindFragDataLocation(0, 0, "dummy");
+	epoxy_glLinkProgram(0);
+	epoxy_glDeleteProgram(0);
+	while (glGetError() != GL_NO_ERROR)
+		;
+}
+
+bool make_directories(const string &directory)
+{
+	for (size_t pos = 1; pos <= directory.size(); ++pos) {
+		if (pos == directory.size() || directory[pos] == '/') {
+			const string dir = directory.substr(0, pos);
+			if (mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+				perror(dir.c_str());
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+}  // namespace
+
+void init_program_cache(const string &directory)
+{
+	if (epoxy_gl_version() < 41 && !epoxy_has_gl_extension("GL_ARB_get_program_binary")) {
+		fprintf(stderr, "WARNING: No support for program binaries; not caching shader programs.\n");
+		return;
+	}
+	GLint num_formats = 0;
+	glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &num_formats);
+	if (num_formats == 0) {
+		fprintf(stderr, "WARNING: The OpenGL driver has no program binary formats; not caching shader programs.\n");
+		return;
+	}
+	if (!make_directories(directory)) {
+		fprintf(stderr, "WARNING: Could not create %s; not caching shader programs.\n", directory.c_str());
+		return;
+	}
+	cache_dir = directory;
+	driver_id = string((const char *)glGetString(GL_VENDOR)) + "\n" +
+		(const char *)glGetString(GL_RENDERER) + "\n" +
+		(const char *)glGetString(GL_VERSION) + "\n";
+
+	FILE *fp = fopen(known_shaders_filename().c_str(), "r");
+	if (fp != nullptr) {
+		char buf[256];
+		while (fgets(buf, sizeof(buf), fp) != nullptr) {
+			known_good_shaders.insert(strtoull(buf, nullptr, 16));
+		}
+		fclose(fp);
+	}
+
+	resolve_epoxy_pointers();
+	real_glCompileShader = epoxy_glCompileShader;
+	real_glGetShaderiv = epoxy_glGetShaderiv;
+	real_glDeleteShader = epoxy_glDeleteShader;
+	real_glBindAttribLocation = epoxy_glBindAttribLocation;
+	real_glBindFragDataLocation = epoxy_glBindFragDataLocation;
+	real_glLinkProgram = epoxy_glLinkProgram;
+	real_glDeleteProgram = epoxy_glDeleteProgram;
+	epoxy_glCompileShader = hooked_glCompileShader;
+	epoxy_glGetShaderiv = hooked_glGetShaderiv;
+	epoxy_glDeleteShader = hooked_glDeleteShader;
+	epoxy_glBindAttribLocation = hooked_glBindAttribLocation;
+	epoxy_glBindFragDataLocation = hooked_glBindFragDataLocation;
+	epoxy_glLinkProgram = hooked_glLinkProgram;
+	epoxy_glDeleteProgram = hooked_glDeleteProgram;
+
+	global_metrics.add("program_cache_hits", &metric_program_cache_hits);
+	global_metrics.add("program_cache_misses", &metric_program_cache_misses);
+}
@@ -0,0 +1,23 @@
+#ifndef _PROGRAM_CACHE_H
+#define _PROGRAM_CACHE_H 1
+
+// A persistent on-disk cache of linked shader programs, so that we do not
+// need to compile and link all of the theme's programs on every start,
+// which can take many seconds.
+//
+// Movit compiles and links its programs itself, and has no hooks for caching,
+// so we hook into the OpenGL calls it makes instead, by replacing libepoxy's
+// dispatch pointers. Shaders we know have compiled before are not actually
+// compiled until we know that they are needed, and linking a program we have
+// seen before (same shaders, same bindings, same driver) loads it with
+// glProgramBinary() instead. If anything goes wrong, we fall back to compiling
+// and linking as usual.
+
+#include <string>
+
+// Must be called with an OpenGL context current, before anything is compiled,
+// and before any other threads use OpenGL. Creates <directory> if needed.
+// Does nothing (except warn) if the driver cannot give us program binaries.
+void init_program_cache(const std::string &directory);
+
+#endif  // !defined(_PROGRAM_CACHE_H)
@@ -0,0 +1,166 @@
+#include "quality_governor.h"
+
+#include <stdio.h>
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+
+#include "flags.h"
+#include "metrics.h"
+#include "timebase.h"
+
+using namespace std;
+
+namespace {
+
+// Tuning parameters. Load is GPU time divided by frame duration.
+constexpr double load_averaging_factor = 0.1;  // Weight of the newest frame in the moving average.
+constexpr double headroom_fraction = 0.6;  // Count as headroom if below this fraction of the budget.
+constexpr int64_t min_headroom_time_before_step_up = 5 * TIMEBASE;
+constexpr int64_t max_headroom_time_before_step_up = 120 * TIMEBASE;
+
+// If full quality does not last this long, it was probably too much
+// after all, so we wait longer (twice as long, up to the maximum above)
+// before trying it again. Otherwise, we would keep flip-flopping.
+constexpr int64_t stable_time_at_full_quality = 60 * TIMEBASE;
+
+// If the GPU is so far behind that this many queries are still outstanding,
+// stop measuring until it catches up, instead of allocating ever more.
+constexpr size_t max_pending_queries = 16;
+
+atomic<double> metric_gpu_frame_time_seconds{0.0};
+atomic<double> metric_quality_level{QualityGovernor::QUALITY_FULL};
+atomic<int64_t> metric_quality_steps_down{0};
+atomic<int64_t> metric_quality_steps_up{0};
+atomic<int64_t> metric_reduced_quality_frames{0};
+once_flag metrics_registered;
+
+void register_metrics()
+{
+	global_metrics.add("gpu_frame_time_seconds", &metric_gpu_frame_time_seconds, Metrics::TYPE_GAUGE);
+	global_metrics.add("quality_governor_level", &metric_quality_level, Metrics::TYPE_GAUGE);
+	global_metrics.add("quality_governor_steps", {{ "direction", "down" }}, &metric_quality_steps_down);
+	global_metrics.add("quality_governor_steps", {{ "direction", "up" }}, &metric_quality_steps_up);
+	global_metrics.add("quality_governor_reduced_frames", &metric_reduced_quality_frames);
+}
+
+}  // namespace
+
+QualityGovernor::QualityGovernor()
+	: time_at_full_quality(stable_time_at_full_quality),  // Starting out at full quality does not count as flip-flopping.
+	  headroom_time_before_step_up(min_headroom_time_before_step_up)
+{
+	call_once(metrics_registered, register_metrics);
+	metric_quality_level = quality;
+}
+
+QualityGovernor::~QualityGovernor()
+{
+	for (const PendingQuery &pending : pending_queries) {
+		free_queries.push_back(pending.query);
+	}
+	if (!free_queries.empty()) {
+		glDeleteQueries(free_queries.size(), free_queries.data());
+	}
+}
+
+void QualityGovernor::begin_frame()
+{
+	collect_results();
+	if (pending_queries.size() >= max_pending_queries) {
+		current_query = 0;
+		return;
+	}
+	if (free_queries.empty()) {
+		GLuint query;
+		glGenQueries(1, &query);
+		free_queries.push_back(query);
+	}
+	current_query = free_queries.back();
+	free_queries.pop_back();
+	glBeginQuery(GL_TIME_ELAPSED, current_query);
+}
+
+void QualityGovernor::end_frame(int64_t frame_duration)
+{
+	if (quality != QUALITY_FULL) {
+		++metric_reduced_quality_frames;
+	}
+	if (current_query == 0) {
+		return;
+	}
+	glEndQuery(GL_TIME_ELAPSED);
+	pending_queries.push_back(PendingQuery{ current_query, frame_duration });
+	current_query = 0;
+}
+
+void QualityGovernor::collect_results()
+{
+	while (!pending_queries.empty()) {
+		const PendingQuery &pending = pending_queries.front();
+		GLuint available = 0;
+		glGetQueryObjectuiv(pending.query, GL_QUERY_RESULT_AVAILABLE, &available);
+		if (!available) {
+			// The later ones cannot be done either.
+			return;
+		}
+		GLuint64 elapsed_ns;
+		glGetQueryObjectui64v(pending.query, GL_QUERY_RESULT, &elapsed_ns);
+		free_queries.push_back(pending.query);
+		int64_t frame_duration = pending.frame_duration;
+		pending_queries.pop_front();
+
+		after_frame(elapsed_ns * 1e-9, frame_duration);
+	}
+}
+
+void QualityGovernor::after_frame(double gpu_time_sec, int64_t frame_duration)
+{
+	double load = gpu_time_sec * TIMEBASE / max<int64_t>(frame_duration, 1);
+	avg_load = avg_load * (1.0 - load_averaging_factor) + load * load_averaging_factor;
+	metric_gpu_frame_time_seconds = gpu_time_sec;
+
+	if (global_flags.gpu_budget_percent <= 0) {
+		// Only measuring.
+		return;
+	}
+	const double budget = global_flags.gpu_budget_percent * 0.01;
+
+	if (quality == QUALITY_FULL) {
+		time_at_full_quality += frame_duration;
+		if (time_at_full_quality >= stable_time_at_full_quality) {
+			headroom_time_before_step_up = min_headroom_time_before_step_up;
+		}
+	}
+
+	if (avg_load > budget) {
+		time_with_headroom = 0;
+		if (quality == QUALITY_FULL) {
+			if (time_at_full_quality < stable_time_at_full_quality) {
+				headroom_time_before_step_up = min(headroom_time_before_step_up * 2, max_headroom_time_before_step_up);
+			}
+			printf("Quality governor: GPU falling behind (average load %.0f%%), asking the theme for reduced quality\n",
+				avg_load * 100.0);
+			quality = QUALITY_REDUCED;
+			metric_quality_level = quality;
+			++metric_quality_steps_down;
+		}
+		return;
+	}
+
+	if (avg_load < budget * headroom_fraction) {
+		time_with_headroom += frame_duration;
+	} else {
+		time_with_headroom = 0;
+	}
+	if (quality == QUALITY_REDUCED && time_with_headroom >= headroom_time_before_step_up) {
+		printf("Quality governor: Headroom available (average load %.0f%%), going back to full quality\n",
+			avg_load * 100.0);
+		quality = QUALITY_FULL;
+		metric_quality_level = quality;
+		++metric_quality_steps_up;
+		time_with_headroom = 0;
+		time_at_full_quality = 0;
+	}
+}
@@ -0,0 +1,58 @@
+#ifndef _QUALITY_GOVERNOR_H
+#define _QUALITY_GOVERNOR_H 1
+
+// Keeps the GPU from falling behind by asking the theme for cheaper chains
+// (see the quality parameter to get_chain() in theme.lua) when rendering
+// the output takes too long, much like X264SpeedControl does for x264.
+//
+// The GPU time for each output frame is measured with timer queries, which
+// we read back a few frames later, so that we never need to wait for the GPU.
+// If a moving average of the GPU time goes above the budget
+// (--gpu-budget, in percent of the frame duration), we step down immediately;
+// if we have been well below it for a while, we step up again (waiting longer
+// each time if full quality turns out not to last).
+
+#include <epoxy/gl.h>
+#include <stdint.h>
+#include <deque>
+#include <vector>
+
+class QualityGovernor {
+public:
+	enum Quality { QUALITY_REDUCED = 0, QUALITY_FULL = 1 };
+
+	// All calls, including the constructor and destructor, must happen
+	// with the same OpenGL context current, since query objects are
+	// not shared between contexts.
+	QualityGovernor();
+	~QualityGovernor();
+
+	// Bracket the GPU work for one output frame. <frame_duration> is
+	// in TIMEBASE units.
+	void begin_frame();
+	void end_frame(int64_t frame_duration);
+
+	Quality get_quality() const { return quality; }
+
+private:
+	struct PendingQuery {
+		GLuint query;
+		int64_t frame_duration;
+	};
+
+	// Reads back all the timer queries that are done, oldest first.
+	void collect_results();
+	void after_frame(double gpu_time_sec, int64_t frame_duration);
+
+	std::deque<PendingQuery> pending_queries;
+	std::vector<GLuint> free_queries;
+	GLuint current_query = 0;
+
+	Quality quality = QUALITY_FULL;
+	double avg_load = 0.0;  // Moving average of GPU time divided by frame duration.
+	int64_t time_with_headroom = 0;  // In TIMEBASE units.
+	int64_t time_at_full_quality;  // In TIMEBASE units. Since the last step up.
+	int64_t headroom_time_before_step_up;  // In TIMEBASE units; grows if we keep flip-flopping.
+};
+
+#endif  // !defined(_QUALITY_GOVERNOR_H)
@@ -0,0 +1,302 @@
+#include "shm_capture.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "bmusb/bmusb.h"
+#include "defs.h"
+#include "nageru_shm_input.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// How often to look for the segment when there is no writer.
+constexpr double attach_interval_seconds = 1.0;
+
+}  // namespace
+
+ShmCapture::ShmCapture(const string &name, int card_index)
+	: name(name), card_index(card_index),
+	  width(WIDTH), height(HEIGHT), frame_rate_nom(60000), frame_rate_den(1001)
+{
+	description = "Shared memory: " + name;
+}
+
+ShmCapture::~ShmCapture()
+{
+	if (dequeue_thread.joinable()) {
+		stop_dequeue_thread();
+	}
+}
+
+void ShmCapture::configure_card()
+{
+	// The video frames go straight into the mixer's PBOs, so it must have
+	// given us its allocator. Nobody needs the audio in any special memory,
+	// so we can allocate that ourselves.
+	assert(video_frame_allocator != nullptr);
+	if (audio_frame_allocator == nullptr) {
+		owned_audio_frame_allocator.reset(new MallocFrameAllocator(65536, NUM_QUEUED_AUDIO_FRAMES));
+		set_audio_frame_allocator(owned_audio_frame_allocator.get());
+	}
+}
+
+void ShmCapture::start_bm_capture()
+{
+	should_quit = false;
+	dequeue_thread = thread(&ShmCapture::dequeue_thread_func, this);
+}
+
+void ShmCapture::stop_dequeue_thread()
+{
+	should_quit = true;
+	dequeue_thread.join();
+}
+
+map<uint32_t, VideoMode> ShmCapture::get_available_video_modes() const
+{
+	VideoMode mode;
+	mode.name = "Shared memory";
+	mode.autodetect = false;
+	mode.width = width;
+	mode.height = height;
+	mode.frame_rate_num = frame_rate_nom;
+	mode.frame_rate_den = frame_rate_den;
+	mode.interlaced = false;
+	return {{ 0, mode }};
+}
+
+void ShmCapture::dequeue_thread_func()
+{
+	if (has_dequeue_callbacks) {
+		dequeue_init_callback();
+	}
+
+	steady_clock::time_point last_attach_attempt = steady_clock::now() - seconds(3600);
+	steady_clock::time_point last_frame = steady_clock::now();
+	while (!should_quit) {
+		steady_clock::time_point now = steady_clock::now();
+		const duration<double> frame_duration(double(frame_rate_den) / frame_rate_nom);
+
+		if (base == nullptr) {
+			if (now - last_attach_attempt >= duration<double>(attach_interval_seconds)) {
+				last_attach_attempt = now;
+				if (attach()) {
+					last_frame = now;
+					continue;
+				}
+			}
+
+			// Nothing connected, so to speak.
+			send_frame_without_signal();
+			++timecode;
+			last_frame += duration_cast<steady_clock::duration>(frame_duration);
+			if (now - last_frame > seconds(1)) {
+				last_frame = now;
+			}
+			this_thread::sleep_until(last_frame);
+			continue;
+		}
+
+		// Read the futex before checking for frames, so that we cannot
+		// miss a wakeup in-between.
+		uint32_t futex_val = __atomic_load_n(&hdr->futex, __ATOMIC_ACQUIRE);
+		uint64_t num_frames = __atomic_load_n(&hdr->num_frames, __ATOMIC_ACQUIRE);
+		if (next_seq >= num_frames) {
+			if (__atomic_load_n(&hdr->closed, __ATOMIC_ACQUIRE) || writer_is_gone()) {
+				fprintf(stderr, "Card %d: Writer for %s went away.\n", card_index, name.c_str());
+				detach();
+				continue;
+			}
+			if (now - last_frame > 2 * frame_duration) {
+				// The writer is stalled; keep the clock going for the mixer.
+				send_frame_without_signal();
+				++timecode;
+				last_frame = now;
+			}
+			timespec timeout;
+			timeout.tv_sec = 0;
+			timeout.tv_nsec = duration_cast<nanoseconds>(frame_duration).count();
+			syscall(SYS_futex, &hdr->futex, FUTEX_WAIT, futex_val, &timeout, nullptr, 0);
+			continue;
+		}
+
+		// The writer may be overwriting the slot of the oldest frame by now,
+		// so that one is off limits. If we are further behind than that,
+		// skip ahead; the gap in the timecodes will tell the mixer
+		// how many frames we dropped.
+		const uint64_t oldest_safe = (num_frames >= hdr->num_slots) ? num_frames - hdr->num_slots + 1 : 0;
+		if (next_seq < oldest_safe) {
+			timecode += oldest_safe - next_seq;
+			next_seq = oldest_safe;
+		}
+		send_frame(next_seq++);
+		++timecode;
+		last_frame = now;
+	}
+
+	detach();
+	if (has_dequeue_callbacks) {
+		dequeue_cleanup_callback();
+	}
+}
+
+bool ShmCapture::attach()
+{
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd == -1) {
+		return false;
+	}
+	struct stat buf;
+	if (fstat(fd, &buf) == -1 || size_t(buf.st_size) < sizeof(nageru_shm_input_header)) {
+		close(fd);
+		return false;
+	}
+	void *ptr = mmap(nullptr, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		return false;
+	}
+
+	const nageru_shm_input_header *new_hdr = (const nageru_shm_input_header *)ptr;
+	const uint64_t frame_bytes = uint64_t(new_hdr->width) * new_hdr->height * 2;
+	if (__atomic_load_n(&new_hdr->magic, __ATOMIC_ACQUIRE) != NAGERU_SHM_INPUT_MAGIC ||
+	    new_hdr->version != NAGERU_SHM_INPUT_VERSION ||
+	    new_hdr->width == 0 || new_hdr->width % 2 != 0 || new_hdr->height == 0 ||
+	    new_hdr->frame_rate_nom == 0 || new_hdr->frame_rate_den == 0 ||
+	    new_hdr->num_slots < 2 ||
+	    new_hdr->slot_size < frame_bytes + NAGERU_SHM_INPUT_MAX_AUDIO_SAMPLES * 2 * sizeof(int32_t) ||
+	    new_hdr->slots_offset + uint64_t(new_hdr->num_slots) * sizeof(nageru_shm_input_slot) > uint64_t(buf.st_size) ||
+	    new_hdr->frames_offset + uint64_t(new_hdr->num_slots) * new_hdr->slot_size > uint64_t(buf.st_size) ||
+	    __atomic_load_n(&new_hdr->closed, __ATOMIC_ACQUIRE)) {
+		// Not (yet) a usable segment; try again later.
+		munmap(ptr, buf.st_size);
+		return false;
+	}
+
+	base = (const uint8_t *)ptr;
+	mapping_size = buf.st_size;
+	hdr = new_hdr;
+	if (writer_is_gone()) {
+		// Left behind by a writer that crashed.
+		detach();
+		return false;
+	}
+	next_seq = __atomic_load_n(&hdr->num_frames, __ATOMIC_ACQUIRE);
+	width = hdr->width;
+	height = hdr->height;
+	frame_rate_nom = hdr->frame_rate_nom;
+	frame_rate_den = hdr->frame_rate_den;
+	fprintf(stderr, "Card %d: Attached to %s (%ux%u, %.2f fps).\n", card_index, name.c_str(),
+		hdr->width, hdr->height, double(hdr->frame_rate_nom) / hdr->frame_rate_den);
+	return true;
+}
+
+void ShmCapture::detach()
+{
+	if (base != nullptr) {
+		munmap((void *)base, mapping_size);
+		base = nullptr;
+		hdr = nullptr;
+	}
+}
+
+bool ShmCapture::writer_is_gone() const
+{
+	// In case it crashed without marking the segment as closed.
+	return kill(hdr->writer_pid, 0) == -1 && errno == ESRCH;
+}
+
+bool ShmCapture::send_frame(uint64_t seq)
+{
+	const unsigned slot_num = seq % hdr->num_slots;
+	const nageru_shm_input_slot *slot = (const nageru_shm_input_slot *)(base + hdr->slots_offset) + slot_num;
+	const uint8_t *data = base + hdr->frames_offset + slot_num * hdr->slot_size;
+	const size_t plane_size = size_t(hdr->width) * hdr->height;
+
+	// The slot is a seqlock; see nageru_shm_input_begin_frame().
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+		return false;
+	}
+	const unsigned num_audio_samples = min<unsigned>(slot->num_audio_samples, NAGERU_SHM_INPUT_MAX_AUDIO_SAMPLES);
+
+	// The layout is the same as in the PBOs (chroma in the first half,
+	// luma in the second), so this is the only copy we need.
+	FrameAllocator::Frame video_frame = video_frame_allocator->alloc_frame();
+	if (video_frame.data != nullptr) {
+		if (plane_size <= video_frame.size / 2) {
+			memcpy(video_frame.data, data, plane_size);
+			memcpy(video_frame.data2, data + plane_size, plane_size);
+			video_frame.len = plane_size * 2;
+		} else {
+			fprintf(stderr, "Card %d: %ux%u is too large, dropping frame.\n", card_index, hdr->width, hdr->height);
+		}
+	}
+	FrameAllocator::Frame audio_frame = audio_frame_allocator->alloc_frame();
+	if (audio_frame.data != nullptr) {
+		audio_frame.len = min<size_t>(num_audio_samples * 2 * sizeof(int32_t), audio_frame.size);
+		memcpy(audio_frame.data, data + plane_size * 2, audio_frame.len);
+	}
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+		// The writer came around and started overwriting the frame
+		// while we were copying it, so it could be torn.
+		if (video_frame.owner) {
+			video_frame.owner->release_frame(video_frame);
+		}
+		if (audio_frame.owner) {
+			audio_frame.owner->release_frame(audio_frame);
+		}
+		return false;
+	}
+
+	VideoFormat video_format;
+	video_format.width = hdr->width;
+	video_format.height = hdr->height;
+	video_format.frame_rate_nom = hdr->frame_rate_nom;
+	video_format.frame_rate_den = hdr->frame_rate_den;
+	video_format.interlaced = false;
+	video_format.has_signal = true;
+
+	AudioFormat audio_format;
+	audio_format.bits_per_sample = 32;
+	audio_format.num_channels = 2;
+
+	frame_callback(timecode,
+		video_frame, /*video_offset=*/0, video_format,
+		audio_frame, /*audio_offset=*/0, audio_format);
+	return true;
+}
+
+void ShmCapture::send_frame_without_signal()
+{
+	VideoFormat video_format;
+	video_format.width = width;
+	video_format.height = height;
+	video_format.frame_rate_nom = frame_rate_nom;
+	video_format.frame_rate_den = frame_rate_den;
+	video_format.interlaced = false;
+	video_format.has_signal = false;
+
+	// An empty video frame is taken as a dropped one, and no audio as silence.
+	frame_callback(timecode,
+		FrameAllocator::Frame(), /*video_offset=*/0, video_format,
+		FrameAllocator::Frame(), /*audio_offset=*/0, AudioFormat());
+}
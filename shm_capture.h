@@ -0,0 +1,130 @@
+#ifndef _SHM_CAPTURE_H
+#define _SHM_CAPTURE_H 1
+
+// A “capture card” that reads video and audio from a shared memory segment
+// written by another process on the same machine (--shm-input); see
+// nageru_shm_input.h for the format and the writer library.
+//
+// The frames are already in the format the mixer wants, so the only copy
+// is from the shared memory into the PBO, where a real card would DMA it.
+// If there is no writer (or it stops sending frames), we send frames
+// without signal at the last known frame rate, like a card with nothing
+// connected would, and attach to the segment whenever it shows up.
+
+#include <stdint.h>
+
+#include <atomic>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <thread>
+
+#include "bmusb/bmusb.h"
+
+struct nageru_shm_input_header;
+
+class ShmCapture : public CaptureInterface
+{
+public:
+	ShmCapture(const std::string &name, int card_index);
+	~ShmCapture();
+
+	// CaptureInterface.
+	void set_video_frame_allocator(FrameAllocator *allocator) override
+	{
+		video_frame_allocator = allocator;
+	}
+
+	FrameAllocator *get_video_frame_allocator() override
+	{
+		return video_frame_allocator;
+	}
+
+	// Does not take ownership.
+	void set_audio_frame_allocator(FrameAllocator *allocator) override
+	{
+		audio_frame_allocator = allocator;
+	}
+
+	FrameAllocator *get_audio_frame_allocator() override
+	{
+		return audio_frame_allocator;
+	}
+
+	void set_frame_callback(frame_callback_t callback) override
+	{
+		frame_callback = callback;
+	}
+
+	void set_dequeue_thread_callbacks(std::function<void()> init, std::function<void()> cleanup) override
+	{
+		dequeue_init_callback = init;
+		dequeue_cleanup_callback = cleanup;
+		has_dequeue_callbacks = true;
+	}
+
+	std::string get_description() const override
+	{
+		return description;
+	}
+
+	void configure_card() override;
+	void start_bm_capture() override;
+	void stop_dequeue_thread() override;
+
+	// The writer decides the format, so there is only ever one mode and input.
+	std::map<uint32_t, VideoMode> get_available_video_modes() const override;
+	void set_video_mode(uint32_t video_mode_id) override {}
+	uint32_t get_current_video_mode() const override { return 0; }
+
+	std::map<uint32_t, std::string> get_available_video_inputs() const override { return {{ 0, "Shared memory" }}; }
+	void set_video_input(uint32_t video_input_id) override {}
+	uint32_t get_current_video_input() const override { return 0; }
+
+	std::map<uint32_t, std::string> get_available_audio_inputs() const override { return {{ 0, "Embedded" }}; }
+	void set_audio_input(uint32_t audio_input_id) override {}
+	uint32_t get_current_audio_input() const override { return 0; }
+
+private:
+	void dequeue_thread_func();
+
+	// Returns false if the segment does not exist (yet) or is not valid.
+	bool attach();
+	void detach();
+	bool writer_is_gone() const;
+
+	// Sends the frame with the given sequence number, if it is still there.
+	// Returns false if it was overwritten before we could get it.
+	bool send_frame(uint64_t seq);
+	void send_frame_without_signal();
+
+	const std::string name;
+	std::string description;
+	uint16_t timecode = 0;
+	int card_index;
+
+	bool has_dequeue_callbacks = false;
+	std::function<void()> dequeue_init_callback = nullptr;
+	std::function<void()> dequeue_cleanup_callback = nullptr;
+
+	FrameAllocator *video_frame_allocator = nullptr;
+	FrameAllocator *audio_frame_allocator = nullptr;
+	std::unique_ptr<FrameAllocator> owned_audio_frame_allocator;  // If nobody set <audio_frame_allocator>.
+	frame_callback_t frame_callback = nullptr;
+
+	std::thread dequeue_thread;
+	std::atomic<bool> should_quit{false};
+
+	// Only touched by the dequeue thread (and get_available_video_modes(),
+	// which only looks at the format).
+	const uint8_t *base = nullptr;  // nullptr if not attached.
+	size_t mapping_size = 0;
+	const nageru_shm_input_header *hdr = nullptr;
+	uint64_t next_seq = 0;
+
+	// Of the last writer we saw, or defaults; used for frames without signal.
+	std::atomic<unsigned> width, height, frame_rate_nom, frame_rate_den;
+};
+
+#endif  // !defined(_SHM_CAPTURE_H)
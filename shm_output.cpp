@@ -0,0 +1,207 @@
+#include "shm_output.h"
+
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include "defs.h"
+#include "metrics.h"
+#include "nageru_shm.h"
+#include "timebase.h"
+
+using namespace std;
+
+namespace {
+
+// Enough for well over ten seconds of video and audio packets;
+// the data ring is typically the limit, not this.
+constexpr uint32_t num_slots = 4096;
+
+// So that each packet starts on its own cache line.
+constexpr uint64_t data_alignment = 64;
+
+size_t round_up_to_power_of_two(size_t x)
+{
+	size_t ret = 1;
+	while (ret < x) {
+		ret <<= 1;
+	}
+	return ret;
+}
+
+size_t align_to_page(size_t x)
+{
+	const size_t page_size = sysconf(_SC_PAGESIZE);
+	return (x + page_size - 1) / page_size * page_size;
+}
+
+}  // namespace
+
+ShmOutput::ShmOutput(const string &name, size_t data_size, int width, int height,
+                     Mux::Codec video_codec, const string &audio_codec_name)
+	: name(name), width(width), height(height), video_codec(video_codec), labels{{ "name", name }}
+{
+	data_size = round_up_to_power_of_two(data_size);
+	const size_t slots_offset = align_to_page(sizeof(nageru_shm_header));
+	const size_t data_offset = align_to_page(slots_offset + num_slots * sizeof(nageru_shm_slot));
+	mapping_size = data_offset + data_size;
+
+	// Start from scratch, so that readers of an old segment (e.g. from
+	// before a restart) do not see our data as a continuation of theirs.
+	shm_unlink(name.c_str());
+	int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+	if (fd == -1) {
+		perror(name.c_str());
+		exit(1);
+	}
+	struct stat st;
+	if (fstat(fd, &st) == -1) {
+		perror("fstat");
+		exit(1);
+	}
+	shm_dev = st.st_dev;
+	shm_ino = st.st_ino;
+	if (ftruncate(fd, mapping_size) == -1) {
+		perror("ftruncate");
+		exit(1);
+	}
+	void *ptr = mmap(nullptr, mapping_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (ptr == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	close(fd);
+
+	base = (uint8_t *)ptr;
+	hdr = (nageru_shm_header *)base;
+	slots = (nageru_shm_slot *)(base + slots_offset);
+	data = base + data_offset;
+
+	// The segment is zero-filled by ftruncate(), so we only need to set
+	// what should not be zero. Set the magic last, so that nobody sees
+	// a half-initialized header.
+	hdr->version = NAGERU_SHM_VERSION;
+	hdr->num_slots = num_slots;
+	hdr->slots_offset = slots_offset;
+	hdr->data_size = data_size;
+	hdr->data_offset = data_offset;
+	hdr->timebase = TIMEBASE;
+	hdr->width = width;
+	hdr->height = height;
+	hdr->audio_sample_rate = OUTPUT_FREQUENCY;
+	hdr->audio_channels = 2;
+	strncpy(hdr->audio_codec, audio_codec_name.c_str(), sizeof(hdr->audio_codec) - 1);
+	hdr->writer_pid = getpid();
+	hdr->last_keyframe_seq = NAGERU_SHM_SEQ_INVALID;
+	for (uint32_t i = 0; i < num_slots; ++i) {
+		slots[i].seq = NAGERU_SHM_SEQ_INVALID;
+	}
+	__atomic_store_n(&hdr->magic, NAGERU_SHM_MAGIC, __ATOMIC_RELEASE);
+
+	global_metrics.add("shm_output_packets", labels, &metric_shm_output_packets);
+	global_metrics.add("shm_output_bytes", labels, &metric_shm_output_bytes);
+	global_metrics.add("shm_output_dropped_packets", labels, &metric_shm_output_dropped_packets);
+}
+
+ShmOutput::~ShmOutput()
+{
+	global_metrics.remove("shm_output_packets", labels);
+	global_metrics.remove("shm_output_bytes", labels);
+	global_metrics.remove("shm_output_dropped_packets", labels);
+
+	__atomic_store_n(&hdr->closed, 1, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+
+	munmap(base, mapping_size);
+
+	// Somebody else (e.g. another instance with the same --shm-output)
+	// may have replaced the segment in the meantime; leave theirs alone.
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+	if (fd != -1) {
+		struct stat st;
+		if (fstat(fd, &st) == 0 && st.st_dev == shm_dev && st.st_ino == shm_ino) {
+			shm_unlink(name.c_str());
+		}
+		close(fd);
+	}
+}
+
+void ShmOutput::tap_packet(const AVPacket &pkt, int64_t pts, int64_t dts)
+{
+	uint16_t type;
+	if (pkt.stream_index == 0) {
+		type = (video_codec == Mux::CODEC_H264) ? NAGERU_SHM_TYPE_H264 : NAGERU_SHM_TYPE_NV12;
+	} else {
+		type = NAGERU_SHM_TYPE_AUDIO;
+	}
+	uint16_t flags = (pkt.flags & AV_PKT_FLAG_KEY) ? NAGERU_SHM_FLAG_KEYFRAME : 0;
+	add_packet(type, flags, pkt.data, pkt.size, pts, dts);
+}
+
+void ShmOutput::add_raw_frame(int64_t pts, const uint8_t *nv12)
+{
+	add_packet(NAGERU_SHM_TYPE_NV12, NAGERU_SHM_FLAG_KEYFRAME, nv12, width * height * 3 / 2, pts, pts);
+}
+
+void ShmOutput::add_packet(uint16_t type, uint16_t flags, const uint8_t *buf, size_t size, int64_t pts, int64_t dts)
+{
+	const uint64_t data_size = hdr->data_size;
+	if (size > data_size / 2) {
+		// Would not leave room for anything else; the ring is too small.
+		++metric_shm_output_dropped_packets;
+		return;
+	}
+
+	lock_guard<mutex> lock(write_mu);
+
+	// Packets are never split across the end of the ring, so that readers
+	// can use them in place.
+	uint64_t pos = write_pos;
+	if ((pos & (data_size - 1)) + size > data_size) {
+		pos += data_size - (pos & (data_size - 1));
+	}
+	const uint64_t end = pos + size;
+
+	// Tell readers what we are about to overwrite before we do it;
+	// see nageru_shm_packet_valid().
+	if (end > data_size) {
+		__atomic_store_n(&hdr->data_reclaimed, end - data_size, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_RELEASE);
+	}
+	memcpy(data + (pos & (data_size - 1)), buf, size);
+
+	// Publish the packet. The slot is a seqlock; see nageru_shm_next().
+	const uint64_t seq = hdr->num_packets;
+	nageru_shm_slot *slot = &slots[seq & (num_slots - 1)];
+	__atomic_store_n(&slot->seq, NAGERU_SHM_SEQ_INVALID, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	slot->offset = pos;
+	slot->size = size;
+	slot->type = type;
+	slot->flags = flags;
+	slot->pts = pts;
+	slot->dts = dts;
+	__atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+	__atomic_store_n(&hdr->num_packets, seq + 1, __ATOMIC_RELEASE);
+	const uint16_t main_video_type = (video_codec == Mux::CODEC_H264) ? NAGERU_SHM_TYPE_H264 : NAGERU_SHM_TYPE_NV12;
+	if (type == main_video_type && (flags & NAGERU_SHM_FLAG_KEYFRAME)) {
+		__atomic_store_n(&hdr->last_keyframe_seq, seq, __ATOMIC_RELEASE);
+	}
+
+	write_pos = (end + data_alignment - 1) & ~(data_alignment - 1);
+
+	// Waking up is cheap if nobody is waiting.
+	__atomic_add_fetch(&hdr->futex, 1, __ATOMIC_RELEASE);
+	syscall(SYS_futex, &hdr->futex, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+
+	++metric_shm_output_packets;
+	metric_shm_output_bytes += size;
+}
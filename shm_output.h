@@ -0,0 +1,72 @@
+#ifndef _SHM_OUTPUT_H
+#define _SHM_OUTPUT_H 1
+
+// The writer side of the shared-memory output (--shm-output). Gets every
+// packet going into the main stream mux (see PacketTap), and optionally the
+// raw NV12 frames from the readback path, and puts them in a ring in POSIX
+// shared memory for local consumers. See nageru_shm.h for the layout and
+// for the reader library.
+//
+// Writing never waits for the readers; old packets are simply overwritten.
+// Each packet is copied once, into the ring, and readers can use it from
+// there without any further copies.
+//
+// The output outlives the muxes feeding it (see H264Encoder::PersistentOutputs),
+// so readers keep going across cuts; the next encoder's mux just gets
+// the same PacketTap.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <mutex>
+#include <string>
+
+#include "metrics.h"
+#include "mux.h"
+
+struct nageru_shm_header;
+struct nageru_shm_slot;
+
+class ShmOutput : public PacketTap {
+public:
+	// <name> is as for shm_open(), e.g. “/nageru”. Any existing segment
+	// with that name is replaced; readers still attached to it will see it
+	// as closed. <data_size> is rounded up to a power of two.
+	ShmOutput(const std::string &name, size_t data_size, int width, int height,
+	          Mux::Codec video_codec, const std::string &audio_codec_name);
+	~ShmOutput();
+
+	// Can be called from any thread.
+	void tap_packet(const AVPacket &pkt, int64_t pts, int64_t dts) override;
+	void add_raw_frame(int64_t pts, const uint8_t *nv12);
+
+private:
+	void add_packet(uint16_t type, uint16_t flags, const uint8_t *buf, size_t size, int64_t pts, int64_t dts);
+
+	const std::string name;
+	dev_t shm_dev;  // Identifies our segment, so that we never unlink somebody else's.
+	ino_t shm_ino;
+	const int width, height;
+	const Mux::Codec video_codec;
+
+	uint8_t *base;  // The entire mapping.
+	size_t mapping_size;
+	nageru_shm_header *hdr;
+	nageru_shm_slot *slots;
+	uint8_t *data;
+
+	// There is only a single writer, but packets come from several threads
+	// (video and audio encoders), so serialize them.
+	std::mutex write_mu;
+	uint64_t write_pos = 0;  // Under <write_mu>. Position in the data ring.
+
+	// Exported with the name as label.
+	const Metrics::Labels labels;
+	std::atomic<int64_t> metric_shm_output_packets{0};
+	std::atomic<int64_t> metric_shm_output_bytes{0};
+	std::atomic<int64_t> metric_shm_output_dropped_packets{0};
+};
+
+#endif  // !defined(_SHM_OUTPUT_H)
@@ -16,16 +16,22 @@
 #include <movit/white_balance_effect.h>
 #include <movit/ycbcr.h>
 #include <movit/ycbcr_input.h>
+#include <epoxy/egl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <algorithm>
+#include <chrono>
 #include <cstddef>
 #include <new>
 #include <utility>
 #include <memory>
 
+#include "context.h"
 #include "defs.h"
 #include "image_input.h"
+#include "metrics.h"
 #include "mixer.h"
+#include "video_input.h"
 
 namespace movit {
 class ResourcePool;
@@ -36,6 +42,24 @@ using namespace movit;
 
 extern Mixer *global_mixer;
 
+// Not in the anonymous namespace, since Theme holds on to some (see last_chains).
+class LuaRefWithDeleter {
+public:
+	LuaRefWithDeleter(mutex *m, lua_State *L, int ref) : m(m), L(L), ref(ref) {}
+	~LuaRefWithDeleter() {
+		unique_lock<mutex> lock(*m);
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+	}
+	int get() const { return ref; }
+
+private:
+	LuaRefWithDeleter(const LuaRefWithDeleter &) = delete;
+
+	mutex *m;
+	lua_State *L;
+	int ref;
+};
+
 namespace {
 
 // Contains basically the same data as InputState, but does not hold on to
@@ -57,6 +81,8 @@ InputStateInfo::InputStateInfo(const InputState &input_state)
 			last_width[signal_num] = last_height[signal_num] = 0;
 			last_interlaced[signal_num] = false;
 			last_has_signal[signal_num] = false;
+			last_frame_rate_nom[signal_num] = 0;
+			last_frame_rate_den[signal_num] = 1;
 			continue;
 		}
 		const PBOFrameAllocator::Userdata *userdata = (const PBOFrameAllocator::Userdata *)frame.frame->userdata;
@@ -69,22 +95,22 @@ InputStateInfo::InputStateInfo(const InputState &input_state)
 	}
 }
 
-class LuaRefWithDeleter {
-public:
-	LuaRefWithDeleter(mutex *m, lua_State *L, int ref) : m(m), L(L), ref(ref) {}
-	~LuaRefWithDeleter() {
-		unique_lock<mutex> lock(*m);
-		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+// Everything the theme can find out about the inputs through InputStateInfo,
+// so that we can tell whether get_chain() would be seeing the same as last time.
+vector<unsigned> get_input_formats(const InputStateInfo &info)
+{
+	vector<unsigned> ret;
+	ret.reserve(MAX_CARDS * 6);
+	for (unsigned signal_num = 0; signal_num < MAX_CARDS; ++signal_num) {
+		ret.push_back(info.last_width[signal_num]);
+		ret.push_back(info.last_height[signal_num]);
+		ret.push_back(info.last_interlaced[signal_num]);
+		ret.push_back(info.last_has_signal[signal_num]);
+		ret.push_back(info.last_frame_rate_nom[signal_num]);
+		ret.push_back(info.last_frame_rate_den[signal_num]);
 	}
-	int get() const { return ref; }
-
-private:
-	LuaRefWithDeleter(const LuaRefWithDeleter &) = delete;
-
-	mutex *m;
-	lua_State *L;
-	int ref;
-};
+	return ret;
+}
 
 template<class T, class... Args>
 int wrap_lua_object(lua_State* L, const char *class_name, Args&&... args)
@@ -138,7 +164,8 @@ Effect *get_effect(lua_State *L, int idx)
 	    luaL_testudata(L, idx, "ResizeEffect") ||
 	    luaL_testudata(L, idx, "MultiplyEffect") ||
 	    luaL_testudata(L, idx, "MixEffect") ||
-	    luaL_testudata(L, idx, "ImageInput")) {
+	    luaL_testudata(L, idx, "ImageInput") ||
+	    luaL_testudata(L, idx, "VideoInput")) {
 		return *(Effect **)lua_touserdata(L, idx);
 	}
 	luaL_error(L, "Error: Index #%d was not an Effect type\n", idx);
@@ -174,13 +201,36 @@ int EffectChain_new(lua_State* L)
 	int aspect_w = luaL_checknumber(L, 1);
 	int aspect_h = luaL_checknumber(L, 2);
 
-	return wrap_lua_object<EffectChain>(L, "EffectChain", aspect_w, aspect_h, theme->get_resource_pool());
+	int ret = wrap_lua_object<EffectChain>(L, "EffectChain", aspect_w, aspect_h, theme->get_resource_pool());
+
+	// Name the chain after where it was created (e.g. “theme.lua:83”)
+	// until the theme gives it a better name.
+	EffectChain *chain = (EffectChain *)lua_touserdata(L, -1);
+	luaL_where(L, 1);
+	string where = checkstdstring(L, -1);
+	lua_pop(L, 1);
+	while (!where.empty() && (where.back() == ' ' || where.back() == ':')) {
+		where.pop_back();
+	}
+	theme->set_chain_name(chain, where);
+	return ret;
+}
+
+int EffectChain_set_name(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	Theme *theme = get_theme_updata(L);
+	EffectChain *chain = (EffectChain *)luaL_checkudata(L, 1, "EffectChain");
+	theme->set_chain_name(chain, checkstdstring(L, 2));
+	return 0;
 }
 
 int EffectChain_gc(lua_State* L)
 {
 	assert(lua_gettop(L) == 1);
+	Theme *theme = get_theme_updata(L);
 	EffectChain *chain = (EffectChain *)luaL_checkudata(L, 1, "EffectChain");
+	theme->forget_chain(chain);
 	chain->~EffectChain();
 	return 0;
 }
@@ -188,20 +238,23 @@ int EffectChain_gc(lua_State* L)
 int EffectChain_add_live_input(lua_State* L)
 {
 	assert(lua_gettop(L) == 3);
-	Theme *theme = get_theme_updata(L);
 	EffectChain *chain = (EffectChain *)luaL_checkudata(L, 1, "EffectChain");
 	bool override_bounce = checkbool(L, 2);
 	bool deinterlace = checkbool(L, 3);
-	return wrap_lua_object<LiveInputWrapper>(L, "LiveInputWrapper", theme, chain, override_bounce, deinterlace);
+	return wrap_lua_object<LiveInputWrapper>(L, "LiveInputWrapper", chain, override_bounce, deinterlace);
 }
 
 int EffectChain_add_effect(lua_State* L)
 {
 	assert(lua_gettop(L) >= 2);
+	Theme *theme = get_theme_updata(L);
 	EffectChain *chain = (EffectChain *)luaL_checkudata(L, 1, "EffectChain");
 
 	// TODO: Better error reporting.
 	Effect *effect = get_effect(L, 2);
+	if (luaL_testudata(L, 2, "VideoInput")) {
+		theme->add_video_input(chain, (VideoInput *)effect);
+	}
 	if (lua_gettop(L) == 2) {
 		if (effect->num_inputs() == 0) {
 			chain->add_input((Input *)effect);
@@ -233,6 +286,7 @@ int EffectChain_add_effect(lua_State* L)
 int EffectChain_finalize(lua_State* L)
 {
 	assert(lua_gettop(L) == 2);
+	Theme *theme = get_theme_updata(L);
 	EffectChain *chain = (EffectChain *)luaL_checkudata(L, 1, "EffectChain");
 	bool is_main_chain = checkbool(L, 2);
 
@@ -271,26 +325,97 @@ int EffectChain_finalize(lua_State* L)
 	}
 	chain->add_output(inout_format, OUTPUT_ALPHA_FORMAT_POSTMULTIPLIED);
 
-	chain->finalize();
+	// Compiling the shaders is the expensive part, and most themes have
+	// many chains that are rarely or never used, so the actual finalization
+	// waits until the chain is needed (see Theme::get_chain()).
+	theme->add_chain_to_finalize(chain);
+	return 0;
+}
+
+int EffectChain_warm_up(lua_State* L)
+{
+	assert(lua_gettop(L) == 1);
+	Theme *theme = get_theme_updata(L);
+	EffectChain *chain = (EffectChain *)luaL_checkudata(L, 1, "EffectChain");
+	theme->warm_up_chain(chain);
 	return 0;
 }
 
 int LiveInputWrapper_connect_signal(lua_State* L)
 {
 	assert(lua_gettop(L) == 2);
+	Theme *theme = get_theme_updata(L);
 	LiveInputWrapper *input = (LiveInputWrapper *)luaL_checkudata(L, 1, "LiveInputWrapper");
 	int signal_num = luaL_checknumber(L, 2);
-	input->connect_signal(signal_num);
+
+	// Outside of a chain setup function (e.g. when the theme builds its
+	// chains on startup), there are no frames to connect to, so there is
+	// nothing to do.
+	ChainSetup *setup = theme->get_recording_setup();
+	if (setup != nullptr) {
+		ChainSetup::Step step;
+		step.type = ChainSetup::Step::CONNECT_SIGNAL;
+		step.input = input;
+		step.int_value = theme->map_signal(signal_num);
+		setup->steps.push_back(step);
+	}
 	return 0;
 }
 
 int ImageInput_new(lua_State* L)
 {
-	assert(lua_gettop(L) == 1);
+	assert(lua_gettop(L) == 1 || lua_gettop(L) == 3);
 	string filename = checkstdstring(L, 1);
+	if (lua_gettop(L) == 3) {
+		// Maximum size; the image is scaled down to fit on load.
+		unsigned max_width = luaL_checknumber(L, 2);
+		unsigned max_height = luaL_checknumber(L, 3);
+		return wrap_lua_object_nonowned<ImageInput>(L, "ImageInput", filename, max_width, max_height);
+	}
 	return wrap_lua_object_nonowned<ImageInput>(L, "ImageInput", filename);
 }
 
+int VideoInput_new(lua_State* L)
+{
+	assert(lua_gettop(L) == 1);
+	string filename = checkstdstring(L, 1);
+	return wrap_lua_object_nonowned<VideoInput>(L, "VideoInput", filename);
+}
+
+int VideoInput_play(lua_State* L)
+{
+	assert(lua_gettop(L) == 1);
+	VideoInput *input = *(VideoInput **)luaL_checkudata(L, 1, "VideoInput");
+	input->play();
+	return 0;
+}
+
+int VideoInput_pause(lua_State* L)
+{
+	assert(lua_gettop(L) == 1);
+	VideoInput *input = *(VideoInput **)luaL_checkudata(L, 1, "VideoInput");
+	input->pause();
+	return 0;
+}
+
+int VideoInput_seek(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	VideoInput *input = *(VideoInput **)luaL_checkudata(L, 1, "VideoInput");
+	double seconds = luaL_checknumber(L, 2);
+	input->seek(seconds);
+	return 0;
+}
+
+int VideoInput_set_loop(lua_State* L)
+{
+	assert(lua_gettop(L) == 2);
+	VideoInput *input = *(VideoInput **)luaL_checkudata(L, 1, "VideoInput");
+	bool loop = checkbool(L, 2);
+	input->set_loop(loop);
+	return 0;
+}
+
 int WhiteBalanceEffect_new(lua_State* L)
 {
 	assert(lua_gettop(L) == 0);
@@ -399,12 +524,34 @@ int InputStateInfo_get_frame_rate_den(lua_State* L)
 	return 1;
 }
 
+// If we are running a chain setup function, records the parameter change
+// instead of making it (see ChainSetup), and returns true.
+bool record_parameter(lua_State *L, ChainSetup::Step::Type type, Effect *effect, const string &key, int int_value, const float *values, unsigned num_values)
+{
+	Theme *theme = get_theme_updata(L);
+	ChainSetup *setup = theme->get_recording_setup();
+	if (setup == nullptr) {
+		return false;
+	}
+	ChainSetup::Step step;
+	step.type = type;
+	step.effect = effect;
+	step.key = key;
+	step.int_value = int_value;
+	copy(values, values + num_values, step.values);
+	setup->steps.push_back(step);
+	return true;
+}
+
 int Effect_set_float(lua_State *L)
 {
 	assert(lua_gettop(L) == 3);
 	Effect *effect = (Effect *)get_effect(L, 1);
 	string key = checkstdstring(L, 2);
 	float value = luaL_checknumber(L, 3);
+	if (record_parameter(L, ChainSetup::Step::SET_FLOAT, effect, key, 0, &value, 1)) {
+		return 0;
+	}
 	if (!effect->set_float(key, value)) {
 		luaL_error(L, "Effect refused set_float(\"%s\", %d) (invalid key?)", key.c_str(), int(value));
 	}
@@ -417,6 +564,9 @@ int Effect_set_int(lua_State *L)
 	Effect *effect = (Effect *)get_effect(L, 1);
 	string key = checkstdstring(L, 2);
 	float value = luaL_checknumber(L, 3);
+	if (record_parameter(L, ChainSetup::Step::SET_INT, effect, key, value, nullptr, 0)) {
+		return 0;
+	}
 	if (!effect->set_int(key, value)) {
 		luaL_error(L, "Effect refused set_int(\"%s\", %d) (invalid key?)", key.c_str(), int(value));
 	}
@@ -432,6 +582,9 @@ int Effect_set_vec3(lua_State *L)
 	v[0] = luaL_checknumber(L, 3);
 	v[1] = luaL_checknumber(L, 4);
 	v[2] = luaL_checknumber(L, 5);
+	if (record_parameter(L, ChainSetup::Step::SET_VEC3, effect, key, 0, v, 3)) {
+		return 0;
+	}
 	if (!effect->set_vec3(key, v)) {
 		luaL_error(L, "Effect refused set_vec3(\"%s\", %f, %f, %f) (invalid key?)", key.c_str(),
 			v[0], v[1], v[2]);
@@ -449,6 +602,9 @@ int Effect_set_vec4(lua_State *L)
 	v[1] = luaL_checknumber(L, 4);
 	v[2] = luaL_checknumber(L, 5);
 	v[3] = luaL_checknumber(L, 6);
+	if (record_parameter(L, ChainSetup::Step::SET_VEC4, effect, key, 0, v, 4)) {
+		return 0;
+	}
 	if (!effect->set_vec4(key, v)) {
 		luaL_error(L, "Effect refused set_vec4(\"%s\", %f, %f, %f, %f) (invalid key?)", key.c_str(),
 			v[0], v[1], v[2], v[3]);
@@ -462,6 +618,8 @@ const luaL_Reg EffectChain_funcs[] = {
 	{ "add_live_input", EffectChain_add_live_input },
 	{ "add_effect", EffectChain_add_effect },
 	{ "finalize", EffectChain_finalize },
+	{ "warm_up", EffectChain_warm_up },
+	{ "set_name", EffectChain_set_name },
 	{ NULL, NULL }
 };
 
@@ -479,6 +637,19 @@ const luaL_Reg ImageInput_funcs[] = {
 	{ NULL, NULL }
 };
 
+const luaL_Reg VideoInput_funcs[] = {
+	{ "new", VideoInput_new },
+	{ "play", VideoInput_play },
+	{ "pause", VideoInput_pause },
+	{ "seek", VideoInput_seek },
+	{ "set_loop", VideoInput_set_loop },
+	{ "set_float", Effect_set_float },
+	{ "set_int", Effect_set_int },
+	{ "set_vec3", Effect_set_vec3 },
+	{ "set_vec4", Effect_set_vec4 },
+	{ NULL, NULL }
+};
+
 const luaL_Reg WhiteBalanceEffect_funcs[] = {
 	{ "new", WhiteBalanceEffect_new },
 	{ "set_float", Effect_set_float },
@@ -563,9 +734,37 @@ const luaL_Reg InputStateInfo_funcs[] = {
 
 }  // namespace
 
-LiveInputWrapper::LiveInputWrapper(Theme *theme, EffectChain *chain, bool override_bounce, bool deinterlace)
-	: theme(theme),
-	  deinterlace(deinterlace)
+void ChainSetup::apply(const InputState &input_state) const
+{
+	for (const Step &step : steps) {
+		bool ok = true;
+		switch (step.type) {
+		case Step::SET_INT:
+			ok = step.effect->set_int(step.key, step.int_value);
+			break;
+		case Step::SET_FLOAT:
+			ok = step.effect->set_float(step.key, step.values[0]);
+			break;
+		case Step::SET_VEC3:
+			ok = step.effect->set_vec3(step.key, step.values);
+			break;
+		case Step::SET_VEC4:
+			ok = step.effect->set_vec4(step.key, step.values);
+			break;
+		case Step::CONNECT_SIGNAL:
+			step.input->connect_card(step.int_value, input_state);
+			break;
+		}
+		if (!ok) {
+			fprintf(stderr, "error running chain setup callback: Effect refused setting \"%s\" (invalid key?)\n",
+				step.key.c_str());
+			exit(1);
+		}
+	}
+}
+
+LiveInputWrapper::LiveInputWrapper(EffectChain *chain, bool override_bounce, bool deinterlace)
+	: deinterlace(deinterlace)
 {
 	ImageFormat inout_format;
 	inout_format.color_space = COLORSPACE_sRGB;
@@ -623,16 +822,14 @@ LiveInputWrapper::LiveInputWrapper(Theme *theme, EffectChain *chain, bool overri
 	}
 }
 
-void LiveInputWrapper::connect_signal(int signal_num)
+void LiveInputWrapper::connect_card(unsigned card_index, const InputState &input_state)
 {
 	if (global_mixer == nullptr) {
 		// No data yet.
 		return;
 	}
 
-	signal_num = theme->map_signal(signal_num);
-
-	BufferedFrame first_frame = theme->input_state->buffered_frames[signal_num][0];
+	BufferedFrame first_frame = input_state.buffered_frames[card_index][0];
 	if (first_frame.frame == nullptr) {
 		// No data yet.
 		return;
@@ -646,7 +843,7 @@ void LiveInputWrapper::connect_signal(int signal_num)
 
 	BufferedFrame last_good_frame = first_frame;
 	for (unsigned i = 0; i < inputs.size(); ++i) {
-		BufferedFrame frame = theme->input_state->buffered_frames[signal_num][i];
+		BufferedFrame frame = input_state.buffered_frames[card_index][i];
 		if (frame.frame == nullptr) {
 			// Not enough data; reuse last frame (well, field).
 			// This is suboptimal, but we have nothing better.
@@ -670,7 +867,7 @@ void LiveInputWrapper::connect_signal(int signal_num)
 	}
 
 	if (deinterlace) {
-		BufferedFrame frame = theme->input_state->buffered_frames[signal_num][0];
+		BufferedFrame frame = input_state.buffered_frames[card_index][0];
 		CHECK(deinterlace_effect->set_int("current_field_position", frame.field_number));
 	}
 }
@@ -694,15 +891,24 @@ int call_num_channels(lua_State *L)
 
 }  // namespace
 
-Theme::Theme(const char *filename, ResourcePool *resource_pool, unsigned num_cards)
+Theme::Theme(const char *filename, ResourcePool *resource_pool, unsigned num_cards, QSurface *finalize_surface)
 	: resource_pool(resource_pool), num_cards(num_cards)
 {
+	global_metrics.add("theme_chains_finalized", &metric_chains_finalized);
+	global_metrics.add("theme_chain_fallbacks", &metric_chain_fallbacks);
+	global_metrics.add("theme_chain_stalls", &metric_chain_stalls);
+	global_metrics.add("theme_get_chain_calls", {{ "cached", "true" }}, &metric_get_chain_cached);
+	global_metrics.add("theme_get_chain_calls", {{ "cached", "false" }}, &metric_get_chain_uncached);
+	global_metrics.add("theme_get_chain_lua_seconds", &metric_get_chain_lua_seconds, Metrics::TYPE_COUNTER);
+	finalize_thread = thread(&Theme::finalize_thread_func, this, finalize_surface);
+
 	L = luaL_newstate();
         luaL_openlibs(L);
 
 	register_class("EffectChain", EffectChain_funcs); 
 	register_class("LiveInputWrapper", LiveInputWrapper_funcs); 
 	register_class("ImageInput", ImageInput_funcs);
+	register_class("VideoInput", VideoInput_funcs);
 	register_class("WhiteBalanceEffect", WhiteBalanceEffect_funcs);
 	register_class("ResampleEffect", ResampleEffect_funcs);
 	register_class("PaddingEffect", PaddingEffect_funcs);
@@ -728,9 +934,147 @@ Theme::Theme(const char *filename, ResourcePool *resource_pool, unsigned num_car
 
 Theme::~Theme()
 {
+	{
+		unique_lock<mutex> lock(finalize_m);
+		finalize_thread_should_quit = true;
+		finalize_changed.notify_all();
+	}
+	finalize_thread.join();
+
+	last_chains.clear();  // Needs the Lua state.
 	lua_close(L);
 }
 
+void Theme::add_chain_to_finalize(EffectChain *chain)
+{
+	unique_lock<mutex> lock(finalize_m);
+	finalize_state[chain] = NOT_FINALIZED;
+}
+
+void Theme::warm_up_chain(EffectChain *chain)
+{
+	unique_lock<mutex> lock(finalize_m);
+	auto it = finalize_state.find(chain);
+	if (it != finalize_state.end() && it->second == NOT_FINALIZED) {
+		// Behind anything that is actually wanted right now.
+		finalize_queue.push_back(chain);
+		it->second = QUEUED;
+		finalize_changed.notify_all();
+	}
+}
+
+void Theme::forget_chain(EffectChain *chain)
+{
+	// We are called from Lua, so <m> is held.
+	chain_names.erase(chain);
+	for (auto it = cached_chains.begin(); it != cached_chains.end(); ) {
+		if (it->second.chain == chain) {
+			it = cached_chains.erase(it);
+		} else {
+			++it;
+		}
+	}
+
+	unique_lock<mutex> lock(finalize_m);
+	finalize_changed.wait(lock, [this, chain]{
+		return finalize_state.count(chain) == 0 || finalize_state[chain] != FINALIZING;
+	});
+	finalize_queue.erase(remove(finalize_queue.begin(), finalize_queue.end(), chain), finalize_queue.end());
+	finalize_state.erase(chain);
+}
+
+bool Theme::request_finalize(EffectChain *chain)
+{
+	unique_lock<mutex> lock(finalize_m);
+	auto it = finalize_state.find(chain);
+	if (it == finalize_state.end()) {
+		// Never finalized from Lua; Movit will complain when we try to render it.
+		return true;
+	}
+	switch (it->second) {
+	case FINALIZED:
+		return true;
+	case FINALIZING:
+		return false;
+	case QUEUED:
+		finalize_queue.erase(find(finalize_queue.begin(), finalize_queue.end(), chain));
+		break;
+	case NOT_FINALIZED:
+		break;
+	}
+	finalize_queue.push_front(chain);
+	it->second = QUEUED;
+	finalize_changed.notify_all();
+	return false;
+}
+
+bool Theme::is_finalized(EffectChain *chain)
+{
+	unique_lock<mutex> lock(finalize_m);
+	auto it = finalize_state.find(chain);
+	return it == finalize_state.end() || it->second == FINALIZED;
+}
+
+void Theme::finalize_chain_now(EffectChain *chain)
+{
+	unique_lock<mutex> lock(finalize_m);
+	finalize_changed.wait(lock, [this, chain]{ return finalize_state[chain] != FINALIZING; });
+	if (finalize_state[chain] == FINALIZED) {
+		return;
+	}
+	finalize_queue.erase(remove(finalize_queue.begin(), finalize_queue.end(), chain), finalize_queue.end());
+	finalize_state[chain] = FINALIZING;
+	lock.unlock();
+
+	chain->finalize();
+	++metric_chains_finalized;
+
+	lock.lock();
+	finalize_state[chain] = FINALIZED;
+	finalize_changed.notify_all();
+}
+
+void Theme::finalize_thread_func(QSurface *surface)
+{
+	eglBindAPI(EGL_OPENGL_API);
+	QOpenGLContext *context = create_context(surface);
+	if (!make_current(context, surface)) {
+		printf("Couldn't make context current\n");
+		exit(1);
+	}
+
+	for ( ;; ) {
+		EffectChain *chain;
+		{
+			unique_lock<mutex> lock(finalize_m);
+			finalize_changed.wait(lock, [this]{ return finalize_thread_should_quit || !finalize_queue.empty(); });
+			if (finalize_thread_should_quit) {
+				break;
+			}
+			chain = finalize_queue.front();
+			finalize_queue.pop_front();
+			finalize_state[chain] = FINALIZING;
+		}
+
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		chain->finalize();
+
+		// Make sure the programs are completely done before any other
+		// context gets to use them.
+		glFinish();
+		++metric_chains_finalized;
+
+		double elapsed_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		if (elapsed_ms > 100.0) {
+			fprintf(stderr, "Finalizing a chain in the background took %.0f ms.\n", elapsed_ms);
+		}
+
+		unique_lock<mutex> lock(finalize_m);
+		finalize_state[chain] = FINALIZED;
+		finalize_changed.notify_all();
+	}
+}
+
 void Theme::register_class(const char *class_name, const luaL_Reg *funcs)
 {
 	assert(lua_gettop(L) == 0);
@@ -743,11 +1087,9 @@ void Theme::register_class(const char *class_name, const luaL_Reg *funcs)
 	assert(lua_gettop(L) == 0);
 }
 
-Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned height, InputState input_state) 
+bool Theme::call_get_chain(unsigned num, float t, unsigned width, unsigned height, const InputState &input_state, int quality,
+                           EffectChain **chain, shared_ptr<ChainSetup> *setup, vector<shared_ptr<LuaRefWithDeleter>> *discarded_funcrefs)
 {
-	Chain chain;
-
-	unique_lock<mutex> lock(m);
 	assert(lua_gettop(L) == 0);
 	lua_getglobal(L, "get_chain");  /* function to be called */
 	lua_pushnumber(L, num);
@@ -755,49 +1097,174 @@ Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned he
 	lua_pushnumber(L, width);
 	lua_pushnumber(L, height);
 	wrap_lua_object<InputStateInfo>(L, "InputStateInfo", input_state);
+	lua_pushnumber(L, quality);
 
-	if (lua_pcall(L, 5, 2, 0) != 0) {
+	if (lua_pcall(L, 6, 5, 0) != 0) {
 		fprintf(stderr, "error running function `get_chain': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
 
-	chain.chain = (EffectChain *)luaL_testudata(L, -2, "EffectChain");
-	if (chain.chain == nullptr) {
+	// The fallback chain and its setup function are optional.
+	EffectChain *fallback_chain = nullptr;
+	shared_ptr<LuaRefWithDeleter> fallback_funcref;
+	if (!lua_isnil(L, -2)) {
+		fallback_chain = (EffectChain *)luaL_testudata(L, -2, "EffectChain");
+		if (fallback_chain == nullptr) {
+			fprintf(stderr, "get_chain() for chain number %d did not return an EffectChain as fallback\n",
+				num);
+			exit(1);
+		}
+		if (!lua_isfunction(L, -1)) {
+			fprintf(stderr, "Argument #-1 should be a function\n");
+			exit(1);
+		}
+		fallback_funcref.reset(new LuaRefWithDeleter(&m, L, luaL_ref(L, LUA_REGISTRYINDEX)));
+	} else {
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
+
+	*chain = (EffectChain *)luaL_testudata(L, -3, "EffectChain");
+	if (*chain == nullptr) {
 		fprintf(stderr, "get_chain() for chain number %d did not return an EffectChain\n",
 			num);
 		exit(1);
 	}
-	if (!lua_isfunction(L, -1)) {
-		fprintf(stderr, "Argument #-1 should be a function\n");
+	if (!lua_isfunction(L, -2)) {
+		fprintf(stderr, "Argument #-2 should be a function\n");
 		exit(1);
 	}
-	lua_pushvalue(L, -1);
+	bool stable = lua_toboolean(L, -1);  // Optional, so nil means false.
+	lua_pushvalue(L, -2);
 	shared_ptr<LuaRefWithDeleter> funcref(new LuaRefWithDeleter(&m, L, luaL_ref(L, LUA_REGISTRYINDEX)));
-	lua_pop(L, 2);
+	lua_pop(L, 3);
 	assert(lua_gettop(L) == 0);
 
-	chain.setup_chain = [this, funcref, input_state]{
-		unique_lock<mutex> lock(m);
+	// If the chain is not ready yet, show the cheaper variant of the same
+	// scene the theme gave us, if that is ready, while the chain is being
+	// finalized, instead of stalling; this is not something to keep.
+	// If there is none, previews can show the last chain we gave out for
+	// this channel (with its old setup) instead, but for the live output,
+	// that is typically the scene we just transitioned away from, so as a
+	// last resort, we need to wait (which is why themes should warm_up()
+	// their fallbacks early, and anything a transition can pick).
+	if (!request_finalize(*chain)) {
+		if (fallback_chain != nullptr && is_finalized(fallback_chain)) {
+			stable = false;
+			discarded_funcrefs->push_back(move(funcref));
+			*chain = fallback_chain;
+			funcref = move(fallback_funcref);
+			++metric_chain_fallbacks;
+		} else if (num != 0 && last_chains.count(num)) {
+			stable = false;
+			discarded_funcrefs->push_back(move(funcref));
+			*chain = last_chains[num].first;
+			funcref = last_chains[num].second;
+			++metric_chain_fallbacks;
+		} else {
+			++metric_chain_stalls;
+			finalize_chain_now(*chain);
+		}
+	}
+	if (funcref != last_chains[num].second) {
+		discarded_funcrefs->push_back(move(last_chains[num].second));
+		last_chains[num] = make_pair(*chain, funcref);
+	}
+	if (fallback_funcref != nullptr) {
+		discarded_funcrefs->push_back(move(fallback_funcref));
+	}
 
-		this->input_state = &input_state;
+	// Run the setup function now, recording what it does instead of doing it,
+	// so that applying it right before rendering (which, for previews whose
+	// size on screen is not known yet, happens in the UI thread) needs
+	// neither Lua nor <m>.
+	setup->reset(new ChainSetup);
+	recording_setup = setup->get();
+	lua_rawgeti(L, LUA_REGISTRYINDEX, funcref->get());
+	if (lua_pcall(L, 0, 0, 0) != 0) {
+		fprintf(stderr, "error running chain setup callback: %s\n", lua_tostring(L, -1));
+		exit(1);
+	}
+	recording_setup = nullptr;
+	assert(lua_gettop(L) == 0);
 
-		// Set up state, including connecting signals.
-		lua_rawgeti(L, LUA_REGISTRYINDEX, funcref->get());
-		if (lua_pcall(L, 0, 0, 0) != 0) {
-			fprintf(stderr, "error running chain setup callback: %s\n", lua_tostring(L, -1));
-			exit(1);
+	return stable;
+}
+
+Theme::Chain Theme::get_chain(unsigned num, float t, unsigned width, unsigned height, InputState input_state, int quality)
+{
+	Chain chain;
+	shared_ptr<ChainSetup> setup;
+	vector<shared_ptr<LuaRefWithDeleter>> discarded_funcrefs;  // Need to be freed without <m> held.
+
+	unique_lock<mutex> lock(m);
+	vector<unsigned> input_formats = get_input_formats(InputStateInfo(input_state));
+	auto cache_it = cached_chains.find(num);
+	if (cache_it != cached_chains.end() &&
+	    cache_it->second.width == width &&
+	    cache_it->second.height == height &&
+	    cache_it->second.quality == quality &&
+	    cache_it->second.input_formats == input_formats) {
+		// The theme would give us the same chain and setup as last time.
+		chain.chain = cache_it->second.chain;
+		setup = cache_it->second.setup;
+		++metric_get_chain_cached;
+	} else {
+		chrono::steady_clock::time_point start = chrono::steady_clock::now();
+		bool stable = call_get_chain(num, t, width, height, input_state, quality, &chain.chain, &setup, &discarded_funcrefs);
+		if (stable) {
+			cached_chains[num] = CachedChain{ chain.chain, setup, width, height, quality, move(input_formats) };
+		} else {
+			cached_chains.erase(num);
 		}
-		assert(lua_gettop(L) == 0);
-	};
+		++metric_get_chain_uncached;
+		metric_get_chain_lua_seconds = metric_get_chain_lua_seconds +
+			chrono::duration<double>(chrono::steady_clock::now() - start).count();
+	}
+	chain.name = chain_names[chain.chain];
+
+	// Pick the frames for any video inputs now and not in setup_chain,
+	// since the chain can be rendered a good while later (e.g. for previews),
+	// and we want it to match the pts. The frames go into input_frames,
+	// so that the decoder does not reuse them while they are being uploaded.
+	vector<pair<VideoInput *, RefCountedFrame>> video_frames;
+	for (VideoInput *video_input : video_inputs[chain.chain]) {
+		RefCountedFrame frame = video_input->get_frame(t);
+		video_frames.emplace_back(video_input, frame);
+		if (frame != nullptr) {
+			chain.input_frames.push_back(frame);
+		}
+	}
 
-	// TODO: Can we do better, e.g. by running setup_chain() and seeing what it references?
-	// Actually, setup_chain does maybe hold all the references we need now anyway?
-	for (unsigned card_index = 0; card_index < num_cards; ++card_index) {
-		for (unsigned frame_num = 0; frame_num < FRAME_HISTORY_LENGTH; ++frame_num) {
-			chain.input_frames.push_back(input_state.buffered_frames[card_index][frame_num].frame);
+	// Hold on to only the frames the setup is actually going to connect
+	// (only the newest one, unless deinterlacing), both until rendering
+	// and until the GPU is done with them (through input_frames).
+	// Holding on to the entire history of every card for every channel
+	// would keep the capture cards' frame allocators from getting
+	// their frames back in time.
+	InputState used_input_state;
+	for (const ChainSetup::Step &step : setup->steps) {
+		if (step.type != ChainSetup::Step::CONNECT_SIGNAL) {
+			continue;
+		}
+		unsigned card_index = step.int_value;
+		for (unsigned frame_num = 0; frame_num < step.input->get_num_frames_used(); ++frame_num) {
+			const BufferedFrame &frame = input_state.buffered_frames[card_index][frame_num];
+			if (frame.frame != nullptr && used_input_state.buffered_frames[card_index][frame_num].frame == nullptr) {
+				used_input_state.buffered_frames[card_index][frame_num] = frame;
+				chain.input_frames.push_back(frame.frame);
+			}
 		}
 	}
 
+	chain.setup_chain = [this, setup, used_input_state, video_frames]{
+		unique_lock<mutex> lock(setup_m);
+		for (const pair<VideoInput *, RefCountedFrame> &video_frame : video_frames) {
+			video_frame.first->set_frame(video_frame.second);
+		}
+		setup->apply(used_input_state);
+	};
+
 	return chain;
 }
 
@@ -878,6 +1345,7 @@ void Theme::set_wb(unsigned channel, double r, double g, double b)
 		exit(1);
 	}
 
+	cached_chains.clear();  // The theme's state may have changed.
 	assert(lua_gettop(L) == 0);
 }
 
@@ -918,7 +1386,12 @@ int Theme::map_signal(int signal_num)
 
 void Theme::set_signal_mapping(int signal_num, int card_num)
 {
-	unique_lock<mutex> lock(map_m);
+	// The recorded setups (and what the theme saw of the inputs)
+	// have the old mapping baked in.
+	unique_lock<mutex> lock(m);
+	cached_chains.clear();
+
+	unique_lock<mutex> map_lock(map_m);
 	assert(card_num < int(num_cards));
 	signal_to_card_mapping[signal_num] = card_num;
 }
@@ -934,6 +1407,7 @@ void Theme::transition_clicked(int transition_num, float t)
 		fprintf(stderr, "error running function `transition_clicked': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
+	cached_chains.clear();  // The theme's state may have changed.
 	assert(lua_gettop(L) == 0);
 }
 
@@ -947,5 +1421,6 @@ void Theme::channel_clicked(int preview_num)
 		fprintf(stderr, "error running function `channel_clicked': %s\n", lua_tostring(L, -1));
 		exit(1);
 	}
+	cached_chains.clear();  // The theme's state may have changed.
 	assert(lua_gettop(L) == 0);
 }
@@ -8,10 +8,16 @@
 #include <movit/ycbcr_input.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
 #include <functional>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
@@ -19,7 +25,13 @@
 #include "input_state.h"
 #include "ref_counted_frame.h"
 
+class LiveInputWrapper;
+class LuaRefWithDeleter;
+class QSurface;
+class VideoInput;
+
 namespace movit {
+class Effect;
 class ResourcePool;
 struct ImageFormat;
 struct YCbCrFormat;
@@ -36,9 +48,32 @@ public:
 	bool override_disable_bounce() const override { return true; }
 };
 
+// What a chain's setup function in the theme does (setting effect parameters
+// and connecting signals), recorded when the chain is handed out
+// (see Theme::get_chain()), so that it can be applied right before rendering,
+// from any thread, without running Lua.
+struct ChainSetup {
+	struct Step {
+		enum Type { SET_INT, SET_FLOAT, SET_VEC3, SET_VEC4, CONNECT_SIGNAL };
+		Type type;
+		movit::Effect *effect = nullptr;  // Unless CONNECT_SIGNAL.
+		LiveInputWrapper *input = nullptr;  // Only for CONNECT_SIGNAL.
+		std::string key;
+		int int_value = 0;  // For SET_INT, and the card (the signal, mapped) for CONNECT_SIGNAL.
+		float values[4];  // For SET_FLOAT (one value) and SET_VEC3/SET_VEC4.
+	};
+	std::vector<Step> steps;
+
+	// Exits if an effect refuses a parameter, like the theme would have
+	// if it set the parameter directly.
+	void apply(const InputState &input_state) const;
+};
+
 class Theme {
 public:
-	Theme(const char *filename, movit::ResourcePool *resource_pool, unsigned num_cards);
+	// Chains are finalized in the background, using an OpenGL context
+	// on <finalize_surface>; see get_chain().
+	Theme(const char *filename, movit::ResourcePool *resource_pool, unsigned num_cards, QSurface *finalize_surface);
 	~Theme();
 
 	struct Chain {
@@ -47,9 +82,26 @@ public:
 
 		// May have duplicates.
 		std::vector<RefCountedFrame> input_frames;
+
+		// For instrumentation (see gpu_timing.h). Set by EffectChain:set_name()
+		// in the theme, or where the chain was created if not.
+		std::string name;
 	};
 
-	Chain get_chain(unsigned num, float t, unsigned width, unsigned height, InputState input_state);
+	// Must be called with an OpenGL context current. If the chain the theme
+	// wants has not been finalized yet, it is finalized in the background,
+	// and the cheaper fallback chain the theme gave along with it is returned
+	// instead, if that one is ready; if not, previews get the last chain given
+	// out for <num> (with the same setup as last time), so that we do not
+	// stall the mixer. Only if neither is possible do we finalize right away.
+	//
+	// If the theme said the chain it gave out last time for <num> was stable,
+	// and nothing it could look at has changed since (see cached_chains),
+	// we give out the same chain and setup again without asking it.
+	//
+	// <quality> is a hint from QualityGovernor; at QUALITY_REDUCED,
+	// the theme should pick cheaper chains if it can.
+	Chain get_chain(unsigned num, float t, unsigned width, unsigned height, InputState input_state, int quality);
 
 	int get_num_channels() const { return num_channels; }
 	int map_signal(int signal_num);
@@ -68,27 +120,117 @@ public:
 
 	movit::ResourcePool *get_resource_pool() const { return resource_pool; }
 
+	// Called from Lua (so with <m> held) when a VideoInput is added to a chain,
+	// so that get_chain() knows to pick a frame for it.
+	void add_video_input(movit::EffectChain *chain, VideoInput *input)
+	{
+		video_inputs[chain].push_back(input);
+	}
+
+	// If we are running a chain's setup function (from get_chain()), where to
+	// record what it does instead of doing it; nullptr otherwise.
+	// Called from Lua (so with <m> held).
+	ChainSetup *get_recording_setup() const { return recording_setup; }
+
+	// Called from Lua (so with <m> held).
+	void set_chain_name(movit::EffectChain *chain, const std::string &name)
+	{
+		chain_names[chain] = name;
+	}
+
+	// Called from Lua when a chain is finalized (or garbage-collected).
+	// The actual movit::EffectChain::finalize() happens later, on demand
+	// (see get_chain()), or in the background after warm_up_chain().
+	void add_chain_to_finalize(movit::EffectChain *chain);
+	void warm_up_chain(movit::EffectChain *chain);
+	void forget_chain(movit::EffectChain *chain);
+
 private:
 	void register_class(const char *class_name, const luaL_Reg *funcs);
 
+	enum FinalizeState { NOT_FINALIZED, QUEUED, FINALIZING, FINALIZED };
+
+	// Returns true if the chain is ready to render; if not, puts it first
+	// in line for the finalize thread.
+	bool request_finalize(movit::EffectChain *chain);
+
+	// Returns true if the chain is ready to render, without queuing it.
+	bool is_finalized(movit::EffectChain *chain);
+
+	// Finalizes the chain in the calling thread (which must have an OpenGL
+	// context), unless the finalize thread is already on it, in which case
+	// we wait for that.
+	void finalize_chain_now(movit::EffectChain *chain);
+
+	void finalize_thread_func(QSurface *surface);
+
+	// The uncached part of get_chain(): Asks the theme for the chain (falling
+	// back as described above if it is not finalized yet) and records its setup.
+	// Returns whether the theme said the chain was stable. <m> must be held.
+	bool call_get_chain(unsigned num, float t, unsigned width, unsigned height, const InputState &input_state, int quality,
+	                    movit::EffectChain **chain, std::shared_ptr<ChainSetup> *setup,
+	                    std::vector<std::shared_ptr<LuaRefWithDeleter>> *discarded_funcrefs);
+
 	std::mutex m;
 	lua_State *L;  // Protected by <m>.
-	const InputState *input_state;  // Protected by <m>. Only set temporarily, during chain setup.
+	ChainSetup *recording_setup = nullptr;  // Protected by <m>. Only set temporarily, in get_chain().
 	movit::ResourcePool *resource_pool;
+	std::map<movit::EffectChain *, std::vector<VideoInput *>> video_inputs;  // Protected by <m>.
+	std::map<movit::EffectChain *, std::string> chain_names;  // Protected by <m>.
+
+	// The last chain (and setup function) returned for each channel,
+	// for falling back to while a new one is being finalized.
+	std::map<unsigned, std::pair<movit::EffectChain *, std::shared_ptr<LuaRefWithDeleter>>> last_chains;  // Protected by <m>.
+
+	// Chains the theme has declared stable (see get_chain() in theme.lua),
+	// along with what get_chain() was called with, apart from the time.
+	// Cleared whenever the theme's state changes (transition_clicked(),
+	// channel_clicked() and set_wb()).
+	struct CachedChain {
+		movit::EffectChain *chain;
+		std::shared_ptr<ChainSetup> setup;
+		unsigned width, height;
+		int quality;
+		std::vector<unsigned> input_formats;  // See get_input_formats() in theme.cpp.
+	};
+	std::map<unsigned, CachedChain> cached_chains;  // Protected by <m>.
+
 	int num_channels;
 	unsigned num_cards;
 
+	std::mutex finalize_m;
+	std::condition_variable finalize_changed;  // Signaled whenever <finalize_state> or <finalize_queue> changes.
+	std::map<movit::EffectChain *, FinalizeState> finalize_state;  // Protected by <finalize_m>.
+	std::deque<movit::EffectChain *> finalize_queue;  // Protected by <finalize_m>. The chains in QUEUED state.
+	bool finalize_thread_should_quit = false;  // Protected by <finalize_m>.
+	std::thread finalize_thread;
+
+	std::atomic<int64_t> metric_chains_finalized{0};
+	std::atomic<int64_t> metric_chain_fallbacks{0};
+	std::atomic<int64_t> metric_chain_stalls{0};
+	std::atomic<int64_t> metric_get_chain_cached{0};
+	std::atomic<int64_t> metric_get_chain_uncached{0};
+	std::atomic<double> metric_get_chain_lua_seconds{0.0};  // Only for uncached calls.
+
+	// Held while applying a ChainSetup (see get_chain()), since the same chain
+	// can be handed out for several channels, which are set up from different
+	// threads. Never held for long, and never while running Lua.
+	std::mutex setup_m;
+
 	std::mutex map_m;
 	std::map<int, int> signal_to_card_mapping;  // Protected by <map_m>.
-
-	friend class LiveInputWrapper;
 };
 
 class LiveInputWrapper {
 public:
-	LiveInputWrapper(Theme *theme, movit::EffectChain *chain, bool override_bounce, bool deinterlace);
+	LiveInputWrapper(movit::EffectChain *chain, bool override_bounce, bool deinterlace);
+
+	// <card_index> is the signal number after Theme::map_signal().
+	void connect_card(unsigned card_index, const InputState &input_state);
+
+	// How many of the card's newest frames (fields) connect_card() looks at.
+	unsigned get_num_frames_used() const { return inputs.size(); }
 
-	void connect_signal(int signal_num);
 	movit::Effect *get_effect() const
 	{
 		if (deinterlace) {
@@ -99,7 +241,6 @@ public:
 	}
 
 private:
-	Theme *theme;  // Not owned by us.
 	std::vector<movit::YCbCrInput *> inputs;  // Multiple ones if deinterlacing. Owned by the chain.
 	movit::Effect *deinterlace_effect = nullptr;  // Owned by the chain.
 	bool deinterlace;
@@ -21,6 +21,10 @@ local input1_neutral_color = {0.5, 0.5, 0.5}
 local live_signal_num = 0
 local preview_signal_num = 1
 
+-- Values for the quality hint given to get_chain().
+local QUALITY_REDUCED = 0
+local QUALITY_FULL = 1
+
 -- Valid values for live_signal_num and preview_signal_num.
 local INPUT0_SIGNAL_NUM = 0
 local INPUT1_SIGNAL_NUM = 1
@@ -36,6 +40,15 @@ local FADE_SIGNAL_NUM = 4
 -- frame and not per field, since we deinterlace.
 local last_resolution = {}
 
+-- For naming chains (which shows up in Nageru's GPU timings, --gpu-timing).
+function describe(flag, if_true, if_false)
+	if flag then
+		return if_true
+	else
+		return if_false
+	end
+end
+
 -- Utility function to help creating many similar chains that can differ
 -- in a free set of chosen parameters.
 function make_cartesian_product(parms, callback)
@@ -78,9 +91,12 @@ function make_sbs_input(chain, signal, deint, hq)
 	}
 end
 
--- The main live chain.
-function make_sbs_chain(input0_deint, input1_deint, hq)
+-- The main live chain. <main> is whether it is for the live output
+-- (normally the same as <hq>, except for the reduced-quality versions below).
+function make_sbs_chain(input0_deint, input1_deint, hq, main)
 	local chain = EffectChain.new(16, 9)
+	chain:set_name("sbs " .. describe(input0_deint, "deint", "live") .. "/" .. describe(input1_deint, "deint", "live") ..
+		describe(hq, " hq", " lq") .. describe(main, "", " preview"))
 
 	local input0 = make_sbs_input(chain, INPUT0_SIGNAL_NUM, input0_deint, hq)
 	local input1 = make_sbs_input(chain, INPUT1_SIGNAL_NUM, input1_deint, hq)
@@ -89,7 +105,7 @@ function make_sbs_chain(input0_deint, input1_deint, hq)
 	input1.padding_effect:set_vec4("border_color", 0.0, 0.0, 0.0, 0.0)
 
 	chain:add_effect(OverlayEffect.new(), input0.padding_effect, input1.padding_effect)
-	chain:finalize(hq)
+	chain:finalize(main)
 
 	return {
 		chain = chain,
@@ -106,7 +122,19 @@ local sbs_chains = make_cartesian_product({
 }, function(input0_type, input1_type, hq)
 	local input0_deint = (input0_type == "livedeint")
 	local input1_deint = (input1_type == "livedeint")
-	return make_sbs_chain(input0_deint, input1_deint, hq)
+	return make_sbs_chain(input0_deint, input1_deint, hq, hq)
+end)
+
+-- Cheaper versions of the live side-by-side chains (resizing instead of
+-- high-quality resampling), for when Nageru tells us the GPU cannot keep up
+-- (see the quality parameter to get_chain()).
+local sbs_chains_reduced = make_cartesian_product({
+	{"live", "livedeint"},  -- input0_type
+	{"live", "livedeint"}   -- input1_type
+}, function(input0_type, input1_type)
+	local input0_deint = (input0_type == "livedeint")
+	local input1_deint = (input1_type == "livedeint")
+	return make_sbs_chain(input0_deint, input1_deint, false, true)
 end)
 
 function make_fade_input(chain, signal, live, deint, scale)
@@ -146,6 +174,8 @@ end
 -- hq parameter.
 function make_fade_chain(input0_live, input0_deint, input0_scale, input1_live, input1_deint, input1_scale, hq)
 	local chain = EffectChain.new(16, 9)
+	chain:set_name("fade " .. describe(input0_live, describe(input0_deint, "deint", "live"), "static") ..
+		"/" .. describe(input1_live, describe(input1_deint, "deint", "live"), "static") .. describe(hq, " hq", " lq"))
 
 	local input0 = make_fade_input(chain, INPUT0_SIGNAL_NUM, input0_live, input0_deint, input0_scale)
 	local input1 = make_fade_input(chain, INPUT1_SIGNAL_NUM, input1_live, input1_deint, input1_scale)
@@ -176,9 +206,11 @@ local fade_chains = make_cartesian_product({
 	return make_fade_chain(input0_live, input0_deint, input0_scale, input1_live, input1_deint, input1_scale, hq)
 end)
 
--- A chain to show a single input on screen.
-function make_simple_chain(input_deint, input_scale, hq)
+-- A chain to show a single input on screen. <main> is as for make_sbs_chain().
+function make_simple_chain(input_deint, input_scale, hq, main)
 	local chain = EffectChain.new(16, 9)
+	chain:set_name("simple " .. describe(input_deint, "deint", "live") .. describe(input_scale, " scaled", "") .. describe(hq, " hq", " lq") ..
+		describe(main, "", " preview"))
 
 	local input = chain:add_live_input(false, input_deint)
 	input:connect_signal(0)  -- First input card. Can be changed whenever you want.
@@ -193,7 +225,7 @@ function make_simple_chain(input_deint, input_scale, hq)
 	end
 
 	local wb_effect = chain:add_effect(WhiteBalanceEffect.new())
-	chain:finalize(hq)
+	chain:finalize(main)
 
 	return {
 		chain = chain,
@@ -211,19 +243,45 @@ local simple_chains = make_cartesian_product({
 	{true, false}           -- hq
 }, function(input_type, input_scale, hq)
 	local input_deint = (input_type == "livedeint")
-	return make_simple_chain(input_deint, input_scale, hq)
+	return make_simple_chain(input_deint, input_scale, hq, hq)
+end)
+
+-- Cheaper versions of the live single-input chains, for the live output
+-- to fall back to while the real ones are being compiled (see get_chain()).
+local simple_chains_reduced = make_cartesian_product({
+	{"live", "livedeint"},  -- input_type
+	{true, false}           -- input_scale
+}, function(input_type, input_scale)
+	local input_deint = (input_type == "livedeint")
+	return make_simple_chain(input_deint, input_scale, false, true)
 end)
 
 -- A chain to show a single static picture on screen (HQ version).
 local static_chain_hq = EffectChain.new(16, 9)
+static_chain_hq:set_name("static hq")
 local static_chain_hq_input = static_chain_hq:add_effect(ImageInput.new("bg.jpeg"))
 static_chain_hq:finalize(true)
 
 -- A chain to show a single static picture on screen (LQ version).
 local static_chain_lq = EffectChain.new(16, 9)
+static_chain_lq:set_name("static lq")
 local static_chain_lq_input = static_chain_lq:add_effect(ImageInput.new("bg.jpeg"))
 static_chain_lq:finalize(false)
 
+-- Compile the live fallbacks (see get_chain()) in the background right away,
+-- so that the live output always has one to show.
+for _, chains in pairs(simple_chains_reduced) do
+	for _, chain in pairs(chains) do
+		chain.chain:warm_up()
+	end
+end
+for _, chains in pairs(sbs_chains_reduced) do
+	for _, chain in pairs(chains) do
+		chain.chain:warm_up()
+	end
+end
+static_chain_hq:warm_up()
+
 -- Used for indexing into the tables of chains.
 function get_input_type(signals, signal_num)
 	if signal_num == STATIC_SIGNAL_NUM then
@@ -537,7 +595,7 @@ end
 -- for any signal number, and use that to e.g. assist in chain selection.
 --
 -- You should return two objects; the chain itself, and then a
--- function (taking no parameters) that is run just before rendering.
+-- function (taking no parameters) that sets up the chain for rendering.
 -- The function needs to call connect_signal on any inputs, so that
 -- it gets updated video data for the given frame. (You are allowed
 -- to switch which input your input is getting from between frames,
@@ -545,9 +603,39 @@ end
 -- If you want to change any parameters in the chain, this is also
 -- the right place.
 --
+-- You can also return a third value, true, if the chain and everything
+-- the function does will stay the same (i.e., does not depend on t) until
+-- the next call to transition_clicked(), channel_clicked() or set_wb().
+-- Nageru will then keep using them, without calling get_chain() again,
+-- as long as width, height, quality and everything in <signals> stay
+-- the same, which saves some CPU time every frame.
+--
+-- Note that the function is run right after get_chain() returns, but
+-- connect_signal and the set_* calls on effects are only recorded, and
+-- applied just before rendering (which can happen in another thread,
+-- or not at all). Thus, it should not do anything else that affects
+-- the chain.
+--
+-- <quality> is normally QUALITY_FULL, but is QUALITY_REDUCED if rendering
+-- the live output has been taking too much of the GPU's time (see
+-- --gpu-budget); you should then pick cheaper chains where you can.
+-- Nageru goes back to QUALITY_FULL after a while if there is room again.
+--
 -- NOTE: The chain returned must be finalized with the Y'CbCr flag
 -- if and only if num==0.
-function get_chain(num, t, width, height, signals)
+--
+-- Chains are not actually compiled when you call finalize(), but the first
+-- time they are returned from get_chain(); until that is done (in the
+-- background), Nageru needs something else to show. You can return a cheaper
+-- fallback chain (with its own prepare function) as the fourth and fifth
+-- return values, which is used if it is already compiled; for the live output,
+-- it must show the same thing, since it goes out on the stream. Otherwise,
+-- previews keep showing their previous chain, and the live output has to wait
+-- for the compilation, dropping frames. We keep a fallback compiled for
+-- every live chain (see simple_chains_reduced), and to avoid needing it,
+-- we also call warm_up() on the chains a transition button can take us to
+-- (see warm_up_transition_chains()), which compiles them in the background.
+function get_chain(num, t, width, height, signals, quality)
 	local input_resolution = {}
 	for signal_num=0,1 do
 		local res = {
@@ -575,20 +663,18 @@ function get_chain(num, t, width, height, signals)
 	last_resolution = input_resolution
 
 	if num == 0 then  -- Live.
+		warm_up_transition_chains(signals, width, height)
 		if live_signal_num == INPUT0_SIGNAL_NUM or live_signal_num == INPUT1_SIGNAL_NUM then  -- Plain input.
 			local input_type = get_input_type(signals, live_signal_num)
 			local input_scale = needs_scale(signals, live_signal_num, width, height)
 			local chain = simple_chains[input_type][input_scale][true]
-			prepare = function()
-				chain.input:connect_signal(live_signal_num)
-				set_scale_parameters_if_needed(chain, width, height)
-				set_neutral_color_from_signal(chain.wb_effect, live_signal_num)
-			end
-			return chain.chain, prepare
+			local fallback = simple_chains_reduced[input_type][input_scale]
+			return chain.chain, make_simple_prepare(chain, live_signal_num, width, height), true,
+				fallback.chain, make_simple_prepare(fallback, live_signal_num, width, height)
 		elseif live_signal_num == STATIC_SIGNAL_NUM then  -- Static picture.
 			prepare = function()
 			end
-			return static_chain_hq, prepare
+			return static_chain_hq, prepare, true
 		elseif live_signal_num == FADE_SIGNAL_NUM then  -- Fade.
 			local input0_type = get_input_type(signals, fade_src_signal)
 			local input0_scale = needs_scale(signals, fade_src_signal, width, height)
@@ -611,7 +697,17 @@ function get_chain(num, t, width, height, signals)
 				chain.mix_effect:set_float("strength_first", 1.0 - tt)
 				chain.mix_effect:set_float("strength_second", tt)
 			end
-			return chain.chain, prepare
+
+			-- As a fallback, show whichever input dominates the fade right now.
+			local fallback_signal = fade_src_signal
+			if calc_fade_progress(t, transition_start, transition_end) >= 0.5 then
+				fallback_signal = fade_dst_signal
+			end
+			if fallback_signal == STATIC_SIGNAL_NUM then
+				return chain.chain, prepare, false, static_chain_hq, function() end
+			end
+			local fallback = simple_chains_reduced[get_input_type(signals, fallback_signal)][needs_scale(signals, fallback_signal, width, height)]
+			return chain.chain, prepare, false, fallback.chain, make_simple_prepare(fallback, fallback_signal, width, height)
 		end
 
 		-- SBS code (live_signal_num == SBS_SIGNAL_NUM).
@@ -619,70 +715,112 @@ function get_chain(num, t, width, height, signals)
 		local input1_type = get_input_type(signals, INPUT1_SIGNAL_NUM)
 		if t > transition_end and zoom_dst == 1.0 then
 			-- Special case: Show only the single image on screen.
+			-- Not stable, since finish_transitions() will soon make
+			-- this a plain input.
 			local input0_scale = needs_scale(signals, fade_src_signal, width, height)
 			local chain = simple_chains[input0_type][input0_scale][true]
-			prepare = function()
-				chain.input:connect_signal(INPUT0_SIGNAL_NUM)
-				set_scale_parameters_if_needed(chain, width, height)
-				set_neutral_color(chain.wb_effect, input0_neutral_color)
-			end
-			return chain.chain, prepare
+			local fallback = simple_chains_reduced[input0_type][input0_scale]
+			return chain.chain, make_simple_prepare(chain, INPUT0_SIGNAL_NUM, width, height), false,
+				fallback.chain, make_simple_prepare(fallback, INPUT0_SIGNAL_NUM, width, height)
 		end
-		local chain = sbs_chains[input0_type][input1_type][true]
-		prepare = function()
-			if t < transition_start then
-				prepare_sbs_chain(chain, zoom_src, width, height, input_resolution)
-			elseif t > transition_end then
-				prepare_sbs_chain(chain, zoom_dst, width, height, input_resolution)
-			else
-				local tt = (t - transition_start) / (transition_end - transition_start)
-				-- Smooth it a bit.
-				tt = math.sin(tt * 3.14159265358 * 0.5)
-				prepare_sbs_chain(chain, zoom_src + (zoom_dst - zoom_src) * tt, width, height, input_resolution)
+		local make_prepare = function(chain)
+			return function()
+				if t < transition_start then
+					prepare_sbs_chain(chain, zoom_src, width, height, input_resolution)
+				elseif t > transition_end then
+					prepare_sbs_chain(chain, zoom_dst, width, height, input_resolution)
+				else
+					local tt = (t - transition_start) / (transition_end - transition_start)
+					-- Smooth it a bit.
+					tt = math.sin(tt * 3.14159265358 * 0.5)
+					prepare_sbs_chain(chain, zoom_src + (zoom_dst - zoom_src) * tt, width, height, input_resolution)
+				end
 			end
 		end
-		return chain.chain, prepare
+		local reduced_chain = sbs_chains_reduced[input0_type][input1_type]
+		if quality == QUALITY_REDUCED then
+			return reduced_chain.chain, make_prepare(reduced_chain), t > transition_end
+		end
+		local chain = sbs_chains[input0_type][input1_type][true]
+		return chain.chain, make_prepare(chain), t > transition_end,
+			reduced_chain.chain, make_prepare(reduced_chain)
 	end
 	if num == 1 then  -- Preview.
 		num = preview_signal_num + 2
 	end
 
-	-- Individual preview inputs.
+	-- Individual preview inputs. For each, we also ask for the HQ version
+	-- to be compiled in the background (see the note above), since it is
+	-- what we will need if the input is put live.
 	if num == INPUT0_SIGNAL_NUM + 2 then
 		local input_type = get_input_type(signals, INPUT0_SIGNAL_NUM)
 		local input_scale = needs_scale(signals, INPUT0_SIGNAL_NUM, width, height)
 		local chain = simple_chains[input_type][input_scale][false]
+		simple_chains[input_type][input_scale][true].chain:warm_up()
 		prepare = function()
 			chain.input:connect_signal(INPUT0_SIGNAL_NUM)
 			set_scale_parameters_if_needed(chain, width, height)
 			set_neutral_color(chain.wb_effect, input0_neutral_color)
 		end
-		return chain.chain, prepare
+		return chain.chain, prepare, true
 	end
 	if num == INPUT1_SIGNAL_NUM + 2 then
 		local input_type = get_input_type(signals, INPUT1_SIGNAL_NUM)
 		local input_scale = needs_scale(signals, INPUT1_SIGNAL_NUM, width, height)
 		local chain = simple_chains[input_type][input_scale][false]
+		simple_chains[input_type][input_scale][true].chain:warm_up()
 		prepare = function()
 			chain.input:connect_signal(INPUT1_SIGNAL_NUM)
 			set_scale_parameters_if_needed(chain, width, height)
 			set_neutral_color(chain.wb_effect, input1_neutral_color)
 		end
-		return chain.chain, prepare
+		return chain.chain, prepare, true
 	end
 	if num == SBS_SIGNAL_NUM + 2 then
 		local input0_type = get_input_type(signals, INPUT0_SIGNAL_NUM)
 		local input1_type = get_input_type(signals, INPUT1_SIGNAL_NUM)
 		local chain = sbs_chains[input0_type][input1_type][false]
+		sbs_chains[input0_type][input1_type][true].chain:warm_up()
 		prepare = function()
 			prepare_sbs_chain(chain, 0.0, width, height, input_resolution)
 		end
-		return chain.chain, prepare
+		return chain.chain, prepare, true
 	end
 	if num == STATIC_SIGNAL_NUM + 2 then
 		prepare = function()
 		end
-		return static_chain_lq, prepare
+		return static_chain_lq, prepare, true
+	end
+end
+
+-- Asks for every live chain that a transition button can take us to
+-- from the current state to be compiled in the background, so that the live
+-- output does not have to wait for it (see the note above get_chain()).
+function warm_up_transition_chains(signals, width, height)
+	-- Cut, and the end of a zoom in from SBS to a single input.
+	if preview_signal_num == INPUT0_SIGNAL_NUM or preview_signal_num == INPUT1_SIGNAL_NUM then
+		local input_type = get_input_type(signals, preview_signal_num)
+		local input_scale = needs_scale(signals, preview_signal_num, width, height)
+		simple_chains[input_type][input_scale][true].chain:warm_up()
+	elseif preview_signal_num == STATIC_SIGNAL_NUM then
+		static_chain_hq:warm_up()
+	elseif preview_signal_num == SBS_SIGNAL_NUM then
+		-- Also zoom out from a single input.
+		local input0_type = get_input_type(signals, INPUT0_SIGNAL_NUM)
+		local input1_type = get_input_type(signals, INPUT1_SIGNAL_NUM)
+		sbs_chains[input0_type][input1_type][true].chain:warm_up()
+	end
+
+	-- Fade (see transition_clicked()).
+	local function can_fade(signal_num)
+		return signal_num == INPUT0_SIGNAL_NUM or signal_num == INPUT1_SIGNAL_NUM or signal_num == STATIC_SIGNAL_NUM
+	end
+	if live_signal_num ~= preview_signal_num and can_fade(live_signal_num) and can_fade(preview_signal_num) then
+		local input0_type = get_input_type(signals, live_signal_num)
+		local input0_scale = needs_scale(signals, live_signal_num, width, height)
+		local input1_type = get_input_type(signals, preview_signal_num)
+		local input1_scale = needs_scale(signals, preview_signal_num, width, height)
+		fade_chains[input0_type][input0_scale][input1_type][input1_scale][true].chain:warm_up()
 	end
 end
 
@@ -839,6 +977,15 @@ function prepare_sbs_chain(chain, t, screen_width, screen_height, input_resoluti
 	place_rectangle(chain.input1.resample_effect, chain.input1.resize_effect, chain.input1.padding_effect, left1, top1, right1, bottom1, screen_width, screen_height, input_resolution[1].width, input_resolution[1].height)
 end
 
+-- The prepare function for a chain from make_simple_chain(), showing <signal_num>.
+function make_simple_prepare(chain, signal_num, width, height)
+	return function()
+		chain.input:connect_signal(signal_num)
+		set_scale_parameters_if_needed(chain, width, height)
+		set_neutral_color_from_signal(chain.wb_effect, signal_num)
+	end
+end
+
 function set_neutral_color(effect, color)
 	effect:set_vec3("neutral_color", color[1], color[2], color[3])
 end
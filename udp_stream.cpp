@@ -0,0 +1,184 @@
+#include "udp_stream.h"
+
+#include <netdb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+
+#include "metrics.h"
+
+using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+constexpr size_t ts_packet_size = 188;
+constexpr size_t datagram_size = 7 * ts_packet_size;  // The standard size; fits in a 1500-byte MTU.
+
+// How much data we try to keep queued. Needs to absorb the burstiness
+// of the mux, but also adds to the latency.
+constexpr double udp_buffer_seconds = 0.2;
+
+// How much faster or slower than the nominal mux rate we are willing to send,
+// to keep the queue at the desired level.
+constexpr double max_rate_adjustment = 0.05;
+
+// Don't let the queue grow without bounds if the mux is much faster than we think.
+constexpr double max_queue_seconds = 5.0;
+
+}  // namespace
+
+UDPStream::UDPStream(const string &destination, int mux_rate_kbit)
+	: mux_rate(mux_rate_kbit * 1000.0 / 8.0)
+{
+	size_t colon = destination.rfind(':');
+	if (colon == string::npos) {
+		fprintf(stderr, "ERROR: UDP destination '%s' is not HOST:PORT\n", destination.c_str());
+		exit(1);
+	}
+	string host = destination.substr(0, colon);
+	string port = destination.substr(colon + 1);
+	if (host.size() >= 2 && host[0] == '[' && host[host.size() - 1] == ']') {
+		host = host.substr(1, host.size() - 2);  // IPv6 address.
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_DGRAM;
+	addrinfo *ai;
+	int err = getaddrinfo(host.c_str(), port.c_str(), &hints, &ai);
+	if (err != 0) {
+		fprintf(stderr, "ERROR: Could not resolve '%s': %s\n", destination.c_str(), gai_strerror(err));
+		exit(1);
+	}
+	memcpy(&addr, ai->ai_addr, ai->ai_addrlen);
+	addr_len = ai->ai_addrlen;
+	sock = socket(ai->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, IPPROTO_UDP);
+	freeaddrinfo(ai);
+	if (sock == -1) {
+		perror("socket");
+		exit(1);
+	}
+
+	labels = Metrics::Labels{{ "destination", destination }};
+	global_metrics.add("udp_output_bytes", labels, &metric_bytes);
+	global_metrics.add("udp_output_datagrams", labels, &metric_datagrams);
+	global_metrics.add("udp_output_underruns", labels, &metric_underruns);
+	global_metrics.add("udp_output_queued_bytes", labels, &metric_queued_bytes, Metrics::TYPE_GAUGE);
+	global_metrics.add("udp_output_rate_kbit", labels, &metric_rate_kbit, Metrics::TYPE_GAUGE);
+	global_metrics.add("udp_output_max_jitter_seconds", labels, &metric_jitter_seconds, Metrics::TYPE_GAUGE);
+
+	sender_thread = thread(&UDPStream::sender_thread_func, this);
+}
+
+UDPStream::~UDPStream()
+{
+	{
+		unique_lock<mutex> lock(queue_mu);
+		should_quit = true;
+		queue_changed.notify_all();
+	}
+	sender_thread.join();
+	close(sock);
+
+	for (const char *name : { "udp_output_bytes", "udp_output_datagrams", "udp_output_underruns",
+	                          "udp_output_queued_bytes", "udp_output_rate_kbit", "udp_output_max_jitter_seconds" }) {
+		global_metrics.remove(name, labels);
+	}
+}
+
+void UDPStream::add_data(const char *buf, size_t size)
+{
+	unique_lock<mutex> lock(queue_mu);
+	if (queue.size() - queue_start + size > mux_rate * max_queue_seconds) {
+		fprintf(stderr, "WARNING: UDP output queue full, dropping %zu bytes; is the mux rate too high?\n", size);
+		return;
+	}
+	if (queue_start > 0 && queue_start == queue.size()) {
+		queue.clear();
+		queue_start = 0;
+	}
+	queue.append(buf, size);
+	queue_changed.notify_all();
+}
+
+void UDPStream::sender_thread_func()
+{
+	const size_t target_queued_bytes = max<size_t>(mux_rate * udp_buffer_seconds, datagram_size);
+	bool running = false;  // False if we are waiting for the queue to fill up.
+	steady_clock::time_point next_send;
+
+	// For the rate and jitter metrics, which are updated about once per second.
+	steady_clock::time_point stats_start = steady_clock::now();
+	int64_t stats_bytes = 0;
+	double stats_max_jitter = 0.0;
+
+	char datagram[datagram_size];
+	for ( ;; ) {
+		size_t queued_bytes;
+		{
+			unique_lock<mutex> lock(queue_mu);
+			if (running && queue.size() - queue_start < datagram_size) {
+				// Ran dry; build up the buffer again before we continue,
+				// instead of sending every datagram as soon as it comes in.
+				++metric_underruns;
+				running = false;
+			}
+			const size_t needed = running ? datagram_size : target_queued_bytes;
+			queue_changed.wait(lock, [this, needed]{ return should_quit || queue.size() - queue_start >= needed; });
+			if (should_quit) {
+				return;
+			}
+			if (!running) {
+				running = true;
+				next_send = steady_clock::now();
+			}
+
+			memcpy(datagram, queue.data() + queue_start, datagram_size);
+			queue_start += datagram_size;
+			queued_bytes = queue.size() - queue_start;
+
+			// Compact once in a while, so that the queue does not grow forever.
+			if (queue_start >= queue.size() / 2) {
+				queue.erase(0, queue_start);
+				queue_start = 0;
+			}
+		}
+		metric_queued_bytes = queued_bytes;
+
+		this_thread::sleep_until(next_send);
+		steady_clock::time_point now = steady_clock::now();
+		stats_max_jitter = max(stats_max_jitter, duration<double>(now - next_send).count());
+
+		if (sendto(sock, datagram, datagram_size, 0, (sockaddr *)&addr, addr_len) == -1) {
+			perror("sendto");
+		}
+		++metric_datagrams;
+		metric_bytes += datagram_size;
+		stats_bytes += datagram_size;
+
+		// Send a bit faster if the queue is growing, and a bit slower
+		// if it is shrinking, so that we follow the mux' actual rate.
+		double fill_error = (double(queued_bytes) - double(target_queued_bytes)) / target_queued_bytes;
+		double rate = mux_rate * (1.0 + max(-max_rate_adjustment, min(max_rate_adjustment, fill_error * max_rate_adjustment)));
+		next_send += duration_cast<steady_clock::duration>(duration<double>(datagram_size / rate));
+		if (now - next_send > seconds(1)) {
+			// We were stalled for a long time; don't try to catch up in a burst.
+			next_send = now;
+		}
+
+		double elapsed = duration<double>(now - stats_start).count();
+		if (elapsed >= 1.0) {
+			metric_rate_kbit = stats_bytes * 8.0 / 1e3 / elapsed;
+			metric_jitter_seconds = stats_max_jitter;
+			stats_start = now;
+			stats_bytes = 0;
+			stats_max_jitter = 0.0;
+		}
+	}
+}
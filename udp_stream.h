@@ -0,0 +1,70 @@
+#ifndef _UDP_STREAM_H
+#define _UDP_STREAM_H 1
+
+// Sends a constant-bitrate MPEG-TS stream (from a Mux with the “muxrate”
+// option set) over UDP, typically to a multicast group for IP decoders.
+//
+// The mux produces data in bursts (at least one frame at a time, and
+// more around flushes), which many hardware decoders handle poorly.
+// Thus, add_data() just queues up the data, and a separate thread sends it
+// in datagrams of seven TS packets each, evenly paced at the mux rate.
+// We keep a small buffer (see udp_buffer_seconds in udp_stream.cpp),
+// and speed up or slow down slightly if it drifts, so that we follow the mux
+// even if its rate is not exactly what we think it is.
+//
+// Achieved rate, scheduling jitter and underruns are exported as metrics.
+//
+// The stream outlives the muxes feeding it (see H264Encoder::PersistentOutputs),
+// so a cut only shows up as a new mux header in the middle of the stream,
+// without any gap in the pacing, and there is only ever one instance
+// (and one set of metrics) per destination.
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "metrics.h"
+
+class UDPStream {
+public:
+	// <destination> is HOST:PORT (IPv6 addresses in brackets);
+	// <mux_rate_kbit> is the muxrate given to the mux.
+	UDPStream(const std::string &destination, int mux_rate_kbit);
+	~UDPStream();
+
+	// Can be called from any thread. Does not block.
+	void add_data(const char *buf, size_t size);
+
+private:
+	void sender_thread_func();
+
+	int sock;
+	sockaddr_storage addr;
+	socklen_t addr_len;
+	const double mux_rate;  // In bytes per second.
+
+	std::thread sender_thread;
+
+	std::mutex queue_mu;
+	std::condition_variable queue_changed;
+	std::string queue;  // Under <queue_mu>.
+	size_t queue_start = 0;  // Under <queue_mu>. Bytes of <queue> that have already been sent.
+	bool should_quit = false;  // Under <queue_mu>.
+
+	// Exported with the destination as label.
+	Metrics::Labels labels;
+	std::atomic<int64_t> metric_bytes{0};
+	std::atomic<int64_t> metric_datagrams{0};
+	std::atomic<int64_t> metric_underruns{0};
+	std::atomic<int64_t> metric_queued_bytes{0};
+	std::atomic<double> metric_rate_kbit{0.0};
+	std::atomic<double> metric_jitter_seconds{0.0};
+};
+
+#endif  // !defined(_UDP_STREAM_H)
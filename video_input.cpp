@@ -0,0 +1,589 @@
+#include "video_input.h"
+
+#include <movit/image_format.h>
+#include <movit/util.h>
+#include <epoxy/egl.h>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include <libavutil/pixfmt.h>
+#include <libswscale/swscale.h>
+}
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "bmusb/bmusb.h"
+#include "context.h"
+#include "ffmpeg_raii.h"
+#include "metrics.h"
+
+using namespace std;
+
+namespace {
+
+// How many frames the decoder can be ahead of what is being shown.
+constexpr size_t max_decode_ahead = 10;
+
+// In addition to the ones decoded ahead, we need some frames for the ones
+// that are being shown; the same frame can be held by the encoder and
+// by several previews at the same time (see Theme::Chain::input_frames).
+constexpr size_t num_slots = max_decode_ahead + 6;
+
+}  // namespace
+
+// Owns the decoder for one file, and the PBOs it decodes into.
+// The PBOs are handed out as FrameAllocator::Frames, so that they can go
+// through RefCountedFrame (and be kept alive by Theme::Chain::input_frames)
+// just like the frames from the capture cards.
+class VideoInput::Player : public FrameAllocator {
+public:
+	// Exits on error.
+	Player(const string &filename);
+
+	Frame alloc_frame() override;
+	void release_frame(Frame frame) override;
+
+	RefCountedFrame get_frame(double t);
+	void play();
+	void pause();
+	void seek(double seconds);
+	void set_loop(bool loop);
+
+	// Stops the decoder thread and unmaps the PBOs. Needs an OpenGL context.
+	void shutdown();
+
+	unsigned get_width() const { return width; }
+	unsigned get_height() const { return height; }
+
+	// Transparent black, for before the first frame is decoded.
+	const uint8_t *get_blank_pixels() const { return blank_pixels.get(); }
+
+	struct Userdata {
+		GLuint pbo;
+		double pts;  // In seconds from the start of playback (increasing across loops).
+		uint64_t serial;  // Unique for each decoded frame, unlike the PBO.
+	};
+
+private:
+	void decode_thread_func();
+
+	// Decodes the next frame, returning false on end of file (or an error
+	// we cannot recover from). <pts> is in seconds from the start of the file.
+	bool decode_frame(AVFrame *frame, double *pts);
+	void seek_decoder(double seconds);
+	void loop_around();
+
+	const string filename;
+	unsigned width, height;
+	double frame_duration;  // From the stream header; only used for rounding.
+
+	// Only touched by the decoder thread (after construction).
+	AVFormatContextWithCloser format_ctx;
+	AVCodecContext *codec_ctx;
+	int stream_index;
+	SwsContext *sws_ctx = nullptr;
+	double pts_offset = 0.0;  // Added to the file's pts; grows every time we loop.
+	double last_pts = 0.0;  // Last pts decoded, including <pts_offset>.
+	double skip_until = -1.0;  // Frames before this are from before a seek target.
+
+	unique_ptr<Userdata[]> userdata;
+	unique_ptr<uint8_t[]> blank_pixels;
+
+	mutex mu;
+	condition_variable decoder_cv;  // Signaled when there is something for the decoder to do.
+	queue<Frame> freelist;  // Under <mu>.
+	deque<Frame> ready;  // Decoded ahead; in pts order. Under <mu>.
+	RefCountedFrame current;  // The one being shown. Under <mu>.
+	unsigned generation = 0;  // Incremented on every seek. Under <mu>.
+	uint64_t next_serial = 1;  // Under <mu>.
+	bool seek_pending = false;  // Under <mu>.
+	double seek_target = 0.0;  // Under <mu>.
+	bool loop = false;  // Under <mu>.
+	bool at_eof = false;  // Under <mu>.
+	bool should_quit = false;  // Under <mu>.
+
+	// The playback clock, in terms of the mixer's pts. When playing,
+	// the position is anchor_position + (t - anchor_t); when paused,
+	// it is just anchor_position. anchor_t is set from the first t we see
+	// after starting or seeking. All under <mu>.
+	bool playing = true;
+	bool anchored = false;
+	double anchor_position = 0.0, anchor_t = 0.0;
+	double last_position = 0.0, last_t = -1.0;
+
+	thread decode_thread;
+
+	atomic<int64_t> metric_decoded_frames{0};
+	atomic<int64_t> metric_dropped_frames{0};
+	atomic<int64_t> metric_underruns{0};
+	atomic<int64_t> metric_queued_frames{0};
+};
+
+VideoInput::Player::Player(const string &filename)
+	: filename(filename), format_ctx(avformat_open_input_unique(filename.c_str(), nullptr, nullptr))
+{
+	if (format_ctx == nullptr) {
+		fprintf(stderr, "%s: Error opening file\n", filename.c_str());
+		exit(1);
+	}
+	if (avformat_find_stream_info(format_ctx.get(), nullptr) < 0) {
+		fprintf(stderr, "%s: Error finding stream info\n", filename.c_str());
+		exit(1);
+	}
+
+	stream_index = -1;
+	for (unsigned i = 0; i < format_ctx->nb_streams; ++i) {
+		if (format_ctx->streams[i]->codec->codec_type == AVMEDIA_TYPE_VIDEO) {
+			stream_index = i;
+			break;
+		}
+	}
+	if (stream_index == -1) {
+		fprintf(stderr, "%s: No video stream found\n", filename.c_str());
+		exit(1);
+	}
+
+	const AVStream *stream = format_ctx->streams[stream_index];
+	codec_ctx = stream->codec;
+	AVCodec *codec = avcodec_find_decoder(codec_ctx->codec_id);
+	if (codec == nullptr) {
+		fprintf(stderr, "%s: Cannot find decoder\n", filename.c_str());
+		exit(1);
+	}
+
+	// Let FFmpeg decode on as many cores as it likes; frame threading adds
+	// some latency, but we are decoding ahead anyway.
+	codec_ctx->thread_count = 0;
+	codec_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+	if (avcodec_open2(codec_ctx, codec, nullptr) < 0) {
+		fprintf(stderr, "%s: Cannot open decoder\n", filename.c_str());
+		exit(1);
+	}
+	width = codec_ctx->width;
+	height = codec_ctx->height;
+	if (width == 0 || height == 0) {
+		fprintf(stderr, "%s: Unknown video size\n", filename.c_str());
+		exit(1);
+	}
+	if (stream->avg_frame_rate.num > 0 && stream->avg_frame_rate.den > 0) {
+		frame_duration = av_q2d(av_inv_q(stream->avg_frame_rate));
+	} else {
+		frame_duration = 1.0 / 60.0;
+	}
+
+	// Persistent and coherent, so that the decoder thread can write directly
+	// into them without having an OpenGL context of its own. The frames are
+	// never modified while they are being uploaded from, since the decoder
+	// only ever gets them back from the freelist.
+	const size_t frame_size = width * height * 4;
+	userdata.reset(new Userdata[num_slots]);
+	for (size_t i = 0; i < num_slots; ++i) {
+		GLuint pbo;
+		glGenBuffers(1, &pbo);
+		check_error();
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo);
+		check_error();
+		glBufferStorage(GL_PIXEL_UNPACK_BUFFER, frame_size, nullptr, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+		check_error();
+
+		Frame frame;
+		frame.data = (uint8_t *)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, frame_size, GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+		check_error();
+		frame.size = frame_size;
+		frame.userdata = &userdata[i];
+		frame.owner = this;
+		userdata[i].pbo = pbo;
+		freelist.push(frame);
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	check_error();
+
+	blank_pixels.reset(new uint8_t[frame_size]());
+
+	Metrics::Labels labels{{ "filename", filename }};
+	global_metrics.add("video_input_decoded_frames", labels, &metric_decoded_frames);
+	global_metrics.add("video_input_dropped_frames", labels, &metric_dropped_frames);
+	global_metrics.add("video_input_underruns", labels, &metric_underruns);
+	global_metrics.add("video_input_queued_frames", labels, &metric_queued_frames, Metrics::TYPE_GAUGE);
+
+	decode_thread = thread(&VideoInput::Player::decode_thread_func, this);
+}
+
+FrameAllocator::Frame VideoInput::Player::alloc_frame()
+{
+	Frame frame;
+	unique_lock<mutex> lock(mu);
+	if (!freelist.empty()) {
+		frame = freelist.front();
+		freelist.pop();
+	}
+	return frame;
+}
+
+void VideoInput::Player::release_frame(Frame frame)
+{
+	unique_lock<mutex> lock(mu);
+	freelist.push(frame);
+	decoder_cv.notify_all();
+}
+
+RefCountedFrame VideoInput::Player::get_frame(double t)
+{
+	// Any frames we replace are released only after we have unlocked,
+	// since release_frame() takes the same lock.
+	vector<RefCountedFrame> old_frames;
+
+	unique_lock<mutex> lock(mu);
+	if (!anchored) {
+		anchor_t = t;
+		anchored = true;
+	}
+	const double position = playing ? anchor_position + (t - anchor_t) : anchor_position;
+
+	// Show the last frame that is due, rounding to the nearest frame.
+	// Every frame we skip past without it ever having been shown is a drop.
+	unsigned num_due = 0;
+	while (!ready.empty() && ((Userdata *)ready.front().userdata)->pts <= position + 0.5 * frame_duration) {
+		old_frames.push_back(move(current));
+		current = RefCountedFrame(ready.front());
+		ready.pop_front();
+		++num_due;
+	}
+	if (num_due > 1) {
+		metric_dropped_frames += num_due - 1;
+	}
+
+	// We are called once per chain, so only count once per mixer frame.
+	if (t != last_t && ready.empty() && num_due == 0 && playing && !at_eof) {
+		++metric_underruns;
+	}
+	last_position = position;
+	last_t = t;
+	metric_queued_frames = ready.size();
+	return current;
+}
+
+void VideoInput::Player::play()
+{
+	unique_lock<mutex> lock(mu);
+	if (!playing) {
+		playing = true;
+		anchored = false;  // Continue from anchor_position.
+	}
+}
+
+void VideoInput::Player::pause()
+{
+	unique_lock<mutex> lock(mu);
+	if (playing) {
+		playing = false;
+		anchor_position = last_position;
+	}
+}
+
+void VideoInput::Player::seek(double seconds)
+{
+	unique_lock<mutex> lock(mu);
+	while (!ready.empty()) {
+		freelist.push(ready.front());
+		ready.pop_front();
+	}
+	++generation;
+	seek_pending = true;
+	seek_target = seconds;
+	at_eof = false;
+	anchor_position = last_position = seconds;
+	anchored = false;
+	metric_queued_frames = 0;
+	decoder_cv.notify_all();
+}
+
+void VideoInput::Player::set_loop(bool loop)
+{
+	unique_lock<mutex> lock(mu);
+	this->loop = loop;
+	decoder_cv.notify_all();
+}
+
+void VideoInput::Player::shutdown()
+{
+	{
+		unique_lock<mutex> lock(mu);
+		should_quit = true;
+		decoder_cv.notify_all();
+	}
+	decode_thread.join();
+
+	for (size_t i = 0; i < num_slots; ++i) {
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, userdata[i].pbo);
+		check_error();
+		glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+		check_error();
+	}
+	glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+	check_error();
+}
+
+void VideoInput::Player::decode_thread_func()
+{
+	AVFrameWithDeleter frame = av_frame_alloc_unique();
+	for ( ;; ) {
+		Frame slot;
+		unsigned slot_generation;
+		{
+			unique_lock<mutex> lock(mu);
+			decoder_cv.wait(lock, [this]{
+				return should_quit || seek_pending ||
+					(!freelist.empty() && ready.size() < max_decode_ahead && (!at_eof || loop));
+			});
+			if (should_quit) {
+				return;
+			}
+			if (seek_pending) {
+				seek_pending = false;
+				const double target = seek_target;
+				lock.unlock();
+
+				// Seeking lands on the keyframe before the target, so decode up to
+				// the frame nearest the target before we start showing anything.
+				pts_offset = 0.0;
+				skip_until = target - 0.5 * frame_duration;
+				seek_decoder(target);
+				continue;
+			}
+			if (at_eof) {
+				// Looping was turned on after we reached the end.
+				at_eof = false;
+				lock.unlock();
+				loop_around();
+				continue;
+			}
+			slot = freelist.front();
+			freelist.pop();
+			slot_generation = generation;
+		}
+
+		double pts;
+		if (!decode_frame(frame.get(), &pts)) {
+			unique_lock<mutex> lock(mu);
+			freelist.push(slot);
+			if (loop && !seek_pending) {
+				lock.unlock();
+				loop_around();
+			} else {
+				at_eof = true;
+			}
+			continue;
+		}
+		pts += pts_offset;
+		last_pts = pts;
+
+		bool discard = false;
+		{
+			unique_lock<mutex> lock(mu);
+			if (pts < skip_until) {
+				// Decoded only to get to the seek target.
+				discard = true;
+			} else if (playing && anchored && pts + 0.5 * frame_duration < last_position) {
+				// Too late to ever be shown; don't waste time converting it.
+				++metric_dropped_frames;
+				discard = true;
+			}
+			if (discard) {
+				freelist.push(slot);
+				continue;
+			}
+		}
+
+		// Convert straight into the PBO. We always scale to the size we started
+		// with, in case the stream changes resolution midway.
+		sws_ctx = sws_getCachedContext(sws_ctx, frame->width, frame->height, (AVPixelFormat)frame->format,
+			width, height, AV_PIX_FMT_RGBA, SWS_BICUBIC, nullptr, nullptr, nullptr);
+		if (sws_ctx == nullptr) {
+			fprintf(stderr, "%s: Could not create scaler context\n", filename.c_str());
+			exit(1);
+		}
+		uint8_t *pic_data[4] = { slot.data, nullptr, nullptr, nullptr };
+		int linesizes[4] = { int(width * 4), 0, 0, 0 };
+		sws_scale(sws_ctx, frame->data, frame->linesize, 0, frame->height, pic_data, linesizes);
+		slot.len = width * height * 4;
+		++metric_decoded_frames;
+
+		unique_lock<mutex> lock(mu);
+		if (generation != slot_generation) {
+			// There was a seek while we were decoding.
+			freelist.push(slot);
+			continue;
+		}
+		((Userdata *)slot.userdata)->pts = pts;
+		((Userdata *)slot.userdata)->serial = next_serial++;
+		ready.push_back(slot);
+		metric_queued_frames = ready.size();
+	}
+}
+
+bool VideoInput::Player::decode_frame(AVFrame *frame, double *pts)
+{
+	const AVStream *stream = format_ctx->streams[stream_index];
+	int frame_finished = 0;
+	do {
+		AVPacket pkt;
+		unique_ptr<AVPacket, decltype(av_packet_unref)*> pkt_cleanup(
+			&pkt, av_packet_unref);
+		av_init_packet(&pkt);
+		pkt.data = nullptr;
+		pkt.size = 0;
+		if (av_read_frame(format_ctx.get(), &pkt) < 0) {
+			// End of file; see if the decoder has any frames left.
+			pkt.data = nullptr;
+			pkt.size = 0;
+			if (avcodec_decode_video2(codec_ctx, frame, &frame_finished, &pkt) < 0) {
+				return false;
+			}
+			if (!frame_finished) {
+				return false;
+			}
+			break;
+		}
+		if (pkt.stream_index != stream_index) {
+			continue;
+		}
+		if (avcodec_decode_video2(codec_ctx, frame, &frame_finished, &pkt) < 0) {
+			// Corrupt packet; keep going, the next keyframe will fix it.
+			fprintf(stderr, "%s: Cannot decode frame, skipping\n", filename.c_str());
+			frame_finished = 0;
+		}
+	} while (!frame_finished);
+
+	const int64_t timestamp = av_frame_get_best_effort_timestamp(frame);
+	if (timestamp == AV_NOPTS_VALUE) {
+		*pts = last_pts - pts_offset + frame_duration;
+	} else {
+		const int64_t start_time = (stream->start_time == AV_NOPTS_VALUE) ? 0 : stream->start_time;
+		*pts = (timestamp - start_time) * av_q2d(stream->time_base);
+	}
+	return true;
+}
+
+void VideoInput::Player::seek_decoder(double seconds)
+{
+	const AVStream *stream = format_ctx->streams[stream_index];
+	const int64_t start_time = (stream->start_time == AV_NOPTS_VALUE) ? 0 : stream->start_time;
+	const int64_t timestamp = start_time + int64_t(seconds / av_q2d(stream->time_base));
+	if (av_seek_frame(format_ctx.get(), stream_index, timestamp, AVSEEK_FLAG_BACKWARD) < 0) {
+		fprintf(stderr, "%s: Could not seek to %.3f seconds\n", filename.c_str(), seconds);
+	}
+	avcodec_flush_buffers(codec_ctx);
+}
+
+void VideoInput::Player::loop_around()
+{
+	// Keep the pts increasing, so that the clock does not need to know.
+	pts_offset = last_pts + frame_duration;
+	skip_until = -1.0;
+	seek_decoder(0.0);
+}
+
+VideoInput::VideoInput(const string &filename)
+	: VideoInput(get_player(filename)) {}
+
+VideoInput::VideoInput(Player *player)
+	: movit::FlatInput({movit::COLORSPACE_sRGB, movit::GAMMA_sRGB}, movit::FORMAT_RGBA_POSTMULTIPLIED_ALPHA,
+	                   GL_UNSIGNED_BYTE, player->get_width(), player->get_height()),
+	  player(player)
+{
+	set_pixel_data(player->get_blank_pixels());
+}
+
+void VideoInput::set_gl_state(GLuint glsl_program_num, const string& prefix, unsigned *sampler_num)
+{
+	if (pending_frame != nullptr) {
+		const Player::Userdata *userdata = (const Player::Userdata *)pending_frame->userdata;
+		if (userdata->serial != current_serial) {
+			// The pixel data is an offset into the PBO, so the upload
+			// will be done by the GPU, asynchronously.
+			set_pixel_data((const unsigned char *)nullptr, userdata->pbo);
+			current_serial = userdata->serial;
+		}
+	}
+	movit::FlatInput::set_gl_state(glsl_program_num, prefix, sampler_num);
+
+	// The texture now has the frame (or will have, by the time the GPU gets
+	// to it; the chain's input_frames keep the PBO alive until then), so let
+	// go of it, so that chains that are not being shown do not hold on to
+	// frames the decoder could use.
+	pending_frame.reset();
+}
+
+void VideoInput::play()
+{
+	player->play();
+}
+
+void VideoInput::pause()
+{
+	player->pause();
+}
+
+void VideoInput::seek(double seconds)
+{
+	player->seek(seconds);
+}
+
+void VideoInput::set_loop(bool loop)
+{
+	player->set_loop(loop);
+}
+
+RefCountedFrame VideoInput::get_frame(double t)
+{
+	return player->get_frame(t);
+}
+
+void VideoInput::set_frame(RefCountedFrame frame)
+{
+	if (frame != nullptr) {
+		pending_frame = frame;
+	}
+}
+
+VideoInput::Player *VideoInput::get_player(const string &filename)
+{
+	unique_lock<mutex> lock(all_players_lock);
+	if (!all_players.count(filename)) {
+		all_players[filename] = new Player(filename);
+	}
+	return all_players[filename];
+}
+
+void VideoInput::shutdown_players(QSurface *surface)
+{
+	unique_lock<mutex> lock(all_players_lock);
+	if (all_players.empty()) {
+		return;
+	}
+
+	eglBindAPI(EGL_OPENGL_API);
+	QOpenGLContext *context = create_context(surface);
+	if (!make_current(context, surface)) {
+		printf("Couldn't make context current\n");
+		exit(1);
+	}
+	for (const auto &filename_and_player : all_players) {
+		filename_and_player.second->shutdown();
+	}
+}
+
+mutex VideoInput::all_players_lock;
+map<string, VideoInput::Player *> VideoInput::all_players;
@@ -0,0 +1,72 @@
+#ifndef _VIDEO_INPUT_H
+#define _VIDEO_INPUT_H 1
+
+#include <epoxy/gl.h>
+#include <stdint.h>
+#include <map>
+#include <mutex>
+#include <string>
+
+#include <movit/flat_input.h>
+
+#include "ref_counted_frame.h"
+
+class QSurface;
+
+// An input that plays back a video file (intros, sponsor spots and the like),
+// decoded with FFmpeg. Like ImageInput, all VideoInputs for the same file share
+// the same decoder, so the clip is at the same place in every chain it is in,
+// and playback control (play/pause/seek/loop) affects all of them.
+//
+// The decoder runs in its own thread (FFmpeg uses several more for the actual
+// decoding) and stays a number of frames ahead, converting straight into
+// persistently mapped PBOs, so that the mixer thread only needs to kick off
+// the texture upload. Frames are picked according to the mixer's pts,
+// not the wall clock, so a 25 fps clip will repeat frames in a 50 fps mix,
+// and a 60 fps clip will drop every other one in a 30 fps mix.
+class VideoInput : public movit::FlatInput {
+public:
+	// Note: You need to have an OpenGL context when calling the constructor
+	// for the first time for a given file.
+	VideoInput(const std::string &filename);
+
+	std::string effect_type_id() const override { return "VideoInput"; }
+	void set_gl_state(GLuint glsl_program_num, const std::string& prefix, unsigned *sampler_num) override;
+
+	void play();
+	void pause();
+	void seek(double seconds);
+	void set_loop(bool loop);
+
+	// Returns the frame to show at mixer time <t> (in seconds), or an empty
+	// frame if there is nothing to show yet. The frame is not reused by the
+	// decoder for as long as there are references to it. Called by the theme
+	// when handing out a chain (see Theme::get_chain()).
+	RefCountedFrame get_frame(double t);
+
+	// Makes the next set_gl_state() upload the given frame, unless it is
+	// empty or already uploaded. Called right before rendering, from the
+	// rendering thread.
+	void set_frame(RefCountedFrame frame);
+
+	// Stops the decoders for all files and unmaps their PBOs, using an
+	// OpenGL context on <surface>. Must be called after the last frame has
+	// been rendered (see Mixer::quit()). The players themselves are never
+	// freed, since the theme's chains can still hold on to their frames.
+	static void shutdown_players(QSurface *surface);
+
+private:
+	class Player;
+
+	VideoInput(Player *player);
+
+	Player *player;  // Not owned by us; see all_players.
+	RefCountedFrame pending_frame;
+	uint64_t current_serial = 0;  // Of the frame in our texture; 0 is none.
+
+	static Player *get_player(const std::string &filename);
+	static std::mutex all_players_lock;
+	static std::map<std::string, Player *> all_players;  // Never freed; see shutdown_players().
+};
+
+#endif  // !defined(_VIDEO_INPUT_H)
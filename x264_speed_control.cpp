@@ -0,0 +1,164 @@
+#include "x264_speed_control.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+#include <atomic>
+
+#include "flags.h"
+#include "metrics.h"
+#include "timebase.h"
+
+using namespace std;
+
+namespace {
+
+// Modelled after the presets in x264's common/base.c, but only the settings
+// that x264_encoder_reconfig() will actually change.
+struct SpeedLevel {
+	const char *preset;
+	int subme;
+	int me_method;
+	int me_range;
+	int refs;
+	int trellis;
+	bool mixed_refs;
+	bool dct8x8;
+	unsigned intra_partitions, inter_partitions;
+};
+
+constexpr unsigned intra_partitions = X264_ANALYSE_I4x4 | X264_ANALYSE_I8x8;
+constexpr unsigned inter_partitions = intra_partitions | X264_ANALYSE_PSUB16x16 | X264_ANALYSE_BSUB16x16;
+
+const SpeedLevel speed_levels[] = {
+	// preset       subme  me            range  refs  trellis  mixed  8x8dct  intra             inter
+	{ "ultrafast",  0,     X264_ME_DIA,  16,    1,    0,       false, false,  0,                0 },
+	{ "superfast",  1,     X264_ME_DIA,  16,    1,    0,       false, true,   intra_partitions, intra_partitions },
+	{ "veryfast",   2,     X264_ME_HEX,  16,    1,    0,       false, true,   intra_partitions, inter_partitions },
+	{ "faster",     4,     X264_ME_HEX,  16,    2,    1,       false, true,   intra_partitions, inter_partitions },
+	{ "fast",       6,     X264_ME_HEX,  16,    2,    1,       true,  true,   intra_partitions, inter_partitions },
+	{ "medium",     7,     X264_ME_HEX,  16,    3,    1,       true,  true,   intra_partitions, inter_partitions },
+	{ "slow",       8,     X264_ME_UMH,  16,    5,    2,       true,  true,   intra_partitions, inter_partitions },
+	{ "slower",     9,     X264_ME_UMH,  16,    8,    2,       true,  true,   intra_partitions, inter_partitions | X264_ANALYSE_PSUB8x8 },
+	{ "veryslow",   10,    X264_ME_UMH,  24,    16,   2,       true,  true,   intra_partitions, inter_partitions | X264_ANALYSE_PSUB8x8 },
+};
+constexpr unsigned num_speed_levels = sizeof(speed_levels) / sizeof(speed_levels[0]);
+
+// Tuning parameters. Load is encode time divided by frame duration.
+constexpr double load_averaging_factor = 0.1;  // Weight of the newest frame in the moving average.
+constexpr double max_load = 0.95;  // Step down if above this.
+constexpr double headroom_load = 0.6;  // Count as headroom if below this.
+constexpr int64_t min_frames_between_step_downs = 10;  // Let x264's frame threads see the change first.
+constexpr int64_t headroom_time_before_step_up = 5 * TIMEBASE;
+
+Metrics::Labels with_label(Metrics::Labels labels, const string &key, const string &value)
+{
+	labels.emplace_back(key, value);
+	return labels;
+}
+
+}  // namespace
+
+X264SpeedControl::X264SpeedControl(x264_t *x264, const string &preset, const Metrics::Labels &metric_labels)
+	: x264(x264), metric_labels(metric_labels)
+{
+	global_metrics.add("x264_speedcontrol_level", metric_labels, &metric_speedcontrol_level, Metrics::TYPE_GAUGE);
+	global_metrics.add("x264_speedcontrol_steps", with_label(metric_labels, "direction", "down"), &metric_speedcontrol_steps_down);
+	global_metrics.add("x264_speedcontrol_steps", with_label(metric_labels, "direction", "up"), &metric_speedcontrol_steps_up);
+
+	max_level = num_speed_levels - 1;
+	for (unsigned i = 0; i < num_speed_levels; ++i) {
+		if (preset == speed_levels[i].preset) {
+			max_level = i;
+			break;
+		}
+	}
+	current_level = max_level;
+	metric_speedcontrol_level = current_level;
+
+	x264_encoder_parameters(x264, &original_param);
+}
+
+X264SpeedControl::~X264SpeedControl()
+{
+	global_metrics.remove("x264_speedcontrol_level", metric_labels);
+	global_metrics.remove("x264_speedcontrol_steps", with_label(metric_labels, "direction", "down"));
+	global_metrics.remove("x264_speedcontrol_steps", with_label(metric_labels, "direction", "up"));
+}
+
+void X264SpeedControl::after_frame(double encode_time_sec, int64_t frame_duration, unsigned queue_length, unsigned max_queue_length)
+{
+	double load = encode_time_sec * TIMEBASE / max<int64_t>(frame_duration, 1);
+	avg_load = avg_load * (1.0 - load_averaging_factor) + load * load_averaging_factor;
+	++frames_since_change;
+
+	if (global_flags.x264_speedcontrol_verbose) {
+		fprintf(stderr, "x264 speedcontrol: Frame encoded in %.1f ms (%.0f%% of frame time, average %.0f%%), level %u, %u frame(s) queued\n",
+			encode_time_sec * 1e3, load * 100.0, avg_load * 100.0, current_level, queue_length);
+	}
+
+	bool falling_behind = (queue_length > max_queue_length / 2 || avg_load > max_load);
+	if (falling_behind) {
+		time_with_headroom = 0;
+		if (current_level > 0 && frames_since_change >= min_frames_between_step_downs) {
+			printf("x264 speedcontrol: Falling behind (average load %.0f%%, %u frame(s) queued), stepping down to %s\n",
+				avg_load * 100.0, queue_length, speed_levels[current_level - 1].preset);
+			set_level(current_level - 1);
+			++metric_speedcontrol_steps_down;
+		}
+		return;
+	}
+
+	if (queue_length == 0 && avg_load < headroom_load) {
+		time_with_headroom += frame_duration;
+	} else {
+		time_with_headroom = 0;
+	}
+	if (current_level < max_level && time_with_headroom >= headroom_time_before_step_up) {
+		printf("x264 speedcontrol: Headroom available (average load %.0f%%), stepping up to %s\n",
+			avg_load * 100.0, speed_levels[current_level + 1].preset);
+		set_level(current_level + 1);
+		++metric_speedcontrol_steps_up;
+	}
+}
+
+void X264SpeedControl::set_level(unsigned level)
+{
+	x264_param_t param;
+	x264_encoder_parameters(x264, &param);
+
+	if (level == max_level) {
+		// Go back to exactly what we were opened with (including any changes
+		// from --x264-extra-param), not what the table says.
+		param.analyse.i_subpel_refine = original_param.analyse.i_subpel_refine;
+		param.analyse.i_me_method = original_param.analyse.i_me_method;
+		param.analyse.i_me_range = original_param.analyse.i_me_range;
+		param.i_frame_reference = original_param.i_frame_reference;
+		param.analyse.i_trellis = original_param.analyse.i_trellis;
+		param.analyse.b_mixed_references = original_param.analyse.b_mixed_references;
+		param.analyse.b_transform_8x8 = original_param.analyse.b_transform_8x8;
+		param.analyse.intra = original_param.analyse.intra;
+		param.analyse.inter = original_param.analyse.inter;
+	} else {
+		const SpeedLevel &sl = speed_levels[level];
+		param.analyse.i_subpel_refine = sl.subme;
+		param.analyse.i_me_method = sl.me_method;
+		param.analyse.i_me_range = sl.me_range;
+		param.i_frame_reference = min(sl.refs, original_param.i_frame_reference);  // Cannot go above what we opened with.
+		param.analyse.i_trellis = sl.trellis;
+		param.analyse.b_mixed_references = sl.mixed_refs;
+		param.analyse.b_transform_8x8 = sl.dct8x8 && original_param.analyse.b_transform_8x8;
+		param.analyse.intra = sl.intra_partitions;
+		param.analyse.inter = sl.inter_partitions;
+	}
+
+	if (x264_encoder_reconfig(x264, &param) < 0) {
+		fprintf(stderr, "WARNING: x264_encoder_reconfig() failed when changing speed level\n");
+		return;
+	}
+	current_level = level;
+	frames_since_change = 0;
+	time_with_headroom = 0;
+	metric_speedcontrol_level = current_level;
+}
@@ -0,0 +1,61 @@
+#ifndef _X264_SPEED_CONTROL_H
+#define _X264_SPEED_CONTROL_H 1
+
+// Automatic speed control for x264, so that we degrade quality gracefully
+// instead of dropping frames when x264 cannot keep up (e.g. on complex
+// content, or when the machine is busy with something else).
+//
+// We keep a ladder of analysis settings, modelled after x264's own presets
+// (but only containing the settings that x264_encoder_reconfig() can change).
+// The preset given on the command line is the top of the ladder; we never go
+// above it, since some settings (e.g. the number of reference frames) can only
+// be lowered from what the encoder was opened with. After each frame, we look
+// at a moving average of the time x264 spent on it compared to the frame
+// duration, and at how full our input queue is; if we are falling behind,
+// we step down immediately, and if we have had plenty of headroom for a while,
+// we step up again.
+
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+extern "C" {
+#include "x264.h"
+}
+
+#include "metrics.h"
+
+class X264SpeedControl {
+public:
+	// <x264> must already be opened with the given preset. Does not take ownership.
+	// The metrics are exported with the given labels (the encoder's).
+	X264SpeedControl(x264_t *x264, const std::string &preset, const Metrics::Labels &metric_labels);
+	~X264SpeedControl();
+
+	// To be called from the encoder thread after each frame is encoded.
+	// <encode_time_sec> is the wall-clock time x264_encoder_encode() took,
+	// <frame_duration> is the time until the next frame (in TIMEBASE units),
+	// and <queue_length> is the number of frames waiting to be encoded.
+	void after_frame(double encode_time_sec, int64_t frame_duration, unsigned queue_length, unsigned max_queue_length);
+
+	unsigned get_current_level() const { return current_level; }
+
+private:
+	void set_level(unsigned level);
+
+	x264_t *x264;
+	x264_param_t original_param;  // What we were opened with; used for the top level.
+	unsigned max_level;  // The level corresponding to the preset we were opened with.
+	unsigned current_level;
+
+	double avg_load = 0.0;  // Moving average of encode time divided by frame duration.
+	int64_t frames_since_change = 0;
+	int64_t time_with_headroom = 0;  // In TIMEBASE units.
+
+	const Metrics::Labels metric_labels;
+	std::atomic<double> metric_speedcontrol_level{0.0};
+	std::atomic<int64_t> metric_speedcontrol_steps_down{0};
+	std::atomic<int64_t> metric_speedcontrol_steps_up{0};
+};
+
+#endif  // !defined(_X264_SPEED_CONTROL_H)
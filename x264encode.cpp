@@ -1,10 +1,15 @@
+#include <math.h>
 #include <string.h>
 #include <unistd.h>
 
+#include <algorithm>
+
 #include "defs.h"
 #include "flags.h"
 #include "mux.h"
+#include "metrics.h"
 #include "timebase.h"
+#include "x264_speed_control.h"
 #include "x264encode.h"
 
 extern "C" {
@@ -12,14 +17,36 @@ extern "C" {
 }
 
 using namespace std;
+using namespace std::chrono;
+
+namespace {
+
+// For --x264-auto-bitrate. The backlog is measured in seconds of stream
+// at the current bitrate, averaged over all clients.
+constexpr double auto_bitrate_check_interval_sec = 1.0;
+constexpr double auto_bitrate_high_backlog_sec = 1.0;  // Back off if above this.
+constexpr double auto_bitrate_low_backlog_sec = 0.25;  // Count as a good check if below this.
+constexpr unsigned auto_bitrate_good_checks_before_increase = 10;
+constexpr double auto_bitrate_decrease_factor = 0.8;
+constexpr double auto_bitrate_increase_factor = 1.05;
+
+// With more than one encoder running, see the comment in the header.
+constexpr int64_t aligned_keyframe_interval = TIMEBASE;
+
+}  // namespace
 
-X264Encoder::X264Encoder(Mux *mux)
-	: mux(mux)
+X264Encoder::X264Encoder(vector<Mux *> muxes, int width, int height, unsigned bitrate_kbit, function<size_t()> get_client_backlog_bytes)
+	: muxes(move(muxes)), width(width), height(height), initial_bitrate_kbit(bitrate_kbit),
+	  aligned_keyframes(!global_flags.x264_renditions.empty()),
+	  metric_labels{{ "rendition", to_string(width) + "x" + to_string(height) }},
+	  get_client_backlog_bytes(get_client_backlog_bytes)
 {
-	frame_pool.reset(new uint8_t[WIDTH * HEIGHT * 2 * X264_QUEUE_LENGTH]);
-	for (unsigned i = 0; i < X264_QUEUE_LENGTH; ++i) {
-		free_frames.push(frame_pool.get() + i * (WIDTH * HEIGHT * 2));
-	}
+	global_metrics.add("x264_queued_frames", metric_labels, &metric_x264_queued_frames, Metrics::TYPE_GAUGE);
+	global_metrics.add("x264_dropped_frames", metric_labels, &metric_x264_dropped_frames);
+	global_metrics.add("x264_encoded_frames", metric_labels, &metric_x264_encoded_frames);
+	global_metrics.add("x264_encode_time_seconds", metric_labels, &metric_x264_encode_time_seconds, Metrics::TYPE_COUNTER);
+	global_metrics.add("x264_last_encode_time_seconds", metric_labels, &metric_x264_last_encode_time_seconds, Metrics::TYPE_GAUGE);
+	global_metrics.add("x264_bitrate_kbit", metric_labels, &metric_x264_bitrate_kbit, Metrics::TYPE_GAUGE);
 	encoder_thread = thread(&X264Encoder::encoder_thread_func, this);
 }
 
@@ -28,31 +55,62 @@ X264Encoder::~X264Encoder()
 	should_quit = true;
 	queued_frames_nonempty.notify_all();
 	encoder_thread.join();
+
+	global_metrics.remove("x264_queued_frames", metric_labels);
+	global_metrics.remove("x264_dropped_frames", metric_labels);
+	global_metrics.remove("x264_encoded_frames", metric_labels);
+	global_metrics.remove("x264_encode_time_seconds", metric_labels);
+	global_metrics.remove("x264_last_encode_time_seconds", metric_labels);
+	global_metrics.remove("x264_bitrate_kbit", metric_labels);
 }
 
-void X264Encoder::add_frame(int64_t pts, const uint8_t *data)
+void X264Encoder::add_frame(int64_t pts, shared_ptr<const uint8_t> data)
 {
 	QueuedFrame qf;
 	qf.pts = pts;
+	qf.data = move(data);
 
 	{
 		lock_guard<mutex> lock(mu);
-		if (free_frames.empty()) {
-			fprintf(stderr, "WARNING: x264 queue full, dropping frame with pts %ld\n", pts);
-			return;
+		qf.keyframe = aligned_keyframes &&
+			(last_added_pts == -1 || pts / aligned_keyframe_interval != last_added_pts / aligned_keyframe_interval);
+		last_added_pts = pts;
+
+		if (queued_frames.size() >= X264_QUEUE_LENGTH) {
+			if (!qf.keyframe) {
+				fprintf(stderr, "WARNING: x264 queue full, dropping frame with pts %ld\n", pts);
+				++metric_x264_dropped_frames;
+				return;
+			}
+
+			// Dropping this frame would put our next keyframe somewhere
+			// the other encoders don't have one, so drop the newest
+			// queued frame instead. (If that was a keyframe, too, we have
+			// not encoded anything for a second, so its second is lost anyway.)
+			fprintf(stderr, "WARNING: x264 queue full, dropping frame with pts %ld\n", queued_frames.back().pts);
+			++metric_x264_dropped_frames;
+			queued_frames.pop_back();
 		}
 
-		qf.data = free_frames.front();
-		free_frames.pop();
+		queued_frames.push_back(move(qf));
+		metric_x264_queued_frames = queued_frames.size();
+		queued_frames_nonempty.notify_all();
 	}
+}
 
-	memcpy(qf.data, data, WIDTH * HEIGHT * 2);
-
-	{
-		lock_guard<mutex> lock(mu);
-		queued_frames.push(qf);
-		queued_frames_nonempty.notify_all();
+void X264Encoder::change_rate_control(int bitrate_kbit, int vbv_max_bitrate_kbit, int vbv_buffer_size_kbit)
+{
+	lock_guard<mutex> lock(mu);
+	if (bitrate_kbit > 0) {
+		new_bitrate_kbit = bitrate_kbit;
+	}
+	if (vbv_max_bitrate_kbit >= 0) {
+		new_vbv_max_bitrate_kbit = vbv_max_bitrate_kbit;
 	}
+	if (vbv_buffer_size_kbit >= 0) {
+		new_vbv_buffer_size_kbit = vbv_buffer_size_kbit;
+	}
+	rate_control_changed = true;
 }
 	
 void X264Encoder::init_x264()
@@ -60,13 +118,19 @@ void X264Encoder::init_x264()
 	x264_param_t param;
 	x264_param_default_preset(&param, global_flags.x264_preset.c_str(), global_flags.x264_tune.c_str());
 
-	param.i_width = WIDTH;
-	param.i_height = HEIGHT;
+	param.i_width = width;
+	param.i_height = height;
 	param.i_csp = X264_CSP_NV12;
 	param.b_vfr_input = 1;
 	param.i_timebase_num = 1;
 	param.i_timebase_den = TIMEBASE;
-	param.i_keyint_max = 50; // About one second.
+	if (aligned_keyframes) {
+		// We place all keyframes ourselves; see encode_frame().
+		param.i_keyint_max = X264_KEYINT_MAX_INFINITE;
+		param.i_scenecut_threshold = 0;
+	} else {
+		param.i_keyint_max = 50; // About one second. Can be overridden by --x264-extra-param.
+	}
 
 	// NOTE: These should be in sync with the ones in h264encode.cpp (sbs_rbsp()).
 	param.vui.i_vidformat = 5;  // Unspecified.
@@ -75,29 +139,77 @@ void X264Encoder::init_x264()
 	param.vui.i_transfer = 2;  // Unspecified (since we use sRGB).
 	param.vui.i_colmatrix = 6;  // BT.601/SMPTE 170M.
 
-	// 4.5 Mbit/sec, CBR.
 	param.rc.i_rc_method = X264_RC_ABR;
-	param.rc.i_bitrate = 4500;
-
-	// One-second VBV.
-	param.rc.i_vbv_max_bitrate = 4500;
-	param.rc.i_vbv_buffer_size = 4500;
+	// Keep the shape of the configured VBV (e.g. CBR with one-second buffer)
+	// if we are running at a different bitrate than the global one.
+	double scale = double(initial_bitrate_kbit) / global_flags.x264_bitrate;
+	param.rc.i_bitrate = initial_bitrate_kbit;
+	param.rc.i_vbv_max_bitrate = lrint(global_flags.x264_vbv_max_bitrate * scale);
+	param.rc.i_vbv_buffer_size = lrint(global_flags.x264_vbv_buffer_size * scale);
+	{
+		// Changes made before we got here (e.g. ones that survive a cut)
+		// apply from the start, which is the only way to turn VBV on or off.
+		lock_guard<mutex> lock(mu);
+		if (rate_control_changed) {
+			if (new_bitrate_kbit > 0) {
+				param.rc.i_bitrate = new_bitrate_kbit;
+			}
+			if (new_vbv_max_bitrate_kbit >= 0) {
+				param.rc.i_vbv_max_bitrate = new_vbv_max_bitrate_kbit;
+			}
+			if (new_vbv_buffer_size_kbit >= 0) {
+				param.rc.i_vbv_buffer_size = new_vbv_buffer_size_kbit;
+			}
+			rate_control_changed = false;
+			new_bitrate_kbit = new_vbv_max_bitrate_kbit = new_vbv_buffer_size_kbit = -1;
+		}
+	}
+	if (param.rc.i_vbv_max_bitrate > 0 && param.rc.i_vbv_buffer_size == 0) {
+		// One-frame VBV.
+		param.rc.i_vbv_buffer_size = param.rc.i_vbv_max_bitrate / MAX_FPS;
+	}
 
-	// TODO: more flags here, via x264_param_parse().
+	for (const string &str : global_flags.x264_extra_param) {
+		const size_t pos = str.find('=');
+		int ret;
+		if (pos == string::npos) {
+			ret = x264_param_parse(&param, str.c_str(), nullptr);
+		} else {
+			const string key = str.substr(0, pos);
+			const string value = str.substr(pos + 1);
+			ret = x264_param_parse(&param, key.c_str(), value.c_str());
+		}
+		if (ret == X264_PARAM_BAD_NAME) {
+			fprintf(stderr, "ERROR: No such x264 parameter '%s'\n", str.c_str());
+			exit(1);
+		} else if (ret == X264_PARAM_BAD_VALUE) {
+			fprintf(stderr, "ERROR: Invalid value for x264 parameter '%s'\n", str.c_str());
+			exit(1);
+		}
+	}
 
 	x264_param_apply_profile(&param, "high");
 
+	max_bitrate_kbit = current_bitrate_kbit = param.rc.i_bitrate;
+	metric_x264_bitrate_kbit = current_bitrate_kbit;
+	vbv_max_bitrate_kbit = param.rc.i_vbv_max_bitrate;
+	vbv_buffer_size_kbit = param.rc.i_vbv_buffer_size;
+	last_auto_bitrate_check = steady_clock::now();
+
 	x264 = x264_encoder_open(&param);
 	if (x264 == nullptr) {
 		fprintf(stderr, "ERROR: x264 initialization failed.\n");
 		exit(1);
 	}
+
+	if (global_flags.x264_speedcontrol) {
+		speed_control.reset(new X264SpeedControl(x264, global_flags.x264_preset, metric_labels));
+	}
 }
 
 void X264Encoder::encoder_thread_func()
 {
 	nice(5);  // Note that x264 further nices some of its threads.
-	init_x264();
 
 	bool frames_left;
 
@@ -109,30 +221,133 @@ void X264Encoder::encoder_thread_func()
 			unique_lock<mutex> lock(mu);
 			queued_frames_nonempty.wait(lock, [this]() { return !queued_frames.empty() || should_quit; });
 			if (!queued_frames.empty()) {
-				qf = queued_frames.front();
-				queued_frames.pop();
+				qf = move(queued_frames.front());
+				queued_frames.pop_front();
 			} else {
 				qf.pts = -1;
 				qf.data = nullptr;
 			}
 
 			frames_left = !queued_frames.empty();
+			metric_x264_queued_frames = queued_frames.size();
 		}
 
-		encode_frame(qf);
-		
-		{
-			lock_guard<mutex> lock(mu);
-			free_frames.push(qf.data);
+		if (x264 == nullptr) {
+			if (qf.data == nullptr) {
+				// Quitting before we ever got a frame.
+				return;
+			}
+			// Not opened until now, so that the owner can give us
+			// rate control changes that need to be there from the start.
+			init_x264();
 		}
 
+		apply_rate_control_changes();
+		update_auto_bitrate();
+
+		// Releases the frame as soon as x264 has taken its copy.
+		encode_frame(move(qf));
+
 		// We should quit only if the should_quit flag is set _and_ we have nothing
 		// in either queue.
 	} while (!should_quit || frames_left || x264_encoder_delayed_frames(x264) > 0);
 
+	speed_control.reset();
 	x264_encoder_close(x264);
 }
 
+void X264Encoder::apply_rate_control_changes()
+{
+	{
+		lock_guard<mutex> lock(mu);
+		if (!rate_control_changed) {
+			return;
+		}
+		if (new_bitrate_kbit > 0) {
+			max_bitrate_kbit = new_bitrate_kbit;
+		}
+		if (new_vbv_max_bitrate_kbit >= 0) {
+			if ((new_vbv_max_bitrate_kbit == 0) != (vbv_max_bitrate_kbit == 0)) {
+				fprintf(stderr, "WARNING: x264 cannot turn VBV on or off while running; it will change on the next cut.\n");
+			} else {
+				vbv_max_bitrate_kbit = new_vbv_max_bitrate_kbit;
+			}
+		}
+		if (new_vbv_buffer_size_kbit >= 0) {
+			vbv_buffer_size_kbit = new_vbv_buffer_size_kbit;
+		}
+		if (vbv_max_bitrate_kbit > 0 && vbv_buffer_size_kbit == 0) {
+			// One-frame VBV, as in init_x264().
+			vbv_buffer_size_kbit = vbv_max_bitrate_kbit / MAX_FPS;
+		}
+		rate_control_changed = false;
+		new_bitrate_kbit = new_vbv_max_bitrate_kbit = new_vbv_buffer_size_kbit = -1;
+	}
+
+	// If we are backed off in automatic mode, stay backed off
+	// (but never above the new limit); otherwise, go straight to the new rate.
+	if (global_flags.x264_auto_bitrate && get_client_backlog_bytes) {
+		current_bitrate_kbit = min(current_bitrate_kbit, max_bitrate_kbit);
+	} else {
+		current_bitrate_kbit = max_bitrate_kbit;
+	}
+	printf("x264: Changing rate control to %u kbit/sec (max %u kbit/sec, VBV buffer %u kbit)\n",
+		max_bitrate_kbit, vbv_max_bitrate_kbit, vbv_buffer_size_kbit);
+	reconfigure_rate_control();
+}
+
+void X264Encoder::update_auto_bitrate()
+{
+	if (!global_flags.x264_auto_bitrate || !get_client_backlog_bytes) {
+		return;
+	}
+
+	steady_clock::time_point now = steady_clock::now();
+	if (duration<double>(now - last_auto_bitrate_check).count() < auto_bitrate_check_interval_sec) {
+		return;
+	}
+	last_auto_bitrate_check = now;
+
+	double backlog_sec = get_client_backlog_bytes() * 8.0 / (current_bitrate_kbit * 1000.0);
+	unsigned min_bitrate_kbit = min<unsigned>(global_flags.x264_min_bitrate, max_bitrate_kbit);
+	if (backlog_sec > auto_bitrate_high_backlog_sec) {
+		auto_bitrate_good_checks = 0;
+		if (current_bitrate_kbit > min_bitrate_kbit) {
+			current_bitrate_kbit = max<unsigned>(current_bitrate_kbit * auto_bitrate_decrease_factor, min_bitrate_kbit);
+			fprintf(stderr, "x264: Clients have %.1f seconds of backlog, lowering bitrate to %u kbit/sec\n",
+				backlog_sec, current_bitrate_kbit);
+			reconfigure_rate_control();
+		}
+	} else if (backlog_sec < auto_bitrate_low_backlog_sec) {
+		if (++auto_bitrate_good_checks >= auto_bitrate_good_checks_before_increase &&
+		    current_bitrate_kbit < max_bitrate_kbit) {
+			auto_bitrate_good_checks = 0;
+			current_bitrate_kbit = min<unsigned>(current_bitrate_kbit * auto_bitrate_increase_factor + 1, max_bitrate_kbit);
+			printf("x264: Clients are keeping up, raising bitrate to %u kbit/sec\n", current_bitrate_kbit);
+			reconfigure_rate_control();
+		}
+	} else {
+		auto_bitrate_good_checks = 0;
+	}
+}
+
+void X264Encoder::reconfigure_rate_control()
+{
+	// Scale the VBV along with the bitrate, so that it keeps the same
+	// shape (e.g. CBR with one-second buffer) when backed off.
+	double scale = double(current_bitrate_kbit) / max_bitrate_kbit;
+
+	x264_param_t param;
+	x264_encoder_parameters(x264, &param);
+	param.rc.i_bitrate = current_bitrate_kbit;
+	param.rc.i_vbv_max_bitrate = lrint(vbv_max_bitrate_kbit * scale);
+	param.rc.i_vbv_buffer_size = lrint(vbv_buffer_size_kbit * scale);
+	if (x264_encoder_reconfig(x264, &param) < 0) {
+		fprintf(stderr, "WARNING: x264_encoder_reconfig() failed\n");
+	}
+	metric_x264_bitrate_kbit = current_bitrate_kbit;
+}
+
 void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 {
 	x264_nal_t *nal = nullptr;
@@ -143,14 +358,38 @@ void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 		x264_picture_init(&pic);
 
 		pic.i_pts = qf.pts;
+		if (qf.keyframe) {
+			pic.i_type = X264_TYPE_IDR;
+		}
 		pic.img.i_csp = X264_CSP_NV12;
 		pic.img.i_plane = 2;
-		pic.img.plane[0] = qf.data;
-		pic.img.i_stride[0] = WIDTH;
-		pic.img.plane[1] = qf.data + WIDTH * HEIGHT;
-		pic.img.i_stride[1] = WIDTH / 2 * sizeof(uint16_t);
-
+		// x264 does not write to the input planes; it copies them
+		// into its own frame buffers before returning.
+		uint8_t *data = const_cast<uint8_t *>(qf.data.get());
+		pic.img.plane[0] = data;
+		pic.img.i_stride[0] = width;
+		pic.img.plane[1] = data + width * height;
+		pic.img.i_stride[1] = width / 2 * sizeof(uint16_t);
+
+		steady_clock::time_point start = steady_clock::now();
 		x264_encoder_encode(x264, &nal, &num_nal, &pic, &pic);
+		double encode_time_sec = duration<double>(steady_clock::now() - start).count();
+		qf.data.reset();
+
+		++metric_x264_encoded_frames;
+		metric_x264_encode_time_seconds = metric_x264_encode_time_seconds + encode_time_sec;  // Only written from here.
+		metric_x264_last_encode_time_seconds = encode_time_sec;
+
+		if (speed_control) {
+			int64_t frame_duration = (last_pts == -1) ? TIMEBASE / MAX_FPS : qf.pts - last_pts;
+			unsigned queue_length;
+			{
+				lock_guard<mutex> lock(mu);
+				queue_length = queued_frames.size();
+			}
+			speed_control->after_frame(encode_time_sec, frame_duration, queue_length, X264_QUEUE_LENGTH);
+		}
+		last_pts = qf.pts;
 	} else {
 		x264_encoder_encode(x264, &nal, &num_nal, nullptr, &pic);
 	}
@@ -182,5 +421,7 @@ void X264Encoder::encode_frame(X264Encoder::QueuedFrame qf)
 		pkt.flags = 0;
 	}
 
-	mux->add_packet(pkt, pic.i_pts, pic.i_dts);
+	for (Mux *mux : muxes) {
+		mux->add_packet(pkt, pic.i_pts, pic.i_dts);
+	}
 }	
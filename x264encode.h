@@ -1,17 +1,31 @@
 // A wrapper around x264, to encode video in higher quality than Quick Sync
-// can give us. We maintain a queue of uncompressed Y'CbCr frames (of 50 frames,
-// so a little under 100 MB at 720p), then have a separate thread pull out
-// those threads as fast as we can to give it to x264 for encoding.
+// can give us. We maintain a queue of references to uncompressed Y'CbCr frames
+// (of X264_QUEUE_LENGTH frames), then have a separate thread pull out
+// those frames as fast as we can to give it to x264 for encoding.
+// The frames are never copied by us; x264 takes its own copy when we give
+// it the picture, at which point we release our reference.
 //
-// TODO: We use x264's “speedcontrol” patch if available, so that quality is
-// automatically scaled up or down to content and available CPU time.
+// With --x264-speedcontrol, quality is automatically scaled down (and back up)
+// according to available CPU time; see X264SpeedControl.
 //
 // The encoding threads are niced down because mixing is more important than
 // encoding; if we lose frames in mixing, we'll lose frames to disk _and_
 // to the stream, as where if we lose frames in encoding, we'll lose frames
 // to the stream only, so the latter is strictly better. More importantly,
-// this allows speedcontrol (when implemented) to do its thing without
-// disturbing the mixer.
+// this allows speedcontrol to do its thing without disturbing the mixer.
+//
+// Rate control (bitrate and VBV) can be changed on the fly. Optionally,
+// the bitrate can also be adjusted automatically based on how far behind
+// the stream clients are; if they start to build up a backlog, we assume
+// the network cannot keep up, and lower the bitrate until it goes away
+// (and then slowly increase it again, up to the configured bitrate).
+//
+// There can be several encoders at the same time (see --x264-rendition).
+// If so, they all put keyframes on the first frame given to add_frame()
+// in each second of pts (and nowhere else), so that players can switch
+// between the streams at any keyframe. Since all encoders are given the same
+// pts, this only depends on the pts, not on which frames each encoder
+// happened to drop; those keyframes are never dropped themselves.
 
 #ifndef _X264ENCODE_H
 #define _X264ENCODE_H 1
@@ -19,63 +33,115 @@
 #include <stdint.h>
 
 #include <atomic>
+#include <chrono>
 #include <condition_variable>
+#include <functional>
 #include <memory>
+#include <deque>
 #include <mutex>
 #include <thread>
-#include <queue>
+#include <vector>
 
 extern "C" {
 #include "x264.h"
 }
 
+#include "metrics.h"
+
 class Mux;
+class X264SpeedControl;
 
 class X264Encoder {
 public:
-	X264Encoder(Mux *httpd);  // Does not take ownership.
+	// Encoded packets are sent to all of <muxes> (see --http-output);
+	// does not take ownership of them. <bitrate_kbit> is the initial bitrate;
+	// the VBV settings are scaled from the global ones accordingly.
+	// If <get_client_backlog_bytes> is set and --x264-auto-bitrate is given,
+	// it is used to drive the automatic bitrate adjustment (see above);
+	// it is called from the encoder thread.
+	X264Encoder(std::vector<Mux *> muxes, int width, int height, unsigned bitrate_kbit,
+	            std::function<size_t()> get_client_backlog_bytes = nullptr);
 
 	// Called after the last frame. Will block; once this returns,
 	// the last data is flushed.
 	~X264Encoder();
 
-	// <data> is taken to be raw NV12 data of WIDTHxHEIGHT resolution.
+	// <data> is taken to be raw NV12 data of the given resolution.
+	// The reference is held until x264 has consumed the frame (or it is
+	// dropped because the queue is full). Does not block.
+	void add_frame(int64_t pts, std::shared_ptr<const uint8_t> data);
+
+	// Changes rate control parameters (in kilobit/sec, or kilobits for the
+	// VBV buffer) before the next frame is encoded. -1 means to keep the
+	// current value; zero VBV max bitrate turns VBV off, and zero VBV buffer
+	// size means a one-frame VBV, as with the flags. In automatic mode,
+	// <bitrate_kbit> becomes the new upper limit for the automatic adjustment.
 	// Does not block.
-	void add_frame(int64_t pts, const uint8_t *data);
+	//
+	// x264 cannot turn VBV on or off in a running encoder, so that only
+	// takes effect if done before the first frame is added (the encoder is
+	// not opened until then); otherwise, it is ignored until a new
+	// X264Encoder is made.
+	void change_rate_control(int bitrate_kbit, int vbv_max_bitrate_kbit, int vbv_buffer_size_kbit);
 
 private:
 	struct QueuedFrame {
 		int64_t pts;
-		uint8_t *data;
+		std::shared_ptr<const uint8_t> data;
+		bool keyframe = false;  // An aligned keyframe; see the comment at the top.
 	};
 	void encoder_thread_func();
 	void init_x264();
 	void encode_frame(QueuedFrame qf);
+	void apply_rate_control_changes();
+	void update_auto_bitrate();
+	void reconfigure_rate_control();
 
-	// One big memory chunk of all 50 (or whatever) frames, allocated in
-	// the constructor. All data functions just use pointers into this
-	// pool.
-	std::unique_ptr<uint8_t[]> frame_pool;
-
-	Mux *mux = nullptr;
+	const std::vector<Mux *> muxes;
+	const int width, height;
+	const unsigned initial_bitrate_kbit;
+	const bool aligned_keyframes;
 
 	std::thread encoder_thread;
 	std::atomic<bool> should_quit{false};
-	x264_t *x264;
+	const Metrics::Labels metric_labels;  // rendition="WxH".
+	x264_t *x264 = nullptr;  // Opened when the first frame arrives.
+	std::unique_ptr<X264SpeedControl> speed_control;  // nullptr if not using speedcontrol.
+	int64_t last_pts = -1;  // Of the last frame given to x264; for frame duration estimation.
+
+	// Only touched by the encoder thread, after init_x264().
+	unsigned max_bitrate_kbit;  // The configured bitrate; the upper limit in automatic mode.
+	unsigned current_bitrate_kbit;  // Lower than <max_bitrate_kbit> if automatic mode has backed off.
+	unsigned vbv_max_bitrate_kbit, vbv_buffer_size_kbit;  // Corresponding to <max_bitrate_kbit>.
+	std::function<size_t()> get_client_backlog_bytes;
+	std::chrono::steady_clock::time_point last_auto_bitrate_check;
+	unsigned auto_bitrate_good_checks = 0;  // Consecutive checks without a significant backlog.
 
 	// Protects everything below it.
 	std::mutex mu;
 
-	// Frames that are not being encoded or waiting to be encoded,
-	// so that add_frame() can use new ones.
-	std::queue<uint8_t *> free_frames;
-
 	// Frames that are waiting to be encoded (ie., add_frame() has been
 	// called, but they are not picked up for encoding yet).
-	std::queue<QueuedFrame> queued_frames;
+	std::deque<QueuedFrame> queued_frames;
+
+	int64_t last_added_pts = -1;  // Of the last frame given to add_frame(), even if dropped.
 
 	// Whenever the state of <queued_frames> changes.
 	std::condition_variable queued_frames_nonempty;
+
+	// Set by change_rate_control(), picked up by the encoder thread.
+	bool rate_control_changed = false;
+	int new_bitrate_kbit = -1, new_vbv_max_bitrate_kbit = -1, new_vbv_buffer_size_kbit = -1;
+
+	// Registered with <metric_labels>, and removed again in the destructor.
+	// Since the encoders are recreated on cuts, the counters start over
+	// from zero then.
+	std::atomic<int64_t> metric_x264_queued_frames{0};
+	std::atomic<int64_t> metric_x264_dropped_frames{0};
+	std::atomic<int64_t> metric_x264_encoded_frames{0};
+	std::atomic<double> metric_x264_encode_time_seconds{0.0};
+	std::atomic<double> metric_x264_last_encode_time_seconds{0.0};
+	std::atomic<int64_t> metric_x264_bitrate_kbit{0};
 };
 
 #endif  // !defined(_X264ENCODE_H)